@@ -3,10 +3,21 @@
 #include "esp_log.h"
 #include "esp_camera.h"
 #include "esp_heap_caps.h"
+#include "esp_timer.h"
 
 static const char *TAG = "camera_manager";
 
 static bool s_camera_initialized = false;
+static uint32_t s_pictures_taken = 0;
+static uint32_t s_capture_failures = 0;
+static uint32_t s_frames_not_taken = 0;
+static uint32_t s_last_frame_id = 0;
+
+// Adaptive JPEG quality control
+static bool s_qc_enabled = false;
+static camera_quality_control_t s_qc_config;
+static uint32_t s_qc_throughput = 0;
+static uint8_t s_qc_settle = 0;  // Frames left to skip after a quality change
 
 // Default camera configuration based on main.h
 static camera_config_t s_camera_config = {
@@ -146,6 +157,101 @@ esp_err_t camera_manager_init_with_config(camera_manager_config_t *config)
     return ESP_OK;
 }
 
+static size_t quality_control_budget(void)
+{
+    size_t budget = s_qc_config.target_size;
+
+    if (s_qc_config.target_upload_ms > 0 && s_qc_throughput > 0) {
+        size_t rate_budget = (uint64_t)s_qc_throughput * s_qc_config.target_upload_ms / 1000;
+        if (budget == 0 || rate_budget < budget) {
+            budget = rate_budget;
+        }
+    }
+    return budget;
+}
+
+static void quality_control_update(const camera_fb_t *fb)
+{
+    if (!s_qc_enabled || fb->format != PIXFORMAT_JPEG) {
+        return;
+    }
+
+    // Frames already queued were captured with the previous quality
+    if (s_qc_settle > 0) {
+        s_qc_settle--;
+        return;
+    }
+
+    size_t budget = quality_control_budget();
+    sensor_t *s = esp_camera_sensor_get();
+    if (budget == 0 || s == NULL || s->set_quality == NULL) {
+        return;
+    }
+
+    size_t margin = budget * s_qc_config.deadband_pct / 100;
+    int quality = s->status.quality;
+    int step = 0;
+
+    // Back off quickly when over budget, recover one step at a time
+    if (fb->len > budget + margin) {
+        if (fb->len > budget * 2) {
+            step = 4;
+        } else if (fb->len > budget + budget / 2) {
+            step = 2;
+        } else {
+            step = 1;
+        }
+    } else if (fb->len + margin < budget) {
+        step = -1;
+    }
+
+    int new_quality = quality + step;
+    if (new_quality < s_qc_config.min_quality) {
+        new_quality = s_qc_config.min_quality;
+    } else if (new_quality > s_qc_config.max_quality) {
+        new_quality = s_qc_config.max_quality;
+    }
+    if (new_quality == quality) {
+        return;
+    }
+
+    if (s->set_quality(s, new_quality) != 0) {
+        printf("Failed to set JPEG quality %d\n", new_quality);
+        return;
+    }
+    s_qc_settle = s_camera_config.fb_count;
+    printf("JPEG quality %d -> %d (frame %zu bytes, budget %zu bytes)\n",
+           quality, new_quality, fb->len, budget);
+}
+
+esp_err_t camera_manager_enable_quality_control(const camera_quality_control_t *ctrl)
+{
+    if (ctrl == NULL || ctrl->min_quality > ctrl->max_quality || ctrl->max_quality > 63 ||
+        ctrl->deadband_pct >= 100 || (ctrl->target_size == 0 && ctrl->target_upload_ms == 0)) {
+        printf("Invalid quality control parameters\n");
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    s_qc_config = *ctrl;
+    s_qc_settle = 0;
+    s_qc_enabled = true;
+    printf("JPEG quality control enabled: target_size=%zu, target_upload_ms=%u, quality=%d..%d, deadband=%d%%\n",
+           ctrl->target_size, (unsigned)ctrl->target_upload_ms, ctrl->min_quality, ctrl->max_quality,
+           ctrl->deadband_pct);
+
+    return ESP_OK;
+}
+
+void camera_manager_disable_quality_control(void)
+{
+    s_qc_enabled = false;
+}
+
+void camera_manager_set_upload_throughput(uint32_t bytes_per_sec)
+{
+    s_qc_throughput = bytes_per_sec;
+}
+
 esp_err_t camera_manager_take_picture(camera_fb_t **fb)
 {
     if (!s_camera_initialized) {
@@ -162,11 +268,24 @@ esp_err_t camera_manager_take_picture(camera_fb_t **fb)
 
     *fb = esp_camera_fb_get();
     if (*fb == NULL) {
+        s_capture_failures++;
         printf("Camera capture failed\n");
         return ESP_FAIL;
     }
+    s_pictures_taken++;
+
+    // Frame ids come from the VSYNC counter, a jump counts the sensor frames captured between two
+    // pictures that were never taken. Lost frames are in the driver's frames_dropped and fb_overflow.
+    if (s_pictures_taken > 1 && (*fb)->frame_id - s_last_frame_id > 1) {
+        s_frames_not_taken += (*fb)->frame_id - s_last_frame_id - 1;
+    }
+    s_last_frame_id = (*fb)->frame_id;
 
-    printf("Picture taken successfully, size: %zu bytes\n", (*fb)->len);
+    int64_t capture_us = (int64_t)(*fb)->timestamp.tv_sec * 1000000 + (*fb)->timestamp.tv_usec;
+    printf("Picture taken successfully, size: %zu bytes, frame %u, captured %lld ms ago\n",
+           (*fb)->len, (unsigned)(*fb)->frame_id, (long long)((esp_timer_get_time() - capture_us) / 1000));
+
+    quality_control_update(*fb);
 
     return ESP_OK;
 }
@@ -182,6 +301,32 @@ void camera_manager_return_fb(camera_fb_t *fb)
     // ESP_LOGD removed - too verbose for printf
 }
 
+esp_err_t camera_manager_get_stats(camera_manager_stats_t *stats)
+{
+    if (stats == NULL) {
+        printf("Invalid stats pointer\n");
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (!s_camera_initialized) {
+        printf("Camera not initialized\n");
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    stats->pictures_taken = s_pictures_taken;
+    stats->capture_failures = s_capture_failures;
+    stats->frames_not_taken = s_frames_not_taken;
+    return esp_camera_get_stats(&stats->driver);
+}
+
+void camera_manager_reset_stats(void)
+{
+    s_pictures_taken = 0;
+    s_capture_failures = 0;
+    s_frames_not_taken = 0;
+    esp_camera_reset_stats();
+}
+
 bool camera_manager_is_initialized(void)
 {
     return s_camera_initialized;
@@ -203,6 +348,7 @@ esp_err_t camera_manager_deinit(void)
     }
 
     s_camera_initialized = false;
+    s_qc_enabled = false;
     printf("Camera deinitialized successfully\n");
 
     return ESP_OK;
@@ -18,6 +18,30 @@ typedef struct {
     uint8_t fb_count;
 } camera_manager_config_t;
 
+/**
+ * @brief Camera manager statistics snapshot
+ */
+typedef struct {
+    uint32_t pictures_taken;    // Successful camera_manager_take_picture() calls
+    uint32_t capture_failures;  // camera_manager_take_picture() calls that got no frame
+    uint32_t frames_not_taken;  // Sensor frames between two pictures the application didn't take (frame id gaps), not losses
+    camera_stats_t driver;      // Frame counters reported by the camera driver
+} camera_manager_stats_t;
+
+/**
+ * @brief Adaptive JPEG quality control settings
+ *
+ * The byte budget per frame is target_size, or the upload throughput times
+ * target_upload_ms, whichever is smaller (a zero field is ignored).
+ */
+typedef struct {
+    size_t target_size;         // Frame size budget in bytes, 0 to derive it from throughput only
+    uint32_t target_upload_ms;  // Upload time budget per frame, 0 to use target_size only
+    uint8_t min_quality;        // Best quality the controller may select (lowest sensor value)
+    uint8_t max_quality;        // Worst quality the controller may select (highest sensor value, <= 63)
+    uint8_t deadband_pct;       // No adjustment while the frame is within +/- this percent of the budget
+} camera_quality_control_t;
+
 /**
  * @brief Initialize camera manager with default configuration
  * 
@@ -55,6 +79,41 @@ void camera_manager_return_fb(camera_fb_t *fb);
  */
 bool camera_manager_is_initialized(void);
 
+/**
+ * @brief Get a snapshot of capture and frame loss statistics
+ * 
+ * @param stats Structure to fill with the current counters
+ * @return esp_err_t ESP_OK on success
+ */
+esp_err_t camera_manager_get_stats(camera_manager_stats_t *stats);
+
+/**
+ * @brief Reset capture and frame loss statistics
+ */
+void camera_manager_reset_stats(void);
+
+/**
+ * @brief Enable adaptive JPEG quality control
+ * 
+ * After each JPEG picture the sensor quality is nudged towards the byte budget.
+ * 
+ * @param ctrl Controller settings
+ * @return esp_err_t ESP_OK on success
+ */
+esp_err_t camera_manager_enable_quality_control(const camera_quality_control_t *ctrl);
+
+/**
+ * @brief Disable adaptive JPEG quality control, keeping the current sensor quality
+ */
+void camera_manager_disable_quality_control(void);
+
+/**
+ * @brief Report the current upload throughput used to derive the byte budget
+ * 
+ * @param bytes_per_sec Measured throughput, 0 if unknown
+ */
+void camera_manager_set_upload_throughput(uint32_t bytes_per_sec);
+
 /**
  * @brief Deinitialize camera manager
  * 
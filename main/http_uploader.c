@@ -2,6 +2,8 @@
 #include "esp_log.h"
 #include "esp_http_client.h"
 #include "esp_heap_caps.h"
+#include "esp_timer.h"
+#include "img_converters.h"
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -16,6 +18,9 @@ static bool s_initialized = false;
 static char s_response_buffer[512];
 static int s_response_len = 0;
 
+// Smoothed upload throughput in bytes per second, 0 until the first upload completes
+static uint32_t s_throughput_bps = 0;
+
 static esp_err_t http_event_handler(esp_http_client_event_t *evt)
 {
     switch (evt->event_id) {
@@ -56,6 +61,68 @@ static esp_err_t http_event_handler(esp_http_client_event_t *evt)
     return ESP_OK;
 }
 
+// Multipart form data around the image
+typedef struct {
+    char content_type[128];
+    char header[512];
+    char footer[128];
+} multipart_parts_t;
+
+static void build_multipart_parts(const char *filename, multipart_parts_t *parts)
+{
+    // Create multipart form data boundary
+    const char *boundary = "----WebKitFormBoundary7MA4YWxkTrZu0gW";
+    snprintf(parts->content_type, sizeof(parts->content_type), "multipart/form-data; boundary=%s", boundary);
+
+    snprintf(parts->header, sizeof(parts->header),
+             "--%s\r\n"
+             "Content-Disposition: form-data; name=\"file\"; filename=\"%s\"\r\n"
+             "Content-Type: image/jpeg\r\n\r\n",
+             boundary, filename);
+
+    snprintf(parts->footer, sizeof(parts->footer), "\r\n--%s--\r\n", boundary);
+}
+
+// Reads the status of a sent request, updates the throughput estimate and fills the response
+static esp_err_t upload_finish(esp_http_client_handle_t client, size_t total_len, int64_t elapsed_us,
+                               http_upload_response_t *response)
+{
+    int status_code = esp_http_client_get_status_code(client);
+    int content_length = esp_http_client_get_content_length(client);
+
+    printf("HTTP Status: %d, Content-Length: %d\n", status_code, content_length);
+
+    // Update throughput estimate (exponential moving average, weight 1/4 for the new sample)
+    if (elapsed_us > 0) {
+        uint32_t bps = (uint32_t)MIN((uint64_t)total_len * 1000000ULL / elapsed_us, UINT32_MAX);
+        s_throughput_bps = s_throughput_bps ? (s_throughput_bps * 3 + bps) / 4 : bps;
+        printf("Upload took %lld ms, throughput: %u B/s (avg %u B/s)\n",
+               elapsed_us / 1000, (unsigned)bps, (unsigned)s_throughput_bps);
+    }
+
+    // Fill response structure
+    if (response != NULL) {
+        response->status_code = status_code;
+        response->response_len = s_response_len;
+        memcpy(response->response_data, s_response_buffer,
+               MIN(s_response_len + 1, sizeof(response->response_data)));
+    }
+
+    if (status_code >= 200 && status_code < 300) {
+        printf("Image uploaded successfully\n");
+        if (s_response_len > 0) {
+            printf("Server response: %s\n", s_response_buffer);
+        }
+        return ESP_OK;
+    }
+
+    printf("Upload failed with status: %d\n", status_code);
+    if (s_response_len > 0) {
+        printf("Server error response: %s\n", s_response_buffer);
+    }
+    return ESP_FAIL;
+}
+
 esp_err_t http_uploader_init(http_upload_config_t *config)
 {
     if (config == NULL) {
@@ -104,25 +171,12 @@ esp_err_t http_uploader_upload_image(const uint8_t *image_data, size_t image_siz
     memset(s_response_buffer, 0, sizeof(s_response_buffer));
     s_response_len = 0;
 
-    // Create multipart form data boundary
-    const char *boundary = "----WebKitFormBoundary7MA4YWxkTrZu0gW";
-    char content_type[128];
-    snprintf(content_type, sizeof(content_type), "multipart/form-data; boundary=%s", boundary);
-
     // Build multipart form data parts
-    char header_part[512];
-    char footer_part[128];
-
-    snprintf(header_part, sizeof(header_part),
-             "--%s\r\n"
-             "Content-Disposition: form-data; name=\"file\"; filename=\"%s\"\r\n"
-             "Content-Type: image/jpeg\r\n\r\n",
-             boundary, filename);
+    multipart_parts_t parts;
+    build_multipart_parts(filename, &parts);
 
-    snprintf(footer_part, sizeof(footer_part), "\r\n--%s--\r\n", boundary);
-
-    size_t header_len = strlen(header_part);
-    size_t footer_len = strlen(footer_part);
+    size_t header_len = strlen(parts.header);
+    size_t footer_len = strlen(parts.footer);
     size_t total_len = header_len + image_size + footer_len;
 
     // Check for reasonable size limits (e.g., 2MB max)
@@ -167,9 +221,9 @@ esp_err_t http_uploader_upload_image(const uint8_t *image_data, size_t image_siz
     }
 
     // Build complete multipart data
-    memcpy(post_data, header_part, header_len);
+    memcpy(post_data, parts.header, header_len);
     memcpy(post_data + header_len, image_data, image_size);
-    memcpy(post_data + header_len + image_size, footer_part, footer_len);
+    memcpy(post_data + header_len + image_size, parts.footer, footer_len);
 
     printf("Multipart data prepared: header_len=%zu, image_size=%zu, footer_len=%zu, total_len=%zu\n",
            header_len, image_size, footer_len, total_len);
@@ -193,38 +247,14 @@ esp_err_t http_uploader_upload_image(const uint8_t *image_data, size_t image_siz
 
     // Set HTTP method and headers
     esp_http_client_set_method(client, HTTP_METHOD_POST);
-    esp_http_client_set_header(client, "Content-Type", content_type);
+    esp_http_client_set_header(client, "Content-Type", parts.content_type);
     esp_http_client_set_post_field(client, (const char *)post_data, total_len);
 
     // Perform the request
+    int64_t start_us = esp_timer_get_time();
     err = esp_http_client_perform(client);
     if (err == ESP_OK) {
-        int status_code = esp_http_client_get_status_code(client);
-        int content_length = esp_http_client_get_content_length(client);
-
-        printf("HTTP Status: %d, Content-Length: %d\n", status_code, content_length);
-
-        // Fill response structure
-        if (response != NULL) {
-            response->status_code = status_code;
-            response->response_len = s_response_len;
-            memcpy(response->response_data, s_response_buffer,
-                   MIN(s_response_len + 1, sizeof(response->response_data)));
-        }
-
-        if (status_code >= 200 && status_code < 300) {
-            printf("Image uploaded successfully\n");
-            if (s_response_len > 0) {
-                printf("Server response: %s\n", s_response_buffer);
-            }
-            err = ESP_OK;
-        } else {
-            printf("Upload failed with status: %d\n", status_code);
-            if (s_response_len > 0) {
-                printf("Server error response: %s\n", s_response_buffer);
-            }
-            err = ESP_FAIL;
-        }
+        err = upload_finish(client, total_len, esp_timer_get_time() - start_us, response);
     } else {
         printf("HTTP request failed: %s\n", esp_err_to_name(err));
     }
@@ -247,6 +277,160 @@ esp_err_t http_uploader_upload_fb(camera_fb_t *fb, const char *filename,
     return http_uploader_upload_image(fb->buf, fb->len, filename, response);
 }
 
+// State of a chunked upload fed by the JPEG encoder
+typedef struct {
+    esp_http_client_handle_t client;
+    size_t sent;
+    bool failed;
+} chunked_upload_t;
+
+static bool write_all(esp_http_client_handle_t client, const char *data, size_t len)
+{
+    while (len > 0) {
+        int written = esp_http_client_write(client, data, len);
+        if (written <= 0) {
+            return false;
+        }
+        data += written;
+        len -= written;
+    }
+    return true;
+}
+
+// Sends data as one chunk of the Transfer-Encoding: chunked body
+static bool write_chunk(chunked_upload_t *upload, const void *data, size_t len)
+{
+    if (upload->failed || len == 0) {
+        return !upload->failed;
+    }
+    char size_line[16];
+    int size_len = snprintf(size_line, sizeof(size_line), "%x\r\n", (unsigned)len);
+    if (!write_all(upload->client, size_line, size_len)
+        || !write_all(upload->client, data, len)
+        || !write_all(upload->client, "\r\n", 2)) {
+        printf("Chunked upload write failed after %zu bytes\n", upload->sent);
+        upload->failed = true;
+        return false;
+    }
+    upload->sent += len;
+    return true;
+}
+
+// Encoder output callback, each scan of a progressive JPEG goes out as soon as it is coded
+static size_t jpg_chunk_cb(void *arg, size_t index, const void *data, size_t len)
+{
+    return write_chunk((chunked_upload_t *)arg, data, len) ? len : 0;
+}
+
+esp_err_t http_uploader_upload_fb_progressive(camera_fb_t *fb, const char *filename, uint8_t quality,
+                                            http_upload_response_t *response)
+{
+    if (!s_initialized) {
+        printf("HTTP uploader not initialized\n");
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    if (fb == NULL || filename == NULL) {
+        printf("Invalid parameters\n");
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    printf("Uploading progressive image: %s, %zux%zu at quality %u to URL: %s\n",
+           filename, fb->width, fb->height, quality, s_config.url);
+
+    // Reset response buffer
+    memset(s_response_buffer, 0, sizeof(s_response_buffer));
+    s_response_len = 0;
+
+    multipart_parts_t parts;
+    build_multipart_parts(filename, &parts);
+
+    // Configure HTTP client
+    esp_http_client_config_t config = {
+        .url = s_config.url,
+        .event_handler = http_event_handler,
+        .timeout_ms = s_config.timeout_ms,
+        .user_agent = s_config.user_agent,
+    };
+
+    esp_http_client_handle_t client = esp_http_client_init(&config);
+    if (client == NULL) {
+        printf("Failed to initialize HTTP client\n");
+        return ESP_FAIL;
+    }
+
+    esp_http_client_set_method(client, HTTP_METHOD_POST);
+    esp_http_client_set_header(client, "Content-Type", parts.content_type);
+
+    // A negative length sends the body with Transfer-Encoding: chunked, the chunks are framed here
+    int64_t start_us = esp_timer_get_time();
+    esp_err_t err = esp_http_client_open(client, -1);
+    if (err != ESP_OK) {
+        printf("HTTP connection failed: %s\n", esp_err_to_name(err));
+        esp_http_client_cleanup(client);
+        return err;
+    }
+
+    chunked_upload_t upload = {
+        .client = client,
+        .sent = 0,
+        .failed = false,
+    };
+
+    jpg_encode_config_t jpg_config = JPG_ENCODE_CONFIG_DEFAULT();
+    jpg_config.quality = quality;
+    jpg_config.progressive = true;
+
+    bool encoded = write_chunk(&upload, parts.header, strlen(parts.header));
+    if (encoded) {
+        if (fb->format == PIXFORMAT_JPEG) {
+            // fmt2jpg_cb_ex() does not take a JPEG source, fmt2jpg_multi() decodes it one MCU row at a time
+            jpg_encode_output_t output = {
+                .scale = 1,
+                .config = jpg_config,
+                .cb = jpg_chunk_cb,
+                .arg = &upload,
+            };
+            encoded = fmt2jpg_multi(fb->buf, fb->len, fb->width, fb->height, fb->format, &output, 1);
+        } else {
+            encoded = fmt2jpg_cb_ex(fb->buf, fb->len, fb->width, fb->height, fb->format, &jpg_config, jpg_chunk_cb, &upload);
+        }
+    }
+    if (encoded) {
+        encoded = write_chunk(&upload, parts.footer, strlen(parts.footer))
+                  && write_all(client, "0\r\n\r\n", 5);
+    }
+    if (!encoded) {
+        // The server only gets a truncated body, drop the connection instead of waiting for its answer
+        printf("Progressive upload aborted after %zu bytes\n", upload.sent);
+        esp_http_client_close(client);
+        esp_http_client_cleanup(client);
+        return ESP_FAIL;
+    }
+
+    // The response body is copied to the response buffer by the event handler
+    if (esp_http_client_fetch_headers(client) < 0) {
+        printf("Failed to read HTTP response headers\n");
+        err = ESP_FAIL;
+    } else {
+        char discard[64];
+        while (esp_http_client_read(client, discard, sizeof(discard)) > 0) {
+        }
+        err = upload_finish(client, upload.sent, esp_timer_get_time() - start_us, response);
+    }
+
+    // Cleanup
+    esp_http_client_close(client);
+    esp_http_client_cleanup(client);
+
+    return err;
+}
+
+uint32_t http_uploader_get_throughput(void)
+{
+    return s_throughput_bps;
+}
+
 bool http_uploader_is_initialized(void)
 {
     return s_initialized;
@@ -260,6 +444,7 @@ esp_err_t http_uploader_deinit(void)
     }
 
     memset(&s_config, 0, sizeof(s_config));
+    s_throughput_bps = 0;
     s_initialized = false;
 
     printf("HTTP uploader deinitialized\n");
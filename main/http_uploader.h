@@ -58,6 +58,32 @@ esp_err_t http_uploader_upload_image(const uint8_t *image_data, size_t image_siz
 esp_err_t http_uploader_upload_fb(camera_fb_t *fb, const char *filename, 
                                 http_upload_response_t *response);
 
+/**
+ * @brief Re-encode a camera frame buffer as a progressive JPEG and stream it via HTTP POST
+ * 
+ * The body is sent with Transfer-Encoding: chunked, each scan as soon as the encoder has coded it,
+ * so the server can show a preview after the first few KB. A JPEG frame is decoded one MCU row at a
+ * time. The encoder keeps about 3 bytes per pixel of coefficients until the last scan. The encoding
+ * time counts in the measured throughput.
+ * 
+ * @param fb Camera frame buffer in JPEG, RGB565, RGB888, YUV422 or grayscale format
+ * @param filename Filename for the upload
+ * @param quality JPEG quality of the uploaded image, 1 to 100
+ * @param response Response structure to store result
+ * @return esp_err_t ESP_OK on success
+ */
+esp_err_t http_uploader_upload_fb_progressive(camera_fb_t *fb, const char *filename, uint8_t quality,
+                                            http_upload_response_t *response);
+
+/**
+ * @brief Get the measured upload throughput
+ * 
+ * Averaged over recent successful uploads, including connection and response time.
+ * 
+ * @return uint32_t Throughput in bytes per second, 0 if no upload has completed yet
+ */
+uint32_t http_uploader_get_throughput(void);
+
 /**
  * @brief Check if HTTP uploader is initialized
  * 
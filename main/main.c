@@ -29,6 +29,9 @@ static const char *TAG = "espcam_main";
 #define BLE_TARGET_DEVICE "BLE_NL"
 #define BLE_RSSI_THRESHOLD -80
 #define BLE_TRIGGERED_UPLOAD_INTERVAL_MS 2000  // 2 seconds when BLE device detected
+#define JPEG_MAX_FRAME_SIZE (64 * 1024)       // Frame size budget for adaptive JPEG quality
+#define JPEG_TARGET_UPLOAD_MS 1000            // Upload time budget per frame for adaptive JPEG quality
+#define UPLOAD_PROGRESSIVE_QUALITY 0          // Re-encode uploads as streamed progressive JPEGs of this quality, 0 to send frames as captured
 
 // Application state
 typedef enum {
@@ -108,13 +111,18 @@ static void take_and_upload_picture(void)
         return;
     }
 
-    // Generate filename with timestamp
+    // Generate filename with the capture timestamp, so uploads sort in capture order
     char filename[64];
-    snprintf(filename, sizeof(filename), "capture_%lld.jpg", esp_timer_get_time() / 1000);
+    int64_t capture_ms = (int64_t)fb->timestamp.tv_sec * 1000 + fb->timestamp.tv_usec / 1000;
+    snprintf(filename, sizeof(filename), "capture_%lld.jpg", capture_ms);
 
     // Upload the image
     http_upload_response_t response;
-    err = http_uploader_upload_fb(fb, filename, &response);
+    if (UPLOAD_PROGRESSIVE_QUALITY > 0) {
+        err = http_uploader_upload_fb_progressive(fb, filename, UPLOAD_PROGRESSIVE_QUALITY, &response);
+    } else {
+        err = http_uploader_upload_fb(fb, filename, &response);
+    }
 
     if (err == ESP_OK) {
         printf("Image uploaded successfully. Status: %d\n", response.status_code);
@@ -125,6 +133,9 @@ static void take_and_upload_picture(void)
         printf("Failed to upload image: %s\n", esp_err_to_name(err));
     }
 
+    // Feed the measured throughput back into the JPEG quality controller
+    camera_manager_set_upload_throughput(http_uploader_get_throughput());
+
     // Return frame buffer
     camera_manager_return_fb(fb);
 }
@@ -199,6 +210,14 @@ void app_main(void)
 
                 // Initialize camera
                 if (camera_manager_init() == ESP_OK) {
+                    camera_quality_control_t quality_ctrl = {
+                        .target_size = JPEG_MAX_FRAME_SIZE,
+                        .target_upload_ms = JPEG_TARGET_UPLOAD_MS,
+                        .min_quality = 6,
+                        .max_quality = 40,
+                        .deadband_pct = 15,
+                    };
+                    camera_manager_enable_quality_control(&quality_ctrl);
                     s_camera_ready = true;
                     s_app_state = APP_STATE_CAMERA_INIT;
                     printf("Camera initialized successfully\n");
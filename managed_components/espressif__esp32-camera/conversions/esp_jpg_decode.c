@@ -11,6 +11,11 @@
 // WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
 // See the License for the specific language governing permissions and
 // limitations under the License.
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
 #include "esp_jpg_decode.h"
 
 #include "esp_system.h"
@@ -38,15 +43,39 @@
 static const char* TAG = "esp_jpg_decode";
 #endif
 
+// the software decoder sizes its memory pool for the configured input buffer and Huffman tables
+#ifdef JD_SZPOOL
+#define JPG_WORK_SIZE JD_SZPOOL
+#else
+#define JPG_WORK_SIZE 3100
+#endif
+
+#define PARALLEL_TASK_STACK (4*1024)
+
 typedef struct {
         jpg_scale_t scale;
+        jpg_pixel_format_t format;
+        const uint8_t * src;
         jpg_reader_cb reader;
         jpg_writer_cb writer;
         void * arg;
         size_t len;
         size_t index;
+        uint16_t top;               // output row of the first decoded row
 } esp_jpg_decoder_t;
 
+// A band of MCU rows that starts after a restart marker, decoded as an image of its own:
+// the headers with the band height in the SOF, then the entropy coded data of the band.
+typedef struct {
+        esp_jpg_decoder_t jpeg;     // read position and size of that image
+        size_t header_len;          // bytes of src up to the entropy coded data
+        size_t height_ofs;          // offset of the image height in the SOF
+        uint8_t height[2];          // height of the band, big endian
+        size_t data;                // offset in src of the band's entropy coded data
+        uint8_t rst_first;          // number of its first RSTn marker, renumbered from RST0
+        bool ff;                    // the last data byte read was 0xFF
+} esp_jpg_band_t;
+
 static const char * jd_errors[] = {
     "Succeeded",
     "Interrupted by output function",
@@ -59,16 +88,59 @@ static const char * jd_errors[] = {
     "Not supported JPEG standard"
 };
 
+#ifdef JD_SZPOOL
+// the software decoder outputs every format itself
+static const uint8_t jd_formats[] = {
+    JD_FMT_RGB888, JD_FMT_BGR888, JD_FMT_RGB565, JD_FMT_RGB565BE, JD_FMT_GRAY
+};
+#else
+// the ROM decoder only outputs RGB888, convert each block in place
+static void _jpg_convert(uint8_t *data, size_t pixels, jpg_pixel_format_t format)
+{
+    uint8_t *out = data;
+    for (size_t i = 0; i < pixels; i++, data += 3) {
+        uint8_t r = data[0], g = data[1], b = data[2];
+        uint8_t hb = (r & 0xF8) | (g >> 5);
+        uint8_t lb = ((g & 0x1C) << 3) | (b >> 3);
+        switch (format) {
+        case JPG_PIXEL_BGR888:
+            *out++ = b;
+            *out++ = g;
+            *out++ = r;
+            break;
+        case JPG_PIXEL_RGB565_LE:
+            *out++ = lb;
+            *out++ = hb;
+            break;
+        case JPG_PIXEL_RGB565_BE:
+            *out++ = hb;
+            *out++ = lb;
+            break;
+        case JPG_PIXEL_GRAYSCALE:
+            *out++ = (r * 77 + g * 150 + b * 29) >> 8;
+            break;
+        default:
+            return;
+        }
+    }
+}
+#endif
+
 static unsigned int _jpg_write(JDEC *decoder, void *bitmap, JRECT *rect)
 {
+    esp_jpg_decoder_t * jpeg = (esp_jpg_decoder_t *)decoder->device;
+
     uint16_t x = rect->left;
-    uint16_t y = rect->top;
+    uint16_t y = rect->top + jpeg->top;
     uint16_t w = rect->right + 1 - x;
-    uint16_t h = rect->bottom + 1 - y;
+    uint16_t h = rect->bottom + 1 - rect->top;
     uint8_t *data = (uint8_t *)bitmap;
 
-    esp_jpg_decoder_t * jpeg = (esp_jpg_decoder_t *)decoder->device;
-
+#ifndef JD_SZPOOL
+    if (jpeg->format != JPG_PIXEL_RGB888) {
+        _jpg_convert(data, w * h, jpeg->format);
+    }
+#endif
     if (jpeg->writer) {
         return jpeg->writer(jpeg->arg, x, y, w, h, data);
     }
@@ -81,49 +153,122 @@ static unsigned int _jpg_read(JDEC *decoder, uint8_t *buf, unsigned int len)
     if (jpeg->len && len > (jpeg->len - jpeg->index)) {
         len = jpeg->len - jpeg->index;
     }
-    if (len) {
+    if (len && jpeg->src) {
+        if (buf) {
+            memcpy(buf, jpeg->src + jpeg->index, len);
+        }
+        jpeg->index += len;
+    } else if (len) {
         len = jpeg->reader(jpeg->arg, jpeg->index, buf, len);
         if (!len) {
-            ESP_LOGE(TAG, "Read Fail at %u/%u", jpeg->index, jpeg->len);
+            ESP_LOGE(TAG, "Read Fail at %u/%u", (unsigned) jpeg->index, (unsigned) jpeg->len);
         }
         jpeg->index += len;
     }
     return len;
 }
 
-esp_err_t esp_jpg_decode(size_t len, jpg_scale_t scale, jpg_reader_cb reader, jpg_writer_cb writer, void * arg)
+static unsigned int _jpg_read_band(JDEC *decoder, uint8_t *buf, unsigned int len)
 {
-    static uint8_t work[3100];
-    JDEC decoder;
-    esp_jpg_decoder_t jpeg;
+    esp_jpg_band_t * band = (esp_jpg_band_t *)decoder->device;
+    esp_jpg_decoder_t * jpeg = &band->jpeg;
+    if (len > jpeg->len - jpeg->index) {
+        len = jpeg->len - jpeg->index;
+    }
+    unsigned int done = 0;
+    if (jpeg->index < band->header_len) {
+        done = len < band->header_len - jpeg->index ? len : band->header_len - jpeg->index;
+        if (buf) {
+            memcpy(buf, jpeg->src + jpeg->index, done);
+            for (int i = 0; i < 2; i++) {
+                if (band->height_ofs + i >= jpeg->index && band->height_ofs + i < jpeg->index + done) {
+                    buf[band->height_ofs + i - jpeg->index] = band->height[i];
+                }
+            }
+        }
+        jpeg->index += done;
+    }
+    if (done < len) {
+        uint8_t *data = buf + done;
+        size_t n = len - done;
+        if (buf) {
+            memcpy(data, jpeg->src + band->data + jpeg->index - band->header_len, n);
+        }
+        jpeg->index += n;
+        if (buf && band->rst_first) {
+            // the decoder expects the markers of the band to count from RST0
+            if (band->ff && (data[0] & 0xF8) == 0xD0) {
+                data[0] = 0xD0 | ((data[0] - band->rst_first) & 7);
+            }
+            for (uint8_t *p = memchr(data, 0xFF, n); p && p < data + n - 1; p = memchr(p + 1, 0xFF, data + n - p - 1)) {
+                if ((p[1] & 0xF8) == 0xD0) {
+                    p[1] = 0xD0 | ((p[1] - band->rst_first) & 7);
+                }
+            }
+            band->ff = data[n - 1] == 0xFF;
+        }
+        done = len;
+    }
+    return done;
+}
 
-    jpeg.len = len;
-    jpeg.reader = reader;
-    jpeg.writer = writer;
-    jpeg.arg = arg;
-    jpeg.scale = scale;
-    jpeg.index = 0;
+static uint8_t work[JPG_WORK_SIZE];
 
-    JRESULT jres = jd_prepare(&decoder, _jpg_read, work, 3100, &jpeg);
+static esp_err_t _jpg_decode(JDEC *decoder, esp_jpg_decoder_t *jpeg)
+{
+    JRESULT jres;
+#ifdef JD_SZPOOL
+    if (jpeg->src) {
+        // the software decoder reads the entropy coded data in place
+        jres = jd_prepare_mem(decoder, jpeg->src, jpeg->len, work, sizeof(work), jpeg);
+    } else
+#endif
+    {
+        jres = jd_prepare(decoder, _jpg_read, work, sizeof(work), jpeg);
+    }
     if(jres != JDR_OK){
         ESP_LOGE(TAG, "JPG Header Parse Failed! %s", jd_errors[jres]);
         return ESP_FAIL;
     }
+#ifdef JD_SZPOOL
+    decoder->format = jd_formats[jpeg->format];
+#endif
 
-    uint16_t output_width = decoder.width / (1 << (uint8_t)(jpeg.scale));
-    uint16_t output_height = decoder.height / (1 << (uint8_t)(jpeg.scale));
+    uint16_t output_width = decoder->width / (1 << (uint8_t)(jpeg->scale));
+    uint16_t output_height = decoder->height / (1 << (uint8_t)(jpeg->scale));
 
     //output start
-    writer(arg, 0, 0, output_width, output_height, NULL);
+    jpeg->writer(jpeg->arg, 0, 0, output_width, output_height, NULL);
     //output write
-    jres = jd_decomp(&decoder, _jpg_write, (uint8_t)jpeg.scale);
+    jres = jd_decomp(decoder, _jpg_write, (uint8_t)jpeg->scale);
     //output end
-    writer(arg, output_width, output_height, output_width, output_height, NULL);
+    jpeg->writer(jpeg->arg, output_width, output_height, output_width, output_height, NULL);
 
     if (jres != JDR_OK) {
         ESP_LOGE(TAG, "JPG Decompression Failed! %s", jd_errors[jres]);
         return ESP_FAIL;
     }
+    return ESP_OK;
+}
+
+esp_err_t esp_jpg_decode(size_t len, jpg_scale_t scale, jpg_reader_cb reader, jpg_writer_cb writer, void * arg)
+{
+    JDEC decoder;
+    esp_jpg_decoder_t jpeg;
+
+    jpeg.len = len;
+    jpeg.src = NULL;
+    jpeg.reader = reader;
+    jpeg.writer = writer;
+    jpeg.arg = arg;
+    jpeg.scale = scale;
+    jpeg.format = JPG_PIXEL_RGB888;
+    jpeg.index = 0;
+    jpeg.top = 0;
+
+    if (_jpg_decode(&decoder, &jpeg) != ESP_OK) {
+        return ESP_FAIL;
+    }
     //check if all data has been consumed.
     if (len && jpeg.index < len) {
         _jpg_read(&decoder, NULL, len - jpeg.index);
@@ -132,3 +277,189 @@ esp_err_t esp_jpg_decode(size_t len, jpg_scale_t scale, jpg_reader_cb reader, jp
     return ESP_OK;
 }
 
+esp_err_t esp_jpg_decode_mem(const uint8_t *src, size_t len, jpg_scale_t scale, jpg_pixel_format_t format, jpg_writer_cb writer, void * arg)
+{
+    JDEC decoder;
+    esp_jpg_decoder_t jpeg;
+
+    jpeg.len = len;
+    jpeg.src = src;
+    jpeg.reader = NULL;
+    jpeg.writer = writer;
+    jpeg.arg = arg;
+    jpeg.scale = scale;
+    jpeg.format = format;
+    jpeg.index = 0;
+    jpeg.top = 0;
+
+    return _jpg_decode(&decoder, &jpeg);
+}
+
+
+static esp_err_t _jpg_decode_band(esp_jpg_band_t *band, uint8_t *pool)
+{
+    JDEC decoder;
+    JRESULT jres = jd_prepare(&decoder, _jpg_read_band, pool, JPG_WORK_SIZE, band);
+    if (jres != JDR_OK) {
+        ESP_LOGE(TAG, "JPG Header Parse Failed! %s", jd_errors[jres]);
+        return ESP_FAIL;
+    }
+#ifdef JD_SZPOOL
+    decoder.format = jd_formats[band->jpeg.format];
+#endif
+    jres = jd_decomp(&decoder, _jpg_write, (uint8_t)band->jpeg.scale);
+    if (jres != JDR_OK) {
+        ESP_LOGE(TAG, "JPG Decompression Failed! %s", jd_errors[jres]);
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+/*
+ * Finds the restart marker that starts the MCU row closest to the middle of the image
+ * and sets up the two bands around it. Returns false if there is none.
+ */
+static bool _jpg_split(const uint8_t *src, size_t len, esp_jpg_band_t *bands, uint16_t *split_row)
+{
+    size_t i = 2, height_ofs = 0;
+    uint16_t width = 0, height = 0, mcu_w = 0, mcu_h = 0, interval = 0;
+
+    // headers, up to the start of scan
+    for (;;) {
+        if (i + 4 > len || src[i] != 0xFF) {
+            return false;
+        }
+        uint8_t marker = src[i + 1];
+        size_t seg_len = src[i + 2] << 8 | src[i + 3];
+        if (i + 2 + seg_len > len) {
+            return false;
+        }
+        if (marker == 0xC0 || marker == 0xC1) {
+            height_ofs = i + 5;
+            height = src[i + 5] << 8 | src[i + 6];
+            width = src[i + 7] << 8 | src[i + 8];
+            mcu_w = (src[i + 11] >> 4) * 8;
+            mcu_h = (src[i + 11] & 15) * 8;
+        } else if (marker == 0xDD) {
+            interval = src[i + 4] << 8 | src[i + 5];
+        } else if (marker == 0xDA) {
+            i += 2 + seg_len;
+            break;
+        }
+        i += 2 + seg_len;
+    }
+    if (!interval || !mcu_w || !mcu_h) {
+        return false;
+    }
+
+    // restart markers, the k-th one starts MCU k * interval
+    uint32_t mcus_x = (width + mcu_w - 1) / mcu_w, rows = (height + mcu_h - 1) / mcu_h;
+    uint32_t best_row = 0, k = 0;
+    size_t best_data = 0;
+    for (const uint8_t *p = memchr(src + i, 0xFF, len - i); p && p < src + len - 1; p = memchr(p + 1, 0xFF, src + len - p - 1)) {
+        if ((p[1] & 0xF8) != 0xD0) {
+            continue;
+        }
+        uint32_t mcu = ++k * interval;
+        if (mcu % mcus_x) {
+            continue;
+        }
+        uint32_t row = mcu / mcus_x;
+        if (row >= rows) {
+            break;
+        }
+        if (!best_row || abs((int)row * 2 - (int)rows) < abs((int)best_row * 2 - (int)rows)) {
+            best_row = row;
+            best_data = p + 2 - src;
+            bands[1].rst_first = k & 7;
+        } else {
+            break;
+        }
+    }
+    if (!best_row) {
+        return false;
+    }
+
+    for (int b = 0; b < 2; b++) {
+        uint16_t band_height = b ? height - best_row * mcu_h : best_row * mcu_h;
+        bands[b].header_len = i;
+        bands[b].height_ofs = height_ofs;
+        bands[b].height[0] = band_height >> 8;
+        bands[b].height[1] = band_height & 0xFF;
+        bands[b].data = b ? best_data : i;
+        bands[b].ff = false;
+        bands[b].jpeg.src = src;
+        bands[b].jpeg.len = i + len - bands[b].data;
+        bands[b].jpeg.index = 0;
+    }
+    bands[0].rst_first = 0;
+    *split_row = best_row * mcu_h;
+    return true;
+}
+
+#if !CONFIG_FREERTOS_UNICORE
+typedef struct {
+    esp_jpg_band_t *band;
+    uint8_t *pool;
+    esp_err_t result;
+    SemaphoreHandle_t done;
+} esp_jpg_band_task_t;
+
+static void _jpg_band_task(void *arg)
+{
+    esp_jpg_band_task_t *task = (esp_jpg_band_task_t *)arg;
+    task->result = _jpg_decode_band(task->band, task->pool);
+    xSemaphoreGive(task->done);
+    vTaskDelete(NULL);
+}
+#endif
+
+esp_err_t esp_jpg_decode_parallel(const uint8_t *src, size_t len, jpg_scale_t scale, jpg_pixel_format_t format, jpg_writer_cb writer, void * arg)
+{
+#if !CONFIG_FREERTOS_UNICORE
+    esp_jpg_band_t bands[2];
+    uint16_t split_row;
+    if (!_jpg_split(src, len, bands, &split_row)) {
+        return esp_jpg_decode_mem(src, len, scale, format, writer, arg);
+    }
+    uint16_t width = src[bands[0].height_ofs + 2] << 8 | src[bands[0].height_ofs + 3];
+    uint16_t height = src[bands[0].height_ofs] << 8 | src[bands[0].height_ofs + 1];
+    for (int b = 0; b < 2; b++) {
+        bands[b].jpeg.reader = NULL;
+        bands[b].jpeg.writer = writer;
+        bands[b].jpeg.arg = arg;
+        bands[b].jpeg.scale = scale;
+        bands[b].jpeg.format = format;
+        bands[b].jpeg.top = b ? split_row >> scale : 0;
+    }
+
+    uint16_t output_width = width / (1 << (uint8_t)scale);
+    uint16_t output_height = height / (1 << (uint8_t)scale);
+    //output start
+    writer(arg, 0, 0, output_width, output_height, NULL);
+
+    // the lower band is decoded on the other core
+    esp_jpg_band_task_t task = { &bands[1], (uint8_t *)malloc(JPG_WORK_SIZE), ESP_FAIL, NULL };
+    task.done = task.pool ? xSemaphoreCreateBinary() : NULL;
+    if (task.done && xTaskCreatePinnedToCore(_jpg_band_task, "jpg_decode", PARALLEL_TASK_STACK, &task,
+                                             uxTaskPriorityGet(NULL), NULL, !xPortGetCoreID()) != pdPASS) {
+        ESP_LOGW(TAG, "JPG decode task create failed, decoding on one core");
+        vSemaphoreDelete(task.done);
+        task.done = NULL;
+    }
+    esp_err_t ret = _jpg_decode_band(&bands[0], work);
+    if (task.done) {
+        xSemaphoreTake(task.done, portMAX_DELAY);
+        vSemaphoreDelete(task.done);
+    } else {
+        task.result = _jpg_decode_band(&bands[1], work);
+    }
+    free(task.pool);
+
+    //output end
+    writer(arg, output_width, output_height, output_width, output_height, NULL);
+    return ret == ESP_OK ? task.result : ret;
+#else
+    return esp_jpg_decode_mem(src, len, scale, format, writer, arg);
+#endif
+}
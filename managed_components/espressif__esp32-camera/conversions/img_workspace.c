@@ -0,0 +1,150 @@
+// Copyright 2015-2016 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_heap_caps.h"
+#include "img_workspace.h"
+
+#if defined(ARDUINO_ARCH_ESP32) && defined(CONFIG_ARDUHAL_ESP_LOG)
+#include "esp32-hal-log.h"
+#define TAG ""
+#else
+#include "esp_log.h"
+static const char* TAG = "img_workspace";
+#endif
+
+// The buffers are stacked in the order they are taken, each after a header linking it to the previous one.
+// A buffer given back is marked, and the top of the stack moves down over the marked buffers, so the
+// conversions, which free what they allocated before returning, leave the workspace empty.
+
+#define BLOCK_ALIGN 8
+#define NO_BLOCK    UINT32_MAX
+
+typedef struct {
+    uint32_t prev;      // offset of the header of the previous buffer, NO_BLOCK for the first
+    uint32_t freed;
+} block_header_t;
+
+struct img_workspace {
+    uint8_t *buf;
+    size_t size;
+    size_t used;        // end of the last buffer
+    uint32_t last;      // offset of the header of the last buffer, NO_BLOCK when empty
+    img_workspace_stats_t stats;
+};
+
+static void *_malloc(size_t size)
+{
+    void * res = malloc(size);
+    if(res) {
+        return res;
+    }
+
+    // check if SPIRAM is enabled and is allocatable
+#if (CONFIG_SPIRAM_SUPPORT && (CONFIG_SPIRAM_USE_CAPS_ALLOC || CONFIG_SPIRAM_USE_MALLOC))
+    return heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+#endif
+    return NULL;
+}
+
+size_t img_workspace_block_size(size_t size)
+{
+    return sizeof(block_header_t) + ((size + BLOCK_ALIGN - 1) & ~(BLOCK_ALIGN - 1));
+}
+
+img_workspace_t *img_workspace_create(size_t size)
+{
+    const size_t head = (sizeof(img_workspace_t) + BLOCK_ALIGN - 1) & ~(BLOCK_ALIGN - 1);
+    size = (size + BLOCK_ALIGN - 1) & ~(BLOCK_ALIGN - 1);
+    img_workspace_t *ws = (img_workspace_t *)_malloc(head + size);
+    if(!ws) {
+        ESP_LOGE(TAG, "_malloc failed! %u", (unsigned) (head + size));
+        return NULL;
+    }
+    memset(ws, 0, sizeof(*ws));
+    ws->buf = (uint8_t *)ws + head;
+    ws->size = size;
+    ws->last = NO_BLOCK;
+    ws->stats.size = size;
+    return ws;
+}
+
+void img_workspace_delete(img_workspace_t *ws)
+{
+    if(ws && ws->used) {
+        ESP_LOGW(TAG, "Workspace deleted with %u bytes in use", (unsigned) ws->used);
+    }
+    free(ws);
+}
+
+void img_workspace_get_stats(const img_workspace_t *ws, img_workspace_stats_t *stats)
+{
+    *stats = ws->stats;
+    stats->used = ws->used;
+}
+
+void *img_workspace_alloc(img_workspace_t *ws, size_t size)
+{
+    if(!ws) {
+        return NULL;
+    }
+    size_t len = img_workspace_block_size(size);
+    if(len > ws->size - ws->used) {
+        ESP_LOGW(TAG, "%u bytes do not fit in the workspace, %u of %u in use", (unsigned) size, (unsigned) ws->used, (unsigned) ws->size);
+        ws->stats.fallbacks++;
+        return NULL;
+    }
+    block_header_t *h = (block_header_t *)(ws->buf + ws->used);
+    h->prev = ws->last;
+    h->freed = 0;
+    ws->last = ws->used;
+    ws->used += len;
+    ws->stats.allocs++;
+    ws->stats.alloc_bytes += size;
+    if(ws->used > ws->stats.peak) {
+        ws->stats.peak = ws->used;
+    }
+    return h + 1;
+}
+
+bool img_workspace_free(img_workspace_t *ws, void *p)
+{
+    if(!ws || (uint8_t *)p < ws->buf || (uint8_t *)p >= ws->buf + ws->size) {
+        return false;
+    }
+    ((block_header_t *)p - 1)->freed = 1;
+    while(ws->last != NO_BLOCK) {
+        block_header_t *h = (block_header_t *)(ws->buf + ws->last);
+        if(!h->freed) {
+            break;
+        }
+        ws->used = ws->last;
+        ws->last = h->prev;
+    }
+    return true;
+}
+
+void *img_ws_malloc(img_workspace_t *ws, size_t size)
+{
+    void *res = img_workspace_alloc(ws, size);
+    return res ? res : _malloc(size);
+}
+
+void img_ws_free(img_workspace_t *ws, void *p)
+{
+    if(!img_workspace_free(ws, p)) {
+        free(p);
+    }
+}
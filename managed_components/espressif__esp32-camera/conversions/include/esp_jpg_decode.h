@@ -31,11 +31,60 @@ typedef enum {
     JPG_SCALE_MAX = JPG_SCALE_8X
 } jpg_scale_t;
 
+typedef enum {
+    JPG_PIXEL_RGB888,       /*!< 3 bytes per pixel: R, G, B */
+    JPG_PIXEL_BGR888,       /*!< 3 bytes per pixel: B, G, R, like fmt2rgb888() and BMP files */
+    JPG_PIXEL_RGB565_LE,    /*!< 2 bytes per pixel, low byte first, like jpg2rgb565() */
+    JPG_PIXEL_RGB565_BE,    /*!< 2 bytes per pixel, high byte first, like PIXFORMAT_RGB565 frames */
+    JPG_PIXEL_GRAYSCALE,    /*!< 1 byte per pixel: luminance */
+} jpg_pixel_format_t;
+
 typedef size_t (* jpg_reader_cb)(void * arg, size_t index, uint8_t *buf, size_t len);
 typedef bool (* jpg_writer_cb)(void * arg, uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint8_t *data);
 
 esp_err_t esp_jpg_decode(size_t len, jpg_scale_t scale, jpg_reader_cb reader, jpg_writer_cb writer, void * arg);
 
+/**
+ * @brief Decode a JPEG image held in memory
+ *
+ * Same as esp_jpg_decode() without the reader. With the software decoder the compressed
+ * data is read in place instead of being copied through its input buffer.
+ * The software decoder writes the requested pixel format directly from its color
+ * conversion and skips the chroma of grayscale output; the ROM decoder output is
+ * converted block by block.
+ *
+ * @param src       JPEG image
+ * @param len       Length in bytes of the JPEG image
+ * @param scale     Output scale
+ * @param format    Pixel format of the data passed to the writer
+ * @param writer    Callback receiving the decoded pixels
+ * @param arg       Pointer to be passed to the writer
+ *
+ * @return ESP_OK on success
+ */
+esp_err_t esp_jpg_decode_mem(const uint8_t *src, size_t len, jpg_scale_t scale, jpg_pixel_format_t format, jpg_writer_cb writer, void * arg);
+
+/**
+ * @brief Decode a JPEG image held in memory on both cores
+ *
+ * Same as esp_jpg_decode_mem(), for JPEGs with restart markers. The image is split in two bands of
+ * MCU rows at the restart marker that starts the row closest to the middle, and the lower band is
+ * decoded by a task on the other core. The writer is then called from both tasks at the same time,
+ * for different rows, but the calls with NULL data that start and end the output are made once
+ * from the calling task. Falls back to esp_jpg_decode_mem() when no restart marker starts a row,
+ * e.g. when the JPEG has none, or on single core chips.
+ *
+ * @param src       JPEG image
+ * @param len       Length in bytes of the JPEG image
+ * @param scale     Output scale
+ * @param format    Pixel format of the data passed to the writer
+ * @param writer    Callback receiving the decoded pixels, must be safe to call from two tasks
+ * @param arg       Pointer to be passed to the writer
+ *
+ * @return ESP_OK on success
+ */
+esp_err_t esp_jpg_decode_parallel(const uint8_t *src, size_t len, jpg_scale_t scale, jpg_pixel_format_t format, jpg_writer_cb writer, void * arg);
+
 #ifdef __cplusplus
 }
 #endif
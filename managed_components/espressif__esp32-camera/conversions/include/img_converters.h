@@ -26,6 +26,146 @@ extern "C" {
 
 typedef size_t (* jpg_out_cb)(void * arg, size_t index, const void* data, size_t len);
 
+/**
+ * @brief Forward DCT used by the JPEG encoder
+ */
+typedef enum {
+    JPEG_DCT_DEFAULT,   /*!< The DCT selected with CONFIG_CAMERA_JPEG_ENCODER_DCT */
+    JPEG_DCT_ISLOW,     /*!< Accurate integer DCT */
+    JPEG_DCT_AAN,       /*!< Fast scaled integer DCT, slightly less accurate at high quality */
+    JPEG_DCT_AAN_SIMD,  /*!< JPEG_DCT_AAN with its column pass on the ESP32-S3 vector instructions. Falls back to JPEG_DCT_AAN when not enabled */
+} jpeg_dct_t;
+
+/**
+ * @brief How the JPEG encoder reads the source image
+ */
+typedef enum {
+    JPG_SOURCE_AUTO,        /*!< JPG_SOURCE_PREFETCH when the source is in PSRAM, otherwise JPG_SOURCE_DIRECT */
+    JPG_SOURCE_DIRECT,      /*!< Read the source lines where they are */
+    JPG_SOURCE_PREFETCH,    /*!< Copy the source into internal RAM a row of MCUs (16 lines, 8 for grayscale and YUV422) at a time, the next row on the other core
+                                 while the current one is encoded. Takes two rows of the source in internal RAM, reads it in place when they cannot be allocated */
+} jpg_source_read_t;
+
+/**
+ * @brief Optimized Huffman tables shared by a series of images, see jpg_huffman_tables_create()
+ */
+typedef struct jpg_huffman_tables jpg_huffman_tables_t;
+
+/**
+ * @brief Scratch memory reused by the conversions instead of the heap, see img_workspace_create()
+ */
+typedef struct img_workspace img_workspace_t;
+
+/**
+ * @brief Use of a workspace since it was created
+ */
+typedef struct {
+    size_t size;            /*!< Bytes the buffers can take */
+    size_t used;            /*!< Bytes taken now, 0 between conversions */
+    size_t peak;            /*!< Most bytes taken at once, with the buffer headers */
+    uint32_t allocs;        /*!< Buffers taken from the workspace, each a heap allocation saved */
+    size_t alloc_bytes;     /*!< Bytes of these buffers, over size the number of times the workspace was reused */
+    uint32_t fallbacks;     /*!< Buffers that did not fit and were allocated from the heap */
+} img_workspace_stats_t;
+
+/**
+ * @brief JPEG encoder settings for fmt2jpg_ex() and fmt2jpg_cb_ex()
+ */
+typedef struct {
+    uint8_t quality;                        /*!< JPEG quality of the resulting image */
+    jpeg_dct_t dct;                         /*!< Forward DCT implementation */
+    bool optimize_huffman;                  /*!< Encode in two passes with Huffman tables optimized for the image: smaller output, about twice the encode time */
+    jpg_huffman_tables_t *huffman_tables;   /*!< Optional with optimize_huffman. Keeps the optimized tables and encodes the following images in one pass with them */
+    uint16_t restart_interval;              /*!< MCUs between restart markers, 0 for none. A row of MCUs, (width + 15) / 16 or (width + 7) / 8 for grayscale, lets esp_jpg_decode_parallel() split the image */
+    bool progressive;                       /*!< Encode a progressive JPEG: a DC scan first, then the AC bands. Each scan is sent to the output as soon as it is coded, so a receiver can show a preview after the first few KB.
+                                                 Keeps all the coefficients until the end, 128 bytes per 8x8 block or about 3 bytes per pixel in color. Ignores optimize_huffman, huffman_tables and restart_interval */
+    jpg_source_read_t source_read;          /*!< How the source is read, see jpg_source_read_t */
+    size_t target_size;                     /*!< Aim for a JPEG of this many bytes instead of using quality, 0 for none. The quality is predicted from a few rows of MCUs
+                                                 encoded beforehand, then each row is quantized more coarsely while the output runs over the bytes left for it.
+                                                 Ignores optimize_huffman, huffman_tables and progressive */
+    img_workspace_t *workspace;             /*!< Optional scratch memory for the encoder buffers, see img_workspace_size(). Jobs of fmt2jpg_parallel() must not share it */
+} jpg_encode_config_t;
+
+#define JPG_ENCODE_CONFIG_DEFAULT() { \
+    .quality = 80, \
+    .dct = JPEG_DCT_DEFAULT, \
+    .optimize_huffman = false, \
+    .huffman_tables = NULL, \
+    .restart_interval = 0, \
+    .progressive = false, \
+    .source_read = JPG_SOURCE_AUTO, \
+    .target_size = 0, \
+    .workspace = NULL, \
+}
+
+/**
+ * @brief Create a store for optimized Huffman tables
+ *
+ * With jpg_encode_config_t::optimize_huffman, an image encoded with the store in its config builds the
+ * tables in two passes. The next reuse_count images are encoded in a single pass with them, then they
+ * are rebuilt. Kept tables have a code for every symbol, so they are slightly larger than the ones
+ * optimized for a single image, but can encode any image.
+ *
+ * @param reuse_count   Number of images encoded with the tables after the one they were built from
+ *
+ * @return The store, NULL if out of memory
+ */
+jpg_huffman_tables_t *jpg_huffman_tables_create(uint16_t reuse_count);
+
+/**
+ * @brief Delete a store created with jpg_huffman_tables_create()
+ *
+ * @param tables    The store to delete
+ */
+void jpg_huffman_tables_delete(jpg_huffman_tables_t *tables);
+
+/**
+ * @brief Create a workspace for the scratch buffers of the conversions
+ *
+ * A conversion given the workspace takes its line buffers, encoder state and decoder stripes from it
+ * instead of allocating them from the heap, and gives them back before it returns, so the same memory
+ * is reused by every conversion and continuous conversion does not fragment the heap. A buffer that does
+ * not fit is allocated from the heap and counted in the statistics. The returned images, like the buffer
+ * of fmt2jpg_ex(), are still allocated from the heap, the callback variants avoid them. The internal RAM
+ * stripes of JPG_SOURCE_PREFETCH also are, JPG_SOURCE_DIRECT avoids them. A workspace can be used by one
+ * conversion at a time.
+ *
+ * @param size      Bytes for the buffers, see img_workspace_size()
+ *
+ * @return The workspace, NULL if out of memory
+ */
+img_workspace_t *img_workspace_create(size_t size);
+
+/**
+ * @brief Delete a workspace created with img_workspace_create()
+ *
+ * @param ws        The workspace to delete
+ */
+void img_workspace_delete(img_workspace_t *ws);
+
+/**
+ * @brief Size of the workspace for the conversions of an image
+ *
+ * For a source in RGB565, RGB888, YUYV or GRAYSCALE format, the bytes fmt2jpg_ex() and fmt2jpg_cb_ex()
+ * take with config. For a JPEG, the bytes jpg2bmp_cb_ex() and jpg_transform_cb() take at most.
+ *
+ * @param width     Width in pixels of the image
+ * @param height    Height in pixels of the image
+ * @param format    Format of the image
+ * @param config    Encoder settings, NULL for JPG_ENCODE_CONFIG_DEFAULT(). Not used for JPEG
+ *
+ * @return Bytes to create the workspace with, 0 for an unsupported format
+ */
+size_t img_workspace_size(uint16_t width, uint16_t height, pixformat_t format, const jpg_encode_config_t *config);
+
+/**
+ * @brief Get the use statistics of a workspace
+ *
+ * @param ws        The workspace
+ * @param stats     Set to its statistics
+ */
+void img_workspace_get_stats(const img_workspace_t *ws, img_workspace_stats_t *stats);
+
 /**
  * @brief Convert image buffer to JPEG
  *
@@ -42,6 +182,22 @@ typedef size_t (* jpg_out_cb)(void * arg, size_t index, const void* data, size_t
  */
 bool fmt2jpg_cb(uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixformat_t format, uint8_t quality, jpg_out_cb cb, void * arg);
 
+/**
+ * @brief Convert image buffer to JPEG with the given encoder settings
+ *
+ * @param src       Source buffer in RGB565, RGB888, YUYV or GRAYSCALE format
+ * @param src_len   Length in bytes of the source buffer
+ * @param width     Width in pixels of the source image
+ * @param height    Height in pixels of the source image
+ * @param format    Format of the source image
+ * @param config    Encoder settings
+ * @param cp        Callback to be called to write the bytes of the output JPEG
+ * @param arg       Pointer to be passed to the callback
+ *
+ * @return true on success
+ */
+bool fmt2jpg_cb_ex(uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixformat_t format, const jpg_encode_config_t *config, jpg_out_cb cb, void * arg);
+
 /**
  * @brief Convert camera frame buffer to JPEG
  *
@@ -71,6 +227,110 @@ bool frame2jpg_cb(camera_fb_t * fb, uint8_t quality, jpg_out_cb cb, void * arg);
  */
 bool fmt2jpg(uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixformat_t format, uint8_t quality, uint8_t ** out, size_t * out_len);
 
+/**
+ * @brief Convert image buffer to JPEG buffer with the given encoder settings
+ *
+ * @param src       Source buffer in RGB565, RGB888, YUYV or GRAYSCALE format
+ * @param src_len   Length in bytes of the source buffer
+ * @param width     Width in pixels of the source image
+ * @param height    Height in pixels of the source image
+ * @param format    Format of the source image
+ * @param config    Encoder settings
+ * @param out       Pointer to be populated with the address of the resulting buffer.
+ *                  You MUST free the pointer once you are done with it.
+ * @param out_len   Pointer to be populated with the length of the output buffer
+ *
+ * @return true on success
+ */
+bool fmt2jpg_ex(uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixformat_t format, const jpg_encode_config_t *config, uint8_t ** out, size_t * out_len);
+
+/**
+ * @brief One image of a fmt2jpg_parallel() batch
+ */
+typedef struct {
+    uint8_t *src;                   /*!< Source buffer in RGB565, RGB888, YUYV or GRAYSCALE format */
+    size_t src_len;                 /*!< Length in bytes of the source buffer */
+    uint16_t width;                 /*!< Width in pixels of the source image */
+    uint16_t height;                /*!< Height in pixels of the source image */
+    pixformat_t format;             /*!< Format of the source image */
+    jpg_encode_config_t config;     /*!< Encoder settings. Jobs must not share huffman_tables */
+    uint8_t *out;                   /*!< Set to the resulting buffer, NULL on failure. You MUST free it once you are done with it */
+    size_t out_len;                 /*!< Set to the length of the output buffer */
+    bool ok;                        /*!< Set to the result of the conversion */
+} jpg_encode_job_t;
+
+/**
+ * @brief Convert several images to JPEG buffers in parallel
+ *
+ * The jobs are shared between the calling task and a worker task on the other core, each taking the next
+ * job as soon as it is done with the previous one. Independent horizontal stripes of one frame can be
+ * encoded this way by pointing each job at the first line of its stripe. On single core chips, or if the
+ * worker can not be created, the jobs are converted one after the other by the calling task.
+ *
+ * @param jobs      Images to convert, the results are written back to each job
+ * @param count     Number of jobs
+ *
+ * @return true if all the jobs succeeded
+ */
+bool fmt2jpg_parallel(jpg_encode_job_t *jobs, size_t count);
+
+/**
+ * @brief One JPEG of fmt2jpg_multi()
+ */
+typedef struct {
+    uint8_t scale;                  /*!< 1 for the full size, 2 to 8 for a box filtered image that many times smaller in each direction */
+    jpg_encode_config_t config;     /*!< Encoder settings. optimize_huffman, huffman_tables and target_size are not used */
+    jpg_out_cb cb;                  /*!< Callback receiving the JPEG, NULL to write it to a buffer in out */
+    void *arg;                      /*!< Pointer to be passed to cb */
+    uint8_t *out;                   /*!< Set to the resulting buffer when cb is NULL. You MUST free it once you are done with it */
+    size_t out_len;                 /*!< Set to the length of the JPEG */
+} jpg_encode_output_t;
+
+/**
+ * @brief Convert one image to several JPEGs of different sizes in a single pass
+ *
+ * Each line of the source is read once and given to one encoder per output, the full size ones take it
+ * as it is and the smaller ones sum it into the average of scale x scale pixels. A JPEG source is decoded
+ * once, one MCU row at a time, and its pixels encoded again. The size of a downscaled JPEG is rounded down,
+ * to an even width for YUV422. The source_read and workspace settings of the first output are used for the
+ * whole conversion, see img_workspace_size_multi() for the size of the workspace.
+ *
+ * @param src       Source buffer in RGB565, RGB888, YUYV, GRAYSCALE or JPEG format
+ * @param src_len   Length in bytes of the source buffer
+ * @param width     Width in pixels of the source image, not used for JPEG
+ * @param height    Height in pixels of the source image, not used for JPEG
+ * @param format    Format of the source image
+ * @param outputs   JPEGs to encode, the results are written back to each output
+ * @param count     Number of outputs
+ *
+ * @return true if all the outputs succeeded, no buffer is returned otherwise
+ */
+bool fmt2jpg_multi(uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixformat_t format, jpg_encode_output_t *outputs, size_t count);
+
+/**
+ * @brief Convert camera frame buffer to several JPEGs of different sizes in a single pass
+ *
+ * @param fb        Source camera frame buffer
+ * @param outputs   JPEGs to encode, see fmt2jpg_multi()
+ * @param count     Number of outputs
+ *
+ * @return true if all the outputs succeeded
+ */
+bool frame2jpg_multi(camera_fb_t * fb, jpg_encode_output_t *outputs, size_t count);
+
+/**
+ * @brief Size of the workspace for fmt2jpg_multi()
+ *
+ * @param width     Width in pixels of the source image, also needed for JPEG
+ * @param height    Height in pixels of the source image, also needed for JPEG
+ * @param format    Format of the source image
+ * @param outputs   JPEGs to encode
+ * @param count     Number of outputs
+ *
+ * @return Bytes to create the workspace with, 0 for an unsupported format or scale
+ */
+size_t img_workspace_size_multi(uint16_t width, uint16_t height, pixformat_t format, const jpg_encode_output_t *outputs, size_t count);
+
 /**
  * @brief Convert camera frame buffer to JPEG buffer
  *
@@ -83,6 +343,65 @@ bool fmt2jpg(uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixf
  */
 bool frame2jpg(camera_fb_t * fb, uint8_t quality, uint8_t ** out, size_t * out_len);
 
+/**
+ * @brief Lossless transform of jpg_transform_cb()
+ */
+typedef enum {
+    JPG_TRANSFORM_NONE,         /*!< Crop only */
+    JPG_TRANSFORM_FLIP_H,       /*!< Mirror left to right */
+    JPG_TRANSFORM_FLIP_V,       /*!< Mirror top to bottom */
+    JPG_TRANSFORM_ROTATE_90,    /*!< Rotate 90 degrees clockwise */
+    JPG_TRANSFORM_ROTATE_180,   /*!< Rotate 180 degrees */
+    JPG_TRANSFORM_ROTATE_270,   /*!< Rotate 90 degrees counterclockwise */
+} jpg_transform_t;
+
+/**
+ * @brief Settings of jpg_transform_cb()
+ *
+ * The crop area is given in source pixels, before the transform. Its left and top edges are rounded
+ * down to the MCU grid (8 or 16 pixels depending on the chroma subsampling). An edge of the area
+ * that the transform moves to the left or top of the output is rounded down to the grid too, so a
+ * partial MCU at the right or bottom of the image is dropped when it would end up inside the output.
+ */
+typedef struct {
+    jpg_transform_t transform;  /*!< Flip or rotation applied to the cropped area */
+    uint16_t crop_x;            /*!< Left of the kept area */
+    uint16_t crop_y;            /*!< Top of the kept area */
+    uint16_t crop_width;        /*!< Width of the kept area, 0 for the rest of the image */
+    uint16_t crop_height;       /*!< Height of the kept area, 0 for the rest of the image */
+    bool optimize_huffman;      /*!< Code the output with Huffman tables optimized for it: smaller, the input is entropy decoded twice */
+    img_workspace_t *workspace; /*!< Optional scratch memory for the decoder and encoder state, see img_workspace_size() */
+} jpg_transform_config_t;
+
+#define JPG_TRANSFORM_CONFIG_DEFAULT() { \
+    .transform = JPG_TRANSFORM_NONE, \
+    .crop_x = 0, \
+    .crop_y = 0, \
+    .crop_width = 0, \
+    .crop_height = 0, \
+    .optimize_huffman = false, \
+    .workspace = NULL, \
+}
+
+/**
+ * @brief Crop, flip or rotate a baseline JPEG without decoding it
+ *
+ * The quantized DCT coefficients are moved and sign flipped instead of going through the pixels,
+ * so there is no loss of quality and no IDCT, color conversion or forward DCT. The output is
+ * streamed: apart from the encoder state, only one MCU of coefficients is kept, plus the position
+ * of each kept MCU in the source when the transform changes their order. Rotating a 4:2:2 image
+ * by 90 or 270 degrees gives 4:4:0 chroma subsampling, which most decoders, but not tjpgd, support.
+ *
+ * @param src       Baseline JPEG image
+ * @param src_len   Length in bytes of the JPEG image
+ * @param config    Crop and transform settings
+ * @param cb        Callback to be called to write the bytes of the output JPEG
+ * @param arg       Pointer to be passed to the callback
+ *
+ * @return true on success
+ */
+bool jpg_transform_cb(const uint8_t *src, size_t src_len, const jpg_transform_config_t *config, jpg_out_cb cb, void * arg);
+
 /**
  * @brief Convert image buffer to BMP buffer
  *
@@ -98,6 +417,36 @@ bool frame2jpg(camera_fb_t * fb, uint8_t quality, uint8_t ** out, size_t * out_l
  */
 bool fmt2bmp(uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixformat_t format, uint8_t ** out, size_t * out_len);
 
+/**
+ * @brief Convert JPEG image to BMP without an output buffer for the whole image
+ *
+ * The header is written first, then the pixel rows, top to bottom, as each row of MCUs is
+ * decoded. Only one row of MCUs is kept in memory. Rows are padded to 4 bytes.
+ *
+ * @param src       Source buffer in JPEG format
+ * @param src_len   Length in bytes of the source buffer
+ * @param cb        Callback to be called to write the bytes of the output BMP
+ * @param arg       Pointer to be passed to the callback
+ *
+ * @return true on success
+ */
+bool jpg2bmp_cb(const uint8_t *src, size_t src_len, jpg_out_cb cb, void * arg);
+
+/**
+ * @brief Convert JPEG image to BMP without an output buffer for the whole image
+ *
+ * Same as jpg2bmp_cb(), with the row of MCUs kept in a workspace instead of the heap.
+ *
+ * @param src       Source buffer in JPEG format
+ * @param src_len   Length in bytes of the source buffer
+ * @param workspace Scratch memory for the row of MCUs, see img_workspace_size(). NULL for the heap
+ * @param cb        Callback to be called to write the bytes of the output BMP
+ * @param arg       Pointer to be passed to the callback
+ *
+ * @return true on success
+ */
+bool jpg2bmp_cb_ex(const uint8_t *src, size_t src_len, img_workspace_t *workspace, jpg_out_cb cb, void * arg);
+
 /**
  * @brief Convert camera frame buffer to BMP buffer
  *
@@ -123,6 +472,70 @@ bool fmt2rgb888(const uint8_t *src_buf, size_t src_len, pixformat_t format, uint
 
 bool jpg2rgb565(const uint8_t *src, size_t src_len, uint8_t * out, jpg_scale_t scale);
 
+/**
+ * @brief Decode the luminance of a JPEG image to an 8-bit grayscale buffer
+ *
+ * With the software decoder only the Y component is decoded: the chroma Huffman
+ * codes are skipped over without being dequantized or transformed, and there is
+ * no color conversion. The ROM decoder output is converted to luminance instead.
+ * Meant for analytics like motion detection that only look at the brightness.
+ *
+ * @param src       Source buffer in JPEG format
+ * @param src_len   Length in bytes of the source buffer
+ * @param out       Pointer to the output buffer ((width >> scale) * (height >> scale))
+ * @param scale     Output scale
+ *
+ * @return true on success
+ */
+bool jpg2gray(const uint8_t *src, size_t src_len, uint8_t * out, jpg_scale_t scale);
+
+/**
+ * @brief Decode a 1/8 scale thumbnail of a JPEG image
+ *
+ * Each pixel comes from the DC coefficients of one block, the AC coefficients are
+ * only skipped over and no IDCT is run. Useful to send a small preview of a frame
+ * before the full image.
+ *
+ * @param src       Source buffer in JPEG format
+ * @param src_len   Length in bytes of the source buffer
+ * @param format    PIXFORMAT_RGB565 (high byte first, like the camera frames) or PIXFORMAT_GRAYSCALE
+ * @param out       Pointer to the output buffer ((width / 8) * (height / 8) * bytes per pixel)
+ * @param width     Optional pointer receiving the width of the thumbnail
+ * @param height    Optional pointer receiving the height of the thumbnail
+ *
+ * @return true on success
+ */
+bool jpg2thumb(const uint8_t *src, size_t src_len, pixformat_t format, uint8_t * out, uint16_t * width, uint16_t * height);
+
+/**
+ * @brief Convert a line of YUV422 (YUYV) pixels to RGB888, with the same output as fmt2rgb888()
+ *
+ * The pixels are written in the B, G, R byte order of the fmt2rgb888() buffers. With an odd
+ * pixel count the last pixel uses the V sample of the previous pair.
+ *
+ * @param src       Source pixels, 2 bytes per pixel
+ * @param dst       Output buffer (pixels * 3)
+ * @param pixels    Number of pixels to convert
+ */
+void yuv422_to_rgb888_line(const uint8_t *src, uint8_t *dst, size_t pixels);
+
+/**
+ * @brief Same as yuv422_to_rgb888_line() with fixed point math instead of the lookup table
+ *
+ * Channels may differ from the table by up to 3 levels. fmt2rgb888() and fmt2bmp() use it
+ * when CONFIG_CAMERA_CONVERSIONS_YUV_FIXED_POINT is set.
+ */
+void yuv422_to_rgb888_line_fixed(const uint8_t *src, uint8_t *dst, size_t pixels);
+
+/**
+ * @brief Convert a line of RGB565 pixels to RGB888, with the same output as fmt2rgb888()
+ *
+ * @param src       Source pixels, 2 bytes per pixel, high byte first
+ * @param dst       Output buffer (pixels * 3)
+ * @param pixels    Number of pixels to convert
+ */
+void rgb565_to_rgb888_line(const uint8_t *src, uint8_t *dst, size_t pixels);
+
 #ifdef __cplusplus
 }
 #endif
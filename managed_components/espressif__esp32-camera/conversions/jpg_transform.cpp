@@ -0,0 +1,589 @@
+// Copyright 2015-2016 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <stddef.h>
+#include <string.h>
+#include "esp_heap_caps.h"
+#include "img_converters.h"
+#include "jpge.h"
+#include "img_workspace.h"
+
+#if defined(ARDUINO_ARCH_ESP32) && defined(CONFIG_ARDUHAL_ESP_LOG)
+#include "esp32-hal-log.h"
+#define TAG ""
+#else
+#include "esp_log.h"
+static const char* TAG = "jpg_transform";
+#endif
+
+// The transcoder reads the quantized coefficients of a baseline JPEG with its own Huffman decoder: the
+// ROM tjpgd of the ESP32 and ESP32-S3 only outputs pixels. They are entropy coded again by jpge.
+
+#define MAX_BLOCKS_PER_MCU 6
+
+// natural order index of each zigzag position
+static const uint8_t zigzag_to_natural[64] = {
+     0,  1,  8, 16,  9,  2,  3, 10, 17, 24, 32, 25, 18, 11,  4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13,  6,  7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63
+};
+
+typedef struct {
+    uint16_t look[256];     // (code length << 8) | symbol of the codes up to 8 bits, by their first 8 bits
+    int32_t maxcode[17];    // largest code of each length, -1 if none
+    int32_t valoffset[17];  // index in val of a code of each length, minus the code
+    uint8_t val[256];
+} huffman_t;
+
+// Position of an MCU in the entropy coded data, to decode the MCUs in another order
+typedef struct {
+    uint32_t pos;           // byte offset << 3 | bits already used from that byte
+    int16_t dc[3];          // DC predictors
+} mcu_pos_t;
+
+typedef struct {
+    // frame
+    uint16_t width, height;
+    uint8_t ncomp;
+    uint8_t id[3], h[3], v[3], tq[3];
+    uint8_t blocks;             // blocks per MCU
+    uint16_t mcus_x, mcus_y;
+    uint16_t restart_interval;
+    bool quant_set[4];
+    uint8_t quant[4][64];       // zigzag order
+    bool huff_set[2][2];
+    huffman_t huff[2][2];       // DC/AC, table id
+    const huffman_t *dc[3], *ac[3];
+    // entropy coded segment
+    const uint8_t *scan, *end;
+    const uint8_t *p;
+    uint32_t buf;               // left aligned bits
+    int bits;                   // number of valid bits in buf
+    int16_t pred[3];
+    uint32_t mcu;               // index of the next MCU
+    int16_t mcu_blocks[2][MAX_BLOCKS_PER_MCU * 64];  // decoded and transformed MCU
+} jpg_source_t;
+
+static bool build_huffman(huffman_t *h, const uint8_t *bits, const uint8_t *val, int count)
+{
+    int k = 0;
+    int32_t code = 0;
+    memset(h->look, 0, sizeof(h->look));
+    memcpy(h->val, val, count);
+    h->maxcode[0] = -1;
+    for (int len = 1; len <= 16; len++) {
+        h->valoffset[len] = k - code;
+        for (int i = 0; i < bits[len - 1]; i++, k++, code++) {
+            if (len <= 8) {
+                int first = code << (8 - len);
+                for (int j = 0; j < (1 << (8 - len)); j++) {
+                    h->look[first + j] = (len << 8) | val[k];
+                }
+            }
+        }
+        if (code > (1 << len)) {
+            return false;
+        }
+        h->maxcode[len] = bits[len - 1] ? code - 1 : -1;
+        code <<= 1;
+    }
+    return true;
+}
+
+// Reads the markers up to the start of the scan
+static bool parse_headers(jpg_source_t *s, const uint8_t *src, size_t len)
+{
+    const uint8_t *p = src + 2, *end = src + len;
+    bool frame = false;
+
+    if (len < 4 || src[0] != 0xFF || src[1] != 0xD8) {
+        ESP_LOGE(TAG, "Not a JPEG");
+        return false;
+    }
+    while (true) {
+        while (p < end && *p != 0xFF) {
+            p++;
+        }
+        while (p < end && *p == 0xFF) {
+            p++;
+        }
+        if (p + 3 > end) {
+            ESP_LOGE(TAG, "No scan");
+            return false;
+        }
+        uint8_t marker = *p++;
+        if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) {
+            continue;
+        }
+        size_t seg_len = (p[0] << 8) | p[1];
+        const uint8_t *q = p + 2, *seg_end = p + seg_len;
+        if (seg_len < 2 || seg_end > end) {
+            ESP_LOGE(TAG, "Truncated marker %02X", marker);
+            return false;
+        }
+        p = seg_end;
+
+        if (marker == 0xDB) {           // DQT
+            while (q + 65 <= seg_end) {
+                if (*q >> 4) {
+                    ESP_LOGE(TAG, "16-bit quantization tables are not supported");
+                    return false;
+                }
+                uint8_t t = *q++ & 3;
+                memcpy(s->quant[t], q, 64);
+                s->quant_set[t] = true;
+                q += 64;
+            }
+        } else if (marker == 0xC4) {    // DHT
+            while (q + 17 <= seg_end) {
+                uint8_t tc = q[0] >> 4, th = q[0] & 15;
+                int count = 0;
+                for (int i = 1; i <= 16; i++) {
+                    count += q[i];
+                }
+                if (tc > 1 || th > 1 || count > 256 || q + 17 + count > seg_end ||
+                    !build_huffman(&s->huff[tc][th], q + 1, q + 17, count)) {
+                    ESP_LOGE(TAG, "Invalid Huffman table");
+                    return false;
+                }
+                s->huff_set[tc][th] = true;
+                q += 17 + count;
+            }
+        } else if (marker == 0xC0 || marker == 0xC1) {  // baseline or extended sequential DCT
+            s->height = (q[1] << 8) | q[2];
+            s->width = (q[3] << 8) | q[4];
+            s->ncomp = q[5];
+            if (q[0] != 8 || !s->width || !s->height || (s->ncomp != 1 && s->ncomp != 3) || q + 6 + s->ncomp * 3 > seg_end) {
+                ESP_LOGE(TAG, "Unsupported frame");
+                return false;
+            }
+            s->blocks = 0;
+            for (int c = 0; c < s->ncomp; c++) {
+                s->id[c] = q[6 + c * 3];
+                s->h[c] = q[7 + c * 3] >> 4;
+                s->v[c] = q[7 + c * 3] & 15;
+                s->tq[c] = q[8 + c * 3] & 3;
+                s->blocks += s->h[c] * s->v[c];
+            }
+            // the MCU layouts of jpge: Y 1x1, 2x1, 1x2 or 2x2 and 1x1 chroma
+            if (s->h[0] < 1 || s->h[0] > 2 || s->v[0] < 1 || s->v[0] > 2 ||
+                (s->ncomp == 3 && (s->h[1] != 1 || s->v[1] != 1 || s->h[2] != 1 || s->v[2] != 1 || s->tq[1] != s->tq[2]))) {
+                ESP_LOGE(TAG, "Unsupported subsampling");
+                return false;
+            }
+            if (s->ncomp == 1) {
+                // a single component scan is not interleaved, its MCU is one block
+                s->h[0] = s->v[0] = 1;
+                s->blocks = 1;
+            }
+            s->mcus_x = (s->width + s->h[0] * 8 - 1) / (s->h[0] * 8);
+            s->mcus_y = (s->height + s->v[0] * 8 - 1) / (s->v[0] * 8);
+            frame = true;
+        } else if ((marker >= 0xC2 && marker <= 0xCF) && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+            ESP_LOGE(TAG, "Only baseline JPEGs are supported");
+            return false;
+        } else if (marker == 0xDD) {    // DRI
+            s->restart_interval = (q[0] << 8) | q[1];
+        } else if (marker == 0xDA) {    // SOS
+            if (!frame || q[0] != s->ncomp || q + 1 + s->ncomp * 2 + 3 > seg_end) {
+                ESP_LOGE(TAG, "Unsupported scan");
+                return false;
+            }
+            for (int i = 0; i < s->ncomp; i++) {
+                const uint8_t *cs = q + 1 + i * 2;
+                int c = 0;
+                while (c < s->ncomp && s->id[c] != cs[0]) {
+                    c++;
+                }
+                uint8_t td = cs[1] >> 4, ta = cs[1] & 15;
+                if (c == s->ncomp || td > 1 || ta > 1 || !s->huff_set[0][td] || !s->huff_set[1][ta] || !s->quant_set[s->tq[c]]) {
+                    ESP_LOGE(TAG, "Missing tables");
+                    return false;
+                }
+                s->dc[c] = &s->huff[0][td];
+                s->ac[c] = &s->huff[1][ta];
+            }
+            s->scan = seg_end;
+            s->end = end;
+            return true;
+        } else if (marker == 0xD9) {
+            ESP_LOGE(TAG, "No scan");
+            return false;
+        }
+    }
+}
+
+// Loads whole bytes into the bit buffer, stopping at a marker
+static inline void fill_bits(jpg_source_t *s)
+{
+    while (s->bits <= 24 && s->p < s->end) {
+        uint8_t c = *s->p;
+        if (c == 0xFF) {
+            if (s->p + 1 >= s->end || s->p[1] != 0) {
+                break;
+            }
+            s->p += 2;
+        } else {
+            s->p++;
+        }
+        s->buf |= (uint32_t)c << (24 - s->bits);
+        s->bits += 8;
+    }
+}
+
+static inline int get_bits(jpg_source_t *s, int n)
+{
+    if (s->bits < n) {
+        fill_bits(s);
+    }
+    int v = s->buf >> (32 - n);
+    s->buf <<= n;
+    s->bits -= n;
+    return v;
+}
+
+static inline int extend(int v, int n)
+{
+    return v < (1 << (n - 1)) ? v - (1 << n) + 1 : v;
+}
+
+static inline int decode_huffman(jpg_source_t *s, const huffman_t *h)
+{
+    if (s->bits < 16) {
+        fill_bits(s);
+    }
+    uint16_t e = h->look[s->buf >> 24];
+    if (e) {
+        s->buf <<= e >> 8;
+        s->bits -= e >> 8;
+        return e & 0xFF;
+    }
+    int32_t code = s->buf >> 16;
+    for (int len = 9; len <= 16; len++) {
+        int32_t c = code >> (16 - len);
+        if (c <= h->maxcode[len]) {
+            s->buf <<= len;
+            s->bits -= len;
+            return h->val[h->valoffset[len] + c];
+        }
+    }
+    return -1;
+}
+
+// Skips the restart marker expected before the MCU
+static bool restart(jpg_source_t *s)
+{
+    s->buf = 0;
+    s->bits = 0;
+    if (s->p + 2 > s->end || s->p[0] != 0xFF || (s->p[1] & 0xF8) != 0xD0) {
+        ESP_LOGE(TAG, "Missing restart marker");
+        return false;
+    }
+    s->p += 2;
+    memset(s->pred, 0, sizeof(s->pred));
+    return true;
+}
+
+// Decodes the next MCU, its blocks in zigzag order
+static bool decode_mcu(jpg_source_t *s, int16_t *blocks)
+{
+    if (s->restart_interval && s->mcu && (s->mcu % s->restart_interval) == 0 && !restart(s)) {
+        return false;
+    }
+    memset(blocks, 0, s->blocks * 64 * sizeof(int16_t));
+    for (int c = 0; c < s->ncomp; c++) {
+        for (int n = s->h[c] * s->v[c]; n > 0; n--, blocks += 64) {
+            int t = decode_huffman(s, s->dc[c]);
+            if (t < 0 || t > 11) {
+                return false;
+            }
+            if (t) {
+                s->pred[c] += extend(get_bits(s, t), t);
+            }
+            blocks[0] = s->pred[c];
+            for (int k = 1; k < 64; k++) {
+                int rs = decode_huffman(s, s->ac[c]);
+                if (rs < 0) {
+                    return false;
+                }
+                int size = rs & 15;
+                if (!size) {
+                    if (rs != 0xF0) {
+                        break;  // end of block
+                    }
+                    k += 15;
+                    continue;
+                }
+                k += rs >> 4;
+                if (k > 63) {
+                    return false;
+                }
+                blocks[k] = extend(get_bits(s, size), size);
+            }
+        }
+    }
+    s->mcu++;
+    return s->bits >= 0;
+}
+
+// Position of the next bit to decode, the buffered bits come from the last data bytes before p.
+// Taken before a restart marker, the restart is done again after seeking back.
+static void tell(const jpg_source_t *s, mcu_pos_t *pos)
+{
+    const uint8_t *q = s->p;
+    int bytes = (s->bits + 7) >> 3;
+    for (int i = 0; i < bytes; i++) {
+        q--;
+        if (*q == 0 && q[-1] == 0xFF) {
+            q--;    // stuffed zero
+        }
+    }
+    pos->pos = ((q - s->scan) << 3) | ((bytes << 3) - s->bits);
+    memcpy(pos->dc, s->pred, sizeof(pos->dc));
+}
+
+static void seek(jpg_source_t *s, const mcu_pos_t *pos, uint32_t mcu)
+{
+    s->p = s->scan + (pos->pos >> 3);
+    s->buf = 0;
+    s->bits = 0;
+    fill_bits(s);
+    s->buf <<= pos->pos & 7;
+    s->bits -= pos->pos & 7;
+    memcpy(s->pred, pos->dc, sizeof(s->pred));
+    s->mcu = mcu;
+}
+
+static void rewind(jpg_source_t *s)
+{
+    s->p = s->scan;
+    s->buf = 0;
+    s->bits = 0;
+    memset(s->pred, 0, sizeof(s->pred));
+    s->mcu = 0;
+}
+
+class transform_stream : public jpge::output_stream {
+protected:
+    jpg_out_cb ocb;
+    void * oarg;
+    size_t index;
+
+public:
+    transform_stream(jpg_out_cb cb, void * arg) : ocb(cb), oarg(arg), index(0) { }
+    virtual ~transform_stream() { }
+    virtual bool put_buf(const void* data, int len)
+    {
+        if (!data) {
+            return true;
+        }
+        size_t written = ocb(oarg, index, data, len);
+        index += written;
+        return written == (size_t)len;
+    }
+    virtual uint get_size() const
+    {
+        return index;
+    }
+};
+
+bool jpg_transform_cb(const uint8_t *src, size_t src_len, const jpg_transform_config_t *config, jpg_out_cb cb, void * arg)
+{
+    // every transform is a transpose followed by flips of the output
+    static const uint8_t transforms[][3] = {
+        // transpose, flip h, flip v
+        { 0, 0, 0 }, { 0, 1, 0 }, { 0, 0, 1 }, { 1, 1, 0 }, { 0, 1, 1 }, { 1, 0, 1 }
+    };
+    if ((unsigned)config->transform > JPG_TRANSFORM_ROTATE_270) {
+        return false;
+    }
+    const bool t = transforms[config->transform][0], fh = transforms[config->transform][1], fv = transforms[config->transform][2];
+
+    img_workspace_t *ws = config->workspace;
+    jpg_source_t *s = (jpg_source_t *)img_ws_malloc(ws, sizeof(jpg_source_t));
+    if (!s) {
+        ESP_LOGE(TAG, "_malloc failed! %u", (unsigned) sizeof(jpg_source_t));
+        return false;
+    }
+    memset(s, 0, sizeof(jpg_source_t));
+    mcu_pos_t *index = NULL;
+    bool ok = false;
+
+    if (!parse_headers(s, src, src_len)) {
+        img_ws_free(ws, s);
+        return false;
+    }
+
+    // crop area in MCUs, the edges moved to the left or top of the output must be on the MCU grid
+    const int mw = s->h[0] * 8, mh = s->v[0] * 8;
+    int x0 = config->crop_x / mw * mw, y0 = config->crop_y / mh * mh;
+    int x1 = config->crop_width ? config->crop_x + config->crop_width : s->width;
+    int y1 = config->crop_height ? config->crop_y + config->crop_height : s->height;
+    x1 = x1 > s->width ? s->width : x1;
+    y1 = y1 > s->height ? s->height : y1;
+    if (t ? fv : fh) {
+        x1 = x0 + (x1 - x0) / mw * mw;
+    }
+    if (t ? fh : fv) {
+        y1 = y0 + (y1 - y0) / mh * mh;
+    }
+    if (x1 <= x0 || y1 <= y0) {
+        ESP_LOGE(TAG, "Empty crop area");
+        img_ws_free(ws, s);
+        return false;
+    }
+    const int mcx0 = x0 / mw, mcy0 = y0 / mh;
+    const int ncx = (x1 - x0 + mw - 1) / mw, ncy = (y1 - y0 + mh - 1) / mh;
+    const int out_mcus_x = t ? ncy : ncx, out_mcus_y = t ? ncx : ncy;
+
+    jpge::coefficient_frame frame;
+    frame.m_num_components = s->ncomp;
+    for (int c = 0; c < s->ncomp; c++) {
+        frame.m_h_samp[c] = t ? s->v[c] : s->h[c];
+        frame.m_v_samp[c] = t ? s->h[c] : s->v[c];
+    }
+    // for each output coefficient in zigzag order, its source position and sign
+    uint8_t perm[64];
+    uint64_t negate = 0;
+    uint8_t natural_to_zigzag[64];
+    for (int k = 0; k < 64; k++) {
+        natural_to_zigzag[zigzag_to_natural[k]] = k;
+    }
+    for (int k = 0; k < 64; k++) {
+        int u = zigzag_to_natural[k] & 7, v = zigzag_to_natural[k] >> 3;
+        perm[k] = natural_to_zigzag[t ? u * 8 + v : v * 8 + u];
+        if ((fh && (u & 1)) ^ (fv && (v & 1))) {
+            negate |= 1ULL << k;
+        }
+    }
+
+    // the quantized coefficients are kept, so a transpose moves their steps with them
+    for (int k = 0; k < 64; k++) {
+        frame.m_quant_tables[0][k] = s->quant[s->tq[0]][perm[k]];
+        frame.m_quant_tables[1][k] = s->quant[s->ncomp == 3 ? s->tq[1] : s->tq[0]][perm[k]];
+    }
+
+    // the MCUs are decoded in order unless the transform moves them
+    const bool reorder = t || fh || fv;
+    if (reorder) {
+        index = (mcu_pos_t *)img_ws_malloc(ws, ncx * ncy * sizeof(mcu_pos_t));
+        if (!index) {
+            ESP_LOGE(TAG, "_malloc failed! %u", (unsigned) (ncx * ncy * sizeof(mcu_pos_t)));
+            img_ws_free(ws, s);
+            return false;
+        }
+    }
+
+    int16_t *in = s->mcu_blocks[0], *out = s->mcu_blocks[1];
+    transform_stream dst_stream(cb, arg);
+    jpge::params comp_params;
+    comp_params.m_two_pass_flag = config->optimize_huffman;
+    comp_params.m_pWorkspace = ws;
+    jpge::jpeg_encoder dst_image;
+
+    if (reorder) {
+        // find where each kept MCU starts
+        rewind(s);
+        uint32_t last = (mcy0 + ncy - 1) * s->mcus_x + mcx0 + ncx;
+        for (uint32_t m = 0; m < last; m++) {
+            int mx = m % s->mcus_x - mcx0, my = m / s->mcus_x - mcy0;
+            if (mx >= 0 && mx < ncx && my >= 0) {
+                tell(s, &index[my * ncx + mx]);
+            }
+            if (!decode_mcu(s, in)) {
+                ESP_LOGE(TAG, "Corrupt data at MCU %u", (unsigned) m);
+                goto out;
+            }
+        }
+    }
+
+    if (!dst_image.init(&dst_stream, t ? y1 - y0 : x1 - x0, t ? x1 - x0 : y1 - y0, frame, comp_params)) {
+        ESP_LOGE(TAG, "JPG encoder init failed");
+        goto out;
+    }
+
+    for (uint pass = 0; pass < dst_image.get_total_passes(); pass++) {
+        rewind(s);
+        for (int oy = 0; oy < out_mcus_y; oy++) {
+            for (int ox = 0; ox < out_mcus_x; ox++) {
+                // source MCU of this output MCU
+                int fx = fh ? out_mcus_x - 1 - ox : ox, fy = fv ? out_mcus_y - 1 - oy : oy;
+                int ix = t ? fy : fx, iy = t ? fx : fy;
+                uint32_t m = (mcy0 + iy) * s->mcus_x + mcx0 + ix;
+                if (reorder) {
+                    seek(s, &index[iy * ncx + ix], m);
+                } else {
+                    // skip to it in the source order
+                    while (s->mcu < m) {
+                        if (!decode_mcu(s, in)) {
+                            ESP_LOGE(TAG, "Corrupt data at MCU %u", (unsigned) s->mcu);
+                            goto out;
+                        }
+                    }
+                }
+                if (!decode_mcu(s, in)) {
+                    ESP_LOGE(TAG, "Corrupt data at MCU %u", (unsigned) m);
+                    goto out;
+                }
+                if (!reorder) {
+                    if (!dst_image.process_mcu_coefficients(in)) {
+                        ESP_LOGE(TAG, "JPG process MCU failed");
+                        goto out;
+                    }
+                    continue;
+                }
+                // move the blocks of each component and their coefficients
+                int16_t *src_comp = in, *dst = out;
+                for (int c = 0; c < s->ncomp; c++) {
+                    int oh = frame.m_h_samp[c], ov = frame.m_v_samp[c];
+                    for (int by = 0; by < ov; by++) {
+                        for (int bx = 0; bx < oh; bx++, dst += 64) {
+                            int sx = fh ? oh - 1 - bx : bx, sy = fv ? ov - 1 - by : by;
+                            const int16_t *blk = src_comp + ((t ? sx * s->h[c] + sy : sy * s->h[c] + sx) << 6);
+                            for (int k = 0; k < 64; k++) {
+                                dst[k] = (negate >> k) & 1 ? -blk[perm[k]] : blk[perm[k]];
+                            }
+                        }
+                    }
+                    src_comp += (s->h[c] * s->v[c]) << 6;
+                }
+                if (!dst_image.process_mcu_coefficients(out)) {
+                    ESP_LOGE(TAG, "JPG process MCU failed");
+                    goto out;
+                }
+            }
+        }
+        if (!dst_image.process_mcu_coefficients(NULL)) {
+            ESP_LOGE(TAG, "JPG image finish failed");
+            goto out;
+        }
+    }
+    ok = true;
+
+out:
+    dst_image.deinit();
+    img_ws_free(ws, index);
+    img_ws_free(ws, s);
+    return ok;
+}
+
+size_t jpg_transform_workspace_size(uint16_t width, uint16_t height)
+{
+    // the index of every MCU of the smallest size and the encoder with optimized tables
+    jpge::params comp_params;
+    comp_params.m_two_pass_flag = true;
+    return img_workspace_block_size(sizeof(jpg_source_t)) +
+           img_workspace_block_size(((width + 7) / 8) * ((height + 7) / 8) * sizeof(mcu_pos_t)) +
+           jpge::jpeg_encoder::get_alloc_size(comp_params);
+}
@@ -18,28 +18,15 @@
 #include <string.h>
 #include <malloc.h>
 #include "esp_heap_caps.h"
+#include "img_workspace.h"
 
 #define JPGE_MAX(a,b) (((a)>(b))?(a):(b))
 #define JPGE_MIN(a,b) (((a)<(b))?(a):(b))
 
 namespace jpge {
 
-    static inline void *jpge_malloc(size_t nSize) {
-        void * b = malloc(nSize);
-        if(b){
-            return b;
-        }
-    // check if SPIRAM is enabled and allocate on SPIRAM if allocatable
-#if (CONFIG_SPIRAM_SUPPORT && (CONFIG_SPIRAM_USE_CAPS_ALLOC || CONFIG_SPIRAM_USE_MALLOC))
-        return heap_caps_malloc(nSize, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
-#else
-        return NULL;
-#endif
-    }
-    static inline void jpge_free(void *p) { free(p); }
-
     // Various JPEG enums and tables.
-    enum { M_SOF0 = 0xC0, M_DHT = 0xC4, M_SOI = 0xD8, M_EOI = 0xD9, M_SOS = 0xDA, M_DQT = 0xDB, M_APP0 = 0xE0 };
+    enum { M_SOF0 = 0xC0, M_SOF2 = 0xC2, M_DHT = 0xC4, M_SOI = 0xD8, M_EOI = 0xD9, M_SOS = 0xDA, M_DQT = 0xDB, M_DRI = 0xDD, M_RST0 = 0xD0, M_APP0 = 0xE0 };
     enum { DC_LUM_CODES = 12, AC_LUM_CODES = 256, DC_CHROMA_CODES = 12, AC_CHROMA_CODES = 256, MAX_HUFF_SYMBOLS = 257, MAX_HUFF_CODESIZE = 32 };
 
     static const uint8 s_zag[64] = { 0,1,8,16,9,2,3,10,17,24,32,25,18,11,4,5,12,19,26,33,40,48,41,34,27,20,13,6,7,14,21,28,35,42,49,56,57,50,43,36,29,22,15,23,30,37,44,51,58,59,52,45,38,31,39,46,53,60,61,54,47,55,62,63 };
@@ -68,16 +55,106 @@ namespace jpge {
         0xf9,0xfa
     };
 
+    // Canonical codes and code sizes of the standard tables above, indexed by symbol.
+    static const uint16 s_dc_lum_codes[DC_LUM_CODES] = {
+        0x0000,0x0002,0x0003,0x0004,0x0005,0x0006,0x000e,0x001e,0x003e,0x007e,0x00fe,0x01fe
+    };
+    static const uint8 s_dc_lum_code_sizes[DC_LUM_CODES] = {
+         2, 3, 3, 3, 3, 3, 4, 5, 6, 7, 8, 9
+    };
+    static const uint16 s_ac_lum_codes[AC_LUM_CODES] = {
+        0x000a,0x0000,0x0001,0x0004,0x000b,0x001a,0x0078,0x00f8,0x03f6,0xff82,0xff83,0x0000,0x0000,0x0000,0x0000,0x0000,
+        0x0000,0x000c,0x001b,0x0079,0x01f6,0x07f6,0xff84,0xff85,0xff86,0xff87,0xff88,0x0000,0x0000,0x0000,0x0000,0x0000,
+        0x0000,0x001c,0x00f9,0x03f7,0x0ff4,0xff89,0xff8a,0xff8b,0xff8c,0xff8d,0xff8e,0x0000,0x0000,0x0000,0x0000,0x0000,
+        0x0000,0x003a,0x01f7,0x0ff5,0xff8f,0xff90,0xff91,0xff92,0xff93,0xff94,0xff95,0x0000,0x0000,0x0000,0x0000,0x0000,
+        0x0000,0x003b,0x03f8,0xff96,0xff97,0xff98,0xff99,0xff9a,0xff9b,0xff9c,0xff9d,0x0000,0x0000,0x0000,0x0000,0x0000,
+        0x0000,0x007a,0x07f7,0xff9e,0xff9f,0xffa0,0xffa1,0xffa2,0xffa3,0xffa4,0xffa5,0x0000,0x0000,0x0000,0x0000,0x0000,
+        0x0000,0x007b,0x0ff6,0xffa6,0xffa7,0xffa8,0xffa9,0xffaa,0xffab,0xffac,0xffad,0x0000,0x0000,0x0000,0x0000,0x0000,
+        0x0000,0x00fa,0x0ff7,0xffae,0xffaf,0xffb0,0xffb1,0xffb2,0xffb3,0xffb4,0xffb5,0x0000,0x0000,0x0000,0x0000,0x0000,
+        0x0000,0x01f8,0x7fc0,0xffb6,0xffb7,0xffb8,0xffb9,0xffba,0xffbb,0xffbc,0xffbd,0x0000,0x0000,0x0000,0x0000,0x0000,
+        0x0000,0x01f9,0xffbe,0xffbf,0xffc0,0xffc1,0xffc2,0xffc3,0xffc4,0xffc5,0xffc6,0x0000,0x0000,0x0000,0x0000,0x0000,
+        0x0000,0x01fa,0xffc7,0xffc8,0xffc9,0xffca,0xffcb,0xffcc,0xffcd,0xffce,0xffcf,0x0000,0x0000,0x0000,0x0000,0x0000,
+        0x0000,0x03f9,0xffd0,0xffd1,0xffd2,0xffd3,0xffd4,0xffd5,0xffd6,0xffd7,0xffd8,0x0000,0x0000,0x0000,0x0000,0x0000,
+        0x0000,0x03fa,0xffd9,0xffda,0xffdb,0xffdc,0xffdd,0xffde,0xffdf,0xffe0,0xffe1,0x0000,0x0000,0x0000,0x0000,0x0000,
+        0x0000,0x07f8,0xffe2,0xffe3,0xffe4,0xffe5,0xffe6,0xffe7,0xffe8,0xffe9,0xffea,0x0000,0x0000,0x0000,0x0000,0x0000,
+        0x0000,0xffeb,0xffec,0xffed,0xffee,0xffef,0xfff0,0xfff1,0xfff2,0xfff3,0xfff4,0x0000,0x0000,0x0000,0x0000,0x0000,
+        0x07f9,0xfff5,0xfff6,0xfff7,0xfff8,0xfff9,0xfffa,0xfffb,0xfffc,0xfffd,0xfffe,0x0000,0x0000,0x0000,0x0000,0x0000
+    };
+    static const uint8 s_ac_lum_code_sizes[AC_LUM_CODES] = {
+         4, 2, 2, 3, 4, 5, 7, 8,10,16,16, 0, 0, 0, 0, 0, 0, 4, 5, 7, 9,11,16,16,16,16,16, 0, 0, 0, 0, 0,
+         0, 5, 8,10,12,16,16,16,16,16,16, 0, 0, 0, 0, 0, 0, 6, 9,12,16,16,16,16,16,16,16, 0, 0, 0, 0, 0,
+         0, 6,10,16,16,16,16,16,16,16,16, 0, 0, 0, 0, 0, 0, 7,11,16,16,16,16,16,16,16,16, 0, 0, 0, 0, 0,
+         0, 7,12,16,16,16,16,16,16,16,16, 0, 0, 0, 0, 0, 0, 8,12,16,16,16,16,16,16,16,16, 0, 0, 0, 0, 0,
+         0, 9,15,16,16,16,16,16,16,16,16, 0, 0, 0, 0, 0, 0, 9,16,16,16,16,16,16,16,16,16, 0, 0, 0, 0, 0,
+         0, 9,16,16,16,16,16,16,16,16,16, 0, 0, 0, 0, 0, 0,10,16,16,16,16,16,16,16,16,16, 0, 0, 0, 0, 0,
+         0,10,16,16,16,16,16,16,16,16,16, 0, 0, 0, 0, 0, 0,11,16,16,16,16,16,16,16,16,16, 0, 0, 0, 0, 0,
+         0,16,16,16,16,16,16,16,16,16,16, 0, 0, 0, 0, 0,11,16,16,16,16,16,16,16,16,16,16, 0, 0, 0, 0, 0
+    };
+    static const uint16 s_dc_chroma_codes[DC_CHROMA_CODES] = {
+        0x0000,0x0001,0x0002,0x0006,0x000e,0x001e,0x003e,0x007e,0x00fe,0x01fe,0x03fe,0x07fe
+    };
+    static const uint8 s_dc_chroma_code_sizes[DC_CHROMA_CODES] = {
+         2, 2, 2, 3, 4, 5, 6, 7, 8, 9,10,11
+    };
+    static const uint16 s_ac_chroma_codes[AC_CHROMA_CODES] = {
+        0x0000,0x0001,0x0004,0x000a,0x0018,0x0019,0x0038,0x0078,0x01f4,0x03f6,0x0ff4,0x0000,0x0000,0x0000,0x0000,0x0000,
+        0x0000,0x000b,0x0039,0x00f6,0x01f5,0x07f6,0x0ff5,0xff88,0xff89,0xff8a,0xff8b,0x0000,0x0000,0x0000,0x0000,0x0000,
+        0x0000,0x001a,0x00f7,0x03f7,0x0ff6,0x7fc2,0xff8c,0xff8d,0xff8e,0xff8f,0xff90,0x0000,0x0000,0x0000,0x0000,0x0000,
+        0x0000,0x001b,0x00f8,0x03f8,0x0ff7,0xff91,0xff92,0xff93,0xff94,0xff95,0xff96,0x0000,0x0000,0x0000,0x0000,0x0000,
+        0x0000,0x003a,0x01f6,0xff97,0xff98,0xff99,0xff9a,0xff9b,0xff9c,0xff9d,0xff9e,0x0000,0x0000,0x0000,0x0000,0x0000,
+        0x0000,0x003b,0x03f9,0xff9f,0xffa0,0xffa1,0xffa2,0xffa3,0xffa4,0xffa5,0xffa6,0x0000,0x0000,0x0000,0x0000,0x0000,
+        0x0000,0x0079,0x07f7,0xffa7,0xffa8,0xffa9,0xffaa,0xffab,0xffac,0xffad,0xffae,0x0000,0x0000,0x0000,0x0000,0x0000,
+        0x0000,0x007a,0x07f8,0xffaf,0xffb0,0xffb1,0xffb2,0xffb3,0xffb4,0xffb5,0xffb6,0x0000,0x0000,0x0000,0x0000,0x0000,
+        0x0000,0x00f9,0xffb7,0xffb8,0xffb9,0xffba,0xffbb,0xffbc,0xffbd,0xffbe,0xffbf,0x0000,0x0000,0x0000,0x0000,0x0000,
+        0x0000,0x01f7,0xffc0,0xffc1,0xffc2,0xffc3,0xffc4,0xffc5,0xffc6,0xffc7,0xffc8,0x0000,0x0000,0x0000,0x0000,0x0000,
+        0x0000,0x01f8,0xffc9,0xffca,0xffcb,0xffcc,0xffcd,0xffce,0xffcf,0xffd0,0xffd1,0x0000,0x0000,0x0000,0x0000,0x0000,
+        0x0000,0x01f9,0xffd2,0xffd3,0xffd4,0xffd5,0xffd6,0xffd7,0xffd8,0xffd9,0xffda,0x0000,0x0000,0x0000,0x0000,0x0000,
+        0x0000,0x01fa,0xffdb,0xffdc,0xffdd,0xffde,0xffdf,0xffe0,0xffe1,0xffe2,0xffe3,0x0000,0x0000,0x0000,0x0000,0x0000,
+        0x0000,0x07f9,0xffe4,0xffe5,0xffe6,0xffe7,0xffe8,0xffe9,0xffea,0xffeb,0xffec,0x0000,0x0000,0x0000,0x0000,0x0000,
+        0x0000,0x3fe0,0xffed,0xffee,0xffef,0xfff0,0xfff1,0xfff2,0xfff3,0xfff4,0xfff5,0x0000,0x0000,0x0000,0x0000,0x0000,
+        0x03fa,0x7fc3,0xfff6,0xfff7,0xfff8,0xfff9,0xfffa,0xfffb,0xfffc,0xfffd,0xfffe,0x0000,0x0000,0x0000,0x0000,0x0000
+    };
+    static const uint8 s_ac_chroma_code_sizes[AC_CHROMA_CODES] = {
+         2, 2, 3, 4, 5, 5, 6, 7, 9,10,12, 0, 0, 0, 0, 0, 0, 4, 6, 8, 9,11,12,16,16,16,16, 0, 0, 0, 0, 0,
+         0, 5, 8,10,12,15,16,16,16,16,16, 0, 0, 0, 0, 0, 0, 5, 8,10,12,16,16,16,16,16,16, 0, 0, 0, 0, 0,
+         0, 6, 9,16,16,16,16,16,16,16,16, 0, 0, 0, 0, 0, 0, 6,10,16,16,16,16,16,16,16,16, 0, 0, 0, 0, 0,
+         0, 7,11,16,16,16,16,16,16,16,16, 0, 0, 0, 0, 0, 0, 7,11,16,16,16,16,16,16,16,16, 0, 0, 0, 0, 0,
+         0, 8,16,16,16,16,16,16,16,16,16, 0, 0, 0, 0, 0, 0, 9,16,16,16,16,16,16,16,16,16, 0, 0, 0, 0, 0,
+         0, 9,16,16,16,16,16,16,16,16,16, 0, 0, 0, 0, 0, 0, 9,16,16,16,16,16,16,16,16,16, 0, 0, 0, 0, 0,
+         0, 9,16,16,16,16,16,16,16,16,16, 0, 0, 0, 0, 0, 0,11,16,16,16,16,16,16,16,16,16, 0, 0, 0, 0, 0,
+         0,14,16,16,16,16,16,16,16,16,16, 0, 0, 0, 0, 0,10,15,16,16,16,16,16,16,16,16,16, 0, 0, 0, 0, 0
+    };
+
+    // Standard Huffman tables, indexed DC luma, DC chroma, AC luma, AC chroma.
+    static const uint8 *const s_huff_bits[4] = { s_dc_lum_bits, s_dc_chroma_bits, s_ac_lum_bits, s_ac_chroma_bits };
+    static const uint8 *const s_huff_val[4] = { s_dc_lum_val, s_dc_chroma_val, s_ac_lum_val, s_ac_chroma_val };
+    static const uint16 *const s_huff_codes[4] = { s_dc_lum_codes, s_dc_chroma_codes, s_ac_lum_codes, s_ac_chroma_codes };
+    static const uint8 *const s_huff_code_sizes[4] = { s_dc_lum_code_sizes, s_dc_chroma_code_sizes, s_ac_lum_code_sizes, s_ac_chroma_code_sizes };
+
     const int YR = 19595, YG = 38470, YB = 7471, CB_R = -11059, CB_G = -21709, CB_B = 32768, CR_R = 32768, CR_G = -27439, CR_B = -5329;
 
-    static int32 m_last_quality = 0;
-    static int32 m_quantization_tables[2][64];
+    // AAN DCT output scale factors, scalefactor[row] * scalefactor[col] * 2^14, in natural order.
+    static const int16 s_aan_scales[64] = {
+        16384, 22725, 21407, 19266, 16384, 12873,  8867,  4520,
+        22725, 31521, 29692, 26722, 22725, 17855, 12299,  6270,
+        21407, 29692, 27969, 25172, 21407, 16819, 11585,  5906,
+        19266, 26722, 25172, 22654, 19266, 15137, 10426,  5315,
+        16384, 22725, 21407, 19266, 16384, 12873,  8867,  4520,
+        12873, 17855, 16819, 15137, 12873, 10114,  6967,  3552,
+         8867, 12299, 11585, 10426,  8867,  6967,  4799,  2446,
+         4520,  6270,  5906,  5315,  4520,  3552,  2446,  1247
+    };
+
+    struct sym_freq { uint m_key, m_sym_index; };
 
-    static bool m_huff_initialized = false;
-    static uint m_huff_codes[4][256];
-    static uint8 m_huff_code_sizes[4][256];
-    static uint8 m_huff_bits[4][17];
-    static uint8 m_huff_val[4][256];
+    // Symbol statistics and optimized Huffman tables, only allocated when the standard tables are not used.
+    struct jpeg_encoder::huffman_state {
+        uint32 m_count[4][256];
+        uint16 m_codes[4][256];
+        uint8 m_code_sizes[4][256];
+        huffman_tables m_tables;
+        sym_freq m_syms[MAX_HUFF_SYMBOLS];
+    };
 
     static inline uint8 clamp(int i) {
         if (i < 0) {
@@ -88,18 +165,104 @@ namespace jpge {
         return static_cast<uint8>(i);
     }
 
+    // R and B are the byte offsets of red and blue in the source pixel, for RGB and BGR order.
+    template <int R, int B>
     static void RGB_to_YCC(uint8* pDst, const uint8 *pSrc, int num_pixels) {
         for ( ; num_pixels; pDst += 3, pSrc += 3, num_pixels--) {
-            const int r = pSrc[0], g = pSrc[1], b = pSrc[2];
+            const int r = pSrc[R], g = pSrc[1], b = pSrc[B];
             pDst[0] = static_cast<uint8>((r * YR + g * YG + b * YB + 32768) >> 16);
             pDst[1] = clamp(128 + ((r * CB_R + g * CB_G + b * CB_B + 32768) >> 16));
             pDst[2] = clamp(128 + ((r * CR_R + g * CR_G + b * CR_B + 32768) >> 16));
         }
     }
 
+    template <int R, int B>
     static void RGB_to_Y(uint8* pDst, const uint8 *pSrc, int num_pixels) {
         for ( ; num_pixels; pDst++, pSrc += 3, num_pixels--) {
-            pDst[0] = static_cast<uint8>((pSrc[0] * YR + pSrc[1] * YG + pSrc[2] * YB + 32768) >> 16);
+            pDst[0] = static_cast<uint8>((pSrc[R] * YR + pSrc[1] * YG + pSrc[B] * YB + 32768) >> 16);
+        }
+    }
+
+    // Big endian RGB565, the low bits of each component are left at zero.
+    static inline void RGB565_unpack(const uint8 *pSrc, int &r, int &g, int &b) {
+        r = pSrc[0] & 0xF8;
+        g = ((pSrc[0] & 0x07) << 5) | ((pSrc[1] & 0xE0) >> 3);
+        b = (pSrc[1] & 0x1F) << 3;
+    }
+
+    static void RGB565_to_YCC(uint8* pDst, const uint8 *pSrc, int num_pixels) {
+        int r, g, b;
+        for ( ; num_pixels; pDst += 3, pSrc += 2, num_pixels--) {
+            RGB565_unpack(pSrc, r, g, b);
+            pDst[0] = static_cast<uint8>((r * YR + g * YG + b * YB + 32768) >> 16);
+            pDst[1] = clamp(128 + ((r * CB_R + g * CB_G + b * CB_B + 32768) >> 16));
+            pDst[2] = clamp(128 + ((r * CR_R + g * CR_G + b * CR_B + 32768) >> 16));
+        }
+    }
+
+    static void RGB565_to_Y(uint8* pDst, const uint8 *pSrc, int num_pixels) {
+        int r, g, b;
+        for ( ; num_pixels; pDst++, pSrc += 2, num_pixels--) {
+            RGB565_unpack(pSrc, r, g, b);
+            pDst[0] = static_cast<uint8>((r * YR + g * YG + b * YB + 32768) >> 16);
+        }
+    }
+
+    // Limited range YUV (Y 16-235, UV 16-240) to full range, the same scaling yuv2rgb() applies:
+    // y = (Y - 16) * 255 / 219 and c = 128 + (C - 128) * 255 / 224, clamped to 0-255.
+    static const uint8 s_yuv_expand_y[256] = {
+        0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,1,2,3,5,6,7,8,9,10,12,13,14,15,16,17,
+        19,20,21,22,23,24,26,27,28,29,30,31,33,34,35,36,37,38,40,41,42,43,44,45,47,48,49,50,51,52,54,55,
+        56,57,58,59,61,62,63,64,65,66,68,69,70,71,72,73,75,76,77,78,79,80,82,83,84,85,86,87,88,90,91,92,
+        93,94,95,97,98,99,100,101,102,104,105,106,107,108,109,111,112,113,114,115,116,118,119,120,121,122,123,125,126,127,128,129,
+        130,132,133,134,135,136,137,139,140,141,142,143,144,146,147,148,149,150,151,153,154,155,156,157,158,160,161,162,163,164,165,167,
+        168,169,170,171,172,173,175,176,177,178,179,180,182,183,184,185,186,187,189,190,191,192,193,194,196,197,198,199,200,201,203,204,
+        205,206,207,208,210,211,212,213,214,215,217,218,219,220,221,222,224,225,226,227,228,229,231,232,233,234,235,236,238,239,240,241,
+        242,243,245,246,247,248,249,250,252,253,254,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255
+    };
+    static const uint8 s_yuv_expand_c[256] = {
+        0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,2,3,4,5,6,7,8,10,11,12,13,14,15,16,18,
+        19,20,21,22,23,24,26,27,28,29,30,31,32,34,35,36,37,38,39,40,41,43,44,45,46,47,48,49,51,52,53,54,
+        55,56,57,59,60,61,62,63,64,65,67,68,69,70,71,72,73,74,76,77,78,79,80,81,82,84,85,86,87,88,89,90,
+        92,93,94,95,96,97,98,100,101,102,103,104,105,106,108,109,110,111,112,113,114,115,117,118,119,120,121,122,123,125,126,127,
+        128,129,130,131,133,134,135,136,137,138,139,141,142,143,144,145,146,147,148,150,151,152,153,154,155,156,158,159,160,161,162,163,
+        164,166,167,168,169,170,171,172,174,175,176,177,178,179,180,182,183,184,185,186,187,188,189,191,192,193,194,195,196,197,199,200,
+        201,202,203,204,205,207,208,209,210,211,212,213,215,216,217,218,219,220,221,222,224,225,226,227,228,229,230,232,233,234,235,236,
+        237,238,240,241,242,243,244,245,246,248,249,250,251,252,253,254,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255
+    };
+
+    static inline uint8 YUV_expand_y(int y) { return s_yuv_expand_y[y]; }
+    static inline uint8 YUV_expand_c(int c) { return s_yuv_expand_c[c]; }
+
+    // With an odd width the last pixel only has U, it takes V from the previous pair.
+    static void YUYV_to_YCC(uint8* pDst, const uint8 *pSrc, int num_pixels) {
+        uint8 cb = 128, cr = 128;
+        for ( ; num_pixels > 1; pDst += 6, pSrc += 4, num_pixels -= 2) {
+            cb = YUV_expand_c(pSrc[1]); cr = YUV_expand_c(pSrc[3]);
+            pDst[0] = YUV_expand_y(pSrc[0]); pDst[1] = cb; pDst[2] = cr;
+            pDst[3] = YUV_expand_y(pSrc[2]); pDst[4] = cb; pDst[5] = cr;
+        }
+        if (num_pixels) {
+            pDst[0] = YUV_expand_y(pSrc[0]); pDst[1] = YUV_expand_c(pSrc[1]); pDst[2] = cr;
+        }
+    }
+
+    // Keeps the YUYV layout for the native H2V1 mode, only the range is expanded. An odd width is completed
+    // to a full pair, the same way as in YUYV_to_YCC().
+    static void YUYV_expand(uint8* pDst, const uint8 *pSrc, int num_pixels) {
+        uint8 cr = 128;
+        for ( ; num_pixels > 1; pDst += 4, pSrc += 4, num_pixels -= 2) {
+            pDst[0] = YUV_expand_y(pSrc[0]); pDst[1] = YUV_expand_c(pSrc[1]);
+            pDst[2] = YUV_expand_y(pSrc[2]); pDst[3] = cr = YUV_expand_c(pSrc[3]);
+        }
+        if (num_pixels) {
+            pDst[0] = pDst[2] = YUV_expand_y(pSrc[0]); pDst[1] = YUV_expand_c(pSrc[1]); pDst[3] = cr;
+        }
+    }
+
+    static void YUYV_to_Y(uint8* pDst, const uint8 *pSrc, int num_pixels) {
+        for ( ; num_pixels; pDst++, pSrc += 2, num_pixels--) {
+            pDst[0] = YUV_expand_y(pSrc[0]);
         }
     }
 
@@ -147,39 +310,213 @@ namespace jpge {
         }
     }
 
+    // Fast forward DCT - scaled integer DCT (Arai, Agui, Nakajima) derived from jfdctfst.
+    // The outputs are scaled up by 8 * s_aan_scales[i] / 2^14, which is folded into the quantization
+    // reciprocals. Every intermediate fits in 16 bits for 8-bit samples, the multiplies truncate.
+    enum { AAN_CONST_BITS = 8, AAN_RECIP_BITS = 20 };
+
+    // Rounding offsets of the rate control in 1/16ths of the quantizer: 8 rounds to nearest, -16 zeroes
+    // everything below 2 steps
+    enum { RATE_ROUND_NEAREST = 8, RATE_ROUND_MIN = -16 };
+#define AAN_MUL(var, c) ((static_cast<int32>(var) * (c)) >> AAN_CONST_BITS)
+#define AAN1D(s0, s1, s2, s3, s4, s5, s6, s7) \
+    int32 t0 = s0 + s7, t7 = s0 - s7, t1 = s1 + s6, t6 = s1 - s6, t2 = s2 + s5, t5 = s2 - s5, t3 = s3 + s4, t4 = s3 - s4; \
+    int32 t10 = t0 + t3, t13 = t0 - t3, t11 = t1 + t2, t12 = t1 - t2; \
+    s0 = t10 + t11; s4 = t10 - t11; \
+    int32 z1 = AAN_MUL(t12 + t13, 181); \
+    s2 = t13 + z1; s6 = t13 - z1; \
+    t10 = t4 + t5; t11 = t5 + t6; t12 = t6 + t7; \
+    int32 z5 = AAN_MUL(t10 - t12, 98); \
+    int32 z2 = AAN_MUL(t10, 139) + z5, z4 = AAN_MUL(t12, 334) + z5, z3 = AAN_MUL(t11, 181); \
+    int32 z11 = t7 + z3, z13 = t7 - z3; \
+    s5 = z13 + z2; s3 = z13 - z2; s1 = z11 + z4; s7 = z11 - z4;
+
+#if CONFIG_CAMERA_JPEG_ENCODER_DCT_SIMD
+    // Column pass on a 16-byte aligned block with the ESP32-S3 vector instructions, see jpge_fdct_esp32s3.S
+    extern "C" void jpge_fdct_aan_cols_esp32s3(int16 *p);
+#endif
+
+    static void DCT2D_AAN(const int32 *pSrc, int16 *p, bool simd) {
+        int32 c;
+        int16 *q = p;
+        for (c = 7; c >= 0; c--, pSrc += 8, q += 8) {
+            int32 s0 = pSrc[0], s1 = pSrc[1], s2 = pSrc[2], s3 = pSrc[3], s4 = pSrc[4], s5 = pSrc[5], s6 = pSrc[6], s7 = pSrc[7];
+            AAN1D(s0, s1, s2, s3, s4, s5, s6, s7);
+            q[0] = s0; q[1] = s1; q[2] = s2; q[3] = s3; q[4] = s4; q[5] = s5; q[6] = s6; q[7] = s7;
+        }
+#if CONFIG_CAMERA_JPEG_ENCODER_DCT_SIMD
+        if (simd) {
+            jpge_fdct_aan_cols_esp32s3(p);
+            return;
+        }
+#endif
+        for (q = p, c = 7; c >= 0; c--, q++) {
+            int32 s0 = q[0*8], s1 = q[1*8], s2 = q[2*8], s3 = q[3*8], s4 = q[4*8], s5 = q[5*8], s6 = q[6*8], s7 = q[7*8];
+            AAN1D(s0, s1, s2, s3, s4, s5, s6, s7);
+            q[0*8] = s0; q[1*8] = s1; q[2*8] = s2; q[3*8] = s3; q[4*8] = s4; q[5*8] = s5; q[6*8] = s6; q[7*8] = s7;
+        }
+    }
+
     // Compute the actual canonical Huffman codes/code sizes given the JPEG huff bits and val arrays.
-    static void compute_huffman_table(uint *codes, uint8 *code_sizes, uint8 *bits, uint8 *val)
+    // The codes are assigned in val order, incrementing within a code size and doubling to the next one.
+    static void compute_huffman_table(uint16 *codes, uint8 *code_sizes, const uint8 *bits, const uint8 *val)
     {
-        int i, l, last_p, si;
-        static uint8 huff_size[257];
-        static uint huff_code[257];
-        uint code;
-
+        uint code = 0;
         int p = 0;
-        for (l = 1; l <= 16; l++) {
-            for (i = 1; i <= bits[l]; i++) {
-                huff_size[p++] = (char)l;
+
+        memset(codes, 0, sizeof(codes[0])*256);
+        memset(code_sizes, 0, sizeof(code_sizes[0])*256);
+        for (int l = 1; l <= 16; l++) {
+            for (int i = 1; i <= bits[l]; i++, p++) {
+                codes[val[p]]      = static_cast<uint16>(code++);
+                code_sizes[val[p]] = static_cast<uint8>(l);
+            }
+            code <<= 1;
+        }
+    }
+
+    static int sym_freq_cmp(const void *a, const void *b)
+    {
+        uint ka = static_cast<const sym_freq *>(a)->m_key, kb = static_cast<const sym_freq *>(b)->m_key;
+        return (ka > kb) - (ka < kb);
+    }
+
+    // calculate_minimum_redundancy() originally written by: Alistair Moffat, alistair@cs.mu.oz.au, Jyrki Katajainen, jyrki@diku.dk, November 1996.
+    // Turns the frequencies of A, sorted in increasing order, into code lengths.
+    static void calculate_minimum_redundancy(sym_freq *A, int n)
+    {
+        int root, leaf, next, avbl, used, dpth;
+        if (n == 0) {
+            return;
+        } else if (n == 1) {
+            A[0].m_key = 1;
+            return;
+        }
+        A[0].m_key += A[1].m_key; root = 0; leaf = 2;
+        for (next = 1; next < n - 1; next++) {
+            if (leaf >= n || A[root].m_key < A[leaf].m_key) {
+                A[next].m_key = A[root].m_key; A[root++].m_key = next;
+            } else {
+                A[next].m_key = A[leaf++].m_key;
+            }
+            if (leaf >= n || (root < next && A[root].m_key < A[leaf].m_key)) {
+                A[next].m_key += A[root].m_key; A[root++].m_key = next;
+            } else {
+                A[next].m_key += A[leaf++].m_key;
+            }
+        }
+        A[n - 2].m_key = 0;
+        for (next = n - 3; next >= 0; next--) {
+            A[next].m_key = A[A[next].m_key].m_key + 1;
+        }
+        avbl = 1; used = dpth = 0; root = n - 2; next = n - 1;
+        while (avbl > 0) {
+            while (root >= 0 && (int)A[root].m_key == dpth) {
+                used++; root--;
+            }
+            while (avbl > used) {
+                A[next--].m_key = dpth; avbl--;
             }
+            avbl = 2 * used; dpth++; used = 0;
         }
+    }
+
+    // Limits canonical Huffman code table's max code size to max_code_size.
+    static void huffman_enforce_max_code_size(int *pNum_codes, int code_list_len, int max_code_size)
+    {
+        if (code_list_len <= 1) {
+            return;
+        }
+        for (int i = max_code_size + 1; i <= MAX_HUFF_CODESIZE; i++) {
+            pNum_codes[max_code_size] += pNum_codes[i];
+        }
+        uint32 total = 0;
+        for (int i = max_code_size; i > 0; i--) {
+            total += (((uint32)pNum_codes[i]) << (max_code_size - i));
+        }
+        while (total != (1UL << max_code_size)) {
+            pNum_codes[max_code_size]--;
+            for (int i = max_code_size - 1; i > 0; i--) {
+                if (pNum_codes[i]) {
+                    pNum_codes[i]--;
+                    pNum_codes[i + 1] += 2;
+                    break;
+                }
+            }
+            total--;
+        }
+    }
 
-        huff_size[p] = 0;
-        last_p = p; // write sentinel
+    // Generates an optimized Huffman table from the pass one statistics. When the tables are kept for
+    // later images every valid symbol gets a code, even if it did not occur in this one.
+    void jpeg_encoder::optimize_huffman_table(int table_num, int table_len)
+    {
+        huffman_tables *pTables = m_params.m_pHuff_tables ? m_params.m_pHuff_tables : &m_pHuff->m_tables;
+        sym_freq *pSyms = m_pHuff->m_syms;
+        const uint32 *pSym_count = m_pHuff->m_count[table_num];
+        const bool all_symbols = m_params.m_pHuff_tables != NULL;
+
+        pSyms[0].m_key = 1; pSyms[0].m_sym_index = 0; // dummy symbol, assures that no valid code contains all 1's
+        int num_used_syms = 1;
+        for (int i = 0; i < table_len; i++) {
+            uint32 count = pSym_count[i];
+            if (all_symbols && (table_num < 2 || i == 0 || i == 0xF0 || ((i & 15) >= 1 && (i & 15) <= 10))) {
+                count++;
+            }
+            if (count) {
+                pSyms[num_used_syms].m_key = count; pSyms[num_used_syms++].m_sym_index = i + 1;
+            }
+        }
+        qsort(pSyms, num_used_syms, sizeof(sym_freq), sym_freq_cmp);
+        calculate_minimum_redundancy(pSyms, num_used_syms);
+
+        // Count the # of symbols of each code size.
+        int num_codes[1 + MAX_HUFF_CODESIZE];
+        memset(num_codes, 0, sizeof(num_codes));
+        for (int i = 0; i < num_used_syms; i++) {
+            num_codes[pSyms[i].m_key]++;
+        }
 
-        code = 0; si = huff_size[0]; p = 0;
+        const uint JPGE_CODE_SIZE_LIMIT = 16;
+        huffman_enforce_max_code_size(num_codes, num_used_syms, JPGE_CODE_SIZE_LIMIT);
 
-        while (huff_size[p]) {
-            while (huff_size[p] == si) {
-                huff_code[p++] = code++;
+        // Compute the bits array, which contains the # of symbols per code size.
+        uint8 *bits = pTables->m_bits[table_num];
+        memset(bits, 0, 17);
+        for (int i = 1; i <= (int)JPGE_CODE_SIZE_LIMIT; i++) {
+            bits[i] = static_cast<uint8>(num_codes[i]);
+        }
+
+        // Remove the dummy symbol added above, which must be in largest bucket.
+        for (int i = JPGE_CODE_SIZE_LIMIT; i >= 1; i--) {
+            if (bits[i]) {
+                bits[i]--;
+                break;
             }
-            code <<= 1;
-            si++;
         }
 
-        memset(codes, 0, sizeof(codes[0])*256);
-        memset(code_sizes, 0, sizeof(code_sizes[0])*256);
-        for (p = 0; p < last_p; p++) {
-            codes[val[p]]      = huff_code[p];
-            code_sizes[val[p]] = huff_size[p];
+        // Compute the val array, which contains the symbol indices sorted by code size (smallest to largest).
+        for (int i = num_used_syms - 1; i >= 1; i--) {
+            pTables->m_val[table_num][num_used_syms - 1 - i] = static_cast<uint8>(pSyms[i].m_sym_index - 1);
+        }
+    }
+
+    // Points the coder at the given tables and computes their codes, NULL selects the precomputed standard ones.
+    void jpeg_encoder::use_huffman_tables(const huffman_tables *pTables)
+    {
+        for (int i = 0; i < 4; i++) {
+            if (!pTables) {
+                m_huff_bits[i] = s_huff_bits[i];
+                m_huff_val[i] = s_huff_val[i];
+                m_huff_codes[i] = s_huff_codes[i];
+                m_huff_code_sizes[i] = s_huff_code_sizes[i];
+            } else {
+                m_huff_bits[i] = pTables->m_bits[i];
+                m_huff_val[i] = pTables->m_val[i];
+                compute_huffman_table(m_pHuff->m_codes[i], m_pHuff->m_code_sizes[i], m_huff_bits[i], m_huff_val[i]);
+                m_huff_codes[i] = m_pHuff->m_codes[i];
+                m_huff_code_sizes[i] = m_pHuff->m_code_sizes[i];
+            }
         }
     }
 
@@ -200,18 +537,34 @@ namespace jpge {
         }
     }
 
-    void jpeg_encoder::put_bits(uint bits, uint len)
+    // Emits 32 entropy coded bits, stuffing a zero byte after each 0xFF.
+    void jpeg_encoder::emit_bits32(uint32 bits)
     {
-        uint8 c = 0;
-        m_bit_buffer |= ((uint32)bits << (24 - (m_bits_in += len)));
-        while (m_bits_in >= 8) {
-            c = (uint8)((m_bit_buffer >> 16) & 0xFF);
+        const uint32 inv = ~bits; // a 0xFF byte is a zero byte of inv
+        if ((((inv - 0x01010101) & ~inv & 0x80808080) == 0) && (m_out_buf_left > 4)) {
+            m_pOut_buf[0] = static_cast<uint8>(bits >> 24); m_pOut_buf[1] = static_cast<uint8>(bits >> 16);
+            m_pOut_buf[2] = static_cast<uint8>(bits >> 8); m_pOut_buf[3] = static_cast<uint8>(bits);
+            m_pOut_buf += 4;
+            m_out_buf_left -= 4;
+            return;
+        }
+        for (int shift = 24; shift >= 0; shift -= 8) {
+            uint8 c = static_cast<uint8>(bits >> shift);
             emit_byte(c);
             if (c == 0xFF) {
                 emit_byte(0);
             }
-            m_bit_buffer <<= 8;
-            m_bits_in -= 8;
+        }
+    }
+
+    // Bits are appended at the low end of the 64-bit accumulator and written out 32 at a time.
+    // len is at most 32 and bits must be zero above len.
+    void jpeg_encoder::put_bits(uint bits, uint len)
+    {
+        m_bit_buffer = (m_bit_buffer << len) | bits;
+        if ((m_bits_in += len) >= 32) {
+            m_bits_in -= 32;
+            emit_bits32(static_cast<uint32>(m_bit_buffer >> m_bits_in));
         }
     }
 
@@ -258,7 +611,7 @@ namespace jpge {
     // Emit start of frame marker
     void jpeg_encoder::emit_sof()
     {
-        emit_marker(M_SOF0);                           /* baseline */
+        emit_marker(m_params.m_progressive ? M_SOF2 : M_SOF0);  /* progressive or baseline */
         emit_word(3 * m_num_components + 2 + 5 + 1);
         emit_byte(8);                                  /* precision */
         emit_word(m_image_y);
@@ -273,7 +626,7 @@ namespace jpge {
     }
 
     // Emit Huffman table.
-    void jpeg_encoder::emit_dht(uint8 *bits, uint8 *val, int index, bool ac_flag)
+    void jpeg_encoder::emit_dht(const uint8 *bits, const uint8 *val, int index, bool ac_flag)
     {
         emit_marker(M_DHT);
 
@@ -302,25 +655,68 @@ namespace jpge {
         }
     }
 
-    // emit start of scan
-    void jpeg_encoder::emit_sos()
+    // emit start of scan, of all the components when component_num is negative
+    void jpeg_encoder::emit_sos(int component_num, int spectral_start, int spectral_end)
     {
+        const int num_components = (component_num < 0) ? m_num_components : 1;
         emit_marker(M_SOS);
-        emit_word(2 * m_num_components + 2 + 1 + 3);
-        emit_byte(m_num_components);
-        for (int i = 0; i < m_num_components; i++)
+        emit_word(2 * num_components + 2 + 1 + 3);
+        emit_byte(num_components);
+        for (int i = 0; i < num_components; i++)
         {
-            emit_byte(static_cast<uint8>(i + 1));
-            if (i == 0)
+            const int c = (component_num < 0) ? i : component_num;
+            emit_byte(static_cast<uint8>(c + 1));
+            if (c == 0)
                 emit_byte((0 << 4) + 0);
             else
                 emit_byte((1 << 4) + 1);
         }
-        emit_byte(0);     /* spectral selection */
-        emit_byte(63);
+        emit_byte(spectral_start);     /* spectral selection */
+        emit_byte(spectral_end);
         emit_byte(0);
     }
 
+    // Emit define restart interval marker
+    void jpeg_encoder::emit_dri()
+    {
+        emit_marker(M_DRI);
+        emit_word(4);
+        emit_word(m_params.m_restart_interval);
+    }
+
+    // Pads the entropy coded data to a byte with 1 bits and writes it out.
+    void jpeg_encoder::flush_bits()
+    {
+        put_bits(0x7F, 7);
+        while (m_bits_in >= 8) {
+            m_bits_in -= 8;
+            uint8 c = static_cast<uint8>(m_bit_buffer >> m_bits_in);
+            emit_byte(c);
+            if (c == 0xFF) {
+                emit_byte(0);
+            }
+        }
+        m_bits_in = 0;
+    }
+
+    // Called before the blocks of each MCU, ends the restart interval when it is full.
+    void jpeg_encoder::start_mcu()
+    {
+        if (!m_params.m_restart_interval) {
+            return;
+        }
+        if (m_restart_mcus_left == 0) {
+            if (m_pass_num == 2) {
+                flush_bits();
+                emit_marker(M_RST0 + m_restart_num);
+                m_restart_num = (m_restart_num + 1) & 7;
+            }
+            memset(m_last_dc_val, 0, 3 * sizeof(m_last_dc_val[0]));
+            m_restart_mcus_left = m_params.m_restart_interval;
+        }
+        m_restart_mcus_left--;
+    }
+
     void jpeg_encoder::load_block_8_8_grey(int x)
     {
         uint8 *pSrc;
@@ -381,6 +777,34 @@ namespace jpge {
         }
     }
 
+    // Y block x of a native YUYV MCU row.
+    void jpeg_encoder::load_block_yuyv_y(int x)
+    {
+        uint8 *pSrc;
+        sample_array_t *pDst = m_sample_array;
+        x <<= 4;
+        for (int i = 0; i < 8; i++, pDst += 8)
+        {
+            pSrc = m_mcu_lines[i] + x;
+            pDst[0] = pSrc[ 0] - 128; pDst[1] = pSrc[ 2] - 128; pDst[2] = pSrc[ 4] - 128; pDst[3] = pSrc[ 6] - 128;
+            pDst[4] = pSrc[ 8] - 128; pDst[5] = pSrc[10] - 128; pDst[6] = pSrc[12] - 128; pDst[7] = pSrc[14] - 128;
+        }
+    }
+
+    // Cb (c = 1) or Cr (c = 2) block of MCU x of a native YUYV MCU row, one sample per pixel pair.
+    void jpeg_encoder::load_block_yuyv_c(int x, int c)
+    {
+        uint8 *pSrc;
+        sample_array_t *pDst = m_sample_array;
+        x = (x << 5) + (c * 2 - 1);
+        for (int i = 0; i < 8; i++, pDst += 8)
+        {
+            pSrc = m_mcu_lines[i] + x;
+            pDst[0] = pSrc[ 0] - 128; pDst[1] = pSrc[ 4] - 128; pDst[2] = pSrc[ 8] - 128; pDst[3] = pSrc[12] - 128;
+            pDst[4] = pSrc[16] - 128; pDst[5] = pSrc[20] - 128; pDst[6] = pSrc[24] - 128; pDst[7] = pSrc[28] - 128;
+        }
+    }
+
     void jpeg_encoder::load_quantized_coefficients(int component_num)
     {
         int32 *q = m_quantization_tables[component_num > 0];
@@ -390,14 +814,14 @@ namespace jpge {
             sample_array_t j = m_sample_array[s_zag[i]];
             if (j < 0)
             {
-                if ((j = -j + (*q >> 1)) < *q)
+                if ((j = -j + ((*q * m_round) >> 4)) < *q)
                     *pDst++ = 0;
                 else
                     *pDst++ = static_cast<int16>(-(j / *q));
             }
             else
             {
-                if ((j = j + (*q >> 1)) < *q)
+                if ((j = j + ((*q * m_round) >> 4)) < *q)
                     *pDst++ = 0;
                 else
                     *pDst++ = static_cast<int16>((j / *q));
@@ -406,23 +830,95 @@ namespace jpge {
         }
     }
 
-    void jpeg_encoder::code_coefficients_pass_two(int component_num)
+    // Same rounding as load_quantized_coefficients(), dividing by the quantizer times the AAN scale factor
+    // through a reciprocal so there is no division per coefficient.
+    void jpeg_encoder::load_quantized_coefficients_aan(int component_num, const int16 *pSrc)
     {
-        int i, j, run_len, nbits, temp1, temp2;
+        uint32 *r = m_quantization_recip[component_num > 0];
+        int16 *pDst = m_coefficient_array;
+        if (m_round != RATE_ROUND_NEAREST) {
+            // rate control, the dead zone around zero is wider than with rounding to nearest
+            const int64_t round = static_cast<int64_t>(m_round) << (AAN_RECIP_BITS - 4);
+            for (int i = 0; i < 64; i++, r++)
+            {
+                int32 j = pSrc[s_zag[i]];
+                int64_t v = static_cast<int64_t>((j < 0) ? -j : j) * *r + round;
+                int16 c = (v < 0) ? 0 : static_cast<int16>(v >> AAN_RECIP_BITS);
+                *pDst++ = (j < 0) ? -c : c;
+            }
+            return;
+        }
+        for (int i = 0; i < 64; i++)
+        {
+            int32 j = pSrc[s_zag[i]];
+            if (j < 0)
+                *pDst++ = -static_cast<int16>((static_cast<uint64>(-j) * *r + (1 << (AAN_RECIP_BITS - 1))) >> AAN_RECIP_BITS);
+            else
+                *pDst++ = static_cast<int16>((static_cast<uint64>(j) * *r + (1 << (AAN_RECIP_BITS - 1))) >> AAN_RECIP_BITS);
+            r++;
+        }
+    }
+
+    void jpeg_encoder::code_coefficients_pass_one(int component_num)
+    {
+        int i, run_len, nbits, temp1;
         int16 *pSrc = m_coefficient_array;
-        uint *codes[2];
-        uint8 *code_sizes[2];
+        uint32 *dc_count = m_pHuff->m_count[0 + (component_num > 0)];
+        uint32 *ac_count = m_pHuff->m_count[2 + (component_num > 0)];
+
+        temp1 = pSrc[0] - m_last_dc_val[component_num];
+        m_last_dc_val[component_num] = pSrc[0];
+        if (temp1 < 0)
+            temp1 = -temp1;
 
-        if (component_num == 0)
+        nbits = 0;
+        while (temp1)
         {
-            codes[0] = m_huff_codes[0 + 0]; codes[1] = m_huff_codes[2 + 0];
-            code_sizes[0] = m_huff_code_sizes[0 + 0]; code_sizes[1] = m_huff_code_sizes[2 + 0];
+            nbits++; temp1 >>= 1;
         }
-        else
+        dc_count[nbits]++;
+
+        for (run_len = 0, i = 1; i < 64; i++)
         {
-            codes[0] = m_huff_codes[0 + 1]; codes[1] = m_huff_codes[2 + 1];
-            code_sizes[0] = m_huff_code_sizes[0 + 1]; code_sizes[1] = m_huff_code_sizes[2 + 1];
+            if ((temp1 = m_coefficient_array[i]) == 0)
+                run_len++;
+            else
+            {
+                while (run_len >= 16)
+                {
+                    ac_count[0xF0]++;
+                    run_len -= 16;
+                }
+                if (temp1 < 0)
+                    temp1 = -temp1;
+                nbits = 1;
+                while (temp1 >>= 1)
+                    nbits++;
+                ac_count[(run_len << 4) + nbits]++;
+                run_len = 0;
+            }
         }
+        if (run_len)
+            ac_count[0]++;
+    }
+
+    // The bit accumulator is kept in locals for the block, each code is written together with its value bits.
+#define JPGE_PUT_BITS(bits, len) do { \
+        bit_buffer = (bit_buffer << (len)) | (bits); \
+        if ((bits_in += (len)) >= 32) { \
+            bits_in -= 32; \
+            emit_bits32(static_cast<uint32>(bit_buffer >> bits_in)); \
+        } \
+    } while (0)
+
+    void jpeg_encoder::code_coefficients_pass_two(int component_num)
+    {
+        int i, j, run_len, nbits, temp1, temp2;
+        int16 *pSrc = m_coefficient_array;
+        const uint16 *dc_codes = m_huff_codes[0 + (component_num > 0)], *ac_codes = m_huff_codes[2 + (component_num > 0)];
+        const uint8 *dc_sizes = m_huff_code_sizes[0 + (component_num > 0)], *ac_sizes = m_huff_code_sizes[2 + (component_num > 0)];
+        uint64 bit_buffer = m_bit_buffer;
+        uint bits_in = m_bits_in;
 
         temp1 = temp2 = pSrc[0] - m_last_dc_val[component_num];
         m_last_dc_val[component_num] = pSrc[0];
@@ -438,8 +934,7 @@ namespace jpge {
             nbits++; temp1 >>= 1;
         }
 
-        put_bits(codes[0][nbits], code_sizes[0][nbits]);
-        if (nbits) put_bits(temp2 & ((1 << nbits) - 1), nbits);
+        JPGE_PUT_BITS((dc_codes[nbits] << nbits) | (temp2 & ((1 << nbits) - 1)), dc_sizes[nbits] + nbits);
 
         for (run_len = 0, i = 1; i < 64; i++)
         {
@@ -449,7 +944,7 @@ namespace jpge {
             {
                 while (run_len >= 16)
                 {
-                    put_bits(codes[1][0xF0], code_sizes[1][0xF0]);
+                    JPGE_PUT_BITS(ac_codes[0xF0], ac_sizes[0xF0]);
                     run_len -= 16;
                 }
                 if ((temp2 = temp1) < 0)
@@ -461,20 +956,190 @@ namespace jpge {
                 while (temp1 >>= 1)
                     nbits++;
                 j = (run_len << 4) + nbits;
-                put_bits(codes[1][j], code_sizes[1][j]);
-                put_bits(temp2 & ((1 << nbits) - 1), nbits);
+                JPGE_PUT_BITS((ac_codes[j] << nbits) | (temp2 & ((1 << nbits) - 1)), ac_sizes[j] + nbits);
                 run_len = 0;
             }
         }
         if (run_len)
-            put_bits(codes[1][0], code_sizes[1][0]);
+            JPGE_PUT_BITS(ac_codes[0], ac_sizes[0]);
+
+        m_bit_buffer = bit_buffer;
+        m_bits_in = bits_in;
     }
 
     void jpeg_encoder::code_block(int component_num)
     {
-        DCT2D(m_sample_array);
-        load_quantized_coefficients(component_num);
-        code_coefficients_pass_two(component_num);
+        if (m_params.m_dct_method == DCT_ISLOW) {
+            DCT2D(m_sample_array);
+            load_quantized_coefficients(component_num);
+        } else {
+            int16 block[64] __attribute__((aligned(16)));
+            DCT2D_AAN(m_sample_array, block, m_params.m_dct_method == DCT_AAN_SIMD);
+            load_quantized_coefficients_aan(component_num, block);
+        }
+        if (m_pCoefficients) {
+            // progressive, the blocks are kept in MCU order and coded once the image is complete
+            memcpy(m_pCoefficients + (m_blocks_stored++ << 6), m_coefficient_array, sizeof(m_coefficient_array));
+            return;
+        }
+        if (m_pass_num == 1)
+            code_coefficients_pass_one(component_num);
+        else
+            code_coefficients_pass_two(component_num);
+    }
+
+    // Counts the symbol in pass one, writes its code and the value bits in pass two.
+    void jpeg_encoder::code_symbol(int table_num, uint symbol, uint bits, uint num_bits)
+    {
+        if (m_pass_num == 1)
+            m_pHuff->m_count[table_num][symbol]++;
+        else
+            put_bits((m_huff_codes[table_num][symbol] << num_bits) | bits, m_huff_code_sizes[table_num][symbol] + num_bits);
+    }
+
+    // Codes the run of blocks whose coefficients in the scan band are all zero.
+    void jpeg_encoder::code_eob_run(int table_num)
+    {
+        if (m_eob_run) {
+            uint nbits = 0;
+            while (m_eob_run >> (nbits + 1))
+                nbits++;
+            code_symbol(table_num, nbits << 4, m_eob_run & ((1 << nbits) - 1), nbits);
+            m_eob_run = 0;
+        }
+    }
+
+    // Codes one scan from the kept coefficients. A negative component_num is the DC scan of all the
+    // components, interleaved in MCU order. Otherwise it is the AC band of one component, whose blocks are
+    // in raster order and only cover the image, not the padding of the last MCUs.
+    void jpeg_encoder::code_progressive_scan(int component_num, int spectral_start, int spectral_end)
+    {
+        int mcu_blocks = 0, component_ofs = 0;
+        for (int c = 0; c < m_num_components; c++) {
+            if (c == component_num)
+                component_ofs = mcu_blocks;
+            mcu_blocks += m_comp_h_samp[c] * m_comp_v_samp[c];
+        }
+
+        if (component_num < 0) {
+            memset(m_last_dc_val, 0, 3 * sizeof(m_last_dc_val[0]));
+            const int16 *pBlock = m_pCoefficients;
+            for (uint b = 0; b < m_blocks_stored; b += mcu_blocks) {
+                for (int c = 0; c < m_num_components; c++) {
+                    for (int n = m_comp_h_samp[c] * m_comp_v_samp[c]; n > 0; n--, pBlock += 64) {
+                        int temp1, temp2;
+                        temp1 = temp2 = pBlock[0] - m_last_dc_val[c];
+                        m_last_dc_val[c] = pBlock[0];
+                        if (temp1 < 0) {
+                            temp1 = -temp1; temp2--;
+                        }
+                        uint nbits = 0;
+                        while (temp1) {
+                            nbits++; temp1 >>= 1;
+                        }
+                        code_symbol(0 + (c > 0), nbits, temp2 & ((1 << nbits) - 1), nbits);
+                    }
+                }
+            }
+            return;
+        }
+
+        const int h = m_comp_h_samp[component_num], v = m_comp_v_samp[component_num];
+        const int blocks_x = ((m_image_x * h + m_comp_h_samp[0] - 1) / m_comp_h_samp[0] + 7) >> 3;
+        const int blocks_y = ((m_image_y * v + m_comp_v_samp[0] - 1) / m_comp_v_samp[0] + 7) >> 3;
+        const int table_num = 2 + (component_num > 0);
+        m_eob_run = 0;
+        for (int by = 0; by < blocks_y; by++) {
+            for (int bx = 0; bx < blocks_x; bx++) {
+                const int16 *pBlock = m_pCoefficients + ((((by / v) * m_mcus_per_row + bx / h) * mcu_blocks + component_ofs + (by % v) * h + bx % h) << 6);
+                int run_len = 0;
+                for (int i = spectral_start; i <= spectral_end; i++) {
+                    int temp1 = pBlock[i], temp2;
+                    if (temp1 == 0) {
+                        run_len++;
+                        continue;
+                    }
+                    code_eob_run(table_num);
+                    while (run_len >= 16) {
+                        code_symbol(table_num, 0xF0, 0, 0);
+                        run_len -= 16;
+                    }
+                    if ((temp2 = temp1) < 0) {
+                        temp1 = -temp1; temp2--;
+                    }
+                    uint nbits = 1;
+                    while (temp1 >>= 1)
+                        nbits++;
+                    code_symbol(table_num, (run_len << 4) + nbits, temp2 & ((1 << nbits) - 1), nbits);
+                    run_len = 0;
+                }
+                if (run_len && ++m_eob_run == 0x7FFF)
+                    code_eob_run(table_num);
+            }
+        }
+        code_eob_run(table_num);
+    }
+
+    // Writes the scans of a progressive JPEG, like the default script of libjpeg without successive
+    // approximation. Each scan is counted, gets its own optimized tables and is flushed to the stream
+    // once coded, so a receiver can show the image as the scans arrive.
+    void jpeg_encoder::emit_progressive_scans()
+    {
+        static const struct { int16 component_num; uint8 spectral_start, spectral_end; } s_scans[] = {
+            { -1, 0, 0 }, { 0, 1, 5 }, { 2, 1, 63 }, { 1, 1, 63 }, { 0, 6, 63 }
+        };
+        memset(&m_pHuff->m_tables, 0, sizeof(m_pHuff->m_tables));
+        for (uint i = 0; i < sizeof(s_scans) / sizeof(s_scans[0]); i++) {
+            const int c = s_scans[i].component_num, ss = s_scans[i].spectral_start, se = s_scans[i].spectral_end;
+            if (c >= m_num_components)
+                continue;
+            memset(m_pHuff->m_count, 0, sizeof(m_pHuff->m_count));
+            m_pass_num = 1;
+            code_progressive_scan(c, ss, se);
+            if (c < 0) {
+                optimize_huffman_table(0+0, DC_LUM_CODES);
+                if (m_num_components > 1)
+                    optimize_huffman_table(0+1, DC_CHROMA_CODES);
+            } else {
+                optimize_huffman_table(2 + (c > 0), AC_LUM_CODES);
+            }
+            use_huffman_tables(&m_pHuff->m_tables);
+
+            m_pass_num = 2;
+            if (c < 0) {
+                emit_dht(m_huff_bits[0+0], m_huff_val[0+0], 0, false);
+                if (m_num_components > 1)
+                    emit_dht(m_huff_bits[0+1], m_huff_val[0+1], 1, false);
+            } else {
+                emit_dht(m_huff_bits[2 + (c > 0)], m_huff_val[2 + (c > 0)], c > 0, true);
+            }
+            emit_sos(c, ss, se);
+            code_progressive_scan(c, ss, se);
+            flush_bits();
+            flush_output_buffer();
+        }
+    }
+
+    // Compares the last row of MCUs with the bytes left for each of the rows still to code, and moves the
+    // rounding of the next row by one step for each 1/8 it was over or under, at most 4 steps. Within 1/16
+    // it stays.
+    void jpeg_encoder::update_rate_control()
+    {
+        const uint size = get_output_size();
+        const int row_size = size - m_rows_start_size;
+        const uint rows_left = m_image_y_mcu / m_mcu_y - ++m_mcu_rows_coded;
+        m_rows_start_size = size;
+        if (!rows_left) {
+            return;
+        }
+        // 1/32 of the target is kept as a margin for the last rows
+        const uint target = m_params.m_target_size - m_params.m_target_size / 32;
+        const int row_budget = (target > size) ? (target - size) / rows_left : 0;
+        int error = row_budget ? (row_size - row_budget) * 16 / row_budget : 16;
+        if (error > 1 || error < -1) {
+            int steps = JPGE_MIN(JPGE_MAX((error + ((error > 0) ? 1 : -1)) / 2, -4), 4);
+            m_round = JPGE_MIN(JPGE_MAX(m_round - steps, (int)RATE_ROUND_MIN), (int)RATE_ROUND_NEAREST);
+        }
     }
 
     void jpeg_encoder::process_mcu_row()
@@ -483,13 +1148,23 @@ namespace jpge {
         {
             for (int i = 0; i < m_mcus_per_row; i++)
             {
-                load_block_8_8_grey(i); code_block(0);
+                start_mcu(); load_block_8_8_grey(i); code_block(0);
+            }
+        }
+        else if (m_yuyv_native)
+        {
+            for (int i = 0; i < m_mcus_per_row; i++)
+            {
+                start_mcu();
+                load_block_yuyv_y(i * 2 + 0); code_block(0); load_block_yuyv_y(i * 2 + 1); code_block(0);
+                load_block_yuyv_c(i, 1); code_block(1); load_block_yuyv_c(i, 2); code_block(2);
             }
         }
         else if ((m_comp_h_samp[0] == 1) && (m_comp_v_samp[0] == 1))
         {
             for (int i = 0; i < m_mcus_per_row; i++)
             {
+                start_mcu();
                 load_block_8_8(i, 0, 0); code_block(0); load_block_8_8(i, 0, 1); code_block(1); load_block_8_8(i, 0, 2); code_block(2);
             }
         }
@@ -497,6 +1172,7 @@ namespace jpge {
         {
             for (int i = 0; i < m_mcus_per_row; i++)
             {
+                start_mcu();
                 load_block_8_8(i * 2 + 0, 0, 0); code_block(0); load_block_8_8(i * 2 + 1, 0, 0); code_block(0);
                 load_block_16_8_8(i, 1); code_block(1); load_block_16_8_8(i, 2); code_block(2);
             }
@@ -505,11 +1181,15 @@ namespace jpge {
         {
             for (int i = 0; i < m_mcus_per_row; i++)
             {
+                start_mcu();
                 load_block_8_8(i * 2 + 0, 0, 0); code_block(0); load_block_8_8(i * 2 + 1, 0, 0); code_block(0);
                 load_block_8_8(i * 2 + 0, 1, 0); code_block(0); load_block_8_8(i * 2 + 1, 1, 0); code_block(0);
                 load_block_16_8(i, 1); code_block(1); load_block_16_8(i, 2); code_block(2);
             }
         }
+        if (m_params.m_target_size && m_pass_num == 2) {
+            update_rate_control();
+        }
     }
 
     void jpeg_encoder::load_mcu(const void *pSrc)
@@ -518,20 +1198,39 @@ namespace jpge {
 
         uint8* pDst = m_mcu_lines[m_mcu_y_ofs]; // OK to write up to m_image_bpl_xlt bytes to pDst
 
-        if (m_num_components == 1) {
-            if (m_image_bpp == 3)
-                RGB_to_Y(pDst, Psrc, m_image_x);
-            else
-                memcpy(pDst, Psrc, m_image_x);
+        if (m_yuyv_native) {
+            YUYV_expand(pDst, Psrc, m_image_x);
+        } else if (m_num_components == 1) {
+            switch (m_src_format) {
+                case SRC_RGB888: RGB_to_Y<0, 2>(pDst, Psrc, m_image_x); break;
+                case SRC_BGR888: RGB_to_Y<2, 0>(pDst, Psrc, m_image_x); break;
+                case SRC_RGB565: RGB565_to_Y(pDst, Psrc, m_image_x); break;
+                case SRC_YUYV: YUYV_to_Y(pDst, Psrc, m_image_x); break;
+                default: memcpy(pDst, Psrc, m_image_x); break;
+            }
         } else {
-            if (m_image_bpp == 3)
-                RGB_to_YCC(pDst, Psrc, m_image_x);
-            else
-                Y_to_YCC(pDst, Psrc, m_image_x);
+            switch (m_src_format) {
+                case SRC_RGB888: RGB_to_YCC<0, 2>(pDst, Psrc, m_image_x); break;
+                case SRC_BGR888: RGB_to_YCC<2, 0>(pDst, Psrc, m_image_x); break;
+                case SRC_RGB565: RGB565_to_YCC(pDst, Psrc, m_image_x); break;
+                case SRC_YUYV: YUYV_to_YCC(pDst, Psrc, m_image_x); break;
+                default: Y_to_YCC(pDst, Psrc, m_image_x); break;
+            }
         }
 
         // Possibly duplicate pixels at end of scanline if not a multiple of 8 or 16
-        if (m_num_components == 1)
+        if (m_yuyv_native)
+        {
+            // The line was completed to a full pair, repeat its last Y with its chroma
+            const int x = (m_image_x + 1) & ~1;
+            const uint8 y = pDst[x * 2 - 2], cb = pDst[x * 2 - 3], cr = pDst[x * 2 - 1];
+            uint8 *q = m_mcu_lines[m_mcu_y_ofs] + x * 2;
+            for (int i = x; i < m_image_x_mcu; i += 2)
+            {
+                *q++ = y; *q++ = cb; *q++ = y; *q++ = cr;
+            }
+        }
+        else if (m_num_components == 1)
             memset(m_mcu_lines[m_mcu_y_ofs] + m_image_bpl_xlt, pDst[m_image_bpl_xlt - 1], m_image_x_mcu - m_image_x);
         else
         {
@@ -551,7 +1250,8 @@ namespace jpge {
     }
 
     // Quantization table generation.
-    void jpeg_encoder::compute_quant_table(int32 *pDst, const int16 *pSrc)
+    // pRecip gets 2^AAN_RECIP_BITS / (quantizer * 8 * AAN scale factor) for the AAN DCT, in the same zigzag order.
+    void jpeg_encoder::compute_quant_table(int32 *pDst, uint32 *pRecip, const int16 *pSrc)
     {
         int32 q;
         if (m_params.m_quality < 50)
@@ -561,13 +1261,27 @@ namespace jpge {
         for (int i = 0; i < 64; i++)
         {
             int32 j = *pSrc++; j = (j * q + 50L) / 100L;
-            *pDst++ = JPGE_MIN(JPGE_MAX(j, 1), 255);
+            *pDst++ = j = JPGE_MIN(JPGE_MAX(j, 1), 255);
+            uint32 d = j * s_aan_scales[s_zag[i]];
+            *pRecip++ = static_cast<uint32>(((static_cast<uint64>(1) << (AAN_RECIP_BITS + 11)) + d / 2) / d);
         }
     }
 
     // Higher-level methods.
-    bool jpeg_encoder::jpg_open(int p_x_res, int p_y_res, int src_channels)
+    bool jpeg_encoder::jpg_open(int p_x_res, int p_y_res, source_format_t src_format)
     {
+        if (m_params.m_progressive) {
+            // the scans are coded from the kept coefficients, each with its own tables
+            m_params.m_two_pass_flag = false;
+            m_params.m_pHuff_tables = NULL;
+            m_params.m_restart_interval = 0;
+        }
+        if (m_params.m_target_size) {
+            // the rounding changes from row to row, so it is coded as it goes with the standard tables
+            m_params.m_two_pass_flag = false;
+            m_params.m_pHuff_tables = NULL;
+            m_params.m_progressive = false;
+        }
         m_num_components = 3;
         switch (m_params.m_subsampling)
         {
@@ -604,40 +1318,67 @@ namespace jpge {
         }
 
         m_image_x        = p_x_res; m_image_y = p_y_res;
-        m_image_bpp      = src_channels;
-        m_image_bpl      = m_image_x * src_channels;
+        m_src_format     = src_format;
         m_image_x_mcu    = (m_image_x + m_mcu_x - 1) & (~(m_mcu_x - 1));
         m_image_y_mcu    = (m_image_y + m_mcu_y - 1) & (~(m_mcu_y - 1));
-        m_image_bpl_xlt  = m_image_x * m_num_components;
-        m_image_bpl_mcu  = m_image_x_mcu * m_num_components;
+        // YUYV is kept as is for H2V1, the chroma is already subsampled horizontally
+        m_yuyv_native    = (m_src_format == SRC_YUYV) && (m_params.m_subsampling == H2V1);
+        const int mcu_bpp = m_yuyv_native ? 2 : m_num_components;
+        m_image_bpl_xlt  = m_image_x * mcu_bpp;
+        m_image_bpl_mcu  = m_image_x_mcu * mcu_bpp;
         m_mcus_per_row   = m_image_x_mcu / m_mcu_x;
 
-        if ((m_mcu_lines[0] = static_cast<uint8*>(jpge_malloc(m_image_bpl_mcu * m_mcu_y))) == NULL) {
+        if ((m_mcu_lines[0] = static_cast<uint8*>(img_ws_malloc(m_params.m_pWorkspace, m_image_bpl_mcu * m_mcu_y))) == NULL) {
             return false;
         }
         for (int i = 1; i < m_mcu_y; i++)
             m_mcu_lines[i] = m_mcu_lines[i-1] + m_image_bpl_mcu;
 
-        if(m_last_quality != m_params.m_quality){
-            m_last_quality = m_params.m_quality;
-            compute_quant_table(m_quantization_tables[0], s_std_lum_quant);
-            compute_quant_table(m_quantization_tables[1], s_std_croma_quant);
+        if (m_params.m_progressive) {
+            int mcu_blocks = 0;
+            for (int c = 0; c < m_num_components; c++)
+                mcu_blocks += m_comp_h_samp[c] * m_comp_v_samp[c];
+            size_t size = (size_t)m_mcus_per_row * (m_image_y_mcu / m_mcu_y) * mcu_blocks * 64 * sizeof(int16);
+            if ((m_pCoefficients = static_cast<int16*>(img_ws_malloc(m_params.m_pWorkspace, size))) == NULL) {
+                return false;
+            }
+            m_blocks_stored = 0;
         }
 
-        if(!m_huff_initialized){
-            m_huff_initialized = true;
-
-            memcpy(m_huff_bits[0+0], s_dc_lum_bits, 17);    memcpy(m_huff_val[0+0], s_dc_lum_val, DC_LUM_CODES);
-            memcpy(m_huff_bits[2+0], s_ac_lum_bits, 17);    memcpy(m_huff_val[2+0], s_ac_lum_val, AC_LUM_CODES);
-            memcpy(m_huff_bits[0+1], s_dc_chroma_bits, 17); memcpy(m_huff_val[0+1], s_dc_chroma_val, DC_CHROMA_CODES);
-            memcpy(m_huff_bits[2+1], s_ac_chroma_bits, 17); memcpy(m_huff_val[2+1], s_ac_chroma_val, AC_CHROMA_CODES);
+        compute_quant_table(m_quantization_tables[0], m_quantization_recip[0], s_std_lum_quant);
+        compute_quant_table(m_quantization_tables[1], m_quantization_recip[1], s_std_croma_quant);
+        return start_passes();
+    }
 
-            compute_huffman_table(&m_huff_codes[0+0][0], &m_huff_code_sizes[0+0][0], m_huff_bits[0+0], m_huff_val[0+0]);
-            compute_huffman_table(&m_huff_codes[2+0][0], &m_huff_code_sizes[2+0][0], m_huff_bits[2+0], m_huff_val[2+0]);
-            compute_huffman_table(&m_huff_codes[0+1][0], &m_huff_code_sizes[0+1][0], m_huff_bits[0+1], m_huff_val[0+1]);
-            compute_huffman_table(&m_huff_codes[2+1][0], &m_huff_code_sizes[2+1][0], m_huff_bits[2+1], m_huff_val[2+1]);
+    // Sets up the Huffman tables and starts the first pass.
+    bool jpeg_encoder::start_passes()
+    {
+        if (m_params.m_two_pass_flag || m_params.m_pHuff_tables || m_params.m_progressive) {
+            if ((m_pHuff = static_cast<huffman_state*>(img_ws_malloc(m_params.m_pWorkspace, sizeof(huffman_state)))) == NULL) {
+                return false;
+            }
         }
+        if (m_params.m_two_pass_flag) {
+            return first_pass_init();
+        }
+        use_huffman_tables(m_params.m_pHuff_tables);
+        return second_pass_init();
+    }
 
+    bool jpeg_encoder::first_pass_init()
+    {
+        memset(m_pHuff->m_count, 0, sizeof(m_pHuff->m_count));
+        m_mcu_y_ofs = 0;
+        m_pass_num = 1;
+        memset(m_last_dc_val, 0, 3 * sizeof(m_last_dc_val[0]));
+        m_restart_mcus_left = m_params.m_restart_interval;
+        m_restart_num = 0;
+        m_round = RATE_ROUND_NEAREST;
+        return true;
+    }
+
+    bool jpeg_encoder::second_pass_init()
+    {
         m_out_buf_left = JPGE_OUT_BUF_SIZE;
         m_pOut_buf = m_out_buf;
         m_bit_buffer = 0;
@@ -645,14 +1386,26 @@ namespace jpge {
         m_mcu_y_ofs = 0;
         m_pass_num = 2;
         memset(m_last_dc_val, 0, 3 * sizeof(m_last_dc_val[0]));
+        m_restart_mcus_left = m_params.m_restart_interval;
+        m_restart_num = 0;
+        m_round = RATE_ROUND_NEAREST;
+        m_mcu_rows_coded = 0;
 
         // Emit all markers at beginning of image file.
         emit_marker(M_SOI);
         emit_jfif_app0();
         emit_dqt();
         emit_sof();
+        if (m_params.m_progressive) {
+            // each scan comes with its tables once the image is complete
+            return m_all_stream_writes_succeeded;
+        }
         emit_dhts();
-        emit_sos();
+        if (m_params.m_restart_interval) {
+            emit_dri();
+        }
+        emit_sos(-1, 0, 63);
+        m_rows_start_size = get_output_size();
 
         return m_all_stream_writes_succeeded;
     }
@@ -668,7 +1421,21 @@ namespace jpge {
             process_mcu_row();
         }
 
-        put_bits(0x7F, 7);
+        if (m_pCoefficients) {
+            emit_progressive_scans();
+        } else if (m_pass_num == 1) {
+            optimize_huffman_table(0+0, DC_LUM_CODES);
+            optimize_huffman_table(2+0, AC_LUM_CODES);
+            if (m_num_components > 1 || m_params.m_pHuff_tables) {
+                optimize_huffman_table(0+1, DC_CHROMA_CODES);
+                optimize_huffman_table(2+1, AC_CHROMA_CODES);
+            }
+            use_huffman_tables(m_params.m_pHuff_tables ? m_params.m_pHuff_tables : &m_pHuff->m_tables);
+            return second_pass_init();
+        }
+
+        // Pad the last byte with 1 bits
+        flush_bits();
         emit_marker(M_EOI);
         flush_output_buffer();
         m_all_stream_writes_succeeded = m_all_stream_writes_succeeded && m_pStream->put_buf(NULL, 0);
@@ -679,7 +1446,10 @@ namespace jpge {
     void jpeg_encoder::clear()
     {
         m_mcu_lines[0] = NULL;
+        m_pHuff = NULL;
+        m_pCoefficients = NULL;
         m_pass_num = 0;
+        m_coefficient_input = false;
         m_all_stream_writes_succeeded = true;
     }
 
@@ -699,18 +1469,73 @@ namespace jpge {
         if (((!pStream) || (width < 1) || (height < 1)) || ((src_channels != 1) && (src_channels != 3) && (src_channels != 4)) || (!comp_params.check())) return false;
         m_pStream = pStream;
         m_params = comp_params;
-        return jpg_open(width, height, src_channels);
+        return jpg_open(width, height, (src_channels == 3) ? SRC_RGB888 : SRC_Y8);
+    }
+
+    bool jpeg_encoder::init(output_stream *pStream, int width, int height, source_format_t src_format, const params &comp_params)
+    {
+        deinit();
+        if (((!pStream) || (width < 1) || (height < 1)) || ((uint)src_format > (uint)SRC_YUYV) || (!comp_params.check())) return false;
+        m_pStream = pStream;
+        m_params = comp_params;
+        return jpg_open(width, height, src_format);
+    }
+
+    bool jpeg_encoder::init(output_stream *pStream, int width, int height, const coefficient_frame &frame, const params &comp_params)
+    {
+        deinit();
+        if ((!pStream) || (width < 1) || (height < 1) || ((frame.m_num_components != 1) && (frame.m_num_components != 3)) || (!comp_params.check()) || comp_params.m_progressive || comp_params.m_target_size) return false;
+        for (int i = 0; i < frame.m_num_components; i++) {
+            if ((frame.m_h_samp[i] < 1) || (frame.m_h_samp[i] > 2) || (frame.m_v_samp[i] < 1) || (frame.m_v_samp[i] > 2)) return false;
+            m_comp_h_samp[i] = frame.m_h_samp[i];
+            m_comp_v_samp[i] = frame.m_v_samp[i];
+        }
+        for (int i = 0; i < 64; i++) {
+            m_quantization_tables[0][i] = frame.m_quant_tables[0][i];
+            m_quantization_tables[1][i] = frame.m_quant_tables[1][i];
+        }
+        m_pStream = pStream;
+        m_params = comp_params;
+        m_num_components = frame.m_num_components;
+        m_image_x = width; m_image_y = height;
+        m_coefficient_input = true;
+        return start_passes();
     }
 
     void jpeg_encoder::deinit()
     {
-        jpge_free(m_mcu_lines[0]);
+        img_ws_free(m_params.m_pWorkspace, m_mcu_lines[0]);
+        img_ws_free(m_params.m_pWorkspace, m_pHuff);
+        img_ws_free(m_params.m_pWorkspace, m_pCoefficients);
         clear();
     }
 
+    uint jpeg_encoder::get_alloc_size(int width, int height, source_format_t src_format, const params &comp_params)
+    {
+        // the buffers of jpg_open() and start_passes()
+        const int mcu_x = (comp_params.m_subsampling >= H2V1) ? 16 : 8;
+        const int mcu_y = (comp_params.m_subsampling == H2V2) ? 16 : 8;
+        const int blocks = (comp_params.m_subsampling == Y_ONLY) ? 1 : (comp_params.m_subsampling == H1V1) ? 3 : (comp_params.m_subsampling == H2V1) ? 4 : 6;
+        const int mcu_bpp = ((src_format == SRC_YUYV) && (comp_params.m_subsampling == H2V1)) ? 2 : (comp_params.m_subsampling == Y_ONLY) ? 1 : 3;
+        const int mcus_x = (width + mcu_x - 1) / mcu_x, mcus_y = (height + mcu_y - 1) / mcu_y;
+        uint size = img_workspace_block_size(mcus_x * mcu_x * mcu_bpp * mcu_y);
+        if (comp_params.m_progressive) {
+            size += img_workspace_block_size((size_t)mcus_x * mcus_y * blocks * 64 * sizeof(int16));
+            size += img_workspace_block_size(sizeof(huffman_state));
+        } else if (!comp_params.m_target_size && (comp_params.m_two_pass_flag || comp_params.m_pHuff_tables)) {
+            size += img_workspace_block_size(sizeof(huffman_state));
+        }
+        return size;
+    }
+
+    uint jpeg_encoder::get_alloc_size(const params &comp_params)
+    {
+        return (comp_params.m_two_pass_flag || comp_params.m_pHuff_tables) ? img_workspace_block_size(sizeof(huffman_state)) : 0;
+    }
+
     bool jpeg_encoder::process_scanline(const void* pScanline)
     {
-        if ((m_pass_num < 1) || (m_pass_num > 2)) {
+        if ((m_pass_num < 1) || (m_pass_num > 2) || m_coefficient_input) {
             return false;
         }
         if (m_all_stream_writes_succeeded) {
@@ -725,4 +1550,30 @@ namespace jpge {
         return m_all_stream_writes_succeeded;
     }
 
+    bool jpeg_encoder::process_mcu_coefficients(const int16 *pBlocks)
+    {
+        if ((m_pass_num < 1) || (m_pass_num > 2) || !m_coefficient_input) {
+            return false;
+        }
+        if (m_all_stream_writes_succeeded) {
+            if (!pBlocks) {
+                if (!process_end_of_image()) {
+                    return false;
+                }
+            } else {
+                start_mcu();
+                for (int c = 0; c < m_num_components; c++) {
+                    for (int n = m_comp_h_samp[c] * m_comp_v_samp[c]; n > 0; n--, pBlocks += 64) {
+                        memcpy(m_coefficient_array, pBlocks, sizeof(m_coefficient_array));
+                        if (m_pass_num == 1)
+                            code_coefficients_pass_one(c);
+                        else
+                            code_coefficients_pass_two(c);
+                    }
+                }
+            }
+        }
+        return m_all_stream_writes_succeeded;
+    }
+
 } // namespace jpge
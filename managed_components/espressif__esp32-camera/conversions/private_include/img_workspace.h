@@ -0,0 +1,49 @@
+// Copyright 2015-2016 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef _CONVERSIONS_IMG_WORKSPACE_H_
+#define _CONVERSIONS_IMG_WORKSPACE_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdbool.h>
+#include "img_converters.h"
+
+// Bytes a buffer of size bytes takes in a workspace, with its header and alignment
+size_t img_workspace_block_size(size_t size);
+
+// Takes a buffer from the workspace, NULL if ws is NULL or it does not fit (the caller then uses the heap)
+void *img_workspace_alloc(img_workspace_t *ws, size_t size);
+
+// Gives a buffer back, false if it was not taken from ws (the caller then frees it to the heap).
+// The space is reused once every buffer taken after it is given back too.
+bool img_workspace_free(img_workspace_t *ws, void *p);
+
+// Takes a buffer from the workspace, from the heap without one or when it is full
+void *img_ws_malloc(img_workspace_t *ws, size_t size);
+
+// Gives a buffer from img_ws_malloc() back to the workspace or the heap it came from
+void img_ws_free(img_workspace_t *ws, void *p);
+
+// Workspace sizes of the conversions outside to_jpg.cpp, for img_workspace_size()
+size_t jpg2bmp_workspace_size(uint16_t width);
+size_t jpg_transform_workspace_size(uint16_t width, uint16_t height);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _CONVERSIONS_IMG_WORKSPACE_H_ */
@@ -4,6 +4,11 @@
 #ifndef JPEG_ENCODER_H
 #define JPEG_ENCODER_H
 
+#include <stddef.h>
+#include "sdkconfig.h"
+
+struct img_workspace;
+
 namespace jpge
 {
     typedef unsigned char  uint8;
@@ -11,14 +16,41 @@ namespace jpge
     typedef signed int     int32;
     typedef unsigned short uint16;
     typedef unsigned int   uint32;
+    typedef unsigned long long uint64;
     typedef unsigned int   uint;
 
     // JPEG chroma subsampling factors. Y_ONLY (grayscale images) and H2V2 (color images) are the most common.
     enum subsampling_t { Y_ONLY = 0, H1V1 = 1, H2V1 = 2, H2V2 = 3 };
 
+    // Scanline pixel formats. SRC_RGB565 is big endian, as sent by the camera. SRC_YUYV is Y0 U Y1 V with
+    // limited range samples, which are expanded to full range YCbCr without going through RGB. With H2V1
+    // subsampling SRC_YUYV is encoded natively: the lines are kept as YUYV and the blocks are read from them,
+    // with no colour conversion or chroma averaging.
+    enum source_format_t { SRC_Y8 = 0, SRC_RGB888 = 1, SRC_BGR888 = 2, SRC_RGB565 = 3, SRC_YUYV = 4 };
+
+    // Forward DCT implementations. DCT_ISLOW is the accurate jfdctint-derived DCT. DCT_AAN is the scaled
+    // integer DCT from jfdctfst, with the scaling folded into the quantization step. DCT_AAN_SIMD runs the
+    // column pass of DCT_AAN with the ESP32-S3 vector instructions, and falls back to DCT_AAN when not built in.
+    enum dct_method_t { DCT_ISLOW = 0, DCT_AAN = 1, DCT_AAN_SIMD = 2 };
+
+#if CONFIG_CAMERA_JPEG_ENCODER_DCT_AAN && CONFIG_CAMERA_JPEG_ENCODER_DCT_SIMD
+#define JPGE_DEFAULT_DCT DCT_AAN_SIMD
+#elif CONFIG_CAMERA_JPEG_ENCODER_DCT_AAN
+#define JPGE_DEFAULT_DCT DCT_AAN
+#else
+#define JPGE_DEFAULT_DCT DCT_ISLOW
+#endif
+
+    // Huffman tables in DHT marker form, indexed DC luma, DC chroma, AC luma, AC chroma.
+    // m_bits[i][1..16] is the number of codes of each length, m_val[i] the symbols in code order.
+    struct huffman_tables {
+            uint8 m_bits[4][17];
+            uint8 m_val[4][256];
+    };
+
     // JPEG compression parameters structure.
     struct params {
-            inline params() : m_quality(85), m_subsampling(H2V2) { }
+            inline params() : m_quality(85), m_subsampling(H2V2), m_dct_method(JPGE_DEFAULT_DCT), m_two_pass_flag(false), m_pHuff_tables(NULL), m_restart_interval(0), m_progressive(false), m_target_size(0), m_pWorkspace(NULL) { }
 
             inline bool check() const {
                 if ((m_quality < 1) || (m_quality > 100)) {
@@ -27,6 +59,9 @@ namespace jpge
                 if ((uint)m_subsampling > (uint)H2V2) {
                     return false;
                 }
+                if ((uint)m_dct_method > (uint)DCT_AAN_SIMD) {
+                    return false;
+                }
                 return true;
             }
 
@@ -39,8 +74,48 @@ namespace jpge
             // 2 = H2V1 subsampling (YCbCr 2x1x1, 4 blocks per MCU)
             // 3 = H2V2 subsampling (YCbCr 4x1x1, 6 blocks per MCU-- very common)
             subsampling_t m_subsampling;
+
+            // Forward DCT implementation, defaults to the one selected in menuconfig.
+            dct_method_t m_dct_method;
+
+            // Disables the standard Huffman tables and uses optimized ones instead: the scanlines are fed
+            // twice (see get_total_passes()), the first pass only gathers the symbol statistics.
+            bool m_two_pass_flag;
+
+            // Optional, Huffman tables carried between images. With m_two_pass_flag the optimized tables are
+            // stored here, with a code for every valid symbol so they can encode any later image. Without it
+            // these tables are used instead of the standard ones.
+            huffman_tables *m_pHuff_tables;
+
+            // Number of MCUs between restart markers, 0 for none. The DC predictions start over after each
+            // marker, so a decoder can resynchronize at the next one after an error or start decoding there.
+            uint16 m_restart_interval;
+
+            // Writes a progressive JPEG: the DC of all the components first, then the AC coefficients in bands
+            // of frequencies, each scan with Huffman tables optimized for it. The quantized coefficients of the
+            // whole image are kept until the end, 128 bytes per block. m_two_pass_flag, m_pHuff_tables and
+            // m_restart_interval are not used, and neither is coefficient input.
+            bool m_progressive;
+
+            // Output size in bytes to aim for, 0 for none. After each row of MCUs the size so far is projected
+            // over the image, and while it is over the target the next rows round more coefficients toward zero,
+            // back to the nearest value once it is under. m_quality still sets the quantization tables and
+            // should be chosen for about this size. m_two_pass_flag, m_pHuff_tables and m_progressive are not used.
+            uint32 m_target_size;
+
+            // Optional, scratch memory the MCU rows, Huffman statistics and kept coefficients are taken from
+            // instead of the heap. See get_alloc_size() for how much is taken.
+            struct img_workspace *m_pWorkspace;
     };
     
+    // Frame layout for coefficient input, as read from the SOF and DQT markers of a baseline JPEG.
+    // Component 0 uses quantization table 0, the chroma components table 1.
+    struct coefficient_frame {
+            uint8 m_num_components;         // 1 or 3
+            uint8 m_h_samp[3], m_v_samp[3]; // sampling factors, 1 or 2
+            uint8 m_quant_tables[2][64];    // quantizers in zigzag order
+    };
+
     // Output stream abstract class - used by the jpeg_encoder class to write to the output stream.
     // put_buf() is generally called with len==JPGE_OUT_BUF_SIZE bytes, but for headers it'll be called with smaller amounts.
     class output_stream {
@@ -51,6 +126,8 @@ namespace jpge
     };
     
     // Lower level jpeg_encoder class - useful if more control is needed than the above helper functions.
+    // All the encoder state lives in the instance and the shared tables are const, so separate instances
+    // can encode concurrently from different tasks.
     class jpeg_encoder {
         public:
             jpeg_encoder();
@@ -64,15 +141,42 @@ namespace jpge
             // Returns false on out of memory or if a stream write fails.
             bool init(output_stream *pStream, int width, int height, int src_channels, const params &comp_params = params());
 
+            // Same as above with the scanline pixel format, the source pixels are converted to YCbCr as they are
+            // loaded into the MCU rows.
+            bool init(output_stream *pStream, int width, int height, source_format_t src_format, const params &comp_params = params());
+
+            // Initializes the compressor for already quantized DCT coefficients, which are only entropy coded.
+            // Used to transcode a JPEG without decoding its pixels. m_quality, m_subsampling and m_dct_method of
+            // comp_params are not used.
+            bool init(output_stream *pStream, int width, int height, const coefficient_frame &frame, const params &comp_params = params());
+
             // Call this method with each source scanline.
-            // width * src_channels bytes per scanline is expected (RGB or Y format).
+            // width * bytes per pixel of the source format per scanline is expected (width * src_channels, RGB or Y format).
             // You must call with NULL after all scanlines are processed to finish compression.
             // Returns false on out of memory or if a stream write fails.
             bool process_scanline(const void* pScanline);
 
+            // With coefficient input, call this method with each MCU in scan order: the blocks of each component,
+            // left to right and top to bottom within the MCU, 64 coefficients each in zigzag order.
+            // You must call with NULL after all MCUs are processed to finish compression.
+            bool process_mcu_coefficients(const int16 *pBlocks);
+
+            // Number of times the scanlines (or MCUs) must be fed, 2 with m_two_pass_flag, otherwise 1.
+            // Each pass ends with a NULL scanline.
+            inline uint get_total_passes() const { return (m_params.m_two_pass_flag && !m_params.m_progressive) ? 2 : 1; }
+
+            // Bytes of JPEG output so far, including the ones not passed to the stream yet.
+            inline uint get_output_size() const { return m_pStream->get_size() + (JPGE_OUT_BUF_SIZE - m_out_buf_left); }
+
             // Deinitializes the compressor, freeing any allocated memory. May be called at any time.
             void deinit();
 
+            // Bytes init() takes from m_pWorkspace with these settings, headers of the workspace buffers included.
+            static uint get_alloc_size(int width, int height, source_format_t src_format, const params &comp_params);
+
+            // Same for coefficient input.
+            static uint get_alloc_size(const params &comp_params);
+
         private:
             jpeg_encoder(const jpeg_encoder &);
             jpeg_encoder &operator =(const jpeg_encoder &);
@@ -80,11 +184,16 @@ namespace jpge
             typedef int32 sample_array_t;
             enum { JPGE_OUT_BUF_SIZE = 512 };
 
+            struct huffman_state;
+
             output_stream *m_pStream;
             params m_params;
             uint8 m_num_components;
             uint8 m_comp_h_samp[3], m_comp_v_samp[3];
-            int m_image_x, m_image_y, m_image_bpp, m_image_bpl;
+            source_format_t m_src_format;
+            bool m_yuyv_native;
+            bool m_coefficient_input;
+            int m_image_x, m_image_y;
             int m_image_x_mcu, m_image_y_mcu;
             int m_image_bpl_xlt, m_image_bpl_mcu;
             int m_mcus_per_row;
@@ -95,18 +204,35 @@ namespace jpge
             int16 m_coefficient_array[64];
 
             int m_last_dc_val[3];
+            uint m_restart_mcus_left;
+            uint8 m_restart_num;
+            int16 *m_pCoefficients;
+            uint m_blocks_stored;
+            uint m_eob_run;
+            int m_round;                // quantizer rounding offset in 1/16ths, 8 rounds to nearest
+            uint m_mcu_rows_coded;
+            uint m_rows_start_size;     // output size before the last row of MCUs
             uint8 m_out_buf[JPGE_OUT_BUF_SIZE];
             uint8 *m_pOut_buf;
             uint m_out_buf_left;
-            uint32 m_bit_buffer;
+            uint64 m_bit_buffer;
             uint m_bits_in;
             uint8 m_pass_num;
+            huffman_state *m_pHuff;
+            int32 m_quantization_tables[2][64];
+            uint32 m_quantization_recip[2][64];
+            const uint16 *m_huff_codes[4];
+            const uint8 *m_huff_code_sizes[4];
+            const uint8 *m_huff_bits[4];
+            const uint8 *m_huff_val[4];
             bool m_all_stream_writes_succeeded;
 
-            bool jpg_open(int p_x_res, int p_y_res, int src_channels);
+            bool jpg_open(int p_x_res, int p_y_res, source_format_t src_format);
+            bool start_passes();
 
             void flush_output_buffer();
             void put_bits(uint bits, uint len);
+            void emit_bits32(uint32 bits);
 
             void emit_byte(uint8 i);
             void emit_word(uint i);
@@ -115,21 +241,39 @@ namespace jpge
             void emit_jfif_app0();
             void emit_dqt();
             void emit_sof();
-            void emit_dht(uint8 *bits, uint8 *val, int index, bool ac_flag);
+            void emit_dht(const uint8 *bits, const uint8 *val, int index, bool ac_flag);
             void emit_dhts();
-            void emit_sos();
+            void emit_sos(int component_num, int spectral_start, int spectral_end);
+            void emit_dri();
+            void flush_bits();
+            void start_mcu();
 
-            void compute_quant_table(int32 *dst, const int16 *src);
+            void compute_quant_table(int32 *dst, uint32 *recip, const int16 *src);
             void load_quantized_coefficients(int component_num);
+            void load_quantized_coefficients_aan(int component_num, const int16 *pSrc);
 
             void load_block_8_8_grey(int x);
             void load_block_8_8(int x, int y, int c);
             void load_block_16_8(int x, int c);
             void load_block_16_8_8(int x, int c);
+            void load_block_yuyv_y(int x);
+            void load_block_yuyv_c(int x, int c);
+
+            void optimize_huffman_table(int table_num, int table_len);
+            void use_huffman_tables(const huffman_tables *pTables);
+            bool first_pass_init();
+            bool second_pass_init();
 
+            void code_coefficients_pass_one(int component_num);
             void code_coefficients_pass_two(int component_num);
             void code_block(int component_num);
 
+            void code_symbol(int table_num, uint symbol, uint bits, uint num_bits);
+            void code_eob_run(int table_num);
+            void code_progressive_scan(int component_num, int spectral_start, int spectral_end);
+            void emit_progressive_scans();
+
+            void update_rate_control();
             void process_mcu_row();
             bool process_end_of_image();
             void load_mcu(const void* src);
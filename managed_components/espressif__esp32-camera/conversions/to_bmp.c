@@ -12,13 +12,13 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 #include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
 #include "img_converters.h"
-#include "soc/efuse_reg.h"
 #include "esp_heap_caps.h"
-#include "yuv.h"
 #include "sdkconfig.h"
 #include "esp_jpg_decode.h"
+#include "img_workspace.h"
 
 #include "esp_system.h"
 
@@ -53,10 +53,23 @@ typedef struct {
         uint16_t width;
         uint16_t height;
         uint16_t data_offset;
-        const uint8_t *input;
+        uint8_t bpp;
         uint8_t *output;
 } rgb_jpg_decoder;
 
+typedef struct {
+        rgb_jpg_decoder jpeg;
+        jpg_out_cb cb;
+        void *arg;
+        size_t index;
+        size_t stride;
+        uint8_t *stripe;
+        uint16_t stripe_y;
+        uint16_t stripe_rows;
+        uint16_t stripe_max;
+        img_workspace_t *workspace;
+} bmp_stream_t;
+
 static void *_malloc(size_t size)
 {
     // check if SPIRAM is enabled and allocate on SPIRAM if allocatable
@@ -89,127 +102,215 @@ static bool _rgb_write(void * arg, uint16_t x, uint16_t y, uint16_t w, uint16_t
         return true;
     }
 
-    size_t jw = jpeg->width*3;
-    size_t t = y * jw;
-    size_t b = t + (h * jw);
-    size_t l = x * 3;
-    uint8_t *out = jpeg->output+jpeg->data_offset;
-    uint8_t *o = out;
-    size_t iy, ix;
+    //the decoder already outputs the pixel format of the buffer
+    size_t jw = jpeg->width*jpeg->bpp;
+    uint8_t *o = jpeg->output + jpeg->data_offset + y * jw + x * jpeg->bpp;
+    size_t iy;
 
-    w = w * 3;
+    w = w * jpeg->bpp;
 
-    for(iy=t; iy<b; iy+=jw) {
-        o = out+iy+l;
-        for(ix=0; ix<w; ix+= 3) {
-            o[ix] = data[ix+2];
-            o[ix+1] = data[ix+1];
-            o[ix+2] = data[ix];
-        }
+    for(iy=0; iy<h; iy++, o+=jw) {
+        memcpy(o, data, w);
         data+=w;
     }
     return true;
 }
 
-static bool _rgb565_write(void * arg, uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint8_t *data)
+static bool jpg2rgb888(const uint8_t *src, size_t src_len, uint8_t * out, jpg_scale_t scale)
 {
-    rgb_jpg_decoder * jpeg = (rgb_jpg_decoder *)arg;
-    if(!data){
-        if(x == 0 && y == 0){
-            //write start
-            jpeg->width = w;
-            jpeg->height = h;
-            //if output is null, this is BMP
-            if(!jpeg->output){
-                jpeg->output = (uint8_t *)_malloc((w*h*3)+jpeg->data_offset);
-                if(!jpeg->output){
-                    return false;
-                }
-            }
-        } else {
-            //write end
-        }
-        return true;
-    }
-
-    size_t jw = jpeg->width*3;
-    size_t jw2 = jpeg->width*2;
-    size_t t = y * jw;
-    size_t t2 = y * jw2;
-    size_t b = t + (h * jw);
-    size_t l = x * 2;
-    uint8_t *out = jpeg->output+jpeg->data_offset;
-    uint8_t *o = out;
-    size_t iy, iy2, ix, ix2;
-
-    w = w * 3;
+    rgb_jpg_decoder jpeg;
+    jpeg.width = 0;
+    jpeg.height = 0;
+    jpeg.output = out;
+    jpeg.data_offset = 0;
+    jpeg.bpp = 3;
 
-    for(iy=t, iy2=t2; iy<b; iy+=jw, iy2+=jw2) {
-        o = out+iy2+l;
-        for(ix2=ix=0; ix<w; ix+= 3, ix2 +=2) {
-            uint16_t r = data[ix];
-            uint16_t g = data[ix+1];
-            uint16_t b = data[ix+2];
-            uint16_t c = ((r & 0xF8) << 8) | ((g & 0xFC) << 3) | (b >> 3);
-            o[ix2+1] = c>>8;
-            o[ix2] = c&0xff;
-        }
-        data+=w;
+    if(esp_jpg_decode_mem(src, src_len, scale, JPG_PIXEL_BGR888, _rgb_write, (void*)&jpeg) != ESP_OK){
+        return false;
     }
     return true;
 }
 
-//input buffer
-static unsigned int _jpg_read(void * arg, size_t index, uint8_t *buf, size_t len)
+bool jpg2rgb565(const uint8_t *src, size_t src_len, uint8_t * out, jpg_scale_t scale)
 {
-    rgb_jpg_decoder * jpeg = (rgb_jpg_decoder *)arg;
-    if(buf) {
-        memcpy(buf, jpeg->input + index, len);
+    rgb_jpg_decoder jpeg;
+    jpeg.width = 0;
+    jpeg.height = 0;
+    jpeg.output = out;
+    jpeg.data_offset = 0;
+    jpeg.bpp = 2;
+
+    if(esp_jpg_decode_mem(src, src_len, scale, JPG_PIXEL_RGB565_LE, _rgb_write, (void*)&jpeg) != ESP_OK){
+        return false;
     }
-    return len;
+    return true;
 }
 
-static bool jpg2rgb888(const uint8_t *src, size_t src_len, uint8_t * out, jpg_scale_t scale)
+bool jpg2gray(const uint8_t *src, size_t src_len, uint8_t * out, jpg_scale_t scale)
 {
     rgb_jpg_decoder jpeg;
     jpeg.width = 0;
     jpeg.height = 0;
-    jpeg.input = src;
     jpeg.output = out;
     jpeg.data_offset = 0;
+    jpeg.bpp = 1;
 
-    if(esp_jpg_decode(src_len, scale, _jpg_read, _rgb_write, (void*)&jpeg) != ESP_OK){
+    if(esp_jpg_decode_mem(src, src_len, scale, JPG_PIXEL_GRAYSCALE, _rgb_write, (void*)&jpeg) != ESP_OK){
         return false;
     }
     return true;
 }
 
-bool jpg2rgb565(const uint8_t *src, size_t src_len, uint8_t * out, jpg_scale_t scale)
+bool jpg2thumb(const uint8_t *src, size_t src_len, pixformat_t format, uint8_t * out, uint16_t * width, uint16_t * height)
 {
     rgb_jpg_decoder jpeg;
+    jpg_pixel_format_t pixel;
     jpeg.width = 0;
     jpeg.height = 0;
-    jpeg.input = src;
     jpeg.output = out;
     jpeg.data_offset = 0;
 
-    if(esp_jpg_decode(src_len, scale, _jpg_read, _rgb565_write, (void*)&jpeg) != ESP_OK){
+    if(format == PIXFORMAT_RGB565){
+        pixel = JPG_PIXEL_RGB565_BE;
+        jpeg.bpp = 2;
+    } else if(format == PIXFORMAT_GRAYSCALE){
+        pixel = JPG_PIXEL_GRAYSCALE;
+        jpeg.bpp = 1;
+    } else {
+        ESP_LOGE(TAG, "Unsupported thumbnail format: %d", format);
+        return false;
+    }
+
+    //1/8 scale only uses the DC coefficients, the decoder skips over the AC ones
+    if(esp_jpg_decode_mem(src, src_len, JPG_SCALE_8X, pixel, _rgb_write, (void*)&jpeg) != ESP_OK){
+        return false;
+    }
+    if(width){
+        *width = jpeg.width;
+    }
+    if(height){
+        *height = jpeg.height;
+    }
+    return true;
+}
+
+static bool _bmp_stream_out(bmp_stream_t *bmp, const void *data, size_t len)
+{
+    if(bmp->cb(bmp->arg, bmp->index, data, len) != len){
+        return false;
+    }
+    bmp->index += len;
+    return true;
+}
+
+//writes the buffered MCU row to the output
+static bool _bmp_stream_flush(bmp_stream_t *bmp)
+{
+    size_t len = bmp->stripe_rows * bmp->stride;
+    bmp->stripe_rows = 0;
+    return _bmp_stream_out(bmp, bmp->stripe, len);
+}
+
+//keeps one MCU row of BGR pixels and writes it out when the decoder moves to the next one
+static bool _bmp_stream_write(void * arg, uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint8_t *data)
+{
+    bmp_stream_t *bmp = (bmp_stream_t *)arg;
+    if(!data){
+        if(x == 0 && y == 0){
+            //write start, the header goes out before any pixel
+            bmp->jpeg.width = w;
+            bmp->jpeg.height = h;
+            bmp->stride = (w * 3 + 3) & ~3;
+            uint32_t header[(BMP_HEADER_LEN + 2) / 4];
+            uint8_t *buf = (uint8_t *)header + 2;
+            buf[0] = 'B';
+            buf[1] = 'M';
+            bmp_header_t * bitmap = (bmp_header_t *)&header[1];
+            bitmap->reserved = 0;
+            bitmap->filesize = bmp->stride * h + BMP_HEADER_LEN;
+            bitmap->fileoffset_to_pixelarray = BMP_HEADER_LEN;
+            bitmap->dibheadersize = 40;
+            bitmap->width = w;
+            bitmap->height = -h;//set negative for top to bottom
+            bitmap->planes = 1;
+            bitmap->bitsperpixel = 24;
+            bitmap->compression = 0;
+            bitmap->imagesize = bmp->stride * h;
+            bitmap->ypixelpermeter = 0x0B13 ; //2835 , 72 DPI
+            bitmap->xpixelpermeter = 0x0B13 ; //2835 , 72 DPI
+            bitmap->numcolorspallette = 0;
+            bitmap->mostimpcolor = 0;
+            return _bmp_stream_out(bmp, buf, BMP_HEADER_LEN);
+        } else if(bmp->stripe_rows) {
+            //write end
+            return _bmp_stream_flush(bmp);
+        }
+        return true;
+    }
+
+    if(!bmp->stripe){
+        //the first block has the full MCU height, later rows can only be shorter
+        bmp->stripe_max = h;
+        bmp->stripe = (uint8_t *)img_ws_malloc(bmp->workspace, bmp->stride * h);
+        if(!bmp->stripe){
+            ESP_LOGE(TAG, "_malloc failed! %u", (unsigned) (bmp->stride * h));
+            return false;
+        }
+        //zero the row padding once, pixels never touch it
+        memset(bmp->stripe, 0, bmp->stride * h);
+    } else if(y != bmp->stripe_y && bmp->stripe_rows && !_bmp_stream_flush(bmp)) {
+        return false;
+    }
+    if(h > bmp->stripe_max){
         return false;
     }
+    bmp->stripe_y = y;
+    bmp->stripe_rows = h;
+
+    size_t iy;
+    w = w * 3;
+    for(iy=0; iy<h; iy++) {
+        memcpy(bmp->stripe + iy * bmp->stride + x * 3, data, w);
+        data+=w;
+    }
     return true;
 }
 
+bool jpg2bmp_cb_ex(const uint8_t *src, size_t src_len, img_workspace_t *workspace, jpg_out_cb cb, void * arg)
+{
+    bmp_stream_t bmp;
+    memset(&bmp, 0, sizeof(bmp));
+    bmp.cb = cb;
+    bmp.arg = arg;
+    bmp.workspace = workspace;
+
+    esp_err_t err = esp_jpg_decode_mem(src, src_len, JPG_SCALE_NONE, JPG_PIXEL_BGR888, _bmp_stream_write, (void*)&bmp);
+    img_ws_free(workspace, bmp.stripe);
+    return err == ESP_OK;
+}
+
+bool jpg2bmp_cb(const uint8_t *src, size_t src_len, jpg_out_cb cb, void * arg)
+{
+    return jpg2bmp_cb_ex(src, src_len, NULL, cb, arg);
+}
+
+size_t jpg2bmp_workspace_size(uint16_t width)
+{
+    //one row of MCUs, at most 16 lines
+    return img_workspace_block_size(((width * 3 + 3) & ~3) * 16);
+}
+
 bool jpg2bmp(const uint8_t *src, size_t src_len, uint8_t ** out, size_t * out_len)
 {
 
     rgb_jpg_decoder jpeg;
     jpeg.width = 0;
     jpeg.height = 0;
-    jpeg.input = src;
     jpeg.output = NULL;
     jpeg.data_offset = BMP_HEADER_LEN;
+    jpeg.bpp = 3;
 
-    if(esp_jpg_decode(src_len, JPG_SCALE_NONE, _jpg_read, _rgb_write, (void*)&jpeg) != ESP_OK){
+    if(esp_jpg_decode_mem(src, src_len, JPG_SCALE_NONE, JPG_PIXEL_BGR888, _rgb_write, (void*)&jpeg) != ESP_OK){
         return false;
     }
 
@@ -239,6 +340,26 @@ bool jpg2bmp(const uint8_t *src, size_t src_len, uint8_t ** out, size_t * out_le
     return true;
 }
 
+static inline void rgb565_pixel(uint8_t *dst, uint8_t hb, uint8_t lb)
+{
+    dst[0] = (lb & 0x1F) << 3;
+    dst[1] = (hb & 0x07) << 5 | (lb & 0xE0) >> 3;
+    dst[2] = hb & 0xF8;
+}
+
+void rgb565_to_rgb888_line(const uint8_t *src, uint8_t *dst, size_t pixels)
+{
+    for (; pixels; pixels--, src += 2, dst += 3) {
+        rgb565_pixel(dst, src[0], src[1]);
+    }
+}
+
+#if CONFIG_CAMERA_CONVERSIONS_YUV_FIXED_POINT
+#define yuv422_to_rgb888 yuv422_to_rgb888_line_fixed
+#else
+#define yuv422_to_rgb888 yuv422_to_rgb888_line
+#endif
+
 bool fmt2rgb888(const uint8_t *src_buf, size_t src_len, pixformat_t format, uint8_t * rgb_buf)
 {
     int pix_count = 0;
@@ -247,16 +368,8 @@ bool fmt2rgb888(const uint8_t *src_buf, size_t src_len, pixformat_t format, uint
     } else if(format == PIXFORMAT_RGB888) {
         memcpy(rgb_buf, src_buf, src_len);
     } else if(format == PIXFORMAT_RGB565) {
-        int i;
-        uint8_t hb, lb;
         pix_count = src_len / 2;
-        for(i=0; i<pix_count; i++) {
-            hb = *src_buf++;
-            lb = *src_buf++;
-            *rgb_buf++ = (lb & 0x1F) << 3;
-            *rgb_buf++ = (hb & 0x07) << 5 | (lb & 0xE0) >> 3;
-            *rgb_buf++ = hb & 0xF8;
-        }
+        rgb565_to_rgb888_line(src_buf, rgb_buf, pix_count);
     } else if(format == PIXFORMAT_GRAYSCALE) {
         int i;
         uint8_t b;
@@ -269,25 +382,7 @@ bool fmt2rgb888(const uint8_t *src_buf, size_t src_len, pixformat_t format, uint
         }
     } else if(format == PIXFORMAT_YUV422) {
         pix_count = src_len / 2;
-        int i, maxi = pix_count / 2;
-        uint8_t y0, y1, u, v;
-        uint8_t r, g, b;
-        for(i=0; i<maxi; i++) {
-            y0 = *src_buf++;
-            u = *src_buf++;
-            y1 = *src_buf++;
-            v = *src_buf++;
-
-            yuv2rgb(y0, u, v, &r, &g, &b);
-            *rgb_buf++ = b;
-            *rgb_buf++ = g;
-            *rgb_buf++ = r;
-
-            yuv2rgb(y1, u, v, &r, &g, &b);
-            *rgb_buf++ = b;
-            *rgb_buf++ = g;
-            *rgb_buf++ = r;
-        }
+        yuv422_to_rgb888(src_buf, rgb_buf, pix_count);
     }
     return true;
 }
@@ -311,7 +406,7 @@ bool fmt2bmp(uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixf
     size_t out_size = (pix_count * bpp) + BMP_HEADER_LEN + palette_size;
     uint8_t * out_buf = (uint8_t *)_malloc(out_size);
     if(!out_buf) {
-        ESP_LOGE(TAG, "_malloc failed! %u", out_size);
+        ESP_LOGE(TAG, "_malloc failed! %u", (unsigned) out_size);
         return false;
     }
 
@@ -354,37 +449,11 @@ bool fmt2bmp(uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixf
     if(format == PIXFORMAT_RGB888) {
         memcpy(pix_buf, src_buf, pix_count*3);
     } else if(format == PIXFORMAT_RGB565) {
-        int i;
-        uint8_t hb, lb;
-        for(i=0; i<pix_count; i++) {
-            hb = *src_buf++;
-            lb = *src_buf++;
-            *pix_buf++ = (lb & 0x1F) << 3;
-            *pix_buf++ = (hb & 0x07) << 5 | (lb & 0xE0) >> 3;
-            *pix_buf++ = hb & 0xF8;
-        }
+        rgb565_to_rgb888_line(src_buf, pix_buf, pix_count);
     } else if(format == PIXFORMAT_GRAYSCALE) {
         memcpy(pix_buf, src_buf, pix_count);
     } else if(format == PIXFORMAT_YUV422) {
-        int i, maxi = pix_count / 2;
-        uint8_t y0, y1, u, v;
-        uint8_t r, g, b;
-        for(i=0; i<maxi; i++) {
-            y0 = *src_buf++;
-            u = *src_buf++;
-            y1 = *src_buf++;
-            v = *src_buf++;
-
-            yuv2rgb(y0, u, v, &r, &g, &b);
-            *pix_buf++ = b;
-            *pix_buf++ = g;
-            *pix_buf++ = r;
-
-            yuv2rgb(y1, u, v, &r, &g, &b);
-            *pix_buf++ = b;
-            *pix_buf++ = g;
-            *pix_buf++ = r;
-        }
+        yuv422_to_rgb888(src_buf, pix_buf, pix_count);
     }
     *out = out_buf;
     *out_len = out_size;
@@ -13,13 +13,25 @@
 // limitations under the License.
 #include <stddef.h>
 #include <string.h>
-#include "esp_attr.h"
-#include "soc/efuse_reg.h"
+#include <math.h>
+#include <new>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
 #include "esp_heap_caps.h"
 #include "esp_camera.h"
 #include "img_converters.h"
 #include "jpge.h"
-#include "yuv.h"
+#include "img_workspace.h"
+
+#if CONFIG_SPIRAM || CONFIG_SPIRAM_SUPPORT
+#include "esp_idf_version.h"
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
+#include "esp_memory_utils.h"
+#else
+#include "soc/soc_memory_layout.h"
+#endif
+#endif
 
 #if defined(ARDUINO_ARCH_ESP32) && defined(CONFIG_ARDUHAL_ESP_LOG)
 #include "esp32-hal-log.h"
@@ -29,6 +41,14 @@
 static const char* TAG = "to_jpg";
 #endif
 
+#define PARALLEL_TASK_STACK (6*1024)
+#define PREFETCH_TASK_STACK (2*1024)
+
+// Target size: the qualities the sampled rows of MCUs are encoded at, and how many rows are sampled
+#define RATE_SAMPLE_QUALITY_LOW  25
+#define RATE_SAMPLE_QUALITY_HIGH 85
+#define RATE_SAMPLE_ROWS         4
+
 static void *_malloc(size_t size)
 {
     void * res = malloc(size);
@@ -43,59 +63,288 @@ static void *_malloc(size_t size)
     return NULL;
 }
 
-static IRAM_ATTR void convert_line_format(uint8_t * src, pixformat_t format, uint8_t * dst, size_t width, size_t in_channels, size_t line)
+struct jpg_huffman_tables {
+    jpge::huffman_tables tables;
+    uint16_t reuse_count;
+    uint16_t images_left;   // images still to encode with the tables, 0 when they must be rebuilt
+};
+
+jpg_huffman_tables_t *jpg_huffman_tables_create(uint16_t reuse_count)
 {
-    int i=0, o=0, l=0;
-    if(format == PIXFORMAT_GRAYSCALE) {
-        memcpy(dst, src + line * width, width);
-    } else if(format == PIXFORMAT_RGB888) {
-        l = width * 3;
-        src += l * line;
-        for(i=0; i<l; i+=3) {
-            dst[o++] = src[i+2];
-            dst[o++] = src[i+1];
-            dst[o++] = src[i];
+    jpg_huffman_tables_t *tables = (jpg_huffman_tables_t *)_malloc(sizeof(jpg_huffman_tables_t));
+    if(tables) {
+        tables->reuse_count = reuse_count;
+        tables->images_left = 0;
+    }
+    return tables;
+}
+
+void jpg_huffman_tables_delete(jpg_huffman_tables_t *tables)
+{
+    free(tables);
+}
+
+// Copies the source a row of MCUs at a time into two stripes in internal RAM. A task on the other core
+// fetches the next stripe while the encoder reads the current one, so it does not stall on PSRAM.
+struct stripe_prefetch {
+    const uint8_t *src;
+    size_t line_len;
+    uint16_t height;
+    uint16_t lines;             // lines per stripe, the height of a row of MCUs
+    uint8_t *buf[2];
+    uint16_t next;              // stripe the worker is asked to fetch
+    bool pending;               // the worker is fetching it
+    bool stop;
+    SemaphoreHandle_t fetch;    // given to ask the worker for the next stripe, or to stop it
+    SemaphoreHandle_t ready;    // given by the worker once the stripe is in its buffer, or once it stopped
+};
+
+static void stripe_prefetch_copy(stripe_prefetch *p, uint16_t stripe)
+{
+    uint16_t y = stripe * p->lines;
+    uint16_t lines = (p->height - y < p->lines) ? p->height - y : p->lines;
+    memcpy(p->buf[stripe & 1], p->src + y * p->line_len, lines * p->line_len);
+}
+
+#if !CONFIG_FREERTOS_UNICORE
+static void stripe_prefetch_task(void *arg)
+{
+    stripe_prefetch *p = (stripe_prefetch *)arg;
+    while(xSemaphoreTake(p->fetch, portMAX_DELAY) == pdTRUE && !p->stop) {
+        stripe_prefetch_copy(p, p->next);
+        xSemaphoreGive(p->ready);
+    }
+    xSemaphoreGive(p->ready);
+    vTaskDelete(NULL);
+}
+#endif
+
+static void stripe_prefetch_request(stripe_prefetch *p, uint16_t stripe)
+{
+    p->next = stripe;
+    p->pending = true;
+    xSemaphoreGive(p->fetch);
+}
+
+// Starts streaming the source, false to read it in place
+static bool stripe_prefetch_start(stripe_prefetch *p, const uint8_t *src, uint16_t width, uint16_t height, size_t bpp,
+                                  uint16_t lines, jpg_source_read_t mode)
+{
+    memset(p, 0, sizeof(*p));
+    if(mode == JPG_SOURCE_AUTO) {
+#if CONFIG_SPIRAM || CONFIG_SPIRAM_SUPPORT
+        mode = esp_ptr_external_ram(src) ? JPG_SOURCE_PREFETCH : JPG_SOURCE_DIRECT;
+#else
+        mode = JPG_SOURCE_DIRECT;
+#endif
+    }
+    if(mode != JPG_SOURCE_PREFETCH) {
+        return false;
+    }
+
+    p->src = src;
+    p->line_len = width * bpp;
+    p->height = height;
+    p->lines = lines;
+    p->buf[0] = (uint8_t *)heap_caps_malloc(2 * lines * p->line_len, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    if(!p->buf[0]) {
+        ESP_LOGW(TAG, "No internal RAM for the source stripes, reading the source in place");
+        return false;
+    }
+    p->buf[1] = p->buf[0] + lines * p->line_len;
+
+#if !CONFIG_FREERTOS_UNICORE
+    p->fetch = xSemaphoreCreateBinary();
+    p->ready = xSemaphoreCreateBinary();
+    if(!p->fetch || !p->ready || xTaskCreatePinnedToCore(stripe_prefetch_task, "jpg_prefetch", PREFETCH_TASK_STACK, p,
+                                                          uxTaskPriorityGet(NULL), NULL, !xPortGetCoreID()) != pdPASS) {
+        ESP_LOGW(TAG, "JPG prefetch task create failed, copying the stripes on one core");
+        if(p->fetch) {
+            vSemaphoreDelete(p->fetch);
         }
-    } else if(format == PIXFORMAT_RGB565) {
-        l = width * 2;
-        src += l * line;
-        for(i=0; i<l; i+=2) {
-            dst[o++] = src[i] & 0xF8;
-            dst[o++] = (src[i] & 0x07) << 5 | (src[i+1] & 0xE0) >> 3;
-            dst[o++] = (src[i+1] & 0x1F) << 3;
+        if(p->ready) {
+            vSemaphoreDelete(p->ready);
         }
-    } else if(format == PIXFORMAT_YUV422) {
-        uint8_t y0, y1, u, v;
-        uint8_t r, g, b;
-        l = width * 2;
-        src += l * line;
-        for(i=0; i<l; i+=4) {
-            y0 = src[i];
-            u = src[i+1];
-            y1 = src[i+2];
-            v = src[i+3];
+        p->fetch = p->ready = NULL;
+    }
+#endif
+    return true;
+}
+
+// Returns line y of the source from its stripe, y must go through the image in order
+static const uint8_t *stripe_prefetch_line(stripe_prefetch *p, uint16_t y)
+{
+    uint16_t stripe = y / p->lines;
+    if(y % p->lines == 0) {
+        if(!p->fetch) {
+            stripe_prefetch_copy(p, stripe);
+        } else {
+            if(!p->pending) {
+                stripe_prefetch_request(p, stripe);
+            }
+            xSemaphoreTake(p->ready, portMAX_DELAY);
+            p->pending = false;
+            if((stripe + 1) * p->lines < p->height) {
+                stripe_prefetch_request(p, stripe + 1);
+            }
+        }
+    }
+    return p->buf[stripe & 1] + (y % p->lines) * p->line_len;
+}
+
+static void stripe_prefetch_end(stripe_prefetch *p)
+{
+    if(p->fetch) {
+        if(p->pending) {
+            xSemaphoreTake(p->ready, portMAX_DELAY);
+        }
+        p->stop = true;
+        xSemaphoreGive(p->fetch);
+        xSemaphoreTake(p->ready, portMAX_DELAY);
+        vSemaphoreDelete(p->fetch);
+        vSemaphoreDelete(p->ready);
+    }
+    heap_caps_free(p->buf[0]);
+}
+
+class counting_stream : public jpge::output_stream {
+protected:
+    size_t index;
+
+public:
+    counting_stream() : index(0) { }
+    virtual ~counting_stream() { }
+    virtual bool put_buf(const void* data, int len)
+    {
+        index += len;
+        return true;
+    }
+    virtual uint get_size() const
+    {
+        return index;
+    }
+};
 
-            yuv2rgb(y0, u, v, &r, &g, &b);
-            dst[o++] = r;
-            dst[o++] = g;
-            dst[o++] = b;
+// A few rows of MCUs spread over the image, encoded to predict the quality for a target size
+struct rate_sample {
+    const uint8_t *src;
+    uint16_t width;
+    uint16_t height;
+    size_t bpp;
+    int mcu_lines;
+    int rows;
+    int samples;
+    jpge::source_format_t src_format;
+    jpge::params params;
+    size_t header_size;
+};
 
-            yuv2rgb(y1, u, v, &r, &g, &b);
-            dst[o++] = r;
-            dst[o++] = g;
-            dst[o++] = b;
+// Encodes the sampled rows at this quality, returns the log of their coded size scaled to the whole image
+static bool rate_sample_size(rate_sample *r, int quality, double *log_size)
+{
+    counting_stream stream;
+    jpge::jpeg_encoder sample;
+    r->params.m_quality = quality;
+    if (!sample.init(&stream, r->width, r->samples * r->mcu_lines, r->src_format, r->params)) {
+        return false;
+    }
+    r->header_size = sample.get_output_size();
+    for (int s = 0; s < r->samples; s++) {
+        int y0 = ((2 * s + 1) * r->rows / (2 * r->samples)) * r->mcu_lines;
+        for (int y = y0; y < y0 + r->mcu_lines; y++) {
+            sample.process_scanline(r->src + ((y < r->height) ? y : r->height - 1) * r->width * r->bpp);
         }
     }
+    if (!sample.process_scanline(NULL)) {
+        return false;
+    }
+    // without the headers and the EOI marker
+    *log_size = log((double)(stream.get_size() - r->header_size - 2) * r->rows / r->samples + 1);
+    return true;
 }
 
-bool convert_image(uint8_t *src, uint16_t width, uint16_t height, pixformat_t format, uint8_t quality, jpge::output_stream *dst_stream)
+// Percentage the standard quantization tables are scaled by at this quality, as in jpge
+static double quality_scale(int quality)
+{
+    return (quality < 50) ? 5000.0 / quality : 200 - quality * 2;
+}
+
+// The quality whose tables are scaled by about this percentage, rounded up
+static int scale_quality(double scale)
+{
+    int quality = (scale >= 100) ? (int)(5000 / scale) : (int)ceil((200 - scale) / 2);
+    return (quality < 1) ? 1 : (quality > 100) ? 100 : quality;
+}
+
+// Predicts the quality that codes the image in about target_size bytes. The sampled rows are encoded at a
+// low and a high quality, and the size is taken as a power of the quantizer scale between them. As the
+// curve bends, they are encoded again at the predicted quality, which is then refined between it and the
+// sample on the other side of the target.
+static int predict_quality(const uint8_t *src, uint16_t width, uint16_t height, size_t bpp, int mcu_lines,
+                           jpge::source_format_t src_format, const jpge::params &comp_params, size_t target_size)
+{
+    rate_sample r = { src, width, height, bpp, mcu_lines, (height + mcu_lines - 1) / mcu_lines, 0, src_format, comp_params, 0 };
+    r.samples = (r.rows < RATE_SAMPLE_ROWS) ? r.rows : RATE_SAMPLE_ROWS;
+    r.params.m_target_size = 0;
+
+    int quality[2] = { RATE_SAMPLE_QUALITY_LOW, RATE_SAMPLE_QUALITY_HIGH };
+    double log_size[2];
+    if (!rate_sample_size(&r, quality[0], &log_size[0]) || !rate_sample_size(&r, quality[1], &log_size[1])) {
+        return comp_params.m_quality;
+    }
+    // aim 1/16 over, the encoder only quantizes more coarsely to get back under the target
+    double target = (double)target_size * 17 / 16 - r.header_size - 2;
+    if (target < 1) {
+        return 1;
+    }
+    double log_target = log(target);
+    // a flat frame codes to the same size at both qualities, there is no curve to follow
+    if (log_size[1] <= log_size[0]) {
+        return (log_size[1] <= log_target) ? RATE_SAMPLE_QUALITY_HIGH : comp_params.m_quality;
+    }
+
+    int predicted = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        double log_scale[2] = { log(quality_scale(quality[0])), log(quality_scale(quality[1])) };
+        predicted = scale_quality(exp(log_scale[0] + (log_target - log_size[0]) * (log_scale[1] - log_scale[0]) / (log_size[1] - log_size[0])));
+        double log_predicted;
+        if (pass || predicted <= quality[0] || predicted >= quality[1] || !rate_sample_size(&r, predicted, &log_predicted)) {
+            break;
+        }
+        int i = (log_predicted > log_target) ? 1 : 0;
+        quality[i] = predicted;
+        log_size[i] = log_predicted;
+        if (log_size[1] <= log_size[0]) {
+            break;
+        }
+    }
+    return predicted;
+}
+
+// Encoder parameters of config for a source in format, without the Huffman table and target size settings
+static bool encode_params(pixformat_t format, const jpg_encode_config_t *config, jpge::params *comp_params, jpge::source_format_t *src_format, size_t *bpp)
 {
-    int num_channels = 3;
     jpge::subsampling_t subsampling = jpge::H2V2;
+    uint8_t quality = config->quality;
+    *bpp = 2;
 
+    // The encoder converts the source pixels to YCbCr while loading its MCU rows, straight from src
     if(format == PIXFORMAT_GRAYSCALE) {
-        num_channels = 1;
+        *src_format = jpge::SRC_Y8;
         subsampling = jpge::Y_ONLY;
+        *bpp = 1;
+    } else if(format == PIXFORMAT_RGB888) {
+        *src_format = jpge::SRC_BGR888;
+        *bpp = 3;
+    } else if(format == PIXFORMAT_RGB565) {
+        *src_format = jpge::SRC_RGB565;
+    } else if(format == PIXFORMAT_YUV422) {
+        // encoded natively, the JPEG keeps the 4:2:2 chroma of the source
+        *src_format = jpge::SRC_YUYV;
+        subsampling = jpge::H2V1;
+    } else {
+        ESP_LOGE(TAG, "Unsupported format for JPG: %d", format);
+        return false;
     }
 
     if(!quality) {
@@ -104,38 +353,86 @@ bool convert_image(uint8_t *src, uint16_t width, uint16_t height, pixformat_t fo
         quality = 100;
     }
 
-    jpge::params comp_params = jpge::params();
-    comp_params.m_subsampling = subsampling;
-    comp_params.m_quality = quality;
+    *comp_params = jpge::params();
+    comp_params->m_subsampling = subsampling;
+    comp_params->m_quality = quality;
+    comp_params->m_restart_interval = config->restart_interval;
+    comp_params->m_progressive = config->progressive;
+    comp_params->m_pWorkspace = config->workspace;
+    if(config->dct == JPEG_DCT_ISLOW) {
+        comp_params->m_dct_method = jpge::DCT_ISLOW;
+    } else if(config->dct == JPEG_DCT_AAN) {
+        comp_params->m_dct_method = jpge::DCT_AAN;
+    } else if(config->dct == JPEG_DCT_AAN_SIMD) {
+        comp_params->m_dct_method = jpge::DCT_AAN_SIMD;
+    }
+    return true;
+}
+
+bool convert_image(uint8_t *src, uint16_t width, uint16_t height, pixformat_t format, const jpg_encode_config_t *config, jpge::output_stream *dst_stream)
+{
+    jpge::params comp_params;
+    jpge::source_format_t src_format;
+    size_t bpp;
+    if(!encode_params(format, config, &comp_params, &src_format, &bpp)) {
+        return false;
+    }
+
+    // a row of MCUs is 16 lines with 4:2:0 chroma, 8 otherwise
+    const int mcu_lines = (comp_params.m_subsampling == jpge::H2V2) ? 16 : 8;
+    if(config->target_size) {
+        comp_params.m_progressive = false;
+        comp_params.m_target_size = config->target_size;
+        comp_params.m_quality = predict_quality(src, width, height, bpp, mcu_lines, src_format, comp_params, config->target_size);
+    }
+
+    jpg_huffman_tables_t *huffman_tables = (config->optimize_huffman && !comp_params.m_progressive && !config->target_size) ? config->huffman_tables : NULL;
+    if(huffman_tables) {
+        comp_params.m_pHuff_tables = &huffman_tables->tables;
+        comp_params.m_two_pass_flag = huffman_tables->images_left == 0;
+    } else {
+        comp_params.m_two_pass_flag = config->optimize_huffman && !config->target_size;
+    }
 
     jpge::jpeg_encoder dst_image;
 
-    if (!dst_image.init(dst_stream, width, height, num_channels, comp_params)) {
+    if (!dst_image.init(dst_stream, width, height, src_format, comp_params)) {
         ESP_LOGE(TAG, "JPG encoder init failed");
         return false;
     }
 
-    uint8_t* line = (uint8_t*)_malloc(width * num_channels);
-    if(!line) {
-        ESP_LOGE(TAG, "Scan line malloc failed");
-        return false;
-    }
+    stripe_prefetch prefetch;
+    bool stream = stripe_prefetch_start(&prefetch, src, width, height, bpp, mcu_lines, config->source_read);
+    bool ok = true;
+    for (uint pass = 0; ok && pass < dst_image.get_total_passes(); pass++) {
+        for (int i = 0; ok && i < height; i++) {
+            const uint8_t *line = stream ? stripe_prefetch_line(&prefetch, i) : src + i * width * bpp;
+            if (!dst_image.process_scanline(line)) {
+                ESP_LOGE(TAG, "JPG process line %u failed", i);
+                ok = false;
+            }
+        }
 
-    for (int i = 0; i < height; i++) {
-        convert_line_format(src, format, line, width, num_channels, i);
-        if (!dst_image.process_scanline(line)) {
-            ESP_LOGE(TAG, "JPG process line %u failed", i);
-            free(line);
-            return false;
+        if (ok && !dst_image.process_scanline(NULL)) {
+            ESP_LOGE(TAG, "JPG image finish failed");
+            ok = false;
         }
     }
-    free(line);
-
-    if (!dst_image.process_scanline(NULL)) {
-        ESP_LOGE(TAG, "JPG image finish failed");
+    if (stream) {
+        stripe_prefetch_end(&prefetch);
+    }
+    if (!ok) {
         return false;
     }
     dst_image.deinit();
+
+    if(huffman_tables) {
+        if(comp_params.m_two_pass_flag) {
+            huffman_tables->images_left = huffman_tables->reuse_count;
+        } else {
+            huffman_tables->images_left--;
+        }
+    }
     return true;
 }
 
@@ -153,16 +450,23 @@ public:
         index += ocb(oarg, index, data, len);
         return true;
     }
-    virtual size_t get_size() const
+    virtual uint get_size() const
     {
         return index;
     }
 };
 
-bool fmt2jpg_cb(uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixformat_t format, uint8_t quality, jpg_out_cb cb, void * arg)
+bool fmt2jpg_cb_ex(uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixformat_t format, const jpg_encode_config_t *config, jpg_out_cb cb, void * arg)
 {
     callback_stream dst_stream(cb, arg);
-    return convert_image(src, width, height, format, quality, &dst_stream);
+    return convert_image(src, width, height, format, config, &dst_stream);
+}
+
+bool fmt2jpg_cb(uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixformat_t format, uint8_t quality, jpg_out_cb cb, void * arg)
+{
+    jpg_encode_config_t config = JPG_ENCODE_CONFIG_DEFAULT();
+    config.quality = quality;
+    return fmt2jpg_cb_ex(src, src_len, width, height, format, &config, cb, arg);
 }
 
 bool frame2jpg_cb(camera_fb_t * fb, uint8_t quality, jpg_out_cb cb, void * arg)
@@ -199,13 +503,13 @@ public:
         return true;
     }
 
-    virtual size_t get_size() const
+    virtual uint get_size() const
     {
         return index;
     }
 };
 
-bool fmt2jpg(uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixformat_t format, uint8_t quality, uint8_t ** out, size_t * out_len)
+bool fmt2jpg_ex(uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixformat_t format, const jpg_encode_config_t *config, uint8_t ** out, size_t * out_len)
 {
     //todo: allocate proper buffer for holding JPEG data
     //this should be enough for CIF frame size
@@ -219,7 +523,7 @@ bool fmt2jpg(uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixf
     }
     memory_stream dst_stream(jpg_buf, jpg_buf_len);
 
-    if(!convert_image(src, width, height, format, quality, &dst_stream)) {
+    if(!convert_image(src, width, height, format, config, &dst_stream)) {
         free(jpg_buf);
         return false;
     }
@@ -229,6 +533,436 @@ bool fmt2jpg(uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixf
     return true;
 }
 
+// One JPEG of fmt2jpg_multi(). A downscaled one sums the source lines into the box of each of its pixels
+// and gives the encoder their average once scale lines were summed.
+struct multi_output {
+    jpg_encode_output_t *desc;
+    img_workspace_t *ws;
+    callback_stream cb_stream;
+    memory_stream mem_stream;
+    jpge::jpeg_encoder encoder;
+    uint16_t width, height;     // of the JPEG
+    uint16_t lines_in;          // source lines summed since the last line given to the encoder
+    uint16_t lines_out;         // lines given to the encoder
+    size_t line_len;
+    uint16_t *sums;             // one per byte of the downscaled line
+    uint8_t *line;              // the downscaled line
+    uint32_t recip;             // 65536 / (scale * scale)
+
+    multi_output(jpg_encode_output_t *o, img_workspace_t *workspace) : desc(o), ws(workspace), cb_stream(o->cb, o->arg), mem_stream(NULL, 0),
+        width(0), height(0), lines_in(0), lines_out(0), line_len(0), sums(NULL), line(NULL), recip(0) { }
+    ~multi_output()
+    {
+        img_ws_free(ws, sums);
+        img_ws_free(ws, line);
+    }
+};
+
+struct multi_encode {
+    img_workspace_t *workspace;
+    multi_output **outputs;
+    size_t count;
+    pixformat_t format;         // of the source lines
+    // JPEG source: the decoder ignores what the writer returns for the start and end of the image
+    bool started;
+    bool finished;
+    // JPEG source: the decoded MCU row
+    size_t stride;
+    uint8_t *stripe;
+    uint16_t stripe_y;
+    uint16_t stripe_rows;
+    uint16_t stripe_max;
+};
+
+// Adds a source line to the box sums, a downscaled pixel covers scale source pixels of it
+static void multi_sum_line(multi_output *o, pixformat_t format, const uint8_t *src)
+{
+    const int scale = o->desc->scale;
+    uint16_t *sum = o->sums;
+    if(format == PIXFORMAT_YUV422) {
+        // A downscaled pair covers scale source pairs, its chroma also averages scale * scale samples
+        for(int x = 0; x < o->width; x += 2, sum += 4) {
+            for(int i = 0; i < scale; i++, src += 4) {
+                sum[(2 * i) / scale * 2] += src[0];
+                sum[1] += src[1];
+                sum[(2 * i + 1) / scale * 2] += src[2];
+                sum[3] += src[3];
+            }
+        }
+    } else if(format == PIXFORMAT_RGB565) {
+        // to BGR888, the big endian unpacking of the encoder
+        for(int x = 0; x < o->width; x++, sum += 3) {
+            for(int i = 0; i < scale; i++, src += 2) {
+                sum[0] += (src[1] & 0x1F) << 3;
+                sum[1] += ((src[0] & 0x07) << 5) | ((src[1] & 0xE0) >> 3);
+                sum[2] += src[0] & 0xF8;
+            }
+        }
+    } else {
+        const int bpp = (format == PIXFORMAT_RGB888) ? 3 : 1;
+        for(int x = 0; x < o->width; x++, sum += bpp) {
+            for(int i = 0; i < scale; i++) {
+                for(int c = 0; c < bpp; c++) {
+                    sum[c] += *src++;
+                }
+            }
+        }
+    }
+}
+
+// Size of a downscaled JPEG and the encoder parameters for its lines
+static bool multi_output_params(const jpg_encode_output_t *desc, uint16_t width, uint16_t height, pixformat_t format, img_workspace_t *ws,
+                                uint16_t *out_width, uint16_t *out_height, jpge::params *comp_params, jpge::source_format_t *src_format, size_t *bpp)
+{
+    const int scale = desc->scale;
+    if(scale < 1 || scale > 8) {
+        ESP_LOGE(TAG, "Unsupported JPG scale: %d", scale);
+        return false;
+    }
+    *out_width = width / scale;
+    *out_height = height / scale;
+    if(scale > 1 && format == PIXFORMAT_YUV422) {
+        *out_width &= ~1;
+    }
+    if(!*out_width || !*out_height) {
+        ESP_LOGE(TAG, "JPG scale %d leaves no pixel of %ux%u", scale, width, height);
+        return false;
+    }
+
+    // RGB565 is averaged to BGR888, the other formats keep theirs
+    pixformat_t line_format = (scale > 1 && format == PIXFORMAT_RGB565) ? PIXFORMAT_RGB888 : format;
+    if(!encode_params(line_format, &desc->config, comp_params, src_format, bpp)) {
+        return false;
+    }
+    comp_params->m_two_pass_flag = false;
+    comp_params->m_pWorkspace = ws;
+    return true;
+}
+
+static bool multi_start(multi_encode *m, uint16_t width, uint16_t height)
+{
+    for(size_t i = 0; i < m->count; i++) {
+        multi_output *o = m->outputs[i];
+        const int scale = o->desc->scale;
+        jpge::params comp_params;
+        jpge::source_format_t src_format;
+        size_t bpp;
+        if(!multi_output_params(o->desc, width, height, m->format, m->workspace, &o->width, &o->height, &comp_params, &src_format, &bpp)) {
+            return false;
+        }
+
+        if(scale > 1) {
+            o->line_len = o->width * bpp;
+            o->recip = (65536 + scale * scale / 2) / (scale * scale);
+            o->sums = (uint16_t *)img_ws_malloc(m->workspace, o->line_len * sizeof(uint16_t));
+            o->line = (uint8_t *)img_ws_malloc(m->workspace, o->line_len);
+            if(!o->sums || !o->line) {
+                ESP_LOGE(TAG, "JPG scale buffers malloc failed");
+                return false;
+            }
+            memset(o->sums, 0, o->line_len * sizeof(uint16_t));
+        }
+
+        jpge::output_stream *stream = &o->cb_stream;
+        if(!o->desc->cb) {
+            //todo: allocate proper buffer for holding JPEG data, the same size as fmt2jpg_ex()
+            int jpg_buf_len = 128*1024;
+            o->desc->out = (uint8_t *)_malloc(jpg_buf_len);
+            if(!o->desc->out) {
+                ESP_LOGE(TAG, "JPG buffer malloc failed");
+                return false;
+            }
+            o->mem_stream = memory_stream(o->desc->out, jpg_buf_len);
+            stream = &o->mem_stream;
+        }
+        if(!o->encoder.init(stream, o->width, o->height, src_format, comp_params)) {
+            ESP_LOGE(TAG, "JPG encoder init failed");
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool multi_line(multi_encode *m, const uint8_t *src)
+{
+    for(size_t i = 0; i < m->count; i++) {
+        multi_output *o = m->outputs[i];
+        if(o->lines_out == o->height) {
+            continue;
+        }
+        const uint8_t *line = src;
+        if(o->sums) {
+            multi_sum_line(o, m->format, src);
+            if(++o->lines_in < o->desc->scale) {
+                continue;
+            }
+            for(size_t j = 0; j < o->line_len; j++) {
+                o->line[j] = (o->sums[j] * o->recip + 0x8000) >> 16;
+            }
+            memset(o->sums, 0, o->line_len * sizeof(uint16_t));
+            o->lines_in = 0;
+            line = o->line;
+        }
+        if(!o->encoder.process_scanline(line)) {
+            ESP_LOGE(TAG, "JPG process line %u failed", o->lines_out);
+            return false;
+        }
+        o->lines_out++;
+    }
+    return true;
+}
+
+static bool multi_finish(multi_encode *m)
+{
+    for(size_t i = 0; i < m->count; i++) {
+        multi_output *o = m->outputs[i];
+        if(!o->encoder.process_scanline(NULL)) {
+            ESP_LOGE(TAG, "JPG image finish failed");
+            return false;
+        }
+        o->desc->out_len = o->desc->cb ? o->cb_stream.get_size() : o->mem_stream.get_size();
+        o->encoder.deinit();
+    }
+    return true;
+}
+
+// gives the buffered MCU row of a JPEG source to the encoders
+static bool multi_stripe_flush(multi_encode *m)
+{
+    for(uint16_t y = 0; y < m->stripe_rows; y++) {
+        if(!multi_line(m, m->stripe + y * m->stride)) {
+            return false;
+        }
+    }
+    m->stripe_rows = 0;
+    return true;
+}
+
+// keeps one MCU row of decoded BGR pixels, the encoders start with the image size from the decoder
+static bool multi_jpg_write(void * arg, uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint8_t *data)
+{
+    multi_encode *m = (multi_encode *)arg;
+    if(!data) {
+        if(x == 0 && y == 0) {
+            m->stride = w * 3;
+            m->started = multi_start(m, w, h);
+            return m->started;
+        }
+        m->finished = m->started && multi_stripe_flush(m) && multi_finish(m);
+        return m->finished;
+    }
+
+    if(!m->started) {
+        return false;
+    } else if(!m->stripe) {
+        //the first block has the full MCU height, later rows can only be shorter
+        m->stripe_max = h;
+        m->stripe = (uint8_t *)img_ws_malloc(m->workspace, m->stride * h);
+        if(!m->stripe) {
+            ESP_LOGE(TAG, "_malloc failed! %u", (unsigned) (m->stride * h));
+            return false;
+        }
+    } else if(y != m->stripe_y && m->stripe_rows && !multi_stripe_flush(m)) {
+        return false;
+    }
+    if(h > m->stripe_max) {
+        return false;
+    }
+    m->stripe_y = y;
+    m->stripe_rows = h;
+
+    w = w * 3;
+    for(uint16_t iy = 0; iy < h; iy++) {
+        memcpy(m->stripe + iy * m->stride + x * 3, data, w);
+        data += w;
+    }
+    return true;
+}
+
+bool fmt2jpg_multi(uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixformat_t format, jpg_encode_output_t *outputs, size_t count)
+{
+    if(!count) {
+        return false;
+    }
+
+    multi_encode m;
+    memset(&m, 0, sizeof(m));
+    m.workspace = outputs[0].config.workspace;
+    m.count = count;
+    m.format = (format == PIXFORMAT_JPEG) ? PIXFORMAT_RGB888 : format;
+    for(size_t i = 0; i < count; i++) {
+        outputs[i].out = NULL;
+        outputs[i].out_len = 0;
+    }
+
+    bool ok = false;
+    m.outputs = (multi_output **)img_ws_malloc(m.workspace, count * sizeof(multi_output *));
+    if(m.outputs) {
+        memset(m.outputs, 0, count * sizeof(multi_output *));
+        ok = true;
+        for(size_t i = 0; ok && i < count; i++) {
+            void *mem = img_ws_malloc(m.workspace, sizeof(multi_output));
+            m.outputs[i] = mem ? new (mem) multi_output(&outputs[i], m.workspace) : NULL;
+            ok = m.outputs[i] != NULL;
+        }
+        if(!ok) {
+            ESP_LOGE(TAG, "JPG outputs malloc failed");
+        }
+    }
+
+    if(ok && format == PIXFORMAT_JPEG) {
+        ok = esp_jpg_decode_mem(src, src_len, JPG_SCALE_NONE, JPG_PIXEL_BGR888, multi_jpg_write, (void *)&m) == ESP_OK && m.finished;
+    } else if(ok && (ok = multi_start(&m, width, height))) {
+        size_t bpp = (format == PIXFORMAT_GRAYSCALE) ? 1 : (format == PIXFORMAT_RGB888) ? 3 : 2;
+        stripe_prefetch prefetch;
+        bool stream = stripe_prefetch_start(&prefetch, src, width, height, bpp, 16, outputs[0].config.source_read);
+        for(int i = 0; ok && i < height; i++) {
+            ok = multi_line(&m, stream ? stripe_prefetch_line(&prefetch, i) : src + i * width * bpp);
+        }
+        if(stream) {
+            stripe_prefetch_end(&prefetch);
+        }
+        ok = ok && multi_finish(&m);
+    }
+
+    img_ws_free(m.workspace, m.stripe);
+    if(m.outputs) {
+        for(size_t i = 0; i < count; i++) {
+            if(m.outputs[i]) {
+                m.outputs[i]->~multi_output();
+                img_ws_free(m.workspace, m.outputs[i]);
+            }
+        }
+        img_ws_free(m.workspace, m.outputs);
+    }
+    if(!ok) {
+        for(size_t i = 0; i < count; i++) {
+            free(outputs[i].out);
+            outputs[i].out = NULL;
+            outputs[i].out_len = 0;
+        }
+    }
+    return ok;
+}
+
+bool frame2jpg_multi(camera_fb_t * fb, jpg_encode_output_t *outputs, size_t count)
+{
+    return fmt2jpg_multi(fb->buf, fb->len, fb->width, fb->height, fb->format, outputs, count);
+}
+
+size_t img_workspace_size_multi(uint16_t width, uint16_t height, pixformat_t format, const jpg_encode_output_t *outputs, size_t count)
+{
+    size_t size = img_workspace_block_size(count * sizeof(multi_output *));
+    if(format == PIXFORMAT_JPEG) {
+        // the decoded MCU row, at most 16 lines
+        size += img_workspace_block_size(width * 3 * 16);
+        format = PIXFORMAT_RGB888;
+    }
+    for(size_t i = 0; i < count; i++) {
+        uint16_t w, h;
+        jpge::params comp_params;
+        jpge::source_format_t src_format;
+        size_t bpp;
+        if(!multi_output_params(&outputs[i], width, height, format, NULL, &w, &h, &comp_params, &src_format, &bpp)) {
+            return 0;
+        }
+        size += img_workspace_block_size(sizeof(multi_output));
+        if(outputs[i].scale > 1) {
+            size += img_workspace_block_size(w * bpp * sizeof(uint16_t)) + img_workspace_block_size(w * bpp);
+        }
+        size += jpge::jpeg_encoder::get_alloc_size(w, h, src_format, comp_params);
+    }
+    return size;
+}
+
+size_t img_workspace_size(uint16_t width, uint16_t height, pixformat_t format, const jpg_encode_config_t *config)
+{
+    if(format == PIXFORMAT_JPEG) {
+        size_t bmp = jpg2bmp_workspace_size(width), transform = jpg_transform_workspace_size(width, height);
+        return bmp > transform ? bmp : transform;
+    }
+
+    jpg_encode_config_t defaults = JPG_ENCODE_CONFIG_DEFAULT();
+    jpge::params comp_params;
+    jpge::source_format_t src_format;
+    size_t bpp;
+    if(!config) {
+        config = &defaults;
+    }
+    if(!encode_params(format, config, &comp_params, &src_format, &bpp)) {
+        return 0;
+    }
+    // the encoder applies the settings that exclude each other, the rate samples take less than it
+    comp_params.m_two_pass_flag = config->optimize_huffman;
+    comp_params.m_pHuff_tables = config->huffman_tables ? &config->huffman_tables->tables : NULL;
+    comp_params.m_target_size = config->target_size;
+    return jpge::jpeg_encoder::get_alloc_size(width, height, src_format, comp_params);
+}
+
+struct parallel_encode {
+    jpg_encode_job_t *jobs;
+    size_t count;
+    size_t next;                // index of the next job to take
+    SemaphoreHandle_t done;     // given by the worker once it ran out of jobs
+};
+
+static void parallel_encode_jobs(parallel_encode *p)
+{
+    size_t i;
+    while((i = __atomic_fetch_add(&p->next, 1, __ATOMIC_RELAXED)) < p->count) {
+        jpg_encode_job_t *job = &p->jobs[i];
+        job->out = NULL;
+        job->out_len = 0;
+        job->ok = fmt2jpg_ex(job->src, job->src_len, job->width, job->height, job->format, &job->config, &job->out, &job->out_len);
+    }
+}
+
+#if !CONFIG_FREERTOS_UNICORE
+static void parallel_encode_task(void *arg)
+{
+    parallel_encode *p = (parallel_encode *)arg;
+    parallel_encode_jobs(p);
+    xSemaphoreGive(p->done);
+    vTaskDelete(NULL);
+}
+#endif
+
+bool fmt2jpg_parallel(jpg_encode_job_t *jobs, size_t count)
+{
+    parallel_encode p = { jobs, count, 0, NULL };
+
+#if !CONFIG_FREERTOS_UNICORE
+    if(count > 1) {
+        p.done = xSemaphoreCreateBinary();
+        if(p.done && xTaskCreatePinnedToCore(parallel_encode_task, "jpg_encode", PARALLEL_TASK_STACK, &p,
+                                             uxTaskPriorityGet(NULL), NULL, !xPortGetCoreID()) != pdPASS) {
+            ESP_LOGW(TAG, "JPG encode task create failed, encoding on one core");
+            vSemaphoreDelete(p.done);
+            p.done = NULL;
+        }
+    }
+#endif
+
+    parallel_encode_jobs(&p);
+    if(p.done) {
+        xSemaphoreTake(p.done, portMAX_DELAY);
+        vSemaphoreDelete(p.done);
+    }
+
+    bool ok = true;
+    for(size_t i = 0; i < count; i++) {
+        ok = ok && jobs[i].ok;
+    }
+    return ok;
+}
+
+bool fmt2jpg(uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixformat_t format, uint8_t quality, uint8_t ** out, size_t * out_len)
+{
+    jpg_encode_config_t config = JPG_ENCODE_CONFIG_DEFAULT();
+    config.quality = quality;
+    return fmt2jpg_ex(src, src_len, width, height, format, &config, out, out_len);
+}
+
 bool frame2jpg(camera_fb_t * fb, uint8_t quality, uint8_t ** out, size_t * out_len)
 {
     return fmt2jpg(fb->buf, fb->len, fb->width, fb->height, fb->format, quality, out, out_len);
@@ -11,7 +11,9 @@
 // WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
 // See the License for the specific language governing permissions and
 // limitations under the License.
+#include <stddef.h>
 #include "yuv.h"
+#include "img_converters.h"
 #include "esp_attr.h"
 
 typedef struct {
@@ -296,3 +298,84 @@ void IRAM_ATTR yuv2rgb(uint8_t y, uint8_t u, uint8_t v, uint8_t *r, uint8_t *g,
     *g = YUYV_CONSTRAIN(gi);
     *b = YUYV_CONSTRAIN(bi);
 }
+
+// Branchless clamp to 0-255: negative values are masked to 0, values above 255 get all bits set
+static inline uint8_t yuv_clamp(int v)
+{
+    v &= ~(v >> 31);
+    v |= (255 - v) >> 31;
+    return (uint8_t)v;
+}
+
+// Writes the B, G, R bytes of a pixel pair with the table, same output as yuv2rgb()
+static inline void yuv_pair_table(uint8_t *dst, int y0, int u, int y1, int v)
+{
+    const int vr = yuv_table[v].vVr;
+    const int uvg = yuv_table[u].vUg + yuv_table[v].vVg;
+    const int ub = yuv_table[u].vUb;
+    int y = yuv_table[y0].vY;
+    dst[0] = yuv_clamp(y + ub);
+    dst[1] = yuv_clamp(y + uvg);
+    dst[2] = yuv_clamp(y + vr);
+    y = yuv_table[y1].vY;
+    dst[3] = yuv_clamp(y + ub);
+    dst[4] = yuv_clamp(y + uvg);
+    dst[5] = yuv_clamp(y + vr);
+}
+
+// The same conversion in 8-bit fixed point. Like the table, green weights U by 0.813 and V by 0.391,
+// so both give the same colours, within 3 levels.
+static inline void yuv_pair_fixed(uint8_t *dst, int y0, int u, int y1, int v)
+{
+    u -= 128;
+    v -= 128;
+    const int vr = 409 * v;
+    const int uvg = -208 * u - 100 * v;
+    const int ub = 516 * u;
+    int y = 298 * (y0 - 16) + 128;
+    dst[0] = yuv_clamp((y + ub) >> 8);
+    dst[1] = yuv_clamp((y + uvg) >> 8);
+    dst[2] = yuv_clamp((y + vr) >> 8);
+    y = 298 * (y1 - 16) + 128;
+    dst[3] = yuv_clamp((y + ub) >> 8);
+    dst[4] = yuv_clamp((y + uvg) >> 8);
+    dst[5] = yuv_clamp((y + vr) >> 8);
+}
+
+typedef void (*yuv_pair_fn)(uint8_t *dst, int y0, int u, int y1, int v);
+
+// Reads one 32-bit word per pair when src is aligned, the chips and the linux target are little endian.
+// With an odd pixel count the last pixel takes V from the previous pair, or no chroma for a single pixel.
+static inline __attribute__((always_inline)) void yuv422_line(const uint8_t *src, uint8_t *dst, size_t pixels, yuv_pair_fn pair)
+{
+    size_t pairs = pixels / 2;
+    if (((uintptr_t)src & 3) == 0) {
+        const uint32_t *src32 = (const uint32_t *)src;
+        for (; pairs; pairs--, dst += 6) {
+            uint32_t p = *src32++;
+            pair(dst, p & 0xFF, (p >> 8) & 0xFF, (p >> 16) & 0xFF, p >> 24);
+        }
+        src = (const uint8_t *)src32;
+    } else {
+        for (; pairs; pairs--, src += 4, dst += 6) {
+            pair(dst, src[0], src[1], src[2], src[3]);
+        }
+    }
+    if (pixels & 1) {
+        uint8_t last[6];
+        pair(last, src[0], src[1], src[0], pixels > 1 ? src[-1] : 128);
+        dst[0] = last[0];
+        dst[1] = last[1];
+        dst[2] = last[2];
+    }
+}
+
+void IRAM_ATTR yuv422_to_rgb888_line(const uint8_t *src, uint8_t *dst, size_t pixels)
+{
+    yuv422_line(src, dst, pixels, yuv_pair_table);
+}
+
+void IRAM_ATTR yuv422_to_rgb888_line_fixed(const uint8_t *src, uint8_t *dst, size_t pixels)
+{
+    yuv422_line(src, dst, pixels, yuv_pair_fixed);
+}
@@ -31,7 +31,11 @@
 #include "esp32s3/rom/ets_sys.h"
 #endif
 #endif // ESP_IDF_VERSION_MAJOR
+#if CONFIG_IDF_TARGET_LINUX
+#define ESP_CAMERA_ETS_PRINTF printf
+#else
 #define ESP_CAMERA_ETS_PRINTF ets_printf
+#endif
 
 #if CONFIG_CAMERA_TASK_STACK_SIZE
 #define CAM_TASK_STACK             CONFIG_CAMERA_TASK_STACK_SIZE
@@ -87,15 +91,17 @@ static bool cam_get_next_frame(int * frame_pos)
     return false;
 }
 
-static bool cam_start_frame(int * frame_pos)
+static bool cam_start_frame(int * frame_pos, const cam_event_msg_t *vsync)
 {
     if (cam_get_next_frame(frame_pos)) {
         if(ll_cam_start(cam_obj, *frame_pos)){
             // Vsync the frame manually
             ll_cam_do_vsync(cam_obj);
-            uint64_t us = (uint64_t)esp_timer_get_time();
+            // The frame starts at the VSYNC being handled, stamped in the ISR
+            uint64_t us = (uint64_t)vsync->vsync_time;
             cam_obj->frames[*frame_pos].fb.timestamp.tv_sec = us / 1000000UL;
             cam_obj->frames[*frame_pos].fb.timestamp.tv_usec = us % 1000000UL;
+            cam_obj->frames[*frame_pos].fb.frame_id = vsync->vsync_cnt;
             return true;
         }
     }
@@ -104,7 +110,16 @@ static bool cam_start_frame(int * frame_pos)
 
 void IRAM_ATTR ll_cam_send_event(cam_obj_t *cam, cam_event_t cam_event, BaseType_t * HPTaskAwoken)
 {
-    if (xQueueSendFromISR(cam->event_queue, (void *)&cam_event, HPTaskAwoken) != pdTRUE) {
+    cam_event_msg_t msg = {
+        .type = cam_event,
+    };
+    if (cam_event == CAM_VSYNC_EVENT) {
+        // Take the frame time here rather than in cam_task, so queueing delays do not skew it
+        msg.vsync_time = esp_timer_get_time();
+        msg.vsync_cnt = ++cam->vsync_cnt;
+    }
+    if (xQueueSendFromISR(cam->event_queue, (void *)&msg, HPTaskAwoken) != pdTRUE) {
+        cam->stats.event_overflow++;
         ll_cam_stop(cam);
         cam->state = CAM_STATE_IDLE;
         ESP_CAMERA_ETS_PRINTF(DRAM_STR("cam_hal: EV-%s-OVF\r\n"), cam_event==CAM_IN_SUC_EOF_EVENT ? DRAM_STR("EOF") : DRAM_STR("VSYNC"));
@@ -116,24 +131,28 @@ static void cam_task(void *arg)
 {
     int cnt = 0;
     int frame_pos = 0;
+    // set when the current frame did not fit, counted once at its VSYNC
+    bool overflow = false;
     cam_obj->state = CAM_STATE_IDLE;
-    cam_event_t cam_event = 0;
+    cam_event_msg_t msg = {0};
 
     xQueueReset(cam_obj->event_queue);
 
     while (1) {
-        xQueueReceive(cam_obj->event_queue, (void *)&cam_event, portMAX_DELAY);
+        xQueueReceive(cam_obj->event_queue, (void *)&msg, portMAX_DELAY);
+        cam_event_t cam_event = msg.type;
         DBG_PIN_SET(1);
         switch (cam_obj->state) {
 
             case CAM_STATE_IDLE: {
                 if (cam_event == CAM_VSYNC_EVENT) {
                     //DBG_PIN_SET(1);
-                    if(cam_start_frame(&frame_pos)){
+                    if(cam_start_frame(&frame_pos, &msg)){
                         cam_obj->frames[frame_pos].fb.len = 0;
                         cam_obj->state = CAM_STATE_READ_BUF;
                     }
                     cnt = 0;
+                    overflow = false;
                 }
             }
             break;
@@ -146,6 +165,7 @@ static void cam_task(void *arg)
                     if(!cam_obj->psram_mode){
                         if (cam_obj->fb_size < (frame_buffer_event->len + pixels_per_dma)) {
                             ESP_LOGW(TAG, "FB-OVF");
+                            overflow = true;
                             ll_cam_stop(cam_obj);
                             DBG_PIN_SET(0);
                             continue;
@@ -157,6 +177,7 @@ static void cam_task(void *arg)
                     }
                     //Check for JPEG SOI in the first buffer. stop if not found
                     if (cam_obj->jpeg_mode && cnt == 0 && cam_verify_jpeg_soi(frame_buffer_event->buf, frame_buffer_event->len) != 0) {
+                        cam_obj->stats.no_soi++;
                         ll_cam_stop(cam_obj);
                         cam_obj->state = CAM_STATE_IDLE;
                     }
@@ -171,6 +192,7 @@ static void cam_task(void *arg)
                             if (!cam_obj->psram_mode) {
                                 if (cam_obj->fb_size < (frame_buffer_event->len + pixels_per_dma)) {
                                     ESP_LOGW(TAG, "FB-OVF");
+                                    overflow = true;
                                     cnt--;
                                 } else {
                                     frame_buffer_event->len += ll_cam_memcpy(cam_obj,
@@ -193,30 +215,43 @@ static void cam_task(void *arg)
                         } else if (!cam_obj->jpeg_mode) {
                             if (frame_buffer_event->len != cam_obj->fb_size) {
                                 cam_obj->frames[frame_pos].en = 1;
-                                ESP_LOGE(TAG, "FB-SIZE: %u != %u", frame_buffer_event->len, (unsigned) cam_obj->fb_size);
+                                ESP_LOGE(TAG, "FB-SIZE: %u != %u", (unsigned) frame_buffer_event->len, (unsigned) cam_obj->fb_size);
                             }
                         }
                         //send frame
-                        if(!cam_obj->frames[frame_pos].en && xQueueSend(cam_obj->frame_buffer_queue, (void *)&frame_buffer_event, 0) != pdTRUE) {
-                            //pop frame buffer from the queue
-                            camera_fb_t * fb2 = NULL;
-                            if(xQueueReceive(cam_obj->frame_buffer_queue, &fb2, 0) == pdTRUE) {
-                                //push the new frame to the end of the queue
-                                if (xQueueSend(cam_obj->frame_buffer_queue, (void *)&frame_buffer_event, 0) != pdTRUE) {
+                        if(!cam_obj->frames[frame_pos].en) {
+                            if (xQueueSend(cam_obj->frame_buffer_queue, (void *)&frame_buffer_event, 0) == pdTRUE) {
+                                cam_obj->stats.frames_captured++;
+                            } else {
+                                //pop frame buffer from the queue
+                                camera_fb_t * fb2 = NULL;
+                                if(xQueueReceive(cam_obj->frame_buffer_queue, &fb2, 0) == pdTRUE) {
+                                    //push the new frame to the end of the queue
+                                    if (xQueueSend(cam_obj->frame_buffer_queue, (void *)&frame_buffer_event, 0) != pdTRUE) {
+                                        cam_obj->frames[frame_pos].en = 1;
+                                        ESP_LOGE(TAG, "FBQ-SND");
+                                    } else {
+                                        cam_obj->stats.frames_captured++;
+                                    }
+                                    //free the popped buffer
+                                    cam_give(fb2);
+                                } else {
+                                    //queue is full and we could not pop a frame from it
                                     cam_obj->frames[frame_pos].en = 1;
-                                    ESP_LOGE(TAG, "FBQ-SND");
+                                    ESP_LOGE(TAG, "FBQ-RCV");
                                 }
-                                //free the popped buffer
-                                cam_give(fb2);
-                            } else {
-                                //queue is full and we could not pop a frame from it
-                                cam_obj->frames[frame_pos].en = 1;
-                                ESP_LOGE(TAG, "FBQ-RCV");
+                                //either the popped frame or the new one is lost
+                                cam_obj->stats.frames_dropped++;
                             }
                         }
                     }
 
-                    if(!cam_start_frame(&frame_pos)){
+                    if (overflow) {
+                        cam_obj->stats.fb_overflow++;
+                        overflow = false;
+                    }
+
+                    if(!cam_start_frame(&frame_pos, &msg)){
                         cam_obj->state = CAM_STATE_IDLE;
                     } else {
                         cam_obj->frames[frame_pos].fb.len = 0;
@@ -244,12 +279,12 @@ static lldesc_t * allocate_dma_descriptors(uint32_t count, uint16_t size, uint8_
         dma[x].eof = 0;
         dma[x].owner = 1;
         dma[x].buf = (buffer + size * x);
-        dma[x].empty = (uint32_t)&dma[(x + 1) % count];
+        dma[x].empty = (uint32_t)(uintptr_t)&dma[(x + 1) % count];
     }
     return dma;
 }
 
-static esp_err_t cam_dma_config(const camera_config_t *config)
+static esp_err_t cam_dma_config(void)
 {
     bool ret = ll_cam_dma_sizes(cam_obj);
     if (0 == ret) {
@@ -281,7 +316,7 @@ static esp_err_t cam_dma_config(const camera_config_t *config)
     /* Allocate memory for frame buffer */
     size_t alloc_size = fb_size * sizeof(uint8_t) + dma_align;
     uint32_t _caps = MALLOC_CAP_8BIT;
-    if (CAMERA_FB_IN_DRAM == config->fb_location) {
+    if (CAMERA_FB_IN_DRAM == cam_obj->fb_location) {
         _caps |= MALLOC_CAP_INTERNAL;
     } else {
         _caps |= MALLOC_CAP_SPIRAM;
@@ -290,7 +325,7 @@ static esp_err_t cam_dma_config(const camera_config_t *config)
         cam_obj->frames[x].dma = NULL;
         cam_obj->frames[x].fb_offset = 0;
         cam_obj->frames[x].en = 0;
-        ESP_LOGI(TAG, "Allocating %d Byte frame buffer in %s", alloc_size, _caps & MALLOC_CAP_SPIRAM ? "PSRAM" : "OnBoard RAM");
+        ESP_LOGI(TAG, "Allocating %d Byte frame buffer in %s", (int) alloc_size, _caps & MALLOC_CAP_SPIRAM ? "PSRAM" : "OnBoard RAM");
 #if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(4, 3, 0)
         // In IDF v4.2 and earlier, memory returned by heap_caps_aligned_alloc must be freed using heap_caps_aligned_free.
         // And heap_caps_aligned_free is deprecated on v4.3.
@@ -301,9 +336,9 @@ static esp_err_t cam_dma_config(const camera_config_t *config)
         CAM_CHECK(cam_obj->frames[x].fb.buf != NULL, "frame buffer malloc failed", ESP_FAIL);
         if (cam_obj->psram_mode) {
             //align PSRAM buffer. TODO: save the offset so proper address can be freed later
-            cam_obj->frames[x].fb_offset = dma_align - ((uint32_t)cam_obj->frames[x].fb.buf & (dma_align - 1));
+            cam_obj->frames[x].fb_offset = dma_align - ((uintptr_t)cam_obj->frames[x].fb.buf & (dma_align - 1));
             cam_obj->frames[x].fb.buf += cam_obj->frames[x].fb_offset;
-            ESP_LOGI(TAG, "Frame[%d]: Offset: %u, Addr: 0x%08X", x, cam_obj->frames[x].fb_offset, (unsigned) cam_obj->frames[x].fb.buf);
+            ESP_LOGI(TAG, "Frame[%d]: Offset: %u, Addr: 0x%08X", x, (unsigned) cam_obj->frames[x].fb_offset, (unsigned) (uintptr_t) cam_obj->frames[x].fb.buf);
             cam_obj->frames[x].dma = allocate_dma_descriptors(cam_obj->dma_node_cnt, cam_obj->dma_node_buffer_size, cam_obj->frames[x].fb.buf);
             CAM_CHECK(cam_obj->frames[x].dma != NULL, "frame dma malloc failed", ESP_FAIL);
         }
@@ -325,6 +360,57 @@ static esp_err_t cam_dma_config(const camera_config_t *config)
     return ESP_OK;
 }
 
+static void cam_dma_free(void)
+{
+    if (cam_obj->dma) {
+        free(cam_obj->dma);
+        cam_obj->dma = NULL;
+    }
+    if (cam_obj->dma_buffer) {
+        free(cam_obj->dma_buffer);
+        cam_obj->dma_buffer = NULL;
+    }
+    if (cam_obj->frames) {
+        for (int x = 0; x < cam_obj->frame_cnt; x++) {
+            free(cam_obj->frames[x].fb.buf - cam_obj->frames[x].fb_offset);
+            if (cam_obj->frames[x].dma) {
+                free(cam_obj->frames[x].dma);
+            }
+        }
+        free(cam_obj->frames);
+        cam_obj->frames = NULL;
+    }
+}
+
+static esp_err_t cam_event_queue_create(void)
+{
+    size_t queue_size = cam_obj->dma_half_buffer_cnt - 1;
+    if (queue_size == 0) {
+        queue_size = 1;
+    }
+    cam_obj->event_queue = xQueueCreate(queue_size, sizeof(cam_event_msg_t));
+    CAM_CHECK(cam_obj->event_queue != NULL, "event_queue create failed", ESP_FAIL);
+    return ESP_OK;
+}
+
+static esp_err_t cam_task_create(void)
+{
+    BaseType_t ret;
+#if CONFIG_CAMERA_CORE0
+    ret = xTaskCreatePinnedToCore(cam_task, "cam_task", CAM_TASK_STACK, NULL, configMAX_PRIORITIES - 2, &cam_obj->task_handle, 0);
+#elif CONFIG_CAMERA_CORE1
+    ret = xTaskCreatePinnedToCore(cam_task, "cam_task", CAM_TASK_STACK, NULL, configMAX_PRIORITIES - 2, &cam_obj->task_handle, 1);
+#else
+    ret = xTaskCreate(cam_task, "cam_task", CAM_TASK_STACK, NULL, configMAX_PRIORITIES - 2, &cam_obj->task_handle);
+#endif
+    if (ret != pdPASS) {
+        cam_obj->task_handle = NULL;
+        ESP_LOGE(TAG, "cam_task create failed");
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
 esp_err_t cam_init(const camera_config_t *config)
 {
     CAM_CHECK(NULL != config, "config pointer is invalid", ESP_ERR_INVALID_ARG);
@@ -371,6 +457,7 @@ esp_err_t cam_config(const camera_config_t *config, framesize_t frame_size, uint
     cam_obj->psram_mode = (config->xclk_freq_hz == 16000000);
 #endif
     cam_obj->frame_cnt = config->fb_count;
+    cam_obj->fb_location = config->fb_location;
     cam_obj->width = resolution[frame_size].width;
     cam_obj->height = resolution[frame_size].height;
 
@@ -386,15 +473,11 @@ esp_err_t cam_config(const camera_config_t *config, framesize_t frame_size, uint
         cam_obj->fb_size = cam_obj->width * cam_obj->height * cam_obj->fb_bytes_per_pixel;
     }
 
-    ret = cam_dma_config(config);
+    ret = cam_dma_config();
     CAM_CHECK_GOTO(ret == ESP_OK, "cam_dma_config failed", err);
 
-    size_t queue_size = cam_obj->dma_half_buffer_cnt - 1;
-    if (queue_size == 0) {
-        queue_size = 1;
-    }
-    cam_obj->event_queue = xQueueCreate(queue_size, sizeof(cam_event_t));
-    CAM_CHECK_GOTO(cam_obj->event_queue != NULL, "event_queue create failed", err);
+    ret = cam_event_queue_create();
+    CAM_CHECK_GOTO(ret == ESP_OK, "event_queue create failed", err);
 
     size_t frame_buffer_queue_len = cam_obj->frame_cnt;
     if (config->grab_mode == CAMERA_GRAB_LATEST && cam_obj->frame_cnt > 1) {
@@ -406,14 +489,8 @@ esp_err_t cam_config(const camera_config_t *config, framesize_t frame_size, uint
     ret = ll_cam_init_isr(cam_obj);
     CAM_CHECK_GOTO(ret == ESP_OK, "cam intr alloc failed", err);
 
-
-#if CONFIG_CAMERA_CORE0
-    xTaskCreatePinnedToCore(cam_task, "cam_task", CAM_TASK_STACK, NULL, configMAX_PRIORITIES - 2, &cam_obj->task_handle, 0);
-#elif CONFIG_CAMERA_CORE1
-    xTaskCreatePinnedToCore(cam_task, "cam_task", CAM_TASK_STACK, NULL, configMAX_PRIORITIES - 2, &cam_obj->task_handle, 1);
-#else
-    xTaskCreate(cam_task, "cam_task", CAM_TASK_STACK, NULL, configMAX_PRIORITIES - 2, &cam_obj->task_handle);
-#endif
+    ret = cam_task_create();
+    CAM_CHECK_GOTO(ret == ESP_OK, "cam_task create failed", err);
 
     ESP_LOGI(TAG, "cam config ok");
     return ESP_OK;
@@ -442,21 +519,7 @@ esp_err_t cam_deinit(void)
 
     ll_cam_deinit(cam_obj);
 
-    if (cam_obj->dma) {
-        free(cam_obj->dma);
-    }
-    if (cam_obj->dma_buffer) {
-        free(cam_obj->dma_buffer);
-    }
-    if (cam_obj->frames) {
-        for (int x = 0; x < cam_obj->frame_cnt; x++) {
-            free(cam_obj->frames[x].fb.buf - cam_obj->frames[x].fb_offset);
-            if (cam_obj->frames[x].dma) {
-                free(cam_obj->frames[x].dma);
-            }
-        }
-        free(cam_obj->frames);
-    }
+    cam_dma_free();
 
     free(cam_obj);
     cam_obj = NULL;
@@ -474,6 +537,26 @@ void cam_start(void)
     ll_cam_vsync_intr_enable(cam_obj, true);
 }
 
+static void cam_set_taken(camera_fb_t *dma_buffer)
+{
+    for (int x = 0; x < cam_obj->frame_cnt; x++) {
+        if (&cam_obj->frames[x].fb == dma_buffer) {
+            cam_obj->frames[x].taken = 1;
+            break;
+        }
+    }
+}
+
+static bool cam_any_taken(void)
+{
+    for (int x = 0; x < cam_obj->frame_cnt; x++) {
+        if (cam_obj->frames[x].taken) {
+            return true;
+        }
+    }
+    return false;
+}
+
 camera_fb_t *cam_take(TickType_t timeout)
 {
     camera_fb_t *dma_buffer = NULL;
@@ -496,9 +579,13 @@ camera_fb_t *cam_take(TickType_t timeout)
             if (offset_e >= 0) {
                 // adjust buffer length
                 dma_buffer->len = offset_e + sizeof(JPEG_EOI_MARKER);
+                cam_obj->stats.jpeg_frames++;
+                cam_obj->stats.jpeg_bytes += dma_buffer->len;
+                cam_set_taken(dma_buffer);
                 return dma_buffer;
             } else {
                 ESP_LOGW(TAG, "NO-EOI");
+                cam_obj->stats.no_eoi++;
                 cam_give(dma_buffer);
                 TickType_t ticks_spent = xTaskGetTickCount() - start;
                 if (ticks_spent >= timeout) {
@@ -510,6 +597,7 @@ camera_fb_t *cam_take(TickType_t timeout)
             //currently this is used only for YUV to GRAYSCALE
             dma_buffer->len = ll_cam_memcpy(cam_obj, dma_buffer->buf, dma_buffer->buf, dma_buffer->len);
         }
+        cam_set_taken(dma_buffer);
         return dma_buffer;
     } else {
         ESP_LOGW(TAG, "Failed to get the frame on time!");
@@ -524,6 +612,7 @@ void cam_give(camera_fb_t *dma_buffer)
 {
     for (int x = 0; x < cam_obj->frame_cnt; x++) {
         if (&cam_obj->frames[x].fb == dma_buffer) {
+            cam_obj->frames[x].taken = 0;
             cam_obj->frames[x].en = 1;
             break;
         }
@@ -532,6 +621,87 @@ void cam_give(camera_fb_t *dma_buffer)
 
 void cam_give_all(void) {
     for (int x = 0; x < cam_obj->frame_cnt; x++) {
+        cam_obj->frames[x].taken = 0;
         cam_obj->frames[x].en = 1;
     }
 }
+
+void cam_get_stats(camera_stats_t *stats)
+{
+    cam_stats_t *st = &cam_obj->stats;
+    stats->frames_captured = st->frames_captured;
+    stats->frames_dropped = st->frames_dropped;
+    stats->fb_overflow = st->fb_overflow;
+    stats->no_soi = st->no_soi;
+    stats->no_eoi = st->no_eoi;
+    stats->event_overflow = st->event_overflow;
+    stats->jpeg_frames = st->jpeg_frames;
+    stats->jpeg_avg_size = st->jpeg_frames ? (uint32_t)(st->jpeg_bytes / st->jpeg_frames) : 0;
+}
+
+void cam_reset_stats(void)
+{
+    memset(&cam_obj->stats, 0, sizeof(cam_stats_t));
+}
+
+size_t cam_get_jpeg_fb_size(void)
+{
+    if (!cam_obj || !cam_obj->jpeg_mode) {
+        return 0;
+    }
+    return cam_obj->recv_size;
+}
+
+size_t cam_get_fb_count(void)
+{
+    return cam_obj ? cam_obj->frame_cnt : 0;
+}
+
+esp_err_t cam_set_jpeg_fb_size(size_t size)
+{
+    CAM_CHECK(cam_obj && cam_obj->jpeg_mode, "JPEG mode is not active", ESP_ERR_INVALID_STATE);
+    CAM_CHECK(size > 0, "invalid frame buffer size", ESP_ERR_INVALID_ARG);
+    // The buffers are freed below, so none may still be held by the application
+    CAM_CHECK(!cam_any_taken(), "frame buffers are still in use", ESP_ERR_INVALID_STATE);
+
+    if (size == cam_obj->recv_size) {
+        return ESP_OK;
+    }
+
+    // Stop capturing and let cam_task drain the pending events before tearing it down
+    cam_stop();
+    vTaskDelay(10 / portTICK_PERIOD_MS);
+    vTaskDelete(cam_obj->task_handle);
+    cam_obj->task_handle = NULL;
+    xQueueReset(cam_obj->frame_buffer_queue);
+    cam_dma_free();
+
+    size_t old_size = cam_obj->recv_size;
+    esp_err_t ret = ESP_OK;
+    cam_obj->recv_size = size;
+    cam_obj->fb_size = size;
+    if (cam_dma_config() != ESP_OK) {
+        ESP_LOGW(TAG, "JPEG frame buffer resize to %u failed, restoring %u", (unsigned) size, (unsigned) old_size);
+        cam_dma_free();
+        cam_obj->recv_size = old_size;
+        cam_obj->fb_size = old_size;
+        CAM_CHECK(cam_dma_config() == ESP_OK, "cam_dma_config failed", ESP_FAIL);
+        ret = ESP_ERR_NO_MEM;
+    }
+
+    // The event queue is sized from the DMA buffers. Keep the old one if a new one can't be made,
+    // a shorter queue only makes EV-OVF more likely.
+    QueueHandle_t event_queue = cam_obj->event_queue;
+    if (cam_event_queue_create() == ESP_OK) {
+        vQueueDelete(event_queue);
+    } else {
+        ESP_LOGW(TAG, "Keeping the previous event queue");
+        cam_obj->event_queue = event_queue;
+        xQueueReset(event_queue);
+    }
+    CAM_CHECK(cam_task_create() == ESP_OK, "cam_task create failed, the camera must be deinitialized", ESP_FAIL);
+    cam_start();
+
+    ESP_LOGI(TAG, "JPEG frame buffer size: %u", (unsigned) cam_obj->recv_size);
+    return ret;
+}
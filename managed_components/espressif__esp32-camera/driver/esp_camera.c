@@ -88,6 +88,7 @@ typedef struct {
 
 static const char *CAMERA_SENSOR_NVS_KEY = "sensor";
 static const char *CAMERA_PIXFORMAT_NVS_KEY = "pixformat";
+static const char *CAMERA_FB_SIZE_NVS_KEY = "fb_size";
 static camera_state_t *s_state = NULL;
 
 #if CONFIG_IDF_TARGET_ESP32S3 // LCD_CAM module of ESP32-S3 will generate xclk
@@ -412,9 +413,12 @@ esp_err_t esp_camera_save_to_nvs(const char *key)
                 uint8_t pf = s->pixformat;
                 ret = nvs_set_u8(handle, CAMERA_PIXFORMAT_NVS_KEY, pf);
             }
-            return ret;
+            size_t fb_size = cam_get_jpeg_fb_size();
+            if (ret == ESP_OK && fb_size) {
+                ret = nvs_set_u32(handle, CAMERA_FB_SIZE_NVS_KEY, fb_size);
+            }
         } else {
-            return ESP_ERR_CAMERA_NOT_DETECTED;
+            ret = ESP_ERR_CAMERA_NOT_DETECTED;
         }
         nvs_close(handle);
         return ret;
@@ -472,6 +476,11 @@ esp_err_t esp_camera_load_from_nvs(const char *key)
             if (ret == ESP_OK) {
                 s->set_pixformat(s, pf);
             }
+            uint32_t fb_size;
+            if (ret == ESP_OK && cam_get_jpeg_fb_size() &&
+                nvs_get_u32(handle, CAMERA_FB_SIZE_NVS_KEY, &fb_size) == ESP_OK) {
+                ret = cam_set_jpeg_fb_size(fb_size);
+            }
         } else {
             return ESP_ERR_CAMERA_NOT_DETECTED;
         }
@@ -490,3 +499,107 @@ void esp_camera_return_all(void) {
     cam_give_all();
 }
 
+esp_err_t esp_camera_get_stats(camera_stats_t *stats)
+{
+    if (stats == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (s_state == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    cam_get_stats(stats);
+    return ESP_OK;
+}
+
+void esp_camera_reset_stats(void)
+{
+    if (s_state == NULL) {
+        return;
+    }
+    cam_reset_stats();
+}
+
+size_t esp_camera_get_jpeg_fb_size(void)
+{
+    if (s_state == NULL) {
+        return 0;
+    }
+    return cam_get_jpeg_fb_size();
+}
+
+esp_err_t esp_camera_set_jpeg_fb_size(size_t size)
+{
+    if (s_state == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    return cam_set_jpeg_fb_size(size);
+}
+
+static int calibration_cmp(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+esp_err_t esp_camera_calibrate_jpeg_fb_size(size_t frame_count, uint8_t percentile, uint8_t headroom, size_t *fb_size)
+{
+    if (frame_count == 0 || percentile == 0 || percentile > 100) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    size_t cur_size = esp_camera_get_jpeg_fb_size();
+    if (cur_size == 0) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    uint32_t *lens = (uint32_t *)malloc(frame_count * sizeof(uint32_t));
+    if (lens == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    // Frames already in the queue may have been captured with older settings
+    for (size_t i = 0; i < cam_get_fb_count(); i++) {
+        camera_fb_t *fb = esp_camera_fb_get();
+        if (fb) {
+            esp_camera_fb_return(fb);
+        }
+    }
+
+    camera_stats_t stats;
+    cam_get_stats(&stats);
+    uint32_t lost = stats.fb_overflow + stats.no_eoi;
+    size_t n = 0;
+    esp_err_t ret = ESP_OK;
+    while (n < frame_count) {
+        camera_fb_t *fb = esp_camera_fb_get();
+        if (fb == NULL) {
+            ret = ESP_ERR_TIMEOUT;
+            break;
+        }
+        lens[n++] = fb->len;
+        esp_camera_fb_return(fb);
+
+        // Frames that did not fit are at least as large as the current buffer
+        cam_get_stats(&stats);
+        while (lost < stats.fb_overflow + stats.no_eoi && n < frame_count) {
+            lens[n++] = cur_size;
+            lost++;
+        }
+    }
+
+    if (ret == ESP_OK) {
+        qsort(lens, n, sizeof(uint32_t), calibration_cmp);
+        size_t size = lens[(n - 1) * percentile / 100];
+        size = size * (100 + headroom) / 100;
+        size = (size + 1023) & ~1023;
+        ESP_LOGI(TAG, "JPEG frames: min %u, max %u, p%u %u, new fb size %u (was %u)",
+                 (unsigned) lens[0], (unsigned) lens[n - 1], percentile, (unsigned) lens[(n - 1) * percentile / 100],
+                 (unsigned) size, (unsigned) cur_size);
+        ret = cam_set_jpeg_fb_size(size);
+        if (fb_size) {
+            *fb_size = cam_get_jpeg_fb_size();
+        }
+    }
+    free(lens);
+    return ret;
+}
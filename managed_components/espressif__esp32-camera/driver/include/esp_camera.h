@@ -67,10 +67,16 @@
 #pragma once
 
 #include "esp_err.h"
-#include "driver/ledc.h"
 #include "sensor.h"
 #include "sys/time.h"
 #include "sdkconfig.h"
+#if CONFIG_IDF_TARGET_LINUX
+// XCLK is not generated by the simulator, only the types of the config fields are needed
+typedef int ledc_timer_t;
+typedef int ledc_channel_t;
+#else
+#include "driver/ledc.h"
+#endif
 
 /**
  * @brief define for if chip supports camera
@@ -166,9 +172,24 @@ typedef struct {
     size_t width;               /*!< Width of the buffer in pixels */
     size_t height;              /*!< Height of the buffer in pixels */
     pixformat_t format;         /*!< Format of the pixel data */
-    struct timeval timestamp;   /*!< Timestamp since boot of the first DMA buffer of the frame */
+    struct timeval timestamp;   /*!< Timestamp since boot of the VSYNC that started the frame, taken in the ISR */
+    uint32_t frame_id;          /*!< Sequence number of the VSYNC that started the frame. Gaps mean sensor frames that were not delivered */
 } camera_fb_t;
 
+/**
+ * @brief Frame capture and loss counters of the camera driver
+ */
+typedef struct {
+    uint32_t frames_captured;   /*!< Frames pushed to the frame buffer queue */
+    uint32_t frames_dropped;    /*!< Frames discarded because the frame buffer queue was full */
+    uint32_t fb_overflow;       /*!< Frames that did not fit in the frame buffer (FB-OVF) */
+    uint32_t no_soi;            /*!< JPEG frames discarded because the SOI marker was missing (NO-SOI) */
+    uint32_t no_eoi;            /*!< JPEG frames discarded because the EOI marker was missing (NO-EOI) */
+    uint32_t event_overflow;    /*!< VSYNC/EOF events lost because the event queue was full (EV-OVF) */
+    uint32_t jpeg_frames;       /*!< JPEG frames returned by esp_camera_fb_get() */
+    uint32_t jpeg_avg_size;     /*!< Average length in bytes of the returned JPEG frames */
+} camera_stats_t;
+
 #define ESP_ERR_CAMERA_BASE 0x20000
 #define ESP_ERR_CAMERA_NOT_DETECTED             (ESP_ERR_CAMERA_BASE + 1)
 #define ESP_ERR_CAMERA_FAILED_TO_SET_FRAME_SIZE (ESP_ERR_CAMERA_BASE + 2)
@@ -226,6 +247,8 @@ sensor_t * esp_camera_sensor_get(void);
 /**
  * @brief Save camera settings to non-volatile-storage (NVS)
  *
+ * In JPEG mode the current frame buffer size is saved as well.
+ *
  * @param key   A unique nvs key name for the camera settings
  */
 esp_err_t esp_camera_save_to_nvs(const char *key);
@@ -233,6 +256,8 @@ esp_err_t esp_camera_save_to_nvs(const char *key);
 /**
  * @brief Load camera settings from non-volatile-storage (NVS)
  *
+ * In JPEG mode a saved frame buffer size is applied with esp_camera_set_jpeg_fb_size().
+ *
  * @param key   A unique nvs key name for the camera settings
  */
 esp_err_t esp_camera_load_from_nvs(const char *key);
@@ -242,6 +267,68 @@ esp_err_t esp_camera_load_from_nvs(const char *key);
  */
 void esp_camera_return_all(void);
 
+/**
+ * @brief Get a snapshot of the driver frame counters
+ *
+ * @param stats   Structure to be filled with the current counters
+ *
+ * @return
+ *      - ESP_OK on success
+ *      - ESP_ERR_INVALID_ARG if stats is NULL
+ *      - ESP_ERR_INVALID_STATE if the driver hasn't been initialized yet
+ */
+esp_err_t esp_camera_get_stats(camera_stats_t *stats);
+
+/**
+ * @brief Reset all driver frame counters to zero
+ */
+void esp_camera_reset_stats(void);
+
+/**
+ * @brief Get the size of each JPEG frame buffer
+ *
+ * @return size in bytes, 0 if the driver is not initialized or not in JPEG mode
+ */
+size_t esp_camera_get_jpeg_fb_size(void);
+
+/**
+ * @brief Reallocate the JPEG frame buffers with a new size
+ *
+ * @note Capture is stopped while the buffers are reallocated and all frame buffers
+ *       must have been returned before calling this function.
+ *
+ * @param size  New size of each frame buffer in bytes
+ *
+ * @return
+ *      - ESP_OK on success
+ *      - ESP_ERR_INVALID_STATE if the driver is not initialized, not in JPEG mode or a frame buffer is still held
+ *      - ESP_ERR_NO_MEM if the new buffers could not be allocated (the previous size is kept)
+ *      - ESP_FAIL if capture could not be restarted, the camera must then be deinitialized
+ */
+esp_err_t esp_camera_set_jpeg_fb_size(size_t size);
+
+/**
+ * @brief Size the JPEG frame buffers from the frames the sensor actually produces
+ *
+ * Captures frame_count frames with the current sensor settings, takes the given percentile
+ * of their lengths, adds headroom percent on top and reallocates the frame buffers to
+ * that size. Frames lost to FB-OVF or NO-EOI during calibration count as full buffers.
+ * Use esp_camera_save_to_nvs() to keep the result across reboots.
+ *
+ * @param frame_count   Number of frames to observe
+ * @param percentile    Percentile of the observed lengths to cover (1-100)
+ * @param headroom      Extra space in percent added to the percentile
+ * @param fb_size       Optional, set to the resulting frame buffer size
+ *
+ * @return
+ *      - ESP_OK on success
+ *      - ESP_ERR_INVALID_ARG if an argument is out of range
+ *      - ESP_ERR_INVALID_STATE if the driver is not initialized or not in JPEG mode
+ *      - ESP_ERR_TIMEOUT if a frame could not be captured
+ *      - ESP_ERR_NO_MEM if the new buffers could not be allocated
+ */
+esp_err_t esp_camera_calibrate_jpeg_fb_size(size_t frame_count, uint8_t percentile, uint8_t headroom, size_t *fb_size);
+
 
 #ifdef __cplusplus
 }
@@ -57,6 +57,16 @@ void cam_give(camera_fb_t *dma_buffer);
 
 void cam_give_all(void);
 
+void cam_get_stats(camera_stats_t *stats);
+
+void cam_reset_stats(void);
+
+size_t cam_get_fb_count(void);
+
+size_t cam_get_jpeg_fb_size(void);
+
+esp_err_t cam_set_jpeg_fb_size(size_t size);
+
 #ifdef __cplusplus
 }
 #endif
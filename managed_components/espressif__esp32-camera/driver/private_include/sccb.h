@@ -9,6 +9,27 @@
 #ifndef __SCCB_H__
 #define __SCCB_H__
 #include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/* Most registers written in one transaction by SCCB_Write_Burst() and the table writes */
+#define SCCB_BURST_MAX 32
+
+/* Registers recorded by a mode switch before they are written, and the last values kept per register */
+#define SCCB_MODE_MAX_REGS 64
+
+/* The register writes of a sensor mode switch, and the values earlier switches left in those registers */
+typedef struct {
+    uint16_t record[SCCB_MODE_MAX_REGS][2]; /* writes of the switch in progress, in order */
+    uint16_t known[SCCB_MODE_MAX_REGS][2];  /* registers written by earlier switches and their value now */
+    uint8_t record_count;
+    uint8_t known_count;
+    uint8_t slv_addr;
+    bool addr16;
+    bool recording;
+    int error;
+} sccb_mode_t;
+
 int SCCB_Init(int pin_sda, int pin_scl);
 int SCCB_Use_Port(int sccb_i2c_port);
 int SCCB_Deinit(void);
@@ -19,4 +40,26 @@ uint8_t SCCB_Read16(uint8_t slv_addr, uint16_t reg);
 int SCCB_Write16(uint8_t slv_addr, uint16_t reg, uint8_t data);
 uint16_t SCCB_Read_Addr16_Val16(uint8_t slv_addr, uint16_t reg);
 int SCCB_Write_Addr16_Val16(uint8_t slv_addr, uint16_t reg, uint16_t data);
+/* One write transaction of up to SCCB_BURST_MAX bytes to reg and the following registers,
+ * for sensors that increment the register address after each byte */
+int SCCB_Write_Multi(uint8_t slv_addr, uint8_t reg, const uint8_t *data, size_t len);
+int SCCB_Write16_Multi(uint8_t slv_addr, uint16_t reg, const uint8_t *data, size_t len);
+/* Writes len consecutive registers in as few transactions as CONFIG_SCCB_BURST_WRITE allows */
+int SCCB_Write_Burst(uint8_t slv_addr, uint8_t reg, const uint8_t *data, size_t len);
+int SCCB_Write16_Burst(uint8_t slv_addr, uint16_t reg, const uint8_t *data, size_t len);
+/* Writes count {reg, value} pairs in order, each run of consecutive registers with SCCB_Write_Burst() */
+int SCCB_Write_Regs(uint8_t slv_addr, const uint8_t (*regs)[2], size_t count);
+int SCCB_Write16_Regs(uint8_t slv_addr, const uint16_t (*regs)[2], size_t count);
+/* Forgets the known register values, at sensor init and after a reset */
+void SCCB_Mode_Init(sccb_mode_t *mode, uint8_t slv_addr, bool addr16);
+/* Records the writes passed to SCCB_Mode_Write() until SCCB_Mode_End() */
+void SCCB_Mode_Begin(sccb_mode_t *mode);
+/* Returns true if the writes were recorded, else they must be sent and the known values are updated.
+ * Once sending a full record has failed, the writes of the switch are dropped */
+bool SCCB_Mode_Write(sccb_mode_t *mode, uint16_t reg, const uint8_t *data, size_t len);
+bool SCCB_Mode_Write_Regs(sccb_mode_t *mode, const uint16_t (*regs)[2], size_t count);
+/* Returns true with the value of a register recorded by the switch in progress */
+bool SCCB_Mode_Read(const sccb_mode_t *mode, uint16_t reg, uint8_t *value);
+/* Sends the recorded writes in order, except those of registers that already hold the value */
+int SCCB_Mode_End(sccb_mode_t *mode);
 #endif // __SCCB_H__
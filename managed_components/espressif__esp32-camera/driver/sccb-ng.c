@@ -307,6 +307,50 @@ int SCCB_Write16(uint8_t slv_addr, uint16_t reg, uint8_t data)
     return ret == ESP_OK ? 0 : -1;
 }
 
+int SCCB_Write_Multi(uint8_t slv_addr, uint8_t reg, const uint8_t *data, size_t len)
+{
+    i2c_master_dev_handle_t dev_handle = *(get_handle_from_address(slv_addr));
+
+    uint8_t tx_buffer[1 + SCCB_BURST_MAX];
+    if (len > SCCB_BURST_MAX)
+    {
+        return -1;
+    }
+    tx_buffer[0] = reg;
+    memcpy(tx_buffer + 1, data, len);
+
+    esp_err_t ret = i2c_master_transmit(dev_handle, tx_buffer, 1 + len, TIMEOUT_MS);
+
+    if (ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "SCCB_Write_Multi Failed addr:0x%02x, reg:0x%02x, len:%u, ret:%d", slv_addr, reg, (unsigned)len, ret);
+    }
+
+    return ret == ESP_OK ? 0 : -1;
+}
+
+int SCCB_Write16_Multi(uint8_t slv_addr, uint16_t reg, const uint8_t *data, size_t len)
+{
+    i2c_master_dev_handle_t dev_handle = *(get_handle_from_address(slv_addr));
+
+    uint8_t tx_buffer[2 + SCCB_BURST_MAX];
+    if (len > SCCB_BURST_MAX)
+    {
+        return -1;
+    }
+    tx_buffer[0] = reg >> 8;
+    tx_buffer[1] = reg & 0x00ff;
+    memcpy(tx_buffer + 2, data, len);
+
+    esp_err_t ret = i2c_master_transmit(dev_handle, tx_buffer, 2 + len, TIMEOUT_MS);
+
+    if (ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "W [%04x] x%u fail\n", reg, (unsigned)len);
+    }
+    return ret == ESP_OK ? 0 : -1;
+}
+
 uint16_t SCCB_Read_Addr16_Val16(uint8_t slv_addr, uint16_t reg)
 {
     i2c_master_dev_handle_t dev_handle = *(get_handle_from_address(slv_addr));
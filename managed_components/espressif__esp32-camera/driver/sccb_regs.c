@@ -0,0 +1,231 @@
+/*
+ * Register table writes on top of the SCCB drivers.
+ *
+ * Sensor tables mostly set runs of consecutive registers. Each run is sent as
+ * one write transaction, the register address followed by the values, which
+ * sensors that auto-increment the address store in order. This saves the
+ * device address, register address, start and stop of every register after the
+ * first, and the driver call around them.
+ */
+#include <stdbool.h>
+#include <string.h>
+#include "sccb.h"
+#include "sdkconfig.h"
+#if defined(ARDUINO_ARCH_ESP32) && defined(CONFIG_ARDUHAL_ESP_LOG)
+#include "esp32-hal-log.h"
+#else
+#include "esp_log.h"
+static const char *TAG = "sccb regs";
+#endif
+
+int SCCB_Write_Burst(uint8_t slv_addr, uint8_t reg, const uint8_t *data, size_t len)
+{
+    for (size_t i = 0; i < len;) {
+#if CONFIG_SCCB_BURST_WRITE
+        size_t n = len - i < SCCB_BURST_MAX ? len - i : SCCB_BURST_MAX;
+        int ret = n > 1 ? SCCB_Write_Multi(slv_addr, reg + i, data + i, n) : SCCB_Write(slv_addr, reg + i, data[i]);
+#else
+        size_t n = 1;
+        int ret = SCCB_Write(slv_addr, reg + i, data[i]);
+#endif
+        if (ret) {
+            return ret;
+        }
+        i += n;
+    }
+    return 0;
+}
+
+int SCCB_Write16_Burst(uint8_t slv_addr, uint16_t reg, const uint8_t *data, size_t len)
+{
+    for (size_t i = 0; i < len;) {
+#if CONFIG_SCCB_BURST_WRITE
+        size_t n = len - i < SCCB_BURST_MAX ? len - i : SCCB_BURST_MAX;
+        int ret = n > 1 ? SCCB_Write16_Multi(slv_addr, reg + i, data + i, n) : SCCB_Write16(slv_addr, reg + i, data[i]);
+#else
+        size_t n = 1;
+        int ret = SCCB_Write16(slv_addr, reg + i, data[i]);
+#endif
+        if (ret) {
+            return ret;
+        }
+        i += n;
+    }
+    return 0;
+}
+
+int SCCB_Write_Regs(uint8_t slv_addr, const uint8_t (*regs)[2], size_t count)
+{
+    uint8_t data[SCCB_BURST_MAX];
+    for (size_t i = 0; i < count;) {
+        size_t n = 0;
+        do {
+            data[n] = regs[i + n][1];
+            n++;
+        } while (i + n < count && n < SCCB_BURST_MAX && regs[i + n][0] == regs[i][0] + n);
+        int ret = SCCB_Write_Burst(slv_addr, regs[i][0], data, n);
+        if (ret) {
+            return ret;
+        }
+        i += n;
+    }
+    return 0;
+}
+
+int SCCB_Write16_Regs(uint8_t slv_addr, const uint16_t (*regs)[2], size_t count)
+{
+    uint8_t data[SCCB_BURST_MAX];
+    for (size_t i = 0; i < count;) {
+        size_t n = 0;
+        do {
+            data[n] = regs[i + n][1];
+            n++;
+        } while (i + n < count && n < SCCB_BURST_MAX && regs[i + n][0] == regs[i][0] + n);
+        int ret = SCCB_Write16_Burst(slv_addr, regs[i][0], data, n);
+        if (ret) {
+            return ret;
+        }
+        i += n;
+    }
+    return 0;
+}
+
+/*
+ * Mode switches. A sensor driver records the register writes of a switch
+ * instead of sending them, then sends only those that change a register
+ * from the value a previous switch, or a later write of the driver, left in
+ * it. A register written more than once by a switch, like a reset or a
+ * trigger, is always sent. The known values are only kept for registers a
+ * switch wrote, the sensor must not change them on its own.
+ */
+static int mode_find(const uint16_t (*regs)[2], int count, uint16_t reg)
+{
+    for (int i = count - 1; i >= 0; i--) {
+        if (regs[i][0] == reg) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void mode_update(sccb_mode_t *mode, uint16_t reg, uint8_t value, bool add)
+{
+    int k = mode_find(mode->known, mode->known_count, reg);
+    if (k >= 0) {
+        mode->known[k][1] = value;
+    } else if (add && mode->known_count < SCCB_MODE_MAX_REGS) {
+        mode->known[mode->known_count][0] = reg;
+        mode->known[mode->known_count][1] = value;
+        mode->known_count++;
+    }
+}
+
+static int mode_flush(sccb_mode_t *mode)
+{
+    int count = 0;
+    for (int i = 0; i < mode->record_count; i++) {
+        uint16_t reg = mode->record[i][0];
+        uint8_t value = mode->record[i][1];
+        int k = mode_find(mode->known, mode->known_count, reg);
+        bool once = mode_find(mode->record, i, reg) < 0 && mode_find(mode->record + i + 1, mode->record_count - i - 1, reg) < 0;
+        if (!once || k < 0 || mode->known[k][1] != value) {
+            // compacted in place, the writes keep their order
+            mode->record[count][0] = reg;
+            mode->record[count][1] = value;
+            count++;
+        }
+        mode_update(mode, reg, value, true);
+    }
+    int skipped = mode->record_count - count;
+    mode->record_count = 0;
+
+    int ret = 0;
+    if (mode->addr16) {
+        ret = SCCB_Write16_Regs(mode->slv_addr, mode->record, count);
+    } else {
+        uint8_t regs[SCCB_MODE_MAX_REGS][2];
+        for (int i = 0; i < count; i++) {
+            regs[i][0] = mode->record[i][0];
+            regs[i][1] = mode->record[i][1];
+        }
+        ret = SCCB_Write_Regs(mode->slv_addr, (const uint8_t (*)[2]) regs, count);
+    }
+    if (ret) {
+        // the registers may hold anything now
+        mode->known_count = 0;
+    }
+    ESP_LOGD(TAG, "Mode switch wrote %d registers, %d were unchanged", count, skipped);
+    return ret;
+}
+
+void SCCB_Mode_Init(sccb_mode_t *mode, uint8_t slv_addr, bool addr16)
+{
+    memset(mode, 0, sizeof(*mode));
+    mode->slv_addr = slv_addr;
+    mode->addr16 = addr16;
+}
+
+void SCCB_Mode_Begin(sccb_mode_t *mode)
+{
+    mode->record_count = 0;
+    mode->error = 0;
+    mode->recording = true;
+}
+
+bool SCCB_Mode_Write(sccb_mode_t *mode, uint16_t reg, const uint8_t *data, size_t len)
+{
+    if (!mode->recording) {
+        for (size_t i = 0; i < len; i++) {
+            mode_update(mode, reg + i, data[i], false);
+        }
+        return false;
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (mode->record_count == SCCB_MODE_MAX_REGS && !mode->error) {
+            mode->error = mode_flush(mode);
+        }
+        if (mode->error) {
+            // the switch has failed, SCCB_Mode_End() returns the error and the rest is dropped
+            continue;
+        }
+        mode->record[mode->record_count][0] = reg + i;
+        mode->record[mode->record_count][1] = data[i];
+        mode->record_count++;
+    }
+    return true;
+}
+
+bool SCCB_Mode_Write_Regs(sccb_mode_t *mode, const uint16_t (*regs)[2], size_t count)
+{
+    if (!mode->recording) {
+        for (size_t i = 0; i < count; i++) {
+            mode_update(mode, regs[i][0], regs[i][1], false);
+        }
+        return false;
+    }
+    for (size_t i = 0; i < count; i++) {
+        uint8_t value = regs[i][1];
+        SCCB_Mode_Write(mode, regs[i][0], &value, 1);
+    }
+    return true;
+}
+
+bool SCCB_Mode_Read(const sccb_mode_t *mode, uint16_t reg, uint8_t *value)
+{
+    int i = mode->recording ? mode_find(mode->record, mode->record_count, reg) : -1;
+    if (i >= 0) {
+        *value = mode->record[i][1];
+    }
+    return i >= 0;
+}
+
+int SCCB_Mode_End(sccb_mode_t *mode)
+{
+    int ret = mode->error;
+    if (!ret) {
+        ret = mode_flush(mode);
+    }
+    mode->record_count = 0;
+    mode->recording = false;
+    return ret;
+}
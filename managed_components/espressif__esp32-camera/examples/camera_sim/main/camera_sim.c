@@ -0,0 +1,194 @@
+/**
+ * This example runs the camera driver on the linux target against the camera
+ * simulator. It replays the test pictures, prints the frame rate and the driver
+ * statistics, then injects each fault once and checks that the driver reports it.
+ * An OV5640 is put on the simulated SCCB bus, so its driver runs during init and
+ * frame size switches. The register writes and SCCB transactions of both are
+ * printed, the output size registers are checked after each switch, and the
+ * time until the first frame started after the switch is measured.
+ * The process exits with a non-zero status on failure, so it can be run on CI.
+ */
+
+#include <esp_log.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+
+#include "esp_camera.h"
+#include "esp_camera_sim.h"
+
+#define BENCHMARK_FRAMES 100
+
+static const char *TAG = "example:camera_sim";
+
+static const char *frame_files[] = {
+    PICTURES_DIR "/testimg.jpeg",
+    PICTURES_DIR "/test_inside.jpeg",
+    PICTURES_DIR "/test_outside.jpeg",
+};
+
+static camera_config_t camera_config = {
+    .pin_pwdn = -1,
+    .pin_reset = -1,
+    .pin_xclk = -1,
+    .pin_sccb_sda = -1,
+    .pin_sccb_scl = -1,
+    .pin_vsync = -1,
+
+    .xclk_freq_hz = 20000000,
+    .pixel_format = PIXFORMAT_JPEG,
+    .frame_size = FRAMESIZE_SVGA,
+
+    .jpeg_quality = 12,
+    .fb_count = 2,
+    .fb_location = CAMERA_FB_IN_DRAM,
+    .grab_mode = CAMERA_GRAB_LATEST,
+};
+
+static void print_stats(void)
+{
+    camera_stats_t stats;
+    camera_sim_stats_t sim;
+    esp_camera_get_stats(&stats);
+    esp_camera_sim_get_stats(&sim);
+    ESP_LOGI(TAG, "sim sent: %u (NO-SOI %u, NO-EOI %u, EV-OVF %u)",
+             (unsigned) sim.frames, (unsigned) sim.no_soi, (unsigned) sim.no_eoi, (unsigned) sim.event_overflow);
+    ESP_LOGI(TAG, "driver captured: %u, dropped: %u, FB-OVF: %u, NO-SOI: %u, NO-EOI: %u, EV-OVF: %u, avg JPEG: %u",
+             (unsigned) stats.frames_captured, (unsigned) stats.frames_dropped, (unsigned) stats.fb_overflow,
+             (unsigned) stats.no_soi, (unsigned) stats.no_eoi, (unsigned) stats.event_overflow,
+             (unsigned) stats.jpeg_avg_size);
+}
+
+static void print_sccb_stats(const char *name)
+{
+    camera_sim_sccb_stats_t sccb;
+    esp_camera_sim_sccb_get_stats(&sccb);
+    ESP_LOGI(TAG, "%s: %u registers written, %u read in %u SCCB transactions, %u ms on the bus", name,
+             (unsigned) sccb.writes, (unsigned) sccb.reads, (unsigned) sccb.transactions, (unsigned) (sccb.bus_us / 1000));
+}
+
+/* Waits for the first frame started after the given time, returns the wait in us or -1 */
+static int64_t wait_frame_after(int64_t since)
+{
+    for (int i = 0; i < 8; i++) {
+        camera_fb_t *pic = esp_camera_fb_get();
+        if (pic == NULL) {
+            break;
+        }
+        int64_t start = pic->timestamp.tv_sec * 1000000LL + pic->timestamp.tv_usec;
+        esp_camera_fb_return(pic);
+        if (start >= since) {
+            return esp_timer_get_time() - since;
+        }
+    }
+    ESP_LOGE(TAG, "No frame after the switch");
+    return -1;
+}
+
+/*
+ * Switches to VGA and back twice, which must set the output size registers of
+ * the sensor. From the second round on the driver knows the register values of
+ * both modes and only writes the ones that differ.
+ */
+static bool run_sccb_switch(void)
+{
+    sensor_t *s = esp_camera_sensor_get();
+    const framesize_t sizes[] = { FRAMESIZE_VGA, camera_config.frame_size };
+    for (int i = 0; i < 4; i++) {
+        framesize_t size = sizes[i % 2];
+        esp_camera_sim_sccb_reset_stats();
+        if (s->set_framesize(s, size) != 0) {
+            ESP_LOGE(TAG, "Frame size switch failed");
+            return false;
+        }
+        int64_t wait_us = wait_frame_after(esp_timer_get_time());
+        if (wait_us < 0) {
+            return false;
+        }
+        print_sccb_stats(i % 2 ? "switch back" : "switch to VGA");
+        camera_sim_sccb_stats_t sccb;
+        esp_camera_sim_sccb_get_stats(&sccb);
+        // on the hardware the frame also waits for the register writes
+        ESP_LOGI(TAG, "frame ready %u ms after the switch", (unsigned) ((wait_us + sccb.bus_us) / 1000));
+        // X_OUTPUT_SIZE_H/L and Y_OUTPUT_SIZE_H/L
+        uint16_t w = (esp_camera_sim_sccb_get_reg(0x3808) << 8) | esp_camera_sim_sccb_get_reg(0x3809);
+        uint16_t h = (esp_camera_sim_sccb_get_reg(0x380A) << 8) | esp_camera_sim_sccb_get_reg(0x380B);
+        if (w != resolution[size].width || h != resolution[size].height) {
+            ESP_LOGE(TAG, "Output size registers are %ux%u", w, h);
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool run_benchmark(void)
+{
+    size_t bytes = 0;
+    esp_camera_reset_stats();
+    int64_t start = esp_timer_get_time();
+    for (int i = 0; i < BENCHMARK_FRAMES; i++) {
+        camera_fb_t *pic = esp_camera_fb_get();
+        if (pic == NULL) {
+            ESP_LOGE(TAG, "Frame %d was not received", i);
+            return false;
+        }
+        bytes += pic->len;
+        esp_camera_fb_return(pic);
+    }
+    int64_t us = esp_timer_get_time() - start;
+    ESP_LOGI(TAG, "%d frames in %lld ms: %.1f fps, %.1f KB/s", BENCHMARK_FRAMES, (long long) (us / 1000),
+             BENCHMARK_FRAMES * 1e6 / us, bytes * 1e6 / 1024 / us);
+    print_stats();
+
+    camera_stats_t stats;
+    esp_camera_get_stats(&stats);
+    return stats.jpeg_frames == BENCHMARK_FRAMES && stats.no_soi == 0 && stats.no_eoi == 0 &&
+           stats.fb_overflow == 0 && stats.event_overflow == 0;
+}
+
+static bool run_fault(uint32_t fault, const char *name, camera_stats_t *stats)
+{
+    esp_camera_reset_stats();
+    esp_camera_sim_inject_fault(fault);
+    for (int i = 0; i < 8; i++) {
+        camera_fb_t *pic = esp_camera_fb_get();
+        if (pic == NULL) {
+            ESP_LOGE(TAG, "%s: frame %d was not received", name, i);
+            return false;
+        }
+        esp_camera_fb_return(pic);
+    }
+    ESP_LOGI(TAG, "%s injected", name);
+    print_stats();
+    return esp_camera_get_stats(stats) == ESP_OK;
+}
+
+void app_main(void)
+{
+    camera_sim_config_t sim = {
+        .files = frame_files,
+        .file_count = sizeof(frame_files) / sizeof(frame_files[0]),
+        .frame_interval_us = 20000,
+        .jitter_us = 5000,
+        .seed = 1,
+    };
+    camera_stats_t stats;
+    bool ok = esp_camera_sim_config(&sim) == ESP_OK && esp_camera_sim_set_sensor(OV5640_PID) == ESP_OK &&
+              esp_camera_init(&camera_config) == ESP_OK;
+    if (ok) {
+        print_sccb_stats("OV5640 init");
+    }
+
+    ok = ok && run_sccb_switch();
+    ok = ok && run_benchmark();
+    ok = ok && run_fault(CAMERA_SIM_FAULT_NO_SOI, "NO-SOI", &stats) && stats.no_soi > 0;
+    ok = ok && run_fault(CAMERA_SIM_FAULT_NO_EOI, "NO-EOI", &stats) && stats.no_eoi > 0;
+    ok = ok && run_fault(CAMERA_SIM_FAULT_EVENT_OVERFLOW, "EV-OVF", &stats) && stats.event_overflow > 0;
+
+    esp_camera_deinit();
+    ESP_LOGI(TAG, "%s", ok ? "PASS" : "FAIL");
+    exit(ok ? 0 : 1);
+}
@@ -0,0 +1,1255 @@
+/**
+ * This example benchmarks the image conversions on the linux target. For each
+ * test picture it prints the time of every step and checks that:
+ *
+ * - decoding at every scale gives the same pixels through a reader and from memory
+ * - every output format of esp_jpg_decode_mem() matches the RGB888 pixels
+ * - the fast forward DCTs stay close to the accurate one. The SIMD one falls back to the plain one
+ *   here, the vector code itself is only compared on the ESP32-S3 by the unit tests
+ * - optimized Huffman tables decode to the same pixels as the standard ones
+ * - encoding from YUV422 keeps the quality of the RGB888 encode
+ * - fmt2jpg_parallel() gives the same bytes as encoding one after the other
+ * - encodes to a target size land close to it
+ * - restart markers don't change the pixels, also when decoded on both cores
+ * - jpg2bmp_cb() streams the decoded pixels while buffering one row of MCUs
+ * - the first progressive scan reaches the callback on its own
+ * - jpg2thumb() decodes 1/8 scale thumbnails from the DC coefficients
+ * - jpg_transform_cb() flips, rotates and crops to the moved source pixels
+ * - fmt2jpg_multi() matches encoding each size separately
+ * - each conversion gives the same bytes without heap calls in an img_workspace_size() workspace
+ *
+ * Then it checks that the RGB565 and YUV422 line converters match the per pixel
+ * conversions, and that a Full HD YUV422 frame streamed through internal RAM
+ * stripes encodes to the same bytes as one read in place.
+ * The process exits with a non-zero status on failure, so it can be run on CI.
+ */
+
+#include <esp_log.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_timer.h"
+
+#include "img_converters.h"
+
+#define ENCODE_RUNS 20
+#define MAX_PSNR_LOSS_DB 1.0
+/* YUV422 is encoded with 4:2:2 chroma, the test pictures were 4:2:0 JPEGs so their chroma fits the RGB888 encode better */
+#define MAX_YUV_PSNR_LOSS_DB 1.5
+#define PARALLEL_JOBS 8
+#define LINE_RUNS 20
+#define MAX_FIXED_POINT_DIFF 3
+/* grayscale output is Y, the RGB888 pixels it is compared with were clipped after the color conversion */
+#define MAX_GRAY_DIFF 32
+/* the transformed blocks go through the IDCT in another order, which rounds differently */
+#define MAX_TRANSFORM_DIFF 4
+/* An encode with a target size may end up to 5% over it and 20% under it */
+#define MAX_TARGET_OVER 0.05
+#define MAX_TARGET_UNDER 0.2
+/* A Full HD YUV422 frame, tiled from the largest picture, is encoded reading the source in place and through the prefetched stripes */
+#define PREFETCH_WIDTH 1920
+#define PREFETCH_HEIGHT 1080
+#define PREFETCH_RUNS 5
+/* the downscale of the fmt2jpg_multi() outputs */
+#define MULTI_SCALE 4
+
+/* per pixel YUV to RGB conversion from conversions/yuv.c, used as the reference for the line converters */
+void yuv2rgb(uint8_t y, uint8_t u, uint8_t v, uint8_t *r, uint8_t *g, uint8_t *b);
+
+static const char *TAG = "example:conversions_benchmark";
+
+typedef struct {
+    const char *file;
+    uint16_t width;
+    uint16_t height;
+} picture_t;
+
+static const picture_t pictures[] = {
+    { PICTURES_DIR "/testimg.jpeg", 227, 149 },
+    { PICTURES_DIR "/test_inside.jpeg", 320, 240 },
+    { PICTURES_DIR "/test_outside.jpeg", 480, 320 },
+};
+
+static const uint8_t qualities[] = { 30, 60, 90 };
+
+static const char *dct_names[] = { "default", "islow", "aan", "aan-simd" };
+
+static uint8_t *read_file(const char *path, size_t *len)
+{
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        ESP_LOGE(TAG, "Failed to open %s", path);
+        return NULL;
+    }
+    fseek(f, 0, SEEK_END);
+    *len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    uint8_t *buf = malloc(*len);
+    if (buf != NULL && fread(buf, 1, *len, f) != *len) {
+        free(buf);
+        buf = NULL;
+    }
+    fclose(f);
+    return buf;
+}
+
+static double psnr(const uint8_t *a, const uint8_t *b, size_t len)
+{
+    double mse = 0;
+    for (size_t i = 0; i < len; i++) {
+        int d = a[i] - b[i];
+        mse += d * d;
+    }
+    mse /= len;
+    return mse == 0 ? 99.0 : 10 * log10(255.0 * 255.0 / mse);
+}
+
+/* Encodes src with config, returns the JPEG from the last run and its PSNR against rgb */
+static uint8_t *encode_format(const picture_t *pic, uint8_t *src, pixformat_t format, uint8_t *rgb, uint8_t *decoded,
+                              const jpg_encode_config_t *config, const char *name, size_t *jpg_len, double *db)
+{
+    size_t rgb_len = pic->width * pic->height * 3;
+    size_t src_len = pic->width * pic->height * (format == PIXFORMAT_RGB888 ? 3 : 2);
+    uint8_t *jpg = NULL;
+
+    int64_t start = esp_timer_get_time();
+    for (int i = 0; i < ENCODE_RUNS; i++) {
+        free(jpg);
+        if (!fmt2jpg_ex(src, src_len, pic->width, pic->height, format, config, &jpg, jpg_len)) {
+            ESP_LOGE(TAG, "Encoding failed");
+            return NULL;
+        }
+    }
+    int64_t us = (esp_timer_get_time() - start) / ENCODE_RUNS;
+
+    if (!fmt2rgb888(jpg, *jpg_len, PIXFORMAT_JPEG, decoded)) {
+        ESP_LOGE(TAG, "Decoding failed");
+        free(jpg);
+        return NULL;
+    }
+    *db = psnr(rgb, decoded, rgb_len);
+    ESP_LOGI(TAG, "%3ux%3u q%2u %-8s %6lld us %6u bytes %5.2f dB", pic->width, pic->height, config->quality,
+             name, (long long) us, (unsigned) *jpg_len, *db);
+    return jpg;
+}
+
+static uint8_t *encode_config(const picture_t *pic, uint8_t *rgb, uint8_t *decoded, const jpg_encode_config_t *config,
+                              const char *name, size_t *jpg_len, double *db)
+{
+    return encode_format(pic, rgb, PIXFORMAT_RGB888, rgb, decoded, config, name, jpg_len, db);
+}
+
+static uint8_t *encode(const picture_t *pic, uint8_t *rgb, uint8_t *decoded, uint8_t quality, jpeg_dct_t dct,
+                       size_t *jpg_len, double *db)
+{
+    jpg_encode_config_t config = JPG_ENCODE_CONFIG_DEFAULT();
+    config.quality = quality;
+    config.dct = dct;
+    return encode_config(pic, rgb, decoded, &config, dct_names[dct], jpg_len, db);
+}
+
+static bool benchmark_huffman(const picture_t *pic, uint8_t *rgb, uint8_t *decoded)
+{
+    jpg_encode_config_t config = JPG_ENCODE_CONFIG_DEFAULT();
+    size_t std_len, opt_len;
+    double std_db, opt_db;
+    uint8_t *std = encode_config(pic, rgb, decoded, &config, "std-huff", &std_len, &std_db);
+    config.optimize_huffman = true;
+    uint8_t *opt = encode_config(pic, rgb, decoded, &config, "opt-huff", &opt_len, &opt_db);
+    bool ok = std && opt;
+    free(std);
+    free(opt);
+    if (ok && (opt_len >= std_len || opt_db != std_db)) {
+        ESP_LOGE(TAG, "Optimized Huffman tables changed the image or did not reduce its size");
+        ok = false;
+    }
+    return ok;
+}
+
+/* The RGB888 buffers are in BGR order, YUV422 is limited range BT.601 as sent by the sensors,
+ * with the chroma of each pixel pair taken from the average of the two pixels */
+static void bgr_to_rgb565_yuyv(const uint8_t *bgr, uint16_t width, size_t pixels, uint8_t *rgb565, uint8_t *yuyv)
+{
+    for (size_t i = 0; i < pixels; i++, bgr += 3) {
+        int r = bgr[2], g = bgr[1], b = bgr[0];
+        rgb565[i * 2] = (r & 0xF8) | (g >> 5);
+        rgb565[i * 2 + 1] = ((g << 3) & 0xE0) | (b >> 3);
+        yuyv[i * 2] = 16 + ((r * 16829 + g * 33039 + b * 6416 + 32768) >> 16);
+
+        int x = i % width;
+        const uint8_t *p0 = bgr - (x & 1) * 3;
+        const uint8_t *p1 = (x | 1) < width ? p0 + 3 : p0;
+        r = p0[2] + p1[2];
+        g = p0[1] + p1[1];
+        b = p0[0] + p1[0];
+        if (x & 1) {
+            yuyv[i * 2 + 1] = 128 + ((r * 28784 - g * 24103 - b * 4681 + 65536) >> 17);
+        } else {
+            yuyv[i * 2 + 1] = 128 + ((-r * 9714 - g * 19070 + b * 28784 + 65536) >> 17);
+        }
+    }
+}
+
+static bool benchmark_formats(const picture_t *pic, uint8_t *rgb, uint8_t *decoded)
+{
+    size_t pixels = pic->width * pic->height;
+    uint8_t *rgb565 = malloc(pixels * 2);
+    uint8_t *yuyv = malloc(pixels * 2);
+    bool ok = rgb565 && yuyv;
+    if (ok) {
+        bgr_to_rgb565_yuyv(rgb, pic->width, pixels, rgb565, yuyv);
+        jpg_encode_config_t config = JPG_ENCODE_CONFIG_DEFAULT();
+        size_t len;
+        double rgb_db, yuv_db, db;
+        uint8_t *jpg[3];
+        jpg[0] = encode_format(pic, rgb, PIXFORMAT_RGB888, rgb, decoded, &config, "rgb888", &len, &rgb_db);
+        jpg[1] = encode_format(pic, rgb565, PIXFORMAT_RGB565, rgb, decoded, &config, "rgb565", &len, &db);
+        jpg[2] = encode_format(pic, yuyv, PIXFORMAT_YUV422, rgb, decoded, &config, "yuv422", &len, &yuv_db);
+        ok = jpg[0] && jpg[1] && jpg[2];
+        if (ok && yuv_db < rgb_db - MAX_YUV_PSNR_LOSS_DB) {
+            ESP_LOGE(TAG, "Encoding from YUV422 lost %.2f dB", rgb_db - yuv_db);
+            ok = false;
+        }
+        for (int i = 0; i < 3; i++) {
+            free(jpg[i]);
+        }
+    }
+    free(rgb565);
+    free(yuyv);
+    return ok;
+}
+
+static bool benchmark_parallel(const picture_t *pic, uint8_t *rgb)
+{
+    jpg_encode_job_t jobs[PARALLEL_JOBS];
+    uint8_t *seq[PARALLEL_JOBS] = { 0 };
+    size_t seq_len[PARALLEL_JOBS];
+    bool ok = true;
+
+    for (int i = 0; i < PARALLEL_JOBS; i++) {
+        jpg_encode_config_t config = JPG_ENCODE_CONFIG_DEFAULT();
+        config.quality = qualities[i % sizeof(qualities)];
+        config.dct = (jpeg_dct_t) (i % 4);
+        config.optimize_huffman = i & 1;
+        jobs[i] = (jpg_encode_job_t) {
+            .src = rgb, .src_len = pic->width * pic->height * 3,
+            .width = pic->width, .height = pic->height, .format = PIXFORMAT_RGB888, .config = config,
+        };
+    }
+
+    int64_t start = esp_timer_get_time();
+    for (int i = 0; i < PARALLEL_JOBS; i++) {
+        jpg_encode_job_t *job = &jobs[i];
+        ok = ok && fmt2jpg_ex(job->src, job->src_len, job->width, job->height, job->format, &job->config,
+                              &seq[i], &seq_len[i]);
+    }
+    int64_t seq_us = esp_timer_get_time() - start;
+    start = esp_timer_get_time();
+    ok = ok && fmt2jpg_parallel(jobs, PARALLEL_JOBS);
+    int64_t par_us = esp_timer_get_time() - start;
+
+    if (ok) {
+        ESP_LOGI(TAG, "%3ux%3u %d encodes: %6lld us sequential, %6lld us parallel, %.2fx", pic->width, pic->height,
+                 PARALLEL_JOBS, (long long) seq_us, (long long) par_us, (double) seq_us / par_us);
+    }
+    for (int i = 0; i < PARALLEL_JOBS; i++) {
+        if (ok && (jobs[i].out_len != seq_len[i] || memcmp(jobs[i].out, seq[i], seq_len[i]) != 0)) {
+            ESP_LOGE(TAG, "Parallel encode %d differs from the sequential one", i);
+            ok = false;
+        }
+        free(seq[i]);
+        free(jobs[i].out);
+    }
+    return ok;
+}
+
+typedef struct {
+    const uint8_t *src;
+    uint8_t *out;
+    uint16_t width;
+    uint8_t bpp;
+} decode_t;
+
+static size_t decode_read(void *arg, size_t index, uint8_t *buf, size_t len)
+{
+    decode_t *d = arg;
+    if (buf) {
+        memcpy(buf, d->src + index, len);
+    }
+    return len;
+}
+
+static bool decode_write(void *arg, uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint8_t *data)
+{
+    decode_t *d = arg;
+    if (data == NULL) {
+        if (x == 0 && y == 0) {
+            d->width = w;
+        }
+        return true;
+    }
+    for (int iy = 0; iy < h; iy++, data += w * d->bpp) {
+        memcpy(d->out + ((y + iy) * d->width + x) * d->bpp, data, w * d->bpp);
+    }
+    return true;
+}
+
+static const struct {
+    jpg_pixel_format_t format;
+    const char *name;
+    uint8_t bpp;
+} decode_formats[] = {
+    { JPG_PIXEL_BGR888, "BGR888", 3 },
+    { JPG_PIXEL_RGB565_LE, "RGB565 LE", 2 },
+    { JPG_PIXEL_RGB565_BE, "RGB565 BE", 2 },
+    { JPG_PIXEL_GRAYSCALE, "gray", 1 },
+};
+
+/* The distance of a decoded pixel from the RGB888 one converted to its format, 0 if they match */
+static int decode_pixel_diff(jpg_pixel_format_t format, const uint8_t *rgb, const uint8_t *px)
+{
+    uint16_t c = ((rgb[0] & 0xF8) << 8) | ((rgb[1] & 0xFC) << 3) | (rgb[2] >> 3);
+    switch (format) {
+    case JPG_PIXEL_BGR888:
+        return px[0] != rgb[2] || px[1] != rgb[1] || px[2] != rgb[0];
+    case JPG_PIXEL_RGB565_LE:
+        return px[0] != (c & 0xFF) || px[1] != (c >> 8);
+    case JPG_PIXEL_RGB565_BE:
+        return px[0] != (c >> 8) || px[1] != (c & 0xFF);
+    default:
+        /* the decoder outputs Y before the color conversion clips it */
+        return abs(px[0] - ((rgb[0] * 77 + rgb[1] * 150 + rgb[2] * 29) >> 8));
+    }
+}
+
+/* Decodes the picture from memory in every output format, which must match the RGB888 pixels */
+static bool benchmark_decode_formats(const picture_t *pic, const uint8_t *src, size_t len, const uint8_t *rgb, int64_t rgb_us)
+{
+    size_t pixels = pic->width * pic->height;
+    uint8_t *out = malloc(pixels * 3);
+    bool ok = out != NULL;
+
+    for (size_t f = 0; ok && f < sizeof(decode_formats) / sizeof(decode_formats[0]); f++) {
+        decode_t d = { .src = src, .out = out, .bpp = decode_formats[f].bpp };
+        int64_t start = esp_timer_get_time();
+        for (int i = 0; ok && i < ENCODE_RUNS; i++) {
+            ok = esp_jpg_decode_mem(src, len, JPG_SCALE_NONE, decode_formats[f].format, decode_write, &d) == ESP_OK;
+        }
+        int64_t us = (esp_timer_get_time() - start) / ENCODE_RUNS;
+        int max_diff = 0;
+        for (size_t i = 0; ok && i < pixels; i++) {
+            int diff = decode_pixel_diff(decode_formats[f].format, rgb + i * 3, out + i * d.bpp);
+            max_diff = diff > max_diff ? diff : max_diff;
+        }
+        if (ok && max_diff > (decode_formats[f].format == JPG_PIXEL_GRAYSCALE ? MAX_GRAY_DIFF : 0)) {
+            ESP_LOGE(TAG, "Decoding to %s differs from RGB888 by %d", decode_formats[f].name, max_diff);
+            ok = false;
+        }
+        if (ok) {
+            ESP_LOGI(TAG, "%3ux%3u decode to %-9s %6lld us, RGB888 %6lld us", pic->width, pic->height,
+                     decode_formats[f].name, (long long) us, (long long) rgb_us);
+        }
+    }
+    free(out);
+    return ok;
+}
+
+/* Decodes the picture at every scale with a reader callback and from memory, which must give the same pixels */
+static bool benchmark_decode(const picture_t *pic, const uint8_t *src, size_t len)
+{
+    size_t rgb_len = pic->width * pic->height * 3;
+    uint8_t *out[2] = { malloc(rgb_len), malloc(rgb_len) };
+    bool ok = out[0] && out[1];
+
+    for (int scale = JPG_SCALE_NONE; ok && scale <= JPG_SCALE_MAX; scale++) {
+        int64_t us[2];
+        for (int mem = 0; ok && mem < 2; mem++) {
+            decode_t d = { .src = src, .out = out[mem], .bpp = 3 };
+            int64_t start = esp_timer_get_time();
+            for (int i = 0; ok && i < ENCODE_RUNS; i++) {
+                ok = (mem ? esp_jpg_decode_mem(src, len, scale, JPG_PIXEL_RGB888, decode_write, &d)
+                          : esp_jpg_decode(len, scale, decode_read, decode_write, &d)) == ESP_OK;
+            }
+            us[mem] = (esp_timer_get_time() - start) / ENCODE_RUNS;
+        }
+        size_t scaled_len = (pic->width >> scale) * (pic->height >> scale) * 3;
+        if (ok && memcmp(out[0], out[1], scaled_len) != 0) {
+            ESP_LOGE(TAG, "Decoding from memory differs from the reader at 1/%d", 1 << scale);
+            ok = false;
+        }
+        if (ok) {
+            ESP_LOGI(TAG, "%3ux%3u decode 1/%d %6lld us reader, %6lld us memory", pic->width, pic->height, 1 << scale,
+                     (long long) us[0], (long long) us[1]);
+        }
+        if (ok && scale == JPG_SCALE_NONE) {
+            ok = benchmark_decode_formats(pic, src, len, out[1], us[1]);
+        }
+    }
+    free(out[0]);
+    free(out[1]);
+    return ok;
+}
+
+static size_t count_out(void *arg, size_t index, const void *data, size_t len)
+{
+    *(size_t *)arg += len;
+    return len;
+}
+
+static bool benchmark_target(const picture_t *pic, uint8_t *rgb)
+{
+    size_t rgb_len = pic->width * pic->height * 3;
+    jpg_encode_config_t config = JPG_ENCODE_CONFIG_DEFAULT();
+    size_t base_len = 0;
+    int64_t start = esp_timer_get_time();
+    bool ok = fmt2jpg_cb_ex(rgb, rgb_len, pic->width, pic->height, PIXFORMAT_RGB888, &config, count_out, &base_len);
+    int64_t base_us = esp_timer_get_time() - start;
+
+    for (int i = 1; ok && i <= 4; i += (i == 2) ? 2 : 1) {
+        config.target_size = base_len * i / 3;
+        size_t len = 0;
+        start = esp_timer_get_time();
+        ok = fmt2jpg_cb_ex(rgb, rgb_len, pic->width, pic->height, PIXFORMAT_RGB888, &config, count_out, &len);
+        int64_t us = esp_timer_get_time() - start;
+        double error = (double) len / config.target_size - 1;
+        if (ok && (error > MAX_TARGET_OVER || error < -MAX_TARGET_UNDER)) {
+            ESP_LOGE(TAG, "Encoding to %u bytes gave %u bytes", (unsigned) config.target_size, (unsigned) len);
+            ok = false;
+        }
+        if (ok) {
+            ESP_LOGI(TAG, "%3ux%3u target %6u bytes: %6u bytes %+5.1f%%, %6lld us (q80 %6lld us)", pic->width, pic->height,
+                     (unsigned) config.target_size, (unsigned) len, error * 100, (long long) us, (long long) base_us);
+        }
+    }
+
+    // A flat frame is tiny at any quality, so a generous budget must not push it down to quality 1
+    uint8_t *flat = malloc(rgb_len * 2), *jpg = NULL;
+    size_t jpg_len = 0;
+    if (ok && flat) {
+        memset(flat, 100, rgb_len);
+        config.target_size = base_len;
+        ok = fmt2jpg_ex(flat, rgb_len, pic->width, pic->height, PIXFORMAT_RGB888, &config, &jpg, &jpg_len) &&
+             fmt2rgb888(jpg, jpg_len, PIXFORMAT_JPEG, flat + rgb_len);
+        int diff = 0;
+        for (size_t i = 0; ok && i < rgb_len; i++) {
+            int d = abs(flat[rgb_len + i] - 100);
+            diff = d > diff ? d : diff;
+        }
+        if (ok && diff > 1) {
+            ESP_LOGE(TAG, "A flat frame encoded to %u bytes is off by %d", (unsigned) jpg_len, diff);
+            ok = false;
+        }
+    }
+    free(flat);
+    free(jpg);
+    return ok;
+}
+
+/*
+ * Encodes with restart markers every row of MCUs, every 3 MCUs and every MCU. The restarts only reset
+ * the DC prediction, so the pixels must match the encode without them, decoded on one core and on both
+ * cores with esp_jpg_decode_parallel(), whose speedup is printed.
+ */
+static bool benchmark_restart(const picture_t *pic, uint8_t *rgb)
+{
+    const uint16_t intervals[] = { (pic->width + 15) / 16, 3, 1 };
+    size_t rgb_len = pic->width * pic->height * 3;
+    uint8_t *ref = malloc(rgb_len), *seq = malloc(rgb_len), *par = malloc(rgb_len);
+    uint8_t *jpg = NULL;
+    size_t jpg_len, plain_len = 0;
+    jpg_encode_config_t config = JPG_ENCODE_CONFIG_DEFAULT();
+    bool ok = ref && seq && par && fmt2jpg_ex(rgb, rgb_len, pic->width, pic->height, PIXFORMAT_RGB888, &config, &jpg, &plain_len);
+    decode_t d = { .out = ref, .bpp = 3 };
+    ok = ok && esp_jpg_decode_mem(jpg, plain_len, JPG_SCALE_NONE, JPG_PIXEL_BGR888, decode_write, &d) == ESP_OK;
+    free(jpg);
+    jpg = NULL;
+
+    for (size_t i = 0; ok && i < sizeof(intervals) / sizeof(intervals[0]); i++) {
+        config.restart_interval = intervals[i];
+        ok = fmt2jpg_ex(rgb, rgb_len, pic->width, pic->height, PIXFORMAT_RGB888, &config, &jpg, &jpg_len);
+        int64_t us[2];
+        for (int parallel = 0; ok && parallel < 2; parallel++) {
+            d.out = parallel ? par : seq;
+            int64_t start = esp_timer_get_time();
+            for (int r = 0; ok && r < ENCODE_RUNS; r++) {
+                ok = (parallel ? esp_jpg_decode_parallel(jpg, jpg_len, JPG_SCALE_NONE, JPG_PIXEL_BGR888, decode_write, &d)
+                               : esp_jpg_decode_mem(jpg, jpg_len, JPG_SCALE_NONE, JPG_PIXEL_BGR888, decode_write, &d)) == ESP_OK;
+            }
+            us[parallel] = (esp_timer_get_time() - start) / ENCODE_RUNS;
+        }
+        if (ok && (memcmp(seq, ref, rgb_len) != 0 || memcmp(par, ref, rgb_len) != 0)) {
+            ESP_LOGE(TAG, "Restart interval %u changed the pixels", intervals[i]);
+            ok = false;
+        }
+        if (ok) {
+            ESP_LOGI(TAG, "%3ux%3u restart every %2u MCUs %6u bytes (+%u), decode %6lld us, parallel %6lld us, %.2fx",
+                     pic->width, pic->height, intervals[i], (unsigned) jpg_len, (unsigned) (jpg_len - plain_len),
+                     (long long) us[0], (long long) us[1], (double) us[0] / us[1]);
+        }
+        free(jpg);
+        jpg = NULL;
+    }
+    free(ref);
+    free(seq);
+    free(par);
+    return ok;
+}
+
+typedef struct {
+    uint8_t *buf;
+    size_t size;
+    size_t len;
+    size_t max_write;
+} bmp_out_t;
+
+static size_t bmp_out(void *arg, size_t index, const void *data, size_t len)
+{
+    bmp_out_t *out = arg;
+    // the JPEG encoder ends its output with an empty write
+    if (!data || !len) {
+        return 0;
+    }
+    if (index != out->len || index + len > out->size) {
+        return 0;
+    }
+    memcpy(out->buf + index, data, len);
+    out->len += len;
+    out->max_write = len > out->max_write ? len : out->max_write;
+    return len;
+}
+
+static bool benchmark_bmp(const picture_t *pic, const uint8_t *src, size_t len, const uint8_t *rgb)
+{
+    size_t row = pic->width * 3;
+    size_t stride = (row + 3) & ~3;
+    bmp_out_t out = { .size = 54 + stride * pic->height };
+    out.buf = malloc(out.size);
+    if (out.buf == NULL) {
+        return false;
+    }
+
+    int64_t start = esp_timer_get_time();
+    bool ok = jpg2bmp_cb(src, len, bmp_out, &out);
+    int64_t us = esp_timer_get_time() - start;
+    ok = ok && out.len == out.size && out.buf[0] == 'B' && out.buf[1] == 'M';
+    for (int y = 0; ok && y < pic->height; y++) {
+        ok = memcmp(out.buf + 54 + y * stride, rgb + y * row, row) == 0;
+    }
+    if (ok) {
+        ESP_LOGI(TAG, "%3ux%3u bmp stream %6lld us %6u bytes, largest write %u bytes", pic->width, pic->height,
+                 (long long) us, (unsigned) out.len, (unsigned) out.max_write);
+    } else {
+        ESP_LOGE(TAG, "Streamed BMP differs from the decoded picture");
+    }
+    free(out.buf);
+    return ok;
+}
+
+typedef struct {
+    bmp_out_t out;
+    size_t preview;
+} progressive_out_t;
+
+/* Records where the DC scan ends: the tables of the next scan start a new write, as each scan is flushed once coded */
+static size_t progressive_out(void *arg, size_t index, const void *data, size_t len)
+{
+    progressive_out_t *p = arg;
+    const uint8_t *d = data;
+    if (!p->preview && index && len >= 2 && d[0] == 0xFF && d[1] == 0xC4) {
+        p->preview = index;
+    }
+    return bmp_out(&p->out, index, data, len);
+}
+
+/*
+ * Encodes a progressive JPEG with fmt2jpg_cb_ex(), which the decoders here do not read. Checks its SOF2
+ * and scan count, and prints after how many bytes the DC scan, enough for a preview, was sent.
+ */
+static bool benchmark_progressive(const picture_t *pic, uint8_t *rgb)
+{
+    size_t rgb_len = pic->width * pic->height * 3;
+    jpg_encode_config_t config = JPG_ENCODE_CONFIG_DEFAULT();
+    uint8_t *jpg = NULL;
+    size_t jpg_len = 0;
+    bool ok = fmt2jpg_ex(rgb, rgb_len, pic->width, pic->height, PIXFORMAT_RGB888, &config, &jpg, &jpg_len);
+    free(jpg);
+
+    config.progressive = true;
+    progressive_out_t p = { .out = { .size = jpg_len * 2 } };
+    p.out.buf = malloc(p.out.size);
+    int64_t start = esp_timer_get_time();
+    for (int i = 0; ok && i < ENCODE_RUNS; i++) {
+        p.out.len = 0;
+        p.preview = 0;
+        ok = p.out.buf && fmt2jpg_cb_ex(rgb, rgb_len, pic->width, pic->height, PIXFORMAT_RGB888, &config, progressive_out, &p);
+    }
+    int64_t us = (esp_timer_get_time() - start) / ENCODE_RUNS;
+
+    int sof2 = 0, scans = 0;
+    for (size_t i = 0; ok && i + 1 < p.out.len; i++) {
+        if (p.out.buf[i] == 0xFF) {
+            sof2 += p.out.buf[i + 1] == 0xC2;
+            scans += p.out.buf[i + 1] == 0xDA;
+        }
+    }
+    if (ok && (sof2 != 1 || scans != 5 || !p.preview || p.preview >= p.out.len)) {
+        ESP_LOGE(TAG, "Progressive JPEG has %d SOF2, %d scans and its DC scan ends at %u of %u bytes", sof2, scans,
+                 (unsigned) p.preview, (unsigned) p.out.len);
+        ok = false;
+    }
+    if (ok) {
+        ESP_LOGI(TAG, "%3ux%3u progressive %6lld us %6u bytes (baseline %6u), %d scans, preview after %u bytes",
+                 pic->width, pic->height, (long long) us, (unsigned) p.out.len, (unsigned) jpg_len, scans,
+                 (unsigned) p.preview);
+    }
+    free(p.out.buf);
+    return ok;
+}
+
+/* Decodes 1/8 scale thumbnails, which must match jpg2rgb565() and jpg2gray() at that scale */
+static bool benchmark_thumb(const picture_t *pic, const uint8_t *src, size_t len)
+{
+    size_t pixels = (pic->width >> 3) * (pic->height >> 3);
+    uint8_t *thumb = malloc(pixels * 2);
+    uint8_t *ref = malloc(pixels * 2);
+    uint16_t w = 0, h = 0;
+    int64_t us[2];
+    bool ok = thumb && ref;
+
+    for (int gray = 0; ok && gray < 2; gray++) {
+        int64_t start = esp_timer_get_time();
+        for (int i = 0; ok && i < ENCODE_RUNS; i++) {
+            ok = jpg2thumb(src, len, gray ? PIXFORMAT_GRAYSCALE : PIXFORMAT_RGB565, thumb, &w, &h);
+        }
+        us[gray] = (esp_timer_get_time() - start) / ENCODE_RUNS;
+        ok = ok && w == pic->width >> 3 && h == pic->height >> 3;
+        if (ok && gray) {
+            ok = jpg2gray(src, len, ref, JPG_SCALE_8X) && memcmp(thumb, ref, pixels) == 0;
+        } else if (ok) {
+            /* jpg2rgb565() writes the low byte first, the thumbnail the high byte like the camera */
+            ok = jpg2rgb565(src, len, ref, JPG_SCALE_8X);
+            for (size_t i = 0; ok && i < pixels; i++) {
+                ok = thumb[i * 2] == ref[i * 2 + 1] && thumb[i * 2 + 1] == ref[i * 2];
+            }
+        }
+    }
+    if (ok) {
+        ESP_LOGI(TAG, "%3ux%3u thumbnail %ux%u %6lld us RGB565, %6lld us gray", pic->width, pic->height, w, h,
+                 (long long) us[0], (long long) us[1]);
+    } else {
+        ESP_LOGE(TAG, "Thumbnail differs from the 1/8 scale decode");
+    }
+    free(thumb);
+    free(ref);
+    return ok;
+}
+
+/* Reads the size from the SOF marker of a JPEG */
+static bool jpg_size(const uint8_t *jpg, size_t len, uint16_t *width, uint16_t *height)
+{
+    for (size_t i = 2; i + 9 < len; i += 2 + (jpg[i + 2] << 8 | jpg[i + 3])) {
+        if (jpg[i] == 0xFF && jpg[i + 1] == 0xC0) {
+            *height = jpg[i + 5] << 8 | jpg[i + 6];
+            *width = jpg[i + 7] << 8 | jpg[i + 8];
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool transform(const uint8_t *src, size_t len, const jpg_transform_config_t *config, bmp_out_t *out)
+{
+    out->len = 0;
+    return jpg_transform_cb(src, len, config, bmp_out, out);
+}
+
+/*
+ * Transforms the picture in the DCT domain. Every transform must decode to the moved source pixels,
+ * up to the rounding of the IDCT, rotating forth and back must give the bytes of a flip forth and
+ * back, and a crop must decode to the same pixels as the source.
+ */
+static bool benchmark_transform(const picture_t *pic, const uint8_t *src, size_t len, const uint8_t *rgb)
+{
+    static const char *names[] = { "none", "flip h", "flip v", "rotate 90", "rotate 180", "rotate 270" };
+    static const uint8_t flips[][3] = {
+        // transpose, flip h, flip v of the output
+        { 0, 0, 0 }, { 0, 1, 0 }, { 0, 0, 1 }, { 1, 1, 0 }, { 0, 1, 1 }, { 1, 0, 1 }
+    };
+    size_t rgb_len = pic->width * pic->height * 3;
+    bmp_out_t out = { .size = len * 2 + 1024 }, back = { .size = len * 2 + 1024 }, ref = { .size = len * 2 + 1024 };
+    out.buf = malloc(out.size);
+    back.buf = malloc(back.size);
+    ref.buf = malloc(ref.size);
+    uint8_t *decoded = malloc(rgb_len);
+    jpg_transform_config_t config = JPG_TRANSFORM_CONFIG_DEFAULT();
+    uint16_t w = 0, h = 0;
+    bool ok = out.buf && back.buf && ref.buf && decoded;
+
+    for (int i = JPG_TRANSFORM_NONE; ok && i <= JPG_TRANSFORM_ROTATE_270; i++) {
+        config.transform = i;
+        int64_t start = esp_timer_get_time();
+        for (int r = 0; ok && r < ENCODE_RUNS; r++) {
+            ok = transform(src, len, &config, &out);
+        }
+        int64_t us = (esp_timer_get_time() - start) / ENCODE_RUNS;
+        ok = ok && jpg_size(out.buf, out.len, &w, &h) && fmt2rgb888(out.buf, out.len, PIXFORMAT_JPEG, decoded);
+        int max = 0;
+        for (int y = 0; ok && y < h; y++) {
+            for (int x = 0; x < w; x++) {
+                int tx = flips[i][1] ? w - 1 - x : x, ty = flips[i][2] ? h - 1 - y : y;
+                const uint8_t *s = rgb + ((flips[i][0] ? tx * pic->width + ty : ty * pic->width + tx) * 3);
+                for (int c = 0; c < 3; c++) {
+                    int d = abs(s[c] - decoded[(y * w + x) * 3 + c]);
+                    max = d > max ? d : max;
+                }
+            }
+        }
+        if (ok && (max > MAX_TRANSFORM_DIFF || (i == JPG_TRANSFORM_NONE && max))) {
+            ESP_LOGE(TAG, "Transform %s differs by %d from the source pixels", names[i], max);
+            ok = false;
+        }
+        if (ok) {
+            ESP_LOGI(TAG, "%3ux%3u transform %-10s %6lld us %6u bytes %3ux%3u, max diff %d", pic->width, pic->height,
+                     names[i], (long long) us, (unsigned) out.len, w, h, max);
+        }
+    }
+
+    // rotating forth and back moves the same coefficients as flipping forth and back
+    config.transform = JPG_TRANSFORM_ROTATE_90;
+    ok = ok && transform(src, len, &config, &out);
+    config.transform = JPG_TRANSFORM_ROTATE_270;
+    ok = ok && transform(out.buf, out.len, &config, &back);
+    config.transform = JPG_TRANSFORM_FLIP_V;
+    ok = ok && transform(src, len, &config, &out);
+    ok = ok && transform(out.buf, out.len, &config, &ref);
+    if (ok && (back.len != ref.len || memcmp(back.buf, ref.buf, ref.len) != 0)) {
+        ESP_LOGE(TAG, "Rotating forth and back differs from flipping forth and back");
+        ok = false;
+    }
+
+    // a crop keeps the pixels of the MCUs it starts in, optimized tables only change the size
+    config.transform = JPG_TRANSFORM_NONE;
+    config.crop_x = pic->width / 3;
+    config.crop_y = pic->height / 3;
+    config.crop_width = pic->width / 2;
+    config.crop_height = pic->height / 2;
+    ok = ok && transform(src, len, &config, &out);
+    config.optimize_huffman = true;
+    ok = ok && transform(src, len, &config, &ref);
+    ok = ok && ref.len <= out.len && jpg_size(out.buf, out.len, &w, &h);
+    ok = ok && fmt2rgb888(out.buf, out.len, PIXFORMAT_JPEG, decoded);
+    uint8_t *optimized = ok ? malloc(w * h * 3) : NULL;
+    ok = ok && optimized && fmt2rgb888(ref.buf, ref.len, PIXFORMAT_JPEG, optimized) && memcmp(decoded, optimized, w * h * 3) == 0;
+    // the crop origin moves to the MCU grid, at most 16 pixels
+    int x0 = config.crop_x + config.crop_width - w, y0 = config.crop_y + config.crop_height - h;
+    for (int y = 0; ok && y < h; y++) {
+        ok = memcmp(decoded + y * w * 3, rgb + ((y0 + y) * pic->width + x0) * 3, w * 3) == 0;
+    }
+    if (ok) {
+        ESP_LOGI(TAG, "%3ux%3u crop %ux%u at %d,%d %6u bytes, %6u bytes optimized", pic->width, pic->height, w, h, x0, y0,
+                 (unsigned) out.len, (unsigned) ref.len);
+    } else {
+        ESP_LOGE(TAG, "Cropped picture differs from the source pixels");
+    }
+    free(optimized);
+    free(out.buf);
+    free(back.buf);
+    free(ref.buf);
+    free(decoded);
+    return ok;
+}
+
+/* Reference box filter of a BGR888 picture, the average of scale x scale pixels rounded to nearest */
+static void box_downscale(const uint8_t *bgr, uint16_t width, uint16_t w, uint16_t h, int scale, uint8_t *out)
+{
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            for (int c = 0; c < 3; c++) {
+                int sum = 0;
+                for (int i = 0; i < scale * scale; i++) {
+                    sum += bgr[((y * scale + i / scale) * width + x * scale + i % scale) * 3 + c];
+                }
+                *out++ = (sum + scale * scale / 2) / (scale * scale);
+            }
+        }
+    }
+}
+
+/*
+ * Encodes the picture at full size and MULTI_SCALE times smaller in one pass with fmt2jpg_multi(), from
+ * RGB888, RGB565, YUV422 and the JPEG itself. The full size JPEG must have the bytes of fmt2jpg_ex(), the
+ * small one the bytes of the reference box filter encoded from RGB888 and JPEG, and the quality of it from
+ * YUV422. The time is compared with encoding both one after the other and downscaling the RGB888 pixels in
+ * between, after decoding for a JPEG source.
+ */
+static bool benchmark_multi(const picture_t *pic, const uint8_t *src, size_t len, uint8_t *rgb, uint8_t *decoded)
+{
+    static const char *names[] = { "rgb888", "rgb565", "yuv422", "jpeg" };
+    const pixformat_t formats[] = { PIXFORMAT_RGB888, PIXFORMAT_RGB565, PIXFORMAT_YUV422, PIXFORMAT_JPEG };
+    size_t pixels = pic->width * pic->height;
+    uint16_t w = pic->width / MULTI_SCALE, h = pic->height / MULTI_SCALE;
+    uint8_t *rgb565 = malloc(pixels * 2);
+    uint8_t *yuyv = malloc(pixels * 2);
+    uint8_t *small = malloc(w * h * 3);
+    uint8_t *sources[] = { rgb, rgb565, yuyv, (uint8_t *) src };
+    size_t lens[] = { pixels * 3, pixels * 2, pixels * 2, len };
+    bmp_out_t out = { .size = pixels * 3 };
+    out.buf = malloc(out.size);
+    uint8_t *full = NULL, *ref_small = NULL;
+    size_t full_len, ref_small_len;
+    double rgb_db = 0;
+    jpg_encode_config_t config = JPG_ENCODE_CONFIG_DEFAULT();
+    bool ok = rgb565 && yuyv && small && out.buf;
+    if (ok) {
+        bgr_to_rgb565_yuyv(rgb, pic->width, pixels, rgb565, yuyv);
+        box_downscale(rgb, pic->width, w, h, MULTI_SCALE, small);
+        ok = fmt2jpg_ex(small, w * h * 3, w, h, PIXFORMAT_RGB888, &config, &ref_small, &ref_small_len);
+    }
+
+    for (size_t f = 0; ok && f < sizeof(formats) / sizeof(formats[0]); f++) {
+        jpg_encode_output_t outputs[2] = {
+            { .scale = 1, .config = config },
+            { .scale = MULTI_SCALE, .config = config, .cb = bmp_out, .arg = &out },
+        };
+        int64_t start = esp_timer_get_time();
+        for (int r = 0; ok && r < ENCODE_RUNS; r++) {
+            free(outputs[0].out);
+            out.len = 0;
+            ok = fmt2jpg_multi(sources[f], lens[f], pic->width, pic->height, formats[f], outputs, 2);
+        }
+        int64_t multi_us = (esp_timer_get_time() - start) / ENCODE_RUNS;
+
+        // the same two JPEGs one after the other, downscaled from the RGB888 pixels
+        start = esp_timer_get_time();
+        for (int r = 0; ok && r < ENCODE_RUNS; r++) {
+            uint8_t *jpg = NULL;
+            size_t jpg_len;
+            free(full);
+            full = NULL;
+            if (formats[f] == PIXFORMAT_JPEG) {
+                ok = fmt2rgb888(src, len, PIXFORMAT_JPEG, decoded) &&
+                     fmt2jpg_ex(decoded, pixels * 3, pic->width, pic->height, PIXFORMAT_RGB888, &config, &full, &full_len);
+            } else {
+                ok = fmt2jpg_ex(sources[f], lens[f], pic->width, pic->height, formats[f], &config, &full, &full_len);
+            }
+            box_downscale(rgb, pic->width, w, h, MULTI_SCALE, small);
+            ok = ok && fmt2jpg_ex(small, w * h * 3, w, h, PIXFORMAT_RGB888, &config, &jpg, &jpg_len);
+            free(jpg);
+        }
+        int64_t separate_us = (esp_timer_get_time() - start) / ENCODE_RUNS;
+
+        uint16_t jw = 0, jh = 0;
+        ok = ok && jpg_size(out.buf, out.len, &jw, &jh) && fmt2rgb888(out.buf, out.len, PIXFORMAT_JPEG, decoded);
+        double db = ok ? psnr(decoded, small, w * h * 3) : 0;
+        if (formats[f] == PIXFORMAT_RGB888) {
+            rgb_db = db;
+        }
+        if (ok && (outputs[0].out_len != full_len || memcmp(outputs[0].out, full, full_len) != 0)) {
+            ESP_LOGE(TAG, "Full size JPEG of fmt2jpg_multi() from %s differs from fmt2jpg_ex()", names[f]);
+            ok = false;
+        } else if (ok && (jw != w || jh != h)) {
+            ESP_LOGE(TAG, "Downscaled JPEG from %s is %ux%u instead of %ux%u", names[f], jw, jh, w, h);
+            ok = false;
+        } else if (ok && (formats[f] == PIXFORMAT_RGB888 || formats[f] == PIXFORMAT_JPEG) &&
+                   (out.len != ref_small_len || memcmp(out.buf, ref_small, ref_small_len) != 0)) {
+            ESP_LOGE(TAG, "Downscaled JPEG from %s differs from the reference box filter", names[f]);
+            ok = false;
+        } else if (ok && formats[f] == PIXFORMAT_YUV422 && db < rgb_db - MAX_YUV_PSNR_LOSS_DB) {
+            ESP_LOGE(TAG, "Downscaled JPEG from YUV422 lost %.2f dB", rgb_db - db);
+            ok = false;
+        }
+        if (ok) {
+            ESP_LOGI(TAG, "%3ux%3u multi %-6s %6u bytes + 1/%d %5u bytes %5.2f dB, %6lld us, separately %6lld us, %.2fx",
+                     pic->width, pic->height, names[f], (unsigned) outputs[0].out_len, MULTI_SCALE, (unsigned) out.len, db,
+                     (long long) multi_us, (long long) separate_us, (double) separate_us / multi_us);
+        }
+        free(outputs[0].out);
+    }
+    free(full);
+    free(ref_small);
+    free(rgb565);
+    free(yuyv);
+    free(small);
+    free(out.buf);
+    return ok;
+}
+
+typedef struct {
+    const char *name;
+    size_t size;                /* from img_workspace_size() */
+    size_t out_len;
+    uint32_t out_hash;
+} workspace_run_t;
+
+static uint32_t hash_bytes(const uint8_t *d, size_t len)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ d[i]) * 16777619;
+    }
+    return hash;
+}
+
+/* Runs conversion i with the given workspace, NULL for the heap, into out */
+static bool workspace_convert(int i, const picture_t *pic, const uint8_t *src, size_t len, uint8_t *rgb, uint8_t *yuyv,
+                              img_workspace_t *ws, bmp_out_t *out)
+{
+    size_t rgb_len = pic->width * pic->height * 3;
+    jpg_encode_config_t config = JPG_ENCODE_CONFIG_DEFAULT();
+    config.workspace = ws;
+    out->len = 0;
+    switch (i) {
+    case 0:
+        return fmt2jpg_cb_ex(rgb, rgb_len, pic->width, pic->height, PIXFORMAT_RGB888, &config, bmp_out, out);
+    case 1:
+        config.optimize_huffman = true;
+        return fmt2jpg_cb_ex(rgb, rgb_len, pic->width, pic->height, PIXFORMAT_RGB888, &config, bmp_out, out);
+    case 2:
+        config.progressive = true;
+        return fmt2jpg_cb_ex(rgb, rgb_len, pic->width, pic->height, PIXFORMAT_RGB888, &config, bmp_out, out);
+    case 3:
+        config.target_size = len / 2;
+        return fmt2jpg_cb_ex(rgb, rgb_len, pic->width, pic->height, PIXFORMAT_RGB888, &config, bmp_out, out);
+    case 4:
+        return fmt2jpg_cb_ex(yuyv, pic->width * pic->height * 2, pic->width, pic->height, PIXFORMAT_YUV422, &config, bmp_out, out);
+    case 5:
+        return jpg2bmp_cb_ex(src, len, ws, bmp_out, out);
+    case 6: {
+        jpg_transform_config_t t = JPG_TRANSFORM_CONFIG_DEFAULT();
+        t.transform = JPG_TRANSFORM_ROTATE_90;
+        t.optimize_huffman = true;
+        t.workspace = ws;
+        return jpg_transform_cb(src, len, &t, bmp_out, out);
+    }
+    default: {
+        jpg_encode_output_t outputs[2] = {
+            { .scale = 1, .config = config, .cb = bmp_out, .arg = out },
+            { .scale = MULTI_SCALE, .config = config },
+        };
+        bool ok = fmt2jpg_multi((uint8_t *) src, len, pic->width, pic->height, PIXFORMAT_JPEG, outputs, 2);
+        free(outputs[1].out);
+        return ok;
+    }
+    }
+}
+
+/*
+ * Runs the conversions with a workspace sized by img_workspace_size(), then all of them in one workspace of
+ * the largest size. They must give the bytes of the heap allocated conversions, take nothing from the heap
+ * and leave the workspace empty.
+ */
+static bool benchmark_workspace(const picture_t *pic, const uint8_t *src, size_t len, uint8_t *rgb)
+{
+    workspace_run_t runs[] = {
+        { .name = "rgb888" },
+        { .name = "opt-huff" },
+        { .name = "progressive" },
+        { .name = "target" },
+        { .name = "yuv422" },
+        { .name = "bmp stream" },
+        { .name = "transform" },
+        { .name = "multi" },
+    };
+    const int count = sizeof(runs) / sizeof(runs[0]);
+    size_t pixels = pic->width * pic->height;
+    uint8_t *rgb565 = malloc(pixels * 2), *yuyv = malloc(pixels * 2);
+    bmp_out_t out = { .size = pixels * 3 + 1024 };
+    out.buf = malloc(out.size);
+    bool ok = rgb565 && yuyv && out.buf;
+    if (ok) {
+        bgr_to_rgb565_yuyv(rgb, pic->width, pixels, rgb565, yuyv);
+    }
+
+    jpg_encode_config_t config = JPG_ENCODE_CONFIG_DEFAULT();
+    size_t largest = 0;
+    for (int i = 0; ok && i < count; i++) {
+        config.optimize_huffman = i == 1;
+        config.progressive = i == 2;
+        config.target_size = i == 3 ? len / 2 : 0;
+        if (i < 4) {
+            runs[i].size = img_workspace_size(pic->width, pic->height, PIXFORMAT_RGB888, &config);
+        } else if (i == 4) {
+            runs[i].size = img_workspace_size(pic->width, pic->height, PIXFORMAT_YUV422, &config);
+        } else if (i < count - 1) {
+            runs[i].size = img_workspace_size(pic->width, pic->height, PIXFORMAT_JPEG, NULL);
+        } else {
+            jpg_encode_output_t outputs[2] = { { .scale = 1, .config = config }, { .scale = MULTI_SCALE, .config = config } };
+            runs[i].size = img_workspace_size_multi(pic->width, pic->height, PIXFORMAT_JPEG, outputs, 2);
+        }
+        largest = runs[i].size > largest ? runs[i].size : largest;
+        ok = runs[i].size && workspace_convert(i, pic, src, len, rgb, yuyv, NULL, &out);
+        runs[i].out_len = out.len;
+        runs[i].out_hash = hash_bytes(out.buf, out.len);
+    }
+
+    // each conversion in a workspace of its size, then all of them in one
+    img_workspace_t *shared = ok ? img_workspace_create(largest) : NULL;
+    ok = ok && shared;
+    for (int i = 0; ok && i < 2 * count; i++) {
+        workspace_run_t *run = &runs[i % count];
+        img_workspace_t *ws = i < count ? img_workspace_create(run->size) : shared;
+        img_workspace_stats_t stats;
+        ok = ws && workspace_convert(i % count, pic, src, len, rgb, yuyv, ws, &out);
+        if (ok) {
+            img_workspace_get_stats(ws, &stats);
+        }
+        if (ok && (out.len != run->out_len || hash_bytes(out.buf, out.len) != run->out_hash)) {
+            ESP_LOGE(TAG, "Conversion %s in a workspace gave other bytes", run->name);
+            ok = false;
+        } else if (ok && (stats.fallbacks || stats.used || stats.peak > stats.size)) {
+            ESP_LOGE(TAG, "Conversion %s took %u bytes from the heap or left %u bytes in its workspace", run->name,
+                     (unsigned) stats.fallbacks, (unsigned) stats.used);
+            ok = false;
+        } else if (ok && i < count) {
+            ESP_LOGI(TAG, "%3ux%3u workspace %-11s %7u bytes, peak %7u, %2u buffers", pic->width, pic->height, run->name,
+                     (unsigned) run->size, (unsigned) stats.peak, (unsigned) stats.allocs);
+        } else if (ok && i == 2 * count - 1) {
+            ESP_LOGI(TAG, "%3ux%3u workspace shared %7u bytes, peak %7u, %3u buffers, reused %.1fx", pic->width, pic->height,
+                     (unsigned) stats.size, (unsigned) stats.peak, (unsigned) stats.allocs, (double) stats.alloc_bytes / stats.size);
+        }
+        if (ws != shared) {
+            img_workspace_delete(ws);
+        }
+    }
+    img_workspace_delete(shared);
+    free(rgb565);
+    free(yuyv);
+    free(out.buf);
+    return ok;
+}
+
+static bool benchmark_picture(const picture_t *pic)
+{
+    bool ok = false;
+    size_t len = 0;
+    size_t rgb_len = pic->width * pic->height * 3;
+    uint8_t *src = read_file(pic->file, &len);
+    uint8_t *rgb = malloc(rgb_len);
+    uint8_t *decoded = malloc(rgb_len);
+    if (src == NULL || rgb == NULL || decoded == NULL || !benchmark_decode(pic, src, len) ||
+        !fmt2rgb888(src, len, PIXFORMAT_JPEG, rgb)) {
+        goto out;
+    }
+
+    for (size_t i = 0; i < sizeof(qualities); i++) {
+        size_t islow_len, aan_len, simd_len;
+        double islow_db, aan_db, simd_db;
+        uint8_t *islow = encode(pic, rgb, decoded, qualities[i], JPEG_DCT_ISLOW, &islow_len, &islow_db);
+        uint8_t *aan = encode(pic, rgb, decoded, qualities[i], JPEG_DCT_AAN, &aan_len, &aan_db);
+        uint8_t *simd = encode(pic, rgb, decoded, qualities[i], JPEG_DCT_AAN_SIMD, &simd_len, &simd_db);
+        ok = islow && aan && simd;
+        if (ok && aan_db < islow_db - MAX_PSNR_LOSS_DB) {
+            ESP_LOGE(TAG, "AAN DCT lost %.2f dB", islow_db - aan_db);
+            ok = false;
+        }
+        if (ok && (simd_len != aan_len || memcmp(simd, aan, aan_len) != 0)) {
+            ESP_LOGE(TAG, "SIMD AAN DCT output differs from the C one");
+            ok = false;
+        }
+        free(islow);
+        free(aan);
+        free(simd);
+        if (!ok) {
+            break;
+        }
+    }
+    ok = ok && benchmark_huffman(pic, rgb, decoded);
+    ok = ok && benchmark_formats(pic, rgb, decoded);
+    ok = ok && benchmark_parallel(pic, rgb);
+    ok = ok && benchmark_target(pic, rgb);
+    ok = ok && benchmark_restart(pic, rgb);
+    ok = ok && benchmark_bmp(pic, src, len, rgb);
+    ok = ok && benchmark_progressive(pic, rgb);
+    ok = ok && benchmark_thumb(pic, src, len);
+    ok = ok && benchmark_transform(pic, src, len, rgb);
+    ok = ok && benchmark_multi(pic, src, len, rgb, decoded);
+    ok = ok && benchmark_workspace(pic, src, len, rgb);
+
+out:
+    free(src);
+    free(rgb);
+    free(decoded);
+    return ok;
+}
+
+/* The conversions of fmt2rgb888() before the line converters */
+static void rgb565_to_rgb888_ref(const uint8_t *src, uint8_t *dst, size_t pixels)
+{
+    for (size_t i = 0; i < pixels; i++) {
+        uint8_t hb = *src++;
+        uint8_t lb = *src++;
+        *dst++ = (lb & 0x1F) << 3;
+        *dst++ = (hb & 0x07) << 5 | (lb & 0xE0) >> 3;
+        *dst++ = hb & 0xF8;
+    }
+}
+
+static void yuv422_to_rgb888_ref(const uint8_t *src, uint8_t *dst, size_t pixels)
+{
+    uint8_t r, g, b;
+    for (size_t i = 0; i < pixels; i++, dst += 3) {
+        const uint8_t *pair = src + (i & ~1) * 2;
+        uint8_t v = (i | 1) < pixels ? pair[3] : (i > 1 ? pair[-1] : 128);
+        yuv2rgb(pair[(i & 1) * 2], pair[1], v, &r, &g, &b);
+        dst[0] = b;
+        dst[1] = g;
+        dst[2] = r;
+    }
+}
+
+static int max_diff(const uint8_t *a, const uint8_t *b, size_t len)
+{
+    int max = 0;
+    for (size_t i = 0; i < len; i++) {
+        int d = abs(a[i] - b[i]);
+        max = d > max ? d : max;
+    }
+    return max;
+}
+
+typedef void (*line_converter_t)(const uint8_t *src, uint8_t *dst, size_t pixels);
+
+static double line_mpixels(line_converter_t convert, const uint8_t *src, uint8_t *dst, size_t pixels)
+{
+    int64_t start = esp_timer_get_time();
+    for (int i = 0; i < LINE_RUNS; i++) {
+        convert(src, dst, pixels);
+    }
+    int64_t us = esp_timer_get_time() - start;
+    return (double) pixels * LINE_RUNS / (us ? us : 1);
+}
+
+/* Checks and times the line converters on every RGB565 value and every U, V pair, whole and from an
+ * unaligned source with an odd pixel count */
+static bool benchmark_lines(void)
+{
+    const size_t pixels = 2 * 65536;
+    uint8_t *src = malloc(pixels * 2 + 4);
+    uint8_t *ref = malloc(pixels * 3);
+    uint8_t *out = malloc(pixels * 3);
+    bool ok = src && ref && out;
+    if (!ok) {
+        goto out;
+    }
+
+    for (size_t i = 0; i < 65536; i++) {
+        uint8_t *pair = src + i * 4;
+        pair[0] = i * 7;
+        pair[1] = i >> 8;
+        pair[2] = i * 13 + 5;
+        pair[3] = i;
+    }
+    static const struct {
+        const char *name;
+        line_converter_t convert, reference;
+    } converters[] = {
+        { "rgb565", rgb565_to_rgb888_line, rgb565_to_rgb888_ref },
+        { "yuv422", yuv422_to_rgb888_line, yuv422_to_rgb888_ref },
+        { "yuv422 fixed", yuv422_to_rgb888_line_fixed, yuv422_to_rgb888_ref },
+    };
+    for (size_t i = 0; ok && i < sizeof(converters) / sizeof(converters[0]); i++) {
+        int diff = 0, max = i == 2 ? MAX_FIXED_POINT_DIFF : 0;
+        for (int unaligned = 0; unaligned < 2; unaligned++) {
+            size_t count = pixels - unaligned * 3;
+            const uint8_t *in = src + unaligned * 2;
+            converters[i].reference(in, ref, count);
+            converters[i].convert(in, out, count);
+            int d = max_diff(ref, out, count * 3);
+            diff = d > diff ? d : diff;
+        }
+        double ref_mp = line_mpixels(converters[i].reference, src, ref, pixels);
+        double mp = line_mpixels(converters[i].convert, src, out, pixels);
+        ESP_LOGI(TAG, "%-12s lines: %6.1f Mpixel/s, per pixel: %6.1f Mpixel/s, max diff %d", converters[i].name, mp,
+                 ref_mp, diff);
+        if (diff > max) {
+            ESP_LOGE(TAG, "%s line converter differs from the per pixel one by %d", converters[i].name, diff);
+            ok = false;
+        }
+    }
+
+out:
+    free(src);
+    free(ref);
+    free(out);
+    return ok;
+}
+
+typedef struct {
+    size_t len;
+    uint32_t hash;
+} hash_out_t;
+
+static size_t hash_out(void *arg, size_t index, const void *data, size_t len)
+{
+    hash_out_t *out = arg;
+    const uint8_t *d = data;
+    for (size_t i = 0; i < len; i++) {
+        out->hash = (out->hash ^ d[i]) * 16777619;
+    }
+    out->len += len;
+    return len;
+}
+
+static bool benchmark_prefetch(void)
+{
+    const picture_t *pic = &pictures[sizeof(pictures) / sizeof(pictures[0]) - 1];
+    size_t pixels = PREFETCH_WIDTH * PREFETCH_HEIGHT;
+    size_t len = 0;
+    uint8_t *src = read_file(pic->file, &len);
+    uint8_t *rgb = malloc(pic->width * pic->height * 3);
+    uint8_t *bgr = malloc(pixels * 3);
+    uint8_t *rgb565 = malloc(pixels * 2);
+    uint8_t *yuyv = malloc(pixels * 2);
+    bool ok = src && rgb && bgr && rgb565 && yuyv && fmt2rgb888(src, len, PIXFORMAT_JPEG, rgb);
+    for (size_t y = 0; ok && y < PREFETCH_HEIGHT; y++) {
+        for (size_t x = 0; x < PREFETCH_WIDTH; x++) {
+            memcpy(bgr + (y * PREFETCH_WIDTH + x) * 3, rgb + ((y % pic->height) * pic->width + x % pic->width) * 3, 3);
+        }
+    }
+    if (ok) {
+        bgr_to_rgb565_yuyv(bgr, PREFETCH_WIDTH, pixels, rgb565, yuyv);
+    }
+
+    const jpg_source_read_t modes[] = { JPG_SOURCE_DIRECT, JPG_SOURCE_PREFETCH };
+    hash_out_t out[2] = { 0 };
+    double lines_per_s[2];
+    jpg_encode_config_t config = JPG_ENCODE_CONFIG_DEFAULT();
+    for (int m = 0; ok && m < 2; m++) {
+        config.source_read = modes[m];
+        int64_t start = esp_timer_get_time();
+        for (int r = 0; ok && r < PREFETCH_RUNS; r++) {
+            out[m] = (hash_out_t) { 0, 2166136261u };
+            ok = fmt2jpg_cb_ex(yuyv, pixels * 2, PREFETCH_WIDTH, PREFETCH_HEIGHT, PIXFORMAT_YUV422, &config, hash_out, &out[m]);
+        }
+        lines_per_s[m] = PREFETCH_HEIGHT * PREFETCH_RUNS * 1e6 / (esp_timer_get_time() - start);
+    }
+    if (ok && (out[0].len != out[1].len || out[0].hash != out[1].hash)) {
+        ESP_LOGE(TAG, "Prefetched source stripes changed the JPEG");
+        ok = false;
+    }
+    if (ok) {
+        ESP_LOGI(TAG, "%ux%u yuv422 %6u bytes, in place %6.0f lines/s, prefetched %6.0f lines/s, %.2fx",
+                 PREFETCH_WIDTH, PREFETCH_HEIGHT, (unsigned) out[0].len, lines_per_s[0], lines_per_s[1],
+                 lines_per_s[1] / lines_per_s[0]);
+    }
+    free(src);
+    free(rgb);
+    free(bgr);
+    free(rgb565);
+    free(yuyv);
+    return ok;
+}
+
+void app_main(void)
+{
+    bool ok = true;
+    for (size_t i = 0; ok && i < sizeof(pictures) / sizeof(pictures[0]); i++) {
+        ok = benchmark_picture(&pictures[i]);
+    }
+    ok = ok && benchmark_lines();
+    ok = ok && benchmark_prefetch();
+    ESP_LOGI(TAG, "%s", ok ? "PASS" : "FAIL");
+    exit(ok ? 0 : 1);
+}
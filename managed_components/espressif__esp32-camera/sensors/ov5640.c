@@ -26,7 +26,14 @@ static const char *TAG = "ov5640";
 
 //#define REG_DEBUG_ON
 
+// registers of the frame size switches, which only write those that change
+static sccb_mode_t s_mode;
+
 static int read_reg(uint8_t slv_addr, const uint16_t reg){
+    uint8_t value;
+    if (SCCB_Mode_Read(&s_mode, reg, &value)) {
+        return value;
+    }
     int ret = SCCB_Read16(slv_addr, reg);
 #ifdef REG_DEBUG_ON
     if (ret < 0) {
@@ -108,6 +115,9 @@ static int read_reg16(uint8_t slv_addr, const uint16_t reg){
 static int write_reg(uint8_t slv_addr, const uint16_t reg, uint8_t value){
     int ret = 0;
 #ifndef REG_DEBUG_ON
+    if (SCCB_Mode_Write(&s_mode, reg, &value, 1)) {
+        return 0;
+    }
     ret = SCCB_Write16(slv_addr, reg, value);
 #else
     int old_value = read_reg(slv_addr, reg);
@@ -148,28 +158,55 @@ static int write_regs(uint8_t slv_addr, const uint16_t (*regs)[2])
     while (!ret && regs[i][0] != REGLIST_TAIL) {
         if (regs[i][0] == REG_DLY) {
             vTaskDelay(regs[i][1] / portTICK_PERIOD_MS);
-        } else {
-            ret = write_reg(slv_addr, regs[i][0], regs[i][1]);
+            i++;
+            continue;
+        }
+#ifndef REG_DEBUG_ON
+        // the registers up to the next delay are sent in runs of consecutive addresses
+        int n = 1;
+        while (regs[i + n][0] != REGLIST_TAIL && regs[i + n][0] != REG_DLY) {
+            n++;
         }
+        ret = SCCB_Mode_Write_Regs(&s_mode, regs + i, n) ? 0 : SCCB_Write16_Regs(slv_addr, regs + i, n);
+        i += n;
+#else
+        ret = write_reg(slv_addr, regs[i][0], regs[i][1]);
         i++;
+#endif
     }
     return ret;
 }
 
 static int write_reg16(uint8_t slv_addr, const uint16_t reg, uint16_t value)
 {
+#ifndef REG_DEBUG_ON
+    uint8_t data[2] = { value >> 8, value & 0xFF };
+    if (SCCB_Mode_Write(&s_mode, reg, data, 2)) {
+        return 0;
+    }
+    return SCCB_Write16_Burst(slv_addr, reg, data, 2) ? -1 : 0;
+#else
     if (write_reg(slv_addr, reg, value >> 8) || write_reg(slv_addr, reg + 1, value)) {
         return -1;
     }
     return 0;
+#endif
 }
 
 static int write_addr_reg(uint8_t slv_addr, const uint16_t reg, uint16_t x_value, uint16_t y_value)
 {
+#ifndef REG_DEBUG_ON
+    uint8_t data[4] = { x_value >> 8, x_value & 0xFF, y_value >> 8, y_value & 0xFF };
+    if (SCCB_Mode_Write(&s_mode, reg, data, 4)) {
+        return 0;
+    }
+    return SCCB_Write16_Burst(slv_addr, reg, data, 4) ? -1 : 0;
+#else
     if (write_reg16(slv_addr, reg, x_value) || write_reg16(slv_addr, reg + 2, y_value)) {
         return -1;
     }
     return 0;
+#endif
 }
 
 #define write_reg_bits(slv_addr, reg, mask, enable) set_reg_bits(slv_addr, reg, 0, mask, (enable)?(mask):0)
@@ -258,6 +295,8 @@ static int reset(sensor_t *sensor)
         ESP_LOGE(TAG, "Software Reset FAILED!");
         return ret;
     }
+    // the registers are back to their defaults
+    SCCB_Mode_Init(&s_mode, sensor->slv_addr, true);
     vTaskDelay(100 / portTICK_PERIOD_MS);
     ret = write_regs(sensor->slv_addr, sensor_default_regs);
     if (ret == 0) {
@@ -378,7 +417,7 @@ static int set_image_options(sensor_t *sensor)
     return ret;
 }
 
-static int set_framesize(sensor_t *sensor, framesize_t framesize)
+static int set_framesize_regs(sensor_t *sensor, framesize_t framesize)
 {
     int ret = 0;
     framesize_t old_framesize = sensor->status.framesize;
@@ -463,6 +502,15 @@ fail:
     return ret;
 }
 
+static int set_framesize(sensor_t *sensor, framesize_t framesize)
+{
+    // the writes are recorded, then only those that change a register are sent
+    SCCB_Mode_Begin(&s_mode);
+    int ret = set_framesize_regs(sensor, framesize);
+    int ret2 = SCCB_Mode_End(&s_mode);
+    return ret ? ret : ret2;
+}
+
 static int set_hmirror(sensor_t *sensor, int enable)
 {
     int ret = 0;
@@ -1091,6 +1139,7 @@ int ov5640_detect(int slv_addr, sensor_id_t *id)
 
 int ov5640_init(sensor_t *sensor)
 {
+    SCCB_Mode_Init(&s_mode, sensor->slv_addr, true);
     sensor->reset = reset;
     sensor->set_pixformat = set_pixformat;
     sensor->set_framesize = set_framesize;
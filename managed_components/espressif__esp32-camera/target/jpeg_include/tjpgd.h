@@ -6,13 +6,37 @@
 /*---------------------------------------------------------------------------*/
 /* System Configurations */
 
+#include "sdkconfig.h"
+
+#ifdef CONFIG_CAMERA_JPEG_DECODER_INPUT_BUFFER
+#define	JD_SZBUF		CONFIG_CAMERA_JPEG_DECODER_INPUT_BUFFER	/* Size of stream input buffer */
+#else
 #define	JD_SZBUF		512	/* Size of stream input buffer */
-#define JD_FORMAT		0	/* Output pixel format 0:RGB888 (3 BYTE/pix), 1:RGB565 (1 WORD/pix) */
+#endif
+#define JD_FORMAT		0	/* Default output pixel format, see JD_FMT_* */
 #define	JD_USE_SCALE	1	/* Use descaling feature for output */
 #define JD_TBLCLIP		1	/* Use table for saturation (might be a bit faster but increases 1K bytes of code size) */
 
+#ifndef JD_FASTDECODE
+#if CONFIG_CAMERA_JPEG_DECODER_HUFFMAN_LUT
+#define JD_FASTDECODE	2
+#elif CONFIG_CAMERA_JPEG_DECODER_ACCUMULATOR
+#define JD_FASTDECODE	1
+#else
+#define JD_FASTDECODE	0
+#endif
+#endif
+/* Bit stream reader 0:Bit by bit, 1:32-bit shift register, 2:Shift register and lookup tables for short huffman codes */
+
+#define JD_HUFFBIT		9	/* Longest huffman code in the lookup tables (JD_FASTDECODE == 2) */
+
+/* Memory pool for an image with two quantizer tables, as written by the camera sensors and the encoder */
+#define JD_SZPOOL		(JD_SZBUF + 2588 + (JD_FASTDECODE == 2 ? 6 << JD_HUFFBIT : 0))
+
 /*---------------------------------------------------------------------------*/
 
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -33,10 +57,17 @@ typedef unsigned short	WORD;
 typedef unsigned short	WCHAR;
 
 /* These types must be 32-bit integer */
-typedef long			LONG;
-typedef unsigned long	ULONG;
-typedef unsigned long	DWORD;
+typedef int32_t			LONG;
+typedef uint32_t		ULONG;
+typedef uint32_t		DWORD;
+
 
+/* Output pixel formats, set JDEC.format between jd_prepare() and jd_decomp() */
+#define JD_FMT_RGB888	0	/* R, G, B (3 BYTE/pix) */
+#define JD_FMT_RGB565	1	/* RGB565 (1 WORD/pix) */
+#define JD_FMT_BGR888	2	/* B, G, R (3 BYTE/pix) */
+#define JD_FMT_RGB565BE	3	/* RGB565, upper byte first (2 BYTE/pix) */
+#define JD_FMT_GRAY		4	/* Y component only (1 BYTE/pix) */
 
 /* Error code */
 typedef enum {
@@ -68,6 +99,7 @@ struct JDEC {
 	BYTE* inbuf;			/* Bit stream input buffer */
 	BYTE dmsk;				/* Current bit in the current read byte */
 	BYTE scale;				/* Output scaling ratio */
+	BYTE format;			/* Output pixel format (JD_FMT_*) */
 	BYTE msx, msy;			/* MCU size in unit of block (width, height) */
 	BYTE qtid[3];			/* Quantization table ID of each component */
 	SHORT dcv[3];			/* Previous DC element of each component */
@@ -83,12 +115,24 @@ struct JDEC {
 	UINT sz_pool;			/* Size of momory pool (bytes available) */
 	UINT (*infunc)(JDEC*, BYTE*, UINT);/* Pointer to jpeg stream input function */
 	void* device;			/* Pointer to I/O device identifiler for the session */
+	const BYTE* mem;		/* Unread part of the memory input given to jd_prepare_mem() */
+	UINT sz_mem;			/* Size of the unread memory input (bytes) */
+#if JD_FASTDECODE >= 1
+	DWORD wreg;				/* Working shift register, valid bits are left aligned */
+	UINT dbit;				/* Number of valid bits in the shift register */
+	BYTE marker;			/* Marker found in the bit stream (0:none) */
+#endif
+#if JD_FASTDECODE == 2
+	BYTE* hufflut_dc[2];	/* Huffman lookup tables of the DC elements [id] (bit length << 4 | data) */
+	WORD* hufflut_ac[2];	/* Huffman lookup tables of the AC elements [id] (bit length << 8 | data) */
+#endif
 };
 
 
 
 /* TJpgDec API functions */
 JRESULT jd_prepare (JDEC*, UINT(*)(JDEC*,BYTE*,UINT), void*, UINT, void*);
+JRESULT jd_prepare_mem (JDEC*, const BYTE*, UINT, void*, UINT, void*);
 JRESULT jd_decomp (JDEC*, UINT(*)(JDEC*,void*,JRECT*), BYTE);
 
 
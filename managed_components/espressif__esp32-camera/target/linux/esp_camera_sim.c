@@ -0,0 +1,215 @@
+// Copyright 2010-2020 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*
+ * esp_camera API for the linux target. Instead of esp_camera.c this drives
+ * cam_hal directly with the simulated ll_cam backend. Without a sensor on the
+ * simulated SCCB bus, the sensor control structure only supports set_quality(),
+ * which records the value for applications that adapt it. With one, its driver
+ * is detected and initialized like esp_camera_init() does on the chip, and all
+ * the sensor controls write to the simulated registers.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "sensor.h"
+#include "cam_hal.h"
+#include "esp_camera.h"
+#include "esp_camera_sim.h"
+#include "sccb.h"
+#include "xclk.h"
+#include "ov3660.h"
+#include "ov5640.h"
+
+static const char *TAG = "camera sim";
+
+static sensor_t *s_sensor = NULL;
+
+static int sim_set_quality(sensor_t *sensor, int quality)
+{
+    sensor->status.quality = quality;
+    return 0;
+}
+
+typedef struct {
+    int (*detect)(int slv_addr, sensor_id_t *id);
+    int (*init)(sensor_t *sensor);
+} sensor_func_t;
+
+static const sensor_func_t g_sensors[] = {
+    {ov3660_detect, ov3660_init},
+    {ov5640_detect, ov5640_init},
+};
+
+// XCLK is not generated by the simulator
+esp_err_t xclk_timer_conf(int ledc_timer, int xclk_freq_hz)
+{
+    return ESP_OK;
+}
+
+static esp_err_t sim_sensor_init(const camera_config_t *config, framesize_t frame_size)
+{
+    s_sensor->slv_addr = SCCB_Probe();
+    s_sensor->xclk_freq_hz = config->xclk_freq_hz;
+    for (size_t i = 0; i < sizeof(g_sensors) / sizeof(sensor_func_t); i++) {
+        if (g_sensors[i].detect(s_sensor->slv_addr, &s_sensor->id)) {
+            g_sensors[i].init(s_sensor);
+            break;
+        }
+    }
+    if (s_sensor->reset == NULL || s_sensor->reset(s_sensor) != 0) {
+        ESP_LOGE(TAG, "Simulated sensor 0x%x was not initialized", esp_camera_sim_get_sensor());
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    s_sensor->status.framesize = frame_size;
+    s_sensor->pixformat = (pixformat_t) config->pixel_format;
+    if (s_sensor->set_framesize(s_sensor, frame_size) != 0) {
+        ESP_LOGE(TAG, "Failed to set frame size");
+        return ESP_ERR_CAMERA_FAILED_TO_SET_FRAME_SIZE;
+    }
+    s_sensor->set_pixformat(s_sensor, (pixformat_t) config->pixel_format);
+    if (config->pixel_format == PIXFORMAT_JPEG) {
+        s_sensor->set_quality(s_sensor, config->jpeg_quality);
+    }
+    s_sensor->init_status(s_sensor);
+    return ESP_OK;
+}
+
+esp_err_t esp_camera_init(const camera_config_t *config)
+{
+    esp_err_t err = cam_init(config);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Camera init failed with error 0x%x", err);
+        return err;
+    }
+
+    s_sensor = (sensor_t *)calloc(1, sizeof(sensor_t));
+    if (s_sensor == NULL) {
+        err = ESP_ERR_NO_MEM;
+        goto fail;
+    }
+
+    framesize_t frame_size = (framesize_t) config->frame_size;
+    if (esp_camera_sim_get_sensor()) {
+        err = sim_sensor_init(config, frame_size);
+        if (err != ESP_OK) {
+            goto fail;
+        }
+    } else {
+        s_sensor->pixformat = (pixformat_t) config->pixel_format;
+        s_sensor->status.framesize = frame_size;
+        s_sensor->status.quality = config->jpeg_quality;
+        s_sensor->set_quality = sim_set_quality;
+    }
+
+    err = cam_config(config, frame_size, s_sensor->id.PID);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Camera config failed with error 0x%x", err);
+        goto fail;
+    }
+
+    cam_start();
+
+    return ESP_OK;
+
+fail:
+    esp_camera_deinit();
+    return err;
+}
+
+esp_err_t esp_camera_deinit(void)
+{
+    esp_err_t ret = cam_deinit();
+    free(s_sensor);
+    s_sensor = NULL;
+    return ret;
+}
+
+#define FB_GET_TIMEOUT (4000 / portTICK_PERIOD_MS)
+
+camera_fb_t *esp_camera_fb_get(void)
+{
+    if (s_sensor == NULL) {
+        return NULL;
+    }
+    camera_fb_t *fb = cam_take(FB_GET_TIMEOUT);
+    //set the frame properties
+    if (fb) {
+        fb->width = resolution[s_sensor->status.framesize].width;
+        fb->height = resolution[s_sensor->status.framesize].height;
+        fb->format = s_sensor->pixformat;
+    }
+    return fb;
+}
+
+void esp_camera_fb_return(camera_fb_t *fb)
+{
+    if (s_sensor == NULL) {
+        return;
+    }
+    cam_give(fb);
+}
+
+sensor_t *esp_camera_sensor_get(void)
+{
+    return s_sensor;
+}
+
+void esp_camera_return_all(void)
+{
+    if (s_sensor == NULL) {
+        return;
+    }
+    cam_give_all();
+}
+
+esp_err_t esp_camera_get_stats(camera_stats_t *stats)
+{
+    if (stats == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (s_sensor == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    cam_get_stats(stats);
+    return ESP_OK;
+}
+
+void esp_camera_reset_stats(void)
+{
+    if (s_sensor == NULL) {
+        return;
+    }
+    cam_reset_stats();
+}
+
+size_t esp_camera_get_jpeg_fb_size(void)
+{
+    if (s_sensor == NULL) {
+        return 0;
+    }
+    return cam_get_jpeg_fb_size();
+}
+
+esp_err_t esp_camera_set_jpeg_fb_size(size_t size)
+{
+    if (s_sensor == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    return cam_set_jpeg_fb_size(size);
+}
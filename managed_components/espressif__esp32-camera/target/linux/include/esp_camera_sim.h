@@ -0,0 +1,159 @@
+// Copyright 2010-2020 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+/*
+ * Camera simulator for the linux target
+ *
+ * Frames are read from files and replayed through the same VSYNC/EOF event
+ * sequence the camera peripheral generates, so cam_hal and everything above it
+ * (esp_camera_fb_get(), frame statistics, applications) run unmodified on a host.
+ *
+ * Example Use
+ *
+    static const char *files[] = { "frame0.jpg", "frame1.jpg" };
+    camera_sim_config_t sim = {
+        .files = files,
+        .file_count = 2,
+        .frame_interval_us = 40000,
+        .jitter_us = 5000,
+    };
+    esp_camera_sim_config(&sim);
+    esp_camera_init(&camera_config);  // JPEG, xclk_freq_hz != 16MHz (EDMA mode is not simulated)
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Faults the simulator can inject into a frame
+ */
+typedef enum {
+    CAMERA_SIM_FAULT_NO_SOI = (1 << 0),         /*!< First bytes of the frame are corrupted (NO-SOI) */
+    CAMERA_SIM_FAULT_NO_EOI = (1 << 1),         /*!< Frame is truncated before the EOI marker (NO-EOI) */
+    CAMERA_SIM_FAULT_EVENT_OVERFLOW = (1 << 2), /*!< Events are raised faster than cam_task can take them (EV-OVF) */
+} camera_sim_fault_t;
+
+/**
+ * @brief Simulator configuration
+ */
+typedef struct {
+    const char *const *files;   /*!< Frame files replayed in a loop, one frame per file. Raw frames must match the configured frame size */
+    size_t file_count;          /*!< Number of entries in files */
+    uint32_t frame_interval_us; /*!< Time between two VSYNC events */
+    uint32_t jitter_us;         /*!< Maximum random deviation of the frame interval */
+    uint8_t no_soi_pct;         /*!< Probability in percent of a CAMERA_SIM_FAULT_NO_SOI frame */
+    uint8_t no_eoi_pct;         /*!< Probability in percent of a CAMERA_SIM_FAULT_NO_EOI frame */
+    uint8_t event_overflow_pct; /*!< Probability in percent of a CAMERA_SIM_FAULT_EVENT_OVERFLOW frame */
+    uint32_t seed;              /*!< Seed of the jitter and fault generator, runs with the same seed are repeatable */
+} camera_sim_config_t;
+
+/**
+ * @brief Frames replayed by the simulator and faults it injected
+ */
+typedef struct {
+    uint32_t frames;            /*!< Frames whose transfer was started */
+    uint32_t no_soi;            /*!< Frames sent with CAMERA_SIM_FAULT_NO_SOI */
+    uint32_t no_eoi;            /*!< Frames sent with CAMERA_SIM_FAULT_NO_EOI */
+    uint32_t event_overflow;    /*!< Frames sent with CAMERA_SIM_FAULT_EVENT_OVERFLOW */
+} camera_sim_stats_t;
+
+/**
+ * @brief Transactions on the simulated SCCB bus
+ */
+typedef struct {
+    uint32_t transactions;      /*!< Write and read transactions, each from a start to a stop condition */
+    uint32_t writes;            /*!< Registers written */
+    uint32_t reads;             /*!< Registers read */
+    uint32_t bus_us;            /*!< Time the transactions take on the bus at CONFIG_SCCB_CLK_FREQ */
+} camera_sim_sccb_stats_t;
+
+/**
+ * @brief Load the frames and set the timing of the simulated sensor
+ *
+ * @note Must be called before esp_camera_init()
+ *
+ * @param config  Simulator configuration
+ *
+ * @return
+ *      - ESP_OK on success
+ *      - ESP_ERR_INVALID_ARG if no file is given
+ *      - ESP_ERR_NOT_FOUND if a file can not be read
+ *      - ESP_ERR_NO_MEM if the frames do not fit in memory
+ */
+esp_err_t esp_camera_sim_config(const camera_sim_config_t *config);
+
+/**
+ * @brief Inject faults into the next frame, in addition to the random ones
+ *
+ * @param faults  Bitmask of camera_sim_fault_t
+ */
+void esp_camera_sim_inject_fault(uint32_t faults);
+
+/**
+ * @brief Get the simulator counters
+ *
+ * @param stats   Structure to be filled with the counters
+ */
+void esp_camera_sim_get_stats(camera_sim_stats_t *stats);
+
+/**
+ * @brief Put a sensor on the simulated SCCB bus
+ *
+ * esp_camera_init() then detects it and runs its driver, whose register
+ * writes go to a register file instead of a sensor. The frames are still read
+ * from the files of esp_camera_sim_config().
+ *
+ * @param pid     OV3660_PID or OV5640_PID
+ *
+ * @return
+ *      - ESP_OK on success
+ *      - ESP_ERR_NOT_SUPPORTED if there is no simulated sensor with this PID
+ */
+esp_err_t esp_camera_sim_set_sensor(uint16_t pid);
+
+/**
+ * @brief Get the PID of the sensor on the simulated SCCB bus, 0 if there is none
+ */
+uint16_t esp_camera_sim_get_sensor(void);
+
+/**
+ * @brief Get the SCCB transaction counters
+ *
+ * @param stats   Structure to be filled with the counters
+ */
+void esp_camera_sim_sccb_get_stats(camera_sim_sccb_stats_t *stats);
+
+/**
+ * @brief Clear the SCCB transaction counters
+ */
+void esp_camera_sim_sccb_reset_stats(void);
+
+/**
+ * @brief Read a register of the simulated sensor without a bus transaction
+ *
+ * @param reg     Register address
+ *
+ * @return The last value written to it
+ */
+uint8_t esp_camera_sim_sccb_get_reg(uint16_t reg);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,375 @@
+// Copyright 2010-2020 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ll_cam.h"
+#include "cam_hal.h"
+#include "esp_camera_sim.h"
+
+static const char *TAG = "sim ll_cam";
+
+/*
+ * The simulator task plays the role of the camera peripheral and its interrupts:
+ * it raises CAM_VSYNC_EVENT at the frame rate and, while the "DMA" is running,
+ * fills the DMA half buffers with frame data and raises CAM_IN_SUC_EOF_EVENT for
+ * each of them. It runs just below cam_task, so cam_task takes every event as
+ * soon as it is sent unless an overflow is being injected.
+ */
+#define SIM_TASK_STACK      4096
+#define SIM_TASK_PRIO       (configMAX_PRIORITIES - 3)
+
+typedef struct {
+    uint8_t *buf;
+    size_t len;
+} sim_frame_t;
+
+static camera_sim_config_t s_config;
+static sim_frame_t *s_frames = NULL;
+static size_t s_frame_cnt = 0;
+static uint32_t s_rand = 1;
+
+static cam_obj_t *s_cam = NULL;
+static TaskHandle_t s_sim_task = NULL;
+static volatile bool s_sim_exit = false;
+static volatile bool s_vsync_en = false;
+static volatile bool s_dma_running = false;
+static volatile uint32_t s_forced_faults = 0;
+static camera_sim_stats_t s_stats;
+
+static uint32_t sim_rand(void)
+{
+    s_rand = s_rand * 1103515245 + 12345;
+    return s_rand >> 8;
+}
+
+static void sim_free_frames(void)
+{
+    for (size_t i = 0; i < s_frame_cnt; i++) {
+        free(s_frames[i].buf);
+    }
+    free(s_frames);
+    s_frames = NULL;
+    s_frame_cnt = 0;
+}
+
+static uint8_t *sim_read_file(const char *path, size_t *len)
+{
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        return NULL;
+    }
+    uint8_t *buf = NULL;
+    if (fseek(f, 0, SEEK_END) == 0) {
+        long size = ftell(f);
+        if (size > 0 && fseek(f, 0, SEEK_SET) == 0) {
+            buf = (uint8_t *)malloc(size);
+            if (buf && fread(buf, 1, size, f) != (size_t)size) {
+                free(buf);
+                buf = NULL;
+            }
+            *len = size;
+        }
+    }
+    fclose(f);
+    return buf;
+}
+
+static void sim_send(cam_event_t event)
+{
+    BaseType_t HPTaskAwoken = pdFALSE;
+    ll_cam_send_event(s_cam, event, &HPTaskAwoken);
+    if (HPTaskAwoken == pdTRUE && xTaskGetSchedulerState() == taskSCHEDULER_RUNNING) {
+        taskYIELD();
+    }
+}
+
+static uint32_t sim_pick_faults(void)
+{
+    uint32_t faults = s_forced_faults;
+    s_forced_faults = 0;
+    if (s_config.no_soi_pct && (sim_rand() % 100) < s_config.no_soi_pct) {
+        faults |= CAMERA_SIM_FAULT_NO_SOI;
+    }
+    if (s_config.no_eoi_pct && (sim_rand() % 100) < s_config.no_eoi_pct) {
+        faults |= CAMERA_SIM_FAULT_NO_EOI;
+    }
+    if (s_config.event_overflow_pct && (sim_rand() % 100) < s_config.event_overflow_pct) {
+        faults |= CAMERA_SIM_FAULT_EVENT_OVERFLOW;
+    }
+    return faults;
+}
+
+static void sim_transfer(const sim_frame_t *frame, uint32_t faults)
+{
+    cam_obj_t *cam = s_cam;
+    size_t half = cam->dma_half_buffer_size;
+    size_t len = frame->len;
+    size_t cnt = 0;
+    size_t offset = 0;
+
+    s_stats.frames++;
+    if (faults & CAMERA_SIM_FAULT_NO_SOI) {
+        s_stats.no_soi++;
+    }
+    if (faults & CAMERA_SIM_FAULT_NO_EOI) {
+        // Cut the frame in the middle so that no EOI marker is left
+        len /= 2;
+        s_stats.no_eoi++;
+    }
+    if (faults & CAMERA_SIM_FAULT_EVENT_OVERFLOW) {
+        // cam_task can not run while the scheduler is suspended, so the event queue fills up
+        s_stats.event_overflow++;
+        vTaskSuspendAll();
+    }
+
+    while (s_dma_running && offset < len) {
+        uint8_t *dst = &cam->dma_buffer[(cnt % cam->dma_half_buffer_cnt) * half];
+        size_t n = len - offset < half ? len - offset : half;
+        memcpy(dst, frame->buf + offset, n);
+        if (offset == 0 && (faults & CAMERA_SIM_FAULT_NO_SOI)) {
+            memset(dst, 0, n < 3 ? n : 3);
+        }
+        offset += n;
+        if (n < half) {
+            // The last partial buffer is picked up by cam_task on the next VSYNC
+            memset(dst + n, 0, half - n);
+            break;
+        }
+        cnt++;
+        sim_send(CAM_IN_SUC_EOF_EVENT);
+    }
+
+    if (faults & CAMERA_SIM_FAULT_EVENT_OVERFLOW) {
+        // Small frames do not fill the queue, keep raising EOF until the driver stops the transfer
+        while (s_dma_running) {
+            sim_send(CAM_IN_SUC_EOF_EVENT);
+        }
+        xTaskResumeAll();
+    }
+}
+
+static void sim_task(void *arg)
+{
+    size_t pos = 0;
+
+    while (!s_sim_exit) {
+        uint32_t interval = s_config.frame_interval_us;
+        if (s_config.jitter_us) {
+            interval += sim_rand() % (2 * s_config.jitter_us + 1);
+            interval = interval > s_config.jitter_us ? interval - s_config.jitter_us : 0;
+        }
+        TickType_t ticks = pdMS_TO_TICKS(interval / 1000);
+        vTaskDelay(ticks ? ticks : 1);
+
+        if (!s_vsync_en) {
+            continue;
+        }
+        // End of the previous frame and start of the next one
+        sim_send(CAM_VSYNC_EVENT);
+
+        if (s_dma_running) {
+            sim_transfer(&s_frames[pos], sim_pick_faults());
+            pos = (pos + 1) % s_frame_cnt;
+        }
+    }
+    s_sim_task = NULL;
+    vTaskDelete(NULL);
+}
+
+esp_err_t esp_camera_sim_config(const camera_sim_config_t *config)
+{
+    if (config == NULL || config->files == NULL || config->file_count == 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    sim_free_frames();
+    s_frames = (sim_frame_t *)calloc(config->file_count, sizeof(sim_frame_t));
+    if (s_frames == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    for (size_t i = 0; i < config->file_count; i++) {
+        s_frames[i].buf = sim_read_file(config->files[i], &s_frames[i].len);
+        if (s_frames[i].buf == NULL) {
+            ESP_LOGE(TAG, "Failed to read frame file %s", config->files[i]);
+            sim_free_frames();
+            return ESP_ERR_NOT_FOUND;
+        }
+        s_frame_cnt++;
+    }
+
+    s_config = *config;
+    s_config.files = NULL;
+    s_rand = config->seed ? config->seed : 1;
+    memset(&s_stats, 0, sizeof(s_stats));
+    ESP_LOGI(TAG, "Loaded %u frames", (unsigned) s_frame_cnt);
+    return ESP_OK;
+}
+
+void esp_camera_sim_inject_fault(uint32_t faults)
+{
+    s_forced_faults |= faults;
+}
+
+void esp_camera_sim_get_stats(camera_sim_stats_t *stats)
+{
+    *stats = s_stats;
+}
+
+bool ll_cam_stop(cam_obj_t *cam)
+{
+    s_dma_running = false;
+    return true;
+}
+
+esp_err_t ll_cam_deinit(cam_obj_t *cam)
+{
+    s_vsync_en = false;
+    s_dma_running = false;
+    if (s_sim_task) {
+        s_sim_exit = true;
+        while (s_sim_task) {
+            vTaskDelay(1);
+        }
+    }
+    s_cam = NULL;
+    return ESP_OK;
+}
+
+bool ll_cam_start(cam_obj_t *cam, int frame_pos)
+{
+    s_dma_running = true;
+    return true;
+}
+
+esp_err_t ll_cam_config(cam_obj_t *cam, const camera_config_t *config)
+{
+    if (s_frame_cnt == 0) {
+        ESP_LOGE(TAG, "No frames loaded, call esp_camera_sim_config() first");
+        return ESP_ERR_INVALID_STATE;
+    }
+    s_cam = cam;
+    return ESP_OK;
+}
+
+void ll_cam_vsync_intr_enable(cam_obj_t *cam, bool en)
+{
+    s_vsync_en = en;
+}
+
+esp_err_t ll_cam_set_pin(cam_obj_t *cam, const camera_config_t *config)
+{
+    return ESP_OK;
+}
+
+esp_err_t ll_cam_init_isr(cam_obj_t *cam)
+{
+    s_sim_exit = false;
+    if (xTaskCreate(sim_task, "cam_sim", SIM_TASK_STACK, NULL, SIM_TASK_PRIO, &s_sim_task) != pdPASS) {
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+void ll_cam_do_vsync(cam_obj_t *cam)
+{
+}
+
+uint8_t ll_cam_get_dma_align(cam_obj_t *cam)
+{
+    return 16;
+}
+
+static bool ll_cam_calc_rgb_dma(cam_obj_t *cam)
+{
+    size_t line_width = cam->width * cam->in_bytes_per_pixel;
+    size_t dma_half_buffer_max = CONFIG_CAMERA_DMA_BUFFER_SIZE_MAX / 2;
+    if (line_width > dma_half_buffer_max) {
+        ESP_LOGE(TAG, "Resolution too high");
+        return 0;
+    }
+
+    // Whole lines per EOF, with the height divisible by the number of lines
+    size_t lines_per_half_buffer = dma_half_buffer_max / line_width;
+    while ((cam->height % lines_per_half_buffer) != 0) {
+        lines_per_half_buffer--;
+    }
+
+    cam->dma_half_buffer_size = lines_per_half_buffer * line_width;
+    cam->dma_half_buffer_cnt = CONFIG_CAMERA_DMA_BUFFER_SIZE_MAX / cam->dma_half_buffer_size;
+    cam->dma_buffer_size = cam->dma_half_buffer_cnt * cam->dma_half_buffer_size;
+    cam->dma_node_buffer_size = line_width;
+    while (cam->dma_node_buffer_size > LCD_CAM_DMA_NODE_BUFFER_MAX_SIZE) {
+        cam->dma_node_buffer_size /= 2;
+    }
+    return 1;
+}
+
+bool ll_cam_dma_sizes(cam_obj_t *cam)
+{
+    if (cam->psram_mode) {
+        ESP_LOGE(TAG, "EDMA mode is not supported by the simulator");
+        return 0;
+    }
+    cam->dma_bytes_per_item = 1;
+    if (cam->jpeg_mode) {
+        cam->dma_half_buffer_cnt = 16;
+        cam->dma_buffer_size = cam->dma_half_buffer_cnt * 1024;
+        cam->dma_half_buffer_size = cam->dma_buffer_size / cam->dma_half_buffer_cnt;
+        cam->dma_node_buffer_size = cam->dma_half_buffer_size;
+    } else {
+        return ll_cam_calc_rgb_dma(cam);
+    }
+    return 1;
+}
+
+size_t ll_cam_memcpy(cam_obj_t *cam, uint8_t *out, const uint8_t *in, size_t len)
+{
+    // YUV to Grayscale
+    if (cam->in_bytes_per_pixel == 2 && cam->fb_bytes_per_pixel == 1) {
+        size_t end = len / 8;
+        for (size_t i = 0; i < end; ++i) {
+            out[0] = in[0];
+            out[1] = in[2];
+            out[2] = in[4];
+            out[3] = in[6];
+            out += 4;
+            in += 8;
+        }
+        return len / 2;
+    }
+
+    // just memcpy
+    memcpy(out, in, len);
+    return len;
+}
+
+esp_err_t ll_cam_set_sample_mode(cam_obj_t *cam, pixformat_t pix_format, uint32_t xclk_freq_hz, uint16_t sensor_pid)
+{
+    if (pix_format == PIXFORMAT_GRAYSCALE) {
+        cam->in_bytes_per_pixel = 1;       // frame files hold Y8
+        cam->fb_bytes_per_pixel = 1;
+    } else if (pix_format == PIXFORMAT_YUV422 || pix_format == PIXFORMAT_RGB565) {
+        cam->in_bytes_per_pixel = 2;
+        cam->fb_bytes_per_pixel = 2;
+    } else if (pix_format == PIXFORMAT_JPEG) {
+        cam->in_bytes_per_pixel = 1;
+        cam->fb_bytes_per_pixel = 1;
+    } else {
+        ESP_LOGE(TAG, "Requested format is not supported");
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    return ESP_OK;
+}
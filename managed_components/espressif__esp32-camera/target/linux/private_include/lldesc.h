@@ -0,0 +1,34 @@
+// Copyright 2010-2020 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Host stand-ins for the ROM DMA descriptor and the interrupt handle, so that
+ * cam_hal can build its DMA chains unchanged when running on the simulator.
+ */
+typedef struct lldesc_s {
+    volatile uint32_t size   : 12,
+             length : 12,
+             offset : 5,
+             sosf   : 1,
+             eof    : 1,
+             owner  : 1;
+    volatile const uint8_t *buf;
+    volatile uint32_t empty;
+} lldesc_t;
+
+typedef void *intr_handle_t;
@@ -0,0 +1,194 @@
+// Copyright 2010-2020 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*
+ * SCCB driver for the linux target. One simulated sensor sits on the bus: a
+ * register file with the chip ID of the selected sensor, which stores the
+ * bytes of a write at increasing register addresses like the OmniVision
+ * sensors do. Every transaction is counted with its bytes, so the cost of
+ * sensor init and mode switches can be measured without the hardware.
+ */
+
+#include <string.h>
+#include "sccb.h"
+#include "sensor.h"
+#include "sdkconfig.h"
+#include "esp_log.h"
+#include "esp_camera_sim.h"
+
+static const char *TAG = "sim sccb";
+
+/* I2C bits per transaction besides the bytes: start and stop, plus the repeated start of a read */
+#define SIM_BITS_PER_BYTE   9
+#define SIM_BITS_START_STOP 2
+
+static uint8_t s_addr = 0;
+static uint8_t s_regs[0x10000];
+static uint16_t s_id_reg = 0;
+static camera_sim_sccb_stats_t s_stats;
+
+static void sim_count(size_t bytes, bool read)
+{
+    s_stats.transactions++;
+    // the device address byte is sent once per write and twice per read
+    uint64_t bits = (bytes + (read ? 2 : 1)) * SIM_BITS_PER_BYTE + SIM_BITS_START_STOP * (read ? 2 : 1);
+    s_stats.bus_us += bits * 1000000 / CONFIG_SCCB_CLK_FREQ;
+}
+
+static bool sim_check(uint8_t slv_addr)
+{
+    if (slv_addr != s_addr || s_addr == 0) {
+        ESP_LOGE(TAG, "No device at address 0x%02x", slv_addr);
+        return false;
+    }
+    return true;
+}
+
+static void sim_store(uint16_t reg, const uint8_t *data, size_t len)
+{
+    for (size_t i = 0; i < len; i++, reg++) {
+        // the chip ID is read only
+        if (reg != s_id_reg && reg != (uint16_t)(s_id_reg + 1)) {
+            s_regs[reg] = data[i];
+        }
+    }
+    s_stats.writes += len;
+}
+
+esp_err_t esp_camera_sim_set_sensor(uint16_t pid)
+{
+    memset(s_regs, 0, sizeof(s_regs));
+    switch (pid) {
+    case OV3660_PID:
+        s_addr = OV3660_SCCB_ADDR;
+        break;
+    case OV5640_PID:
+        s_addr = OV5640_SCCB_ADDR;
+        break;
+    default:
+        s_addr = 0;
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    s_id_reg = 0x300A;
+    s_regs[s_id_reg] = pid >> 8;
+    s_regs[s_id_reg + 1] = pid & 0xFF;
+    esp_camera_sim_sccb_reset_stats();
+    return ESP_OK;
+}
+
+uint16_t esp_camera_sim_get_sensor(void)
+{
+    return s_addr ? (s_regs[s_id_reg] << 8) | s_regs[s_id_reg + 1] : 0;
+}
+
+void esp_camera_sim_sccb_get_stats(camera_sim_sccb_stats_t *stats)
+{
+    *stats = s_stats;
+}
+
+void esp_camera_sim_sccb_reset_stats(void)
+{
+    memset(&s_stats, 0, sizeof(s_stats));
+}
+
+uint8_t esp_camera_sim_sccb_get_reg(uint16_t reg)
+{
+    return s_regs[reg];
+}
+
+int SCCB_Init(int pin_sda, int pin_scl)
+{
+    return 0;
+}
+
+int SCCB_Use_Port(int sccb_i2c_port)
+{
+    return 0;
+}
+
+int SCCB_Deinit(void)
+{
+    return 0;
+}
+
+uint8_t SCCB_Probe(void)
+{
+    return s_addr;
+}
+
+uint8_t SCCB_Read(uint8_t slv_addr, uint8_t reg)
+{
+    if (!sim_check(slv_addr)) {
+        return 0xFF;
+    }
+    sim_count(2, true);
+    s_stats.reads++;
+    return s_regs[reg];
+}
+
+int SCCB_Write(uint8_t slv_addr, uint8_t reg, uint8_t data)
+{
+    return SCCB_Write_Multi(slv_addr, reg, &data, 1);
+}
+
+uint8_t SCCB_Read16(uint8_t slv_addr, uint16_t reg)
+{
+    if (!sim_check(slv_addr)) {
+        return 0xFF;
+    }
+    sim_count(3, true);
+    s_stats.reads++;
+    return s_regs[reg];
+}
+
+int SCCB_Write16(uint8_t slv_addr, uint16_t reg, uint8_t data)
+{
+    return SCCB_Write16_Multi(slv_addr, reg, &data, 1);
+}
+
+uint16_t SCCB_Read_Addr16_Val16(uint8_t slv_addr, uint16_t reg)
+{
+    if (!sim_check(slv_addr)) {
+        return 0xFFFF;
+    }
+    sim_count(4, true);
+    s_stats.reads += 2;
+    return (s_regs[reg] << 8) | s_regs[(uint16_t)(reg + 1)];
+}
+
+int SCCB_Write_Addr16_Val16(uint8_t slv_addr, uint16_t reg, uint16_t data)
+{
+    uint8_t value[2] = { data >> 8, data & 0xFF };
+    return SCCB_Write16_Multi(slv_addr, reg, value, 2);
+}
+
+int SCCB_Write_Multi(uint8_t slv_addr, uint8_t reg, const uint8_t *data, size_t len)
+{
+    if (!sim_check(slv_addr) || len > SCCB_BURST_MAX) {
+        return -1;
+    }
+    sim_count(1 + len, false);
+    sim_store(reg, data, len);
+    return 0;
+}
+
+int SCCB_Write16_Multi(uint8_t slv_addr, uint16_t reg, const uint8_t *data, size_t len)
+{
+    if (!sim_check(slv_addr) || len > SCCB_BURST_MAX) {
+        return -1;
+    }
+    sim_count(2 + len, false);
+    sim_store(reg, data, len);
+    return 0;
+}
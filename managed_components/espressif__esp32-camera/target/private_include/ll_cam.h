@@ -27,6 +27,8 @@
 #include "esp32s2/rom/lldesc.h"
 #elif CONFIG_IDF_TARGET_ESP32S3
 #include "esp32s3/rom/lldesc.h"
+#elif CONFIG_IDF_TARGET_LINUX
+#include "lldesc.h"
 #endif
 #include "esp_log.h"
 #include "esp_camera.h"
@@ -80,6 +82,14 @@ typedef enum {
     CAM_VSYNC_EVENT
 } cam_event_t;
 
+// Item of the event queue. A VSYNC carries its time and sequence number, taken in the ISR,
+// so the frame it starts is stamped with them however late cam_task handles it
+typedef struct {
+    cam_event_t type;
+    uint32_t vsync_cnt;
+    int64_t vsync_time;
+} cam_event_msg_t;
+
 typedef enum {
     CAM_STATE_IDLE = 0,
     CAM_STATE_READ_BUF = 1,
@@ -88,11 +98,24 @@ typedef enum {
 typedef struct {
     camera_fb_t fb;
     uint8_t en;
+    //held by the application between cam_take and cam_give
+    uint8_t taken;
     //for RGB/YUV modes
     lldesc_t *dma;
     size_t fb_offset;
 } cam_frame_t;
 
+typedef struct {
+    volatile uint32_t frames_captured;
+    volatile uint32_t frames_dropped;
+    volatile uint32_t fb_overflow;
+    volatile uint32_t no_soi;
+    volatile uint32_t no_eoi;
+    volatile uint32_t event_overflow;//updated from ISR
+    uint32_t jpeg_frames;
+    uint64_t jpeg_bytes;
+} cam_stats_t;
+
 typedef struct {
     uint32_t dma_bytes_per_item;
     uint32_t dma_buffer_size;
@@ -139,8 +162,12 @@ typedef struct {
     uint8_t fb_bytes_per_pixel;
 #endif
     uint32_t fb_size;
+    camera_fb_location_t fb_location;
 
     cam_state_t state;
+    cam_stats_t stats;
+
+    uint32_t vsync_cnt;//number of VSYNC events, only touched in the ISR
 } cam_obj_t;
 
 
@@ -18,6 +18,7 @@
 / Sep 03,'12 R0.01b Added JD_TBLCLIP option.
 /----------------------------------------------------------------------------*/
 
+#include <string.h>
 #include "tjpgd.h"
 
 #define SUPPORT_JPEG 1
@@ -239,7 +240,92 @@ UINT create_huffman_tbl (	/* 0:OK, !0:Failed */
 			if (!cls && d > 11) return JDR_FMT1;
 			*pd++ = d;
 		}
+
+#if JD_FASTDECODE == 2
+		{	/* Create the lookup table of the codes up to JD_HUFFBIT bits */
+			BYTE *tdc = 0;
+			WORD *tac = 0, e;
+			UINT span, ti;
+
+			if (cls) {
+				tac = alloc_pool(jd, (1 << JD_HUFFBIT) * sizeof (WORD));
+				if (!tac) return JDR_MEM1;	/* Err: not enough memory */
+				jd->hufflut_ac[num] = tac;
+				memset(tac, 0, (1 << JD_HUFFBIT) * sizeof (WORD));	/* 0 is a code not in the table */
+			} else {
+				tdc = alloc_pool(jd, 1 << JD_HUFFBIT);
+				if (!tdc) return JDR_MEM1;	/* Err: not enough memory */
+				jd->hufflut_dc[num] = tdc;
+				memset(tdc, 0, 1 << JD_HUFFBIT);
+			}
+			pd = jd->huffdata[num][cls];
+			for (j = b = 0; b < JD_HUFFBIT; b++) {	/* Code length is b + 1 */
+				for (i = pb[b]; i; i--, j++) {
+					span = 1 << (JD_HUFFBIT - 1 - b);	/* Number of entries starting with this code */
+					ti = ((UINT)ph[j] * span) & ((1 << JD_HUFFBIT) - 1);
+					e = cls ? (WORD)((b + 1) << 8 | pd[j]) : (WORD)((b + 1) << 4 | pd[j]);
+					while (span--) {
+						if (cls) tac[ti++] = e; else tdc[ti++] = (BYTE)e;
+					}
+				}
+			}
+		}
+#endif
+	}
+
+	return JDR_OK;
+}
+
+
+
+
+#if JD_FASTDECODE >= 1
+
+/*-----------------------------------------------------------------------*/
+/* Load the shift register with at least 25 bits from input stream       */
+/*-----------------------------------------------------------------------*/
+
+static
+JRESULT fill_bits (	/* JDR_OK or error code */
+	JDEC* jd		/* Pointer to the decompressor object */
+)
+{
+	BYTE d, f, *dp;
+	UINT dc, wbit;
+	DWORD w;
+
+
+	dc = jd->dctr; dp = jd->dptr;	/* Number of data available, read ptr (next byte) */
+	w = jd->wreg; wbit = jd->dbit;
+	while (wbit <= 24) {
+		d = 0;					/* Feed zeros once a marker has ended the entropy coded segment */
+		if (!jd->marker) {
+			f = 0;
+			do {
+				if (!dc) {		/* No input data is available, re-fill input buffer */
+					dp = jd->inbuf;
+					dc = jd->infunc(jd, dp, JD_SZBUF);
+					if (!dc) return JDR_INP;	/* Err: read error or wrong stream termination */
+				}
+				dc--;
+				d = *dp++;		/* Get next data byte */
+				if (f) {		/* In flag sequence? */
+					f = 0;
+					if (d) {	/* Marker (RSTn or EOI) */
+						jd->marker = d; d = 0;
+					} else {	/* The flag is a data 0xFF */
+						d = 0xFF;
+					}
+				} else if (d == 0xFF) {
+					f = 1;		/* Enter flag sequence, get trailing byte */
+				}
+			} while (f);
+		}
+		w |= (DWORD)d << (24 - wbit);
+		wbit += 8;
 	}
+	jd->dctr = dc; jd->dptr = dp;
+	jd->wreg = w; jd->dbit = wbit;
 
 	return JDR_OK;
 }
@@ -247,6 +333,95 @@ UINT create_huffman_tbl (	/* 0:OK, !0:Failed */
 
 
 
+/*-----------------------------------------------------------------------*/
+/* Extract N bits from input stream                                      */
+/*-----------------------------------------------------------------------*/
+
+static
+INT bitext (	/* >=0: extracted data, <0: error code */
+	JDEC* jd,	/* Pointer to the decompressor object */
+	UINT nbit	/* Number of bits to extract (1 to 15) */
+)
+{
+	DWORD w;
+	JRESULT rc;
+
+
+	if (jd->dbit < nbit) {
+		rc = fill_bits(jd);
+		if (rc) return 0 - (INT)rc;
+	}
+	w = jd->wreg;
+	jd->wreg = w << nbit;
+	jd->dbit -= nbit;
+
+	return (INT)(w >> (32 - nbit));
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Extract a huffman decoded data from input stream                      */
+/*-----------------------------------------------------------------------*/
+
+static
+INT huffext (			/* >=0: decoded data, <0: error code */
+	JDEC* jd,			/* Pointer to the decompressor object */
+	UINT id,			/* Huffman table ID (0:Y, 1:C) */
+	UINT cls			/* Table class (0:DC, 1:AC) */
+)
+{
+	const BYTE* hbits = jd->huffbits[id][cls];	/* Bit distribution table */
+	const WORD* hcode = jd->huffcode[id][cls];	/* Code word table */
+	const BYTE* hdata = jd->huffdata[id][cls];	/* Data table */
+	UINT v, bl, nd;
+	DWORD w;
+	JRESULT rc;
+
+
+	if (jd->dbit < 16) {	/* Longest code */
+		rc = fill_bits(jd);
+		if (rc) return 0 - (INT)rc;
+	}
+	w = jd->wreg;
+	bl = 1;
+
+#if JD_FASTDECODE == 2
+	v = w >> (32 - JD_HUFFBIT);	/* Look up the short codes */
+	if (cls) {
+		v = jd->hufflut_ac[id][v];
+		nd = v >> 8; v &= 0xFF;
+	} else {
+		v = jd->hufflut_dc[id][v];
+		nd = v >> 4; v &= 0x0F;
+	}
+	if (nd) {	/* Found, nd is the code length */
+		jd->wreg = w << nd; jd->dbit -= nd;
+		return (INT)v;
+	}
+	for ( ; bl <= JD_HUFFBIT; bl++) {	/* Skip the codes in the table */
+		nd = *hbits++;
+		hcode += nd; hdata += nd;
+	}
+#endif
+
+	for ( ; bl <= 16; bl++) {	/* Search the code word in each bit length */
+		v = w >> (32 - bl);
+		for (nd = *hbits++; nd; nd--) {
+			if (v == *hcode++) {	/* Matched? */
+				jd->wreg = w << bl; jd->dbit -= bl;
+				return *hdata;		/* Return the decoded data */
+			}
+			hdata++;
+		}
+	}
+
+	return 0 - (INT)JDR_FMT1;	/* Err: code not found (may be collapted data) */
+}
+
+#else	/* JD_FASTDECODE */
+
 /*-----------------------------------------------------------------------*/
 /* Extract N bits from input stream                                      */
 /*-----------------------------------------------------------------------*/
@@ -305,11 +480,13 @@ INT bitext (	/* >=0: extracted data, <0: error code */
 static
 INT huffext (			/* >=0: decoded data, <0: error code */
 	JDEC* jd,			/* Pointer to the decompressor object */
-	const BYTE* hbits,	/* Pointer to the bit distribution table */
-	const WORD* hcode,	/* Pointer to the code word table */
-	const BYTE* hdata	/* Pointer to the data table */
+	UINT id,			/* Huffman table ID (0:Y, 1:C) */
+	UINT cls			/* Table class (0:DC, 1:AC) */
 )
 {
+	const BYTE* hbits = jd->huffbits[id][cls];	/* Bit distribution table */
+	const WORD* hcode = jd->huffcode[id][cls];	/* Code word table */
+	const BYTE* hdata = jd->huffdata[id][cls];	/* Data table */
 	BYTE msk, s, *dp;
 	UINT dc, v, f, bl, nd;
 
@@ -357,6 +534,8 @@ INT huffext (			/* >=0: decoded data, <0: error code */
 	return 0 - (INT)JDR_FMT1;	/* Err: code not found (may be collapted data) */
 }
 
+#endif	/* JD_FASTDECODE */
+
 
 
 
@@ -473,6 +652,35 @@ void block_idct (
 
 
 
+/*-----------------------------------------------------------------------*/
+/* Skip over the AC elements of a block in the input stream              */
+/*-----------------------------------------------------------------------*/
+
+static
+JRESULT skip_ac (
+	JDEC* jd,		/* Pointer to the decompressor object */
+	UINT id			/* Huffman table ID of the component */
+)
+{
+	UINT i;
+	INT b, d;
+
+
+	for (i = 1; i < 64; i++) {
+		b = huffext(jd, id, 1);			/* Extract a huffman coded value (zero runs and bit length) */
+		if (b == 0) break;				/* EOB? */
+		if (b < 0) return 0 - b;		/* Err: invalid code or input error */
+		i += (UINT)b >> 4;				/* Skip zero elements */
+		if (i >= 64) return JDR_FMT1;	/* Too long zero run */
+		if ((b &= 0x0F) && (d = bitext(jd, b)) < 0) return 0 - d;	/* Drop the data bits */
+	}
+
+	return JDR_OK;
+}
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Load all blocks in the MCU into working buffer                        */
 /*-----------------------------------------------------------------------*/
@@ -483,11 +691,10 @@ JRESULT mcu_load (
 )
 {
 	LONG *tmp = (LONG*)jd->workbuf;	/* Block working buffer for de-quantize and IDCT */
-	UINT blk, nby, nbc, i, z, id, cmp;
+	UINT blk, nby, nbc, i, z, id, cmp, ac;
 	INT b, d, e;
+	JRESULT rc;
 	BYTE *bp;
-	const BYTE *hb, *hd;
-	const WORD *hc;
 	const LONG *dqf;
 
 
@@ -499,11 +706,17 @@ JRESULT mcu_load (
 		cmp = (blk < nby) ? 0 : blk - nby + 1;	/* Component number 0:Y, 1:Cb, 2:Cr */
 		id = cmp ? 1 : 0;						/* Huffman table ID of the component */
 
+		if (cmp && jd->format == JD_FMT_GRAY) {	/* Chroma is not used for grayscale output, only skip over its codes */
+			b = huffext(jd, id, 0);				/* DC bit length */
+			if (b < 0) return 0 - b;
+			if (b && (e = bitext(jd, b)) < 0) return 0 - e;
+			if ((rc = skip_ac(jd, id)) != JDR_OK) return rc;
+			bp += 64;
+			continue;
+		}
+
 		/* Extract a DC element from input stream */
-		hb = jd->huffbits[id][0];				/* Huffman table for the DC element */
-		hc = jd->huffcode[id][0];
-		hd = jd->huffdata[id][0];
-		b = huffext(jd, hb, hc, hd);			/* Extract a huffman coded data (bit length) */
+		b = huffext(jd, id, 0);					/* Extract a huffman coded data (bit length) */
 		if (b < 0) return 0 - b;				/* Err: invalid code or input */
 		d = jd->dcv[cmp];						/* DC value of previous block */
 		if (b) {								/* If there is any difference from previous block */
@@ -517,14 +730,19 @@ JRESULT mcu_load (
 		dqf = jd->qttbl[jd->qtid[cmp]];			/* De-quantizer table ID for this component */
 		tmp[0] = d * dqf[0] >> 8;				/* De-quantize, apply scale factor of Arai algorithm and descale 8 bits */
 
+		if (JD_USE_SCALE && jd->scale == 3) {	/* If scale ratio is 1/8, IDCT can be ommited and only DC element is used */
+			if ((rc = skip_ac(jd, id)) != JDR_OK) return rc;	/* The AC elements are only skipped over */
+			*bp = (*tmp / 256) + 128;
+			bp += 64;
+			continue;
+		}
+
 		/* Extract following 63 AC elements from input stream */
 		for (i = 1; i < 64; i++) tmp[i] = 0;	/* Clear rest of elements */
-		hb = jd->huffbits[id][1];				/* Huffman table for the AC elements */
-		hc = jd->huffcode[id][1];
-		hd = jd->huffdata[id][1];
+		ac = 0;					/* No AC element yet */
 		i = 1;					/* Top of the AC elements */
 		do {
-			b = huffext(jd, hb, hc, hd);		/* Extract a huffman coded value (zero runs and bit length) */
+			b = huffext(jd, id, 1);				/* Extract a huffman coded value (zero runs and bit length) */
 			if (b == 0) break;					/* EOB? */
 			if (b < 0) return 0 - b;			/* Err: invalid code or input error */
 			z = (UINT)b >> 4;					/* Number of leading zero elements */
@@ -539,11 +757,12 @@ JRESULT mcu_load (
 				if (!(d & b)) d -= (b << 1) - 1;/* Restore negative value if needed */
 				z = ZIG(i);						/* Zigzag-order to raster-order converted index */
 				tmp[z] = d * dqf[z] >> 8;		/* De-quantize, apply scale factor of Arai algorithm and descale 8 bits */
+				ac = 1;
 			}
 		} while (++i < 64);		/* Next AC element */
 
-		if (JD_USE_SCALE && jd->scale == 3)
-			*bp = (*tmp / 256) + 128;	/* If scale ratio is 1/8, IDCT can be ommited and only DC element is used */
+		if (!ac)
+			memset(bp, BYTECLIP((tmp[0] + (128L << 8)) >> 8), 64);	/* Only DC, the IDCT gives a flat block */
 		else
 			block_idct(tmp, bp);		/* Apply IDCT and store the block to the MCU buffer */
 
@@ -556,6 +775,44 @@ JRESULT mcu_load (
 
 
 
+/*-----------------------------------------------------------------------*/
+/* Store a pixel in the output format                                    */
+/*-----------------------------------------------------------------------*/
+
+static inline
+BYTE* put_pixel (	/* Pointer to the next pixel */
+	BYTE* op,		/* Pointer to the pixel */
+	BYTE fmt,		/* Output format (JD_FMT_RGB888, RGB565, BGR888 or RGB565BE) */
+	UINT r,
+	UINT g,
+	UINT b
+)
+{
+	WORD w;
+
+
+	switch (fmt) {
+	case JD_FMT_BGR888:
+		*op++ = (BYTE)b; *op++ = (BYTE)g; *op++ = (BYTE)r;
+		break;
+	case JD_FMT_RGB565:
+		w = (WORD)((r & 0xF8) << 8 | (g & 0xFC) << 3 | b >> 3);
+		*(WORD*)op = w; op += 2;	/* The work buffer is word aligned */
+		break;
+	case JD_FMT_RGB565BE:
+		*op++ = (BYTE)((r & 0xF8) | g >> 5);			/* RRRRRGGG */
+		*op++ = (BYTE)((g & 0x1C) << 3 | b >> 3);		/* GGGBBBBB */
+		break;
+	default:
+		*op++ = (BYTE)r; *op++ = (BYTE)g; *op++ = (BYTE)b;
+	}
+
+	return op;
+}
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Output an MCU: Convert YCrCb to RGB and output it in RGB form         */
 /*-----------------------------------------------------------------------*/
@@ -569,9 +826,9 @@ JRESULT mcu_output (
 )
 {
 	const INT CVACC = (sizeof (INT) > 2) ? 1024 : 128;
-	UINT ix, iy, mx, my, rx, ry;
+	UINT ix, iy, mx, my, rx, ry, bpp;
 	INT yy, cb, cr;
-	BYTE *py, *pc, *rgb24;
+	BYTE *py, *pc, *op, fmt;
 	JRECT rect;
 
 
@@ -586,11 +843,14 @@ JRESULT mcu_output (
 	rect.left = x; rect.right = x + rx - 1;				/* Rectangular area in the frame buffer */
 	rect.top = y; rect.bottom = y + ry - 1;
 
+	fmt = jd->format;
+	bpp = (fmt == JD_FMT_GRAY) ? 1 : (fmt == JD_FMT_RGB565 || fmt == JD_FMT_RGB565BE) ? 2 : 3;	/* Bytes per output pixel */
 
 	if (!JD_USE_SCALE || jd->scale != 3) {	/* Not for 1/8 scaling */
 
-		/* Build an RGB MCU from discrete comopnents */
-		rgb24 = (BYTE*)jd->workbuf;
+		/* Build the MCU from discrete comopnents, in the output format unless it is to be descaled */
+		if (JD_USE_SCALE && jd->scale && fmt != JD_FMT_GRAY) fmt = JD_FMT_RGB888;
+		op = (BYTE*)jd->workbuf;
 		for (iy = 0; iy < my; iy++) {
 			pc = jd->mcubuf;
 			py = pc + iy * 8;
@@ -600,6 +860,13 @@ JRESULT mcu_output (
 			} else {			/* Single block height */
 				pc += mx * 8 + iy * 8;
 			}
+			if (fmt == JD_FMT_GRAY) {	/* Only the Y component */
+				for (ix = 0; ix < mx; ix++) {
+					if (ix == 8) py += 64 - 8;	/* Jump to next block if double block width */
+					*op++ = *py++;
+				}
+				continue;
+			}
 			for (ix = 0; ix < mx; ix++) {
 				cb = pc[0] - 128; 	/* Get Cb/Cr component and restore right level */
 				cr = pc[64] - 128;
@@ -612,45 +879,51 @@ JRESULT mcu_output (
 				yy = *py++;			/* Get Y component */
 
 				/* Convert YCbCr to RGB */
-				*rgb24++ = /* R */ BYTECLIP(yy + ((INT)(1.402 * CVACC) * cr) / CVACC);
-				*rgb24++ = /* G */ BYTECLIP(yy - ((INT)(0.344 * CVACC) * cb + (INT)(0.714 * CVACC) * cr) / CVACC);
-				*rgb24++ = /* B */ BYTECLIP(yy + ((INT)(1.772 * CVACC) * cb) / CVACC);
+				op = put_pixel(op, fmt,
+					/* R */ BYTECLIP(yy + ((INT)(1.402 * CVACC) * cr) / CVACC),
+					/* G */ BYTECLIP(yy - ((INT)(0.344 * CVACC) * cb + (INT)(0.714 * CVACC) * cr) / CVACC),
+					/* B */ BYTECLIP(yy + ((INT)(1.772 * CVACC) * cb) / CVACC));
 			}
 		}
 
 		/* Descale the MCU rectangular if needed */
 		if (JD_USE_SCALE && jd->scale) {
-			UINT x, y, r, g, b, s, w, a;
-			BYTE *op;
+			UINT x, y, r, g, b, s, w, a, n;
+			BYTE *ip;
 
 			/* Get averaged RGB value of each square correcponds to a pixel */
 			s = jd->scale * 2;	/* Bumber of shifts for averaging */
 			w = 1 << jd->scale;	/* Width of square */
-			a = (mx - w) * 3;	/* Bytes to skip for next line in the square */
+			n = (fmt == JD_FMT_GRAY) ? 1 : 3;	/* Bytes per built pixel */
+			a = (mx - w) * n;	/* Bytes to skip for next line in the square */
 			op = (BYTE*)jd->workbuf;
 			for (iy = 0; iy < my; iy += w) {
 				for (ix = 0; ix < mx; ix += w) {
-					rgb24 = (BYTE*)jd->workbuf + (iy * mx + ix) * 3;
+					ip = (BYTE*)jd->workbuf + (iy * mx + ix) * n;
 					r = g = b = 0;
 					for (y = 0; y < w; y++) {	/* Accumulate RGB value in the square */
 						for (x = 0; x < w; x++) {
-							r += *rgb24++;
-							g += *rgb24++;
-							b += *rgb24++;
+							r += *ip++;
+							if (n == 3) {
+								g += *ip++;
+								b += *ip++;
+							}
 						}
-						rgb24 += a;
-					}							/* Put the averaged RGB value as a pixel */
-					*op++ = (BYTE)(r >> s);
-					*op++ = (BYTE)(g >> s);
-					*op++ = (BYTE)(b >> s);
+						ip += a;
+					}							/* Put the averaged value as a pixel */
+					if (n == 1) {
+						*op++ = (BYTE)(r >> s);
+					} else {
+						op = put_pixel(op, jd->format, r >> s, g >> s, b >> s);
+					}
 				}
 			}
 		}
 
 	} else {	/* For only 1/8 scaling (left-top pixel in each block are the DC value of the block) */
 
-		/* Build a 1/8 descaled RGB MCU from discrete comopnents */
-		rgb24 = (BYTE*)jd->workbuf;
+		/* Build a 1/8 descaled MCU from discrete comopnents */
+		op = (BYTE*)jd->workbuf;
 		pc = jd->mcubuf + mx * my;
 		cb = pc[0] - 128;		/* Get Cb/Cr component and restore right level */
 		cr = pc[64] - 128;
@@ -661,10 +934,15 @@ JRESULT mcu_output (
 				yy = *py;	/* Get Y component */
 				py += 64;
 
+				if (fmt == JD_FMT_GRAY) {
+					*op++ = (BYTE)yy;
+					continue;
+				}
 				/* Convert YCbCr to RGB */
-				*rgb24++ = /* R */ BYTECLIP(yy + ((INT)(1.402 * CVACC) * cr / CVACC));
-				*rgb24++ = /* G */ BYTECLIP(yy - ((INT)(0.344 * CVACC) * cb + (INT)(0.714 * CVACC) * cr) / CVACC);
-				*rgb24++ = /* B */ BYTECLIP(yy + ((INT)(1.772 * CVACC) * cb / CVACC));
+				op = put_pixel(op, fmt,
+					/* R */ BYTECLIP(yy + ((INT)(1.402 * CVACC) * cr / CVACC)),
+					/* G */ BYTECLIP(yy - ((INT)(0.344 * CVACC) * cb + (INT)(0.714 * CVACC) * cr) / CVACC),
+					/* B */ BYTECLIP(yy + ((INT)(1.772 * CVACC) * cb / CVACC)));
 			}
 		}
 	}
@@ -677,29 +955,13 @@ JRESULT mcu_output (
 
 		s = d = (BYTE*)jd->workbuf;
 		for (y = 0; y < ry; y++) {
-			for (x = 0; x < rx; x++) {	/* Copy effective pixels */
-				*d++ = *s++;
-				*d++ = *s++;
+			for (x = 0; x < rx * bpp; x++) {	/* Copy effective pixels */
 				*d++ = *s++;
 			}
-			s += (mx - rx) * 3;	/* Skip truncated pixels */
+			s += (mx - rx) * bpp;	/* Skip truncated pixels */
 		}
 	}
 
-	/* Convert RGB888 to RGB565 if needed */
-	if (JD_FORMAT == 1) {
-		BYTE *s = (BYTE*)jd->workbuf;
-		WORD w, *d = (WORD*)s;
-		UINT n = rx * ry;
-
-		do {
-			w = (*s++ & 0xF8) << 8;		/* RRRRR----------- */
-			w |= (*s++ & 0xFC) << 3;	/* -----GGGGGG----- */
-			w |= *s++ >> 3;				/* -----------BBBBB */
-			*d++ = w;
-		} while (--n);
-	}
-
 	/* Output the RGB rectangular */
 	return outfunc(jd, jd->workbuf, &rect) ? JDR_OK : JDR_INTR; 
 }
@@ -722,6 +984,27 @@ JRESULT restart (
 	BYTE *dp;
 
 
+#if JD_FASTDECODE >= 1
+	/* Discard padding bits, the marker may have been loaded with them */
+	jd->wreg = 0; jd->dbit = 0;
+	if (jd->marker) {
+		d = 0xFF00 | jd->marker;
+		jd->marker = 0;
+	} else {	/* Get two bytes from the input stream */
+		dp = jd->dptr; dc = jd->dctr;
+		d = 0;
+		for (i = 0; i < 2; i++) {
+			if (!dc) {	/* No input data is available, re-fill input buffer */
+				dp = jd->inbuf;
+				dc = jd->infunc(jd, dp, JD_SZBUF);
+				if (!dc) return JDR_INP;
+			}
+			dc--;
+			d = (d << 8) | *dp++;	/* Get a byte */
+		}
+		jd->dptr = dp; jd->dctr = dc;
+	}
+#else
 	/* Discard padding bits and get two bytes from the input stream */
 	dp = jd->dptr; dc = jd->dctr;
 	d = 0;
@@ -737,6 +1020,7 @@ JRESULT restart (
 		d = (d << 8) | *dp;	/* Get a byte */
 	}
 	jd->dptr = dp; jd->dctr = dc; jd->dmsk = 0;
+#endif
 
 	/* Check the marker */
 	if ((d & 0xFFD8) != 0xFFD0 || (d & 7) != (rstn & 7))
@@ -758,6 +1042,22 @@ JRESULT restart (
 #define	LDB_WORD(ptr)		(WORD)(((WORD)*((BYTE*)(ptr))<<8)|(WORD)*(BYTE*)((ptr)+1))
 
 
+static
+UINT mem_input (	/* Number of bytes read or skipped */
+	JDEC* jd,		/* Pointer to the decompressor object */
+	BYTE* buff,		/* Pointer to the read buffer (NULL:skip) */
+	UINT nd			/* Number of bytes to read or skip */
+)
+{
+	if (nd > jd->sz_mem) nd = jd->sz_mem;
+	if (buff) memcpy(buff, jd->mem, nd);
+	jd->mem += nd;
+	jd->sz_mem -= nd;
+
+	return nd;
+}
+
+
 JRESULT jd_prepare (
 	JDEC* jd,			/* Blank decompressor object */
 	UINT (*infunc)(JDEC*, BYTE*, UINT),	/* JPEG strem input function */
@@ -775,11 +1075,13 @@ JRESULT jd_prepare (
 
 	if (!pool) return JDR_PAR;
 
+	if (infunc != mem_input) jd->mem = 0;	/* Not called from jd_prepare_mem() */
 	jd->pool = pool;		/* Work memroy */
 	jd->sz_pool = sz_pool;	/* Size of given work memory */
 	jd->infunc = infunc;	/* Stream input function */
 	jd->device = dev;		/* I/O device identifier */
 	jd->nrst = 0;			/* No restart interval (default) */
+	jd->format = JD_FORMAT;	/* Output format (default) */
 
 	for (i = 0; i < 2; i++) {	/* Nulls pointers */
 		for (j = 0; j < 2; j++) {
@@ -890,12 +1192,27 @@ JRESULT jd_prepare (
 			jd->mcubuf = alloc_pool(jd, (n + 2) * 64);	/* Allocate MCU working buffer */
 			if (!jd->mcubuf) return JDR_MEM1;			/* Err: not enough memory */
 
+#if JD_FASTDECODE >= 1
+			jd->wreg = 0; jd->dbit = 0; jd->marker = 0;	/* Prepare to read bit stream */
+			if (jd->mem) {								/* The bit stream is read in place from the memory input, */
+				jd->dptr = (BYTE*)jd->mem;				/* which is never written to */
+				jd->dctr = jd->sz_mem;
+				jd->mem += jd->sz_mem; jd->sz_mem = 0;
+			} else {									/* Pre-load the JPEG data to extract it from the bit stream */
+				jd->dptr = seg; jd->dctr = 0;
+				if (ofs %= JD_SZBUF) {					/* Align read offset to JD_SZBUF */
+					jd->dctr = jd->infunc(jd, seg + ofs, JD_SZBUF - (UINT)ofs);
+					jd->dptr = seg + ofs;
+				}
+			}
+#else
 			/* Pre-load the JPEG data to extract it from the bit stream */
 			jd->dptr = seg; jd->dctr = 0; jd->dmsk = 0;	/* Prepare to read bit stream */
 			if (ofs %= JD_SZBUF) {						/* Align read offset to JD_SZBUF */
 				jd->dctr = jd->infunc(jd, seg + ofs, JD_SZBUF - (UINT)ofs);
 				jd->dptr = seg + ofs - 1;
 			}
+#endif
 
 			return JDR_OK;		/* Initialization succeeded. Ready to decompress the JPEG image. */
 
@@ -925,6 +1242,28 @@ JRESULT jd_prepare (
 
 
 
+/*-----------------------------------------------------------------------*/
+/* Analyze the JPEG image in memory and Initialize decompressor object   */
+/*-----------------------------------------------------------------------*/
+
+JRESULT jd_prepare_mem (
+	JDEC* jd,			/* Blank decompressor object */
+	const BYTE* data,	/* JPEG image, it must stay valid until jd_decomp() returns */
+	UINT ndata,			/* Size of the JPEG image */
+	void* pool,			/* Working buffer for the decompression session */
+	UINT sz_pool,		/* Size of working buffer */
+	void* dev			/* I/O device identifier for the session */
+)
+{
+	jd->mem = data;
+	jd->sz_mem = ndata;
+
+	return jd_prepare(jd, mem_input, pool, sz_pool, dev);	/* With JD_FASTDECODE, the bit stream is not copied */
+}
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Start to decompress the JPEG picture                                  */
 /*-----------------------------------------------------------------------*/
@@ -1,6 +1,7 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <math.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "unity.h"
@@ -9,6 +10,7 @@
 #include "driver/i2c.h"
 
 #include "esp_camera.h"
+#include "img_converters.h"
 
 #ifdef CONFIG_IDF_TARGET_ESP32
 #define BOARD_WROVER_KIT 1
@@ -338,6 +340,108 @@ TEST_CASE("Camera driver take JPEG picture test", "[camera]")
     TEST_ASSERT_NOT_NULL(pic);
 }
 
+TEST_CASE("Camera driver frame statistics test", "[camera]")
+{
+    camera_stats_t stats;
+    TEST_ESP_OK(init_camera(20000000, PIXFORMAT_JPEG, FRAMESIZE_QVGA, 2, SIOD_GPIO_NUM, -1));
+    esp_camera_reset_stats();
+    for (int i = 0; i < 8; i++) {
+        camera_fb_t *pic = esp_camera_fb_get();
+        TEST_ASSERT_NOT_NULL(pic);
+        esp_camera_fb_return(pic);
+    }
+    TEST_ESP_OK(esp_camera_get_stats(&stats));
+    ESP_LOGI(TAG, "captured: %u, dropped: %u, FB-OVF: %u, NO-SOI: %u, NO-EOI: %u, EV-OVF: %u, avg JPEG: %u",
+             (unsigned) stats.frames_captured, (unsigned) stats.frames_dropped, (unsigned) stats.fb_overflow,
+             (unsigned) stats.no_soi, (unsigned) stats.no_eoi, (unsigned) stats.event_overflow,
+             (unsigned) stats.jpeg_avg_size);
+    TEST_ESP_OK(esp_camera_deinit());
+
+    TEST_ASSERT_GREATER_OR_EQUAL(8, stats.frames_captured);
+    TEST_ASSERT_EQUAL(8, stats.jpeg_frames);
+    TEST_ASSERT_GREATER_THAN(0, stats.jpeg_avg_size);
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_STATE, esp_camera_get_stats(&stats));
+}
+
+TEST_CASE("Camera driver JPEG frame buffer calibration test", "[camera]")
+{
+    size_t fb_size = 0;
+    TEST_ESP_OK(init_camera(20000000, PIXFORMAT_JPEG, FRAMESIZE_QVGA, 2, SIOD_GPIO_NUM, -1));
+    size_t auto_size = esp_camera_get_jpeg_fb_size();
+    TEST_ASSERT_GREATER_THAN(0, auto_size);
+    // the buffers can't be reallocated while the application holds one
+    camera_fb_t *held = esp_camera_fb_get();
+    TEST_ASSERT_NOT_NULL(held);
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_STATE, esp_camera_set_jpeg_fb_size(auto_size / 2));
+    esp_camera_fb_return(held);
+    TEST_ESP_OK(esp_camera_calibrate_jpeg_fb_size(16, 95, 25, &fb_size));
+    ESP_LOGI(TAG, "JPEG fb size: %u -> %u", (unsigned) auto_size, (unsigned) fb_size);
+    TEST_ASSERT_EQUAL(fb_size, esp_camera_get_jpeg_fb_size());
+
+    esp_camera_reset_stats();
+    for (int i = 0; i < 8; i++) {
+        camera_fb_t *pic = esp_camera_fb_get();
+        TEST_ASSERT_NOT_NULL(pic);
+        TEST_ASSERT_LESS_OR_EQUAL(fb_size, pic->len);
+        esp_camera_fb_return(pic);
+    }
+    camera_stats_t stats;
+    TEST_ESP_OK(esp_camera_get_stats(&stats));
+    TEST_ESP_OK(esp_camera_deinit());
+
+    TEST_ASSERT_EQUAL(8, stats.jpeg_frames);
+    TEST_ASSERT_EQUAL(0, esp_camera_get_jpeg_fb_size());
+}
+
+TEST_CASE("Camera driver frame id and timestamp test", "[camera]")
+{
+    uint32_t last_id = 0;
+    int64_t last_us = 0;
+    TEST_ESP_OK(init_camera(20000000, PIXFORMAT_JPEG, FRAMESIZE_QVGA, 2, SIOD_GPIO_NUM, -1));
+    for (int i = 0; i < 16; i++) {
+        camera_fb_t *pic = esp_camera_fb_get();
+        TEST_ASSERT_NOT_NULL(pic);
+        int64_t us = (int64_t)pic->timestamp.tv_sec * 1000000 + pic->timestamp.tv_usec;
+        TEST_ASSERT(us <= esp_timer_get_time());
+        if (i > 0) {
+            TEST_ASSERT_GREATER_THAN(last_id, pic->frame_id);
+            TEST_ASSERT(us > last_us);
+        }
+        last_id = pic->frame_id;
+        last_us = us;
+        esp_camera_fb_return(pic);
+    }
+    TEST_ESP_OK(esp_camera_deinit());
+}
+
+TEST_CASE("Camera driver frame size switch test", "[camera]")
+{
+    const framesize_t sizes[] = { FRAMESIZE_VGA, FRAMESIZE_QVGA };
+    TEST_ESP_OK(init_camera(20000000, PIXFORMAT_JPEG, FRAMESIZE_QVGA, 2, SIOD_GPIO_NUM, -1));
+    sensor_t *s = esp_camera_sensor_get();
+    TEST_ASSERT_NOT_NULL(s);
+    // the later rounds only write the registers that differ between the two sizes
+    for (int i = 0; i < 6; i++) {
+        int64_t start = esp_timer_get_time();
+        TEST_ASSERT_EQUAL(0, s->set_framesize(s, sizes[i % 2]));
+        int64_t switched = esp_timer_get_time();
+        int64_t ready = -1;
+        for (int j = 0; j < 8 && ready < 0; j++) {
+            camera_fb_t *pic = esp_camera_fb_get();
+            TEST_ASSERT_NOT_NULL(pic);
+            int64_t us = (int64_t)pic->timestamp.tv_sec * 1000000 + pic->timestamp.tv_usec;
+            if (us >= switched) {
+                ready = esp_timer_get_time();
+            }
+            esp_camera_fb_return(pic);
+        }
+        TEST_ASSERT(ready >= 0);
+        ESP_LOGI(TAG, "switch %d: set_framesize %u us, frame ready after %u us", i,
+                 (unsigned) (switched - start), (unsigned) (ready - start));
+    }
+    TEST_ESP_OK(esp_camera_deinit());
+}
+
 TEST_CASE("Camera driver performance test", "[camera]")
 {
     camera_performance_test(20 * 1000000, 16);
@@ -525,6 +629,750 @@ TEST_CASE("Conversions image 480x320 jpeg decode test", "[camera]")
     img_jpeg_decode_test(2, 0);
 }
 
+static double img_psnr(const uint8_t *a, const uint8_t *b, size_t len)
+{
+    double mse = 0;
+    for (size_t i = 0; i < len; i++) {
+        int d = a[i] - b[i];
+        mse += d * d;
+    }
+    mse /= len;
+    return mse == 0 ? 99.0 : 10 * log10(255.0 * 255.0 / mse);
+}
+
+static double jpg_encode_dct_test(jpeg_dct_t dct, uint8_t *rgb, uint8_t *decoded, uint8_t **jpg, size_t *jpg_len)
+{
+    jpg_encode_config_t config = JPG_ENCODE_CONFIG_DEFAULT();
+    config.dct = dct;
+    size_t rgb_len = 320 * 240 * 3;
+    uint64_t t = esp_timer_get_time();
+    TEST_ASSERT_TRUE(fmt2jpg_ex(rgb, rgb_len, 320, 240, PIXFORMAT_RGB888, &config, jpg, jpg_len));
+    t = esp_timer_get_time() - t;
+    TEST_ASSERT_TRUE(fmt2rgb888(*jpg, *jpg_len, PIXFORMAT_JPEG, decoded));
+    double db = img_psnr(rgb, decoded, rgb_len);
+    ESP_LOGI(TAG, "dct %d: %u us, %u bytes, %.2f dB", dct, (unsigned) t, (unsigned) *jpg_len, db);
+    return db;
+}
+
+TEST_CASE("Conversions JPEG encoder DCT test", "[camera]")
+{
+    extern const uint8_t img_start[] asm("_binary_test_inside_jpeg_start");
+    extern const uint8_t img_end[]   asm("_binary_test_inside_jpeg_end");
+    uint8_t *rgb = heap_caps_malloc(320 * 240 * 3, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    uint8_t *decoded = heap_caps_malloc(320 * 240 * 3, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    TEST_ASSERT_NOT_NULL(rgb);
+    TEST_ASSERT_NOT_NULL(decoded);
+    TEST_ASSERT_TRUE(fmt2rgb888(img_start, img_end - img_start, PIXFORMAT_JPEG, rgb));
+
+    uint8_t *islow, *aan, *simd;
+    size_t islow_len, aan_len, simd_len;
+    double islow_db = jpg_encode_dct_test(JPEG_DCT_ISLOW, rgb, decoded, &islow, &islow_len);
+    double aan_db = jpg_encode_dct_test(JPEG_DCT_AAN, rgb, decoded, &aan, &aan_len);
+    jpg_encode_dct_test(JPEG_DCT_AAN_SIMD, rgb, decoded, &simd, &simd_len);
+
+    TEST_ASSERT_GREATER_THAN(30, (int) islow_db);
+    TEST_ASSERT_TRUE(aan_db > islow_db - 1.0);
+    TEST_ASSERT_EQUAL(aan_len, simd_len);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(aan, simd, aan_len);
+
+    free(islow);
+    free(aan);
+    free(simd);
+    heap_caps_free(rgb);
+    heap_caps_free(decoded);
+}
+
+TEST_CASE("Conversions JPEG encoder SIMD DCT test", "[camera]")
+{
+#if !CONFIG_CAMERA_JPEG_ENCODER_DCT_SIMD
+    TEST_IGNORE_MESSAGE("CONFIG_CAMERA_JPEG_ENCODER_DCT_SIMD is not enabled");
+#else
+    // Full range patterns at quality 100, where the quantizer keeps nearly every difference of the DCTs
+    const size_t width = 64, height = 64, rgb_len = width * height * 3;
+    uint8_t *rgb = heap_caps_malloc(rgb_len, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    TEST_ASSERT_NOT_NULL(rgb);
+    jpg_encode_config_t config = JPG_ENCODE_CONFIG_DEFAULT();
+    config.quality = 100;
+
+    uint32_t seed = 1;
+    for (int pattern = 0; pattern < 4; pattern++) {
+        for (size_t i = 0; i < rgb_len; i++) {
+            size_t x = (i / 3) % width, y = (i / 3) / width;
+            seed = seed * 1103515245 + 12345;
+            switch (pattern) {
+            case 0: rgb[i] = seed >> 24; break;                     // noise
+            case 1: rgb[i] = (seed >> 31) ? 255 : 0; break;         // black and white noise
+            case 2: rgb[i] = ((x ^ y) & 1) ? 255 : 0; break;        // checkerboard
+            default: rgb[i] = ((x + i) & 4) ? 255 : 0; break;       // coloured stripes
+            }
+        }
+
+        uint8_t *aan, *simd;
+        size_t aan_len, simd_len;
+        config.dct = JPEG_DCT_AAN;
+        TEST_ASSERT_TRUE(fmt2jpg_ex(rgb, rgb_len, width, height, PIXFORMAT_RGB888, &config, &aan, &aan_len));
+        config.dct = JPEG_DCT_AAN_SIMD;
+        TEST_ASSERT_TRUE(fmt2jpg_ex(rgb, rgb_len, width, height, PIXFORMAT_RGB888, &config, &simd, &simd_len));
+        ESP_LOGI(TAG, "pattern %d: %u bytes", pattern, (unsigned) aan_len);
+        TEST_ASSERT_EQUAL(aan_len, simd_len);
+        TEST_ASSERT_EQUAL_UINT8_ARRAY(aan, simd, aan_len);
+        free(aan);
+        free(simd);
+    }
+    heap_caps_free(rgb);
+#endif
+}
+
+TEST_CASE("Conversions JPEG encoder optimized Huffman test", "[camera]")
+{
+    extern const uint8_t img_start[] asm("_binary_test_inside_jpeg_start");
+    extern const uint8_t img_end[]   asm("_binary_test_inside_jpeg_end");
+    size_t rgb_len = 320 * 240 * 3;
+    uint8_t *rgb = heap_caps_malloc(rgb_len, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    uint8_t *decoded = heap_caps_malloc(rgb_len, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    uint8_t *decoded_std = heap_caps_malloc(rgb_len, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    TEST_ASSERT_NOT_NULL(rgb);
+    TEST_ASSERT_NOT_NULL(decoded);
+    TEST_ASSERT_NOT_NULL(decoded_std);
+    TEST_ASSERT_TRUE(fmt2rgb888(img_start, img_end - img_start, PIXFORMAT_JPEG, rgb));
+
+    jpg_encode_config_t config = JPG_ENCODE_CONFIG_DEFAULT();
+    jpg_huffman_tables_t *tables = jpg_huffman_tables_create(2);
+    TEST_ASSERT_NOT_NULL(tables);
+    uint8_t *std, *opt;
+    size_t std_len, opt_len, kept_len[3];
+    TEST_ASSERT_TRUE(fmt2jpg_ex(rgb, rgb_len, 320, 240, PIXFORMAT_RGB888, &config, &std, &std_len));
+    config.optimize_huffman = true;
+    TEST_ASSERT_TRUE(fmt2jpg_ex(rgb, rgb_len, 320, 240, PIXFORMAT_RGB888, &config, &opt, &opt_len));
+    ESP_LOGI(TAG, "standard tables: %u bytes, optimized: %u bytes", (unsigned) std_len, (unsigned) opt_len);
+    TEST_ASSERT_LESS_THAN(std_len, opt_len);
+
+    // Only the entropy coding changes, both decode to the same pixels
+    TEST_ASSERT_TRUE(fmt2rgb888(std, std_len, PIXFORMAT_JPEG, decoded_std));
+    TEST_ASSERT_TRUE(fmt2rgb888(opt, opt_len, PIXFORMAT_JPEG, decoded));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(decoded_std, decoded, rgb_len);
+    free(opt);
+
+    // Built on the first image, reused for the next two
+    config.huffman_tables = tables;
+    for (int i = 0; i < 3; i++) {
+        TEST_ASSERT_TRUE(fmt2jpg_ex(rgb, rgb_len, 320, 240, PIXFORMAT_RGB888, &config, &opt, &kept_len[i]));
+        TEST_ASSERT_TRUE(fmt2rgb888(opt, kept_len[i], PIXFORMAT_JPEG, decoded));
+        free(opt);
+        TEST_ASSERT_EQUAL_UINT8_ARRAY(decoded_std, decoded, rgb_len);
+        TEST_ASSERT_LESS_THAN(std_len, kept_len[i]);
+        TEST_ASSERT_EQUAL(kept_len[0], kept_len[i]);
+    }
+
+    jpg_huffman_tables_delete(tables);
+    free(std);
+    heap_caps_free(rgb);
+    heap_caps_free(decoded);
+    heap_caps_free(decoded_std);
+}
+
+TEST_CASE("Conversions JPEG encoder YUV422 source test", "[camera]")
+{
+    extern const uint8_t img_start[] asm("_binary_test_inside_jpeg_start");
+    extern const uint8_t img_end[]   asm("_binary_test_inside_jpeg_end");
+    size_t pixels = 320 * 240;
+    uint8_t *rgb = heap_caps_malloc(pixels * 3, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    uint8_t *decoded = heap_caps_malloc(pixels * 3, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    uint8_t *yuyv = heap_caps_malloc(pixels * 2, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    TEST_ASSERT_NOT_NULL(rgb);
+    TEST_ASSERT_NOT_NULL(decoded);
+    TEST_ASSERT_NOT_NULL(yuyv);
+    TEST_ASSERT_TRUE(fmt2rgb888(img_start, img_end - img_start, PIXFORMAT_JPEG, rgb));
+
+    // Limited range BT.601 from the BGR888 pixels, as a sensor would send it
+    for (size_t i = 0; i < pixels; i++) {
+        int r = rgb[i * 3 + 2], g = rgb[i * 3 + 1], b = rgb[i * 3];
+        yuyv[i * 2] = 16 + ((r * 16829 + g * 33039 + b * 6416 + 32768) >> 16);
+        if (i & 1) {
+            yuyv[i * 2 + 1] = 128 + ((r * 28784 - g * 24103 - b * 4681 + 32768) >> 16);
+        } else {
+            yuyv[i * 2 + 1] = 128 + ((-r * 9714 - g * 19070 + b * 28784 + 32768) >> 16);
+        }
+    }
+
+    uint8_t *jpg;
+    size_t jpg_len;
+    uint64_t t = esp_timer_get_time();
+    TEST_ASSERT_TRUE(fmt2jpg(rgb, pixels * 3, 320, 240, PIXFORMAT_RGB888, 80, &jpg, &jpg_len));
+    t = esp_timer_get_time() - t;
+    TEST_ASSERT_TRUE(fmt2rgb888(jpg, jpg_len, PIXFORMAT_JPEG, decoded));
+    free(jpg);
+    double rgb_db = img_psnr(rgb, decoded, pixels * 3);
+    ESP_LOGI(TAG, "RGB888 source: %u us, %.2f dB", (unsigned) t, rgb_db);
+
+    // Converted straight to YCbCr by the encoder, without going through RGB
+    t = esp_timer_get_time();
+    TEST_ASSERT_TRUE(fmt2jpg(yuyv, pixels * 2, 320, 240, PIXFORMAT_YUV422, 80, &jpg, &jpg_len));
+    t = esp_timer_get_time() - t;
+    TEST_ASSERT_TRUE(fmt2rgb888(jpg, jpg_len, PIXFORMAT_JPEG, decoded));
+    free(jpg);
+    double yuv_db = img_psnr(rgb, decoded, pixels * 3);
+    ESP_LOGI(TAG, "YUV422 source: %u us, %.2f dB", (unsigned) t, yuv_db);
+    TEST_ASSERT_TRUE(yuv_db > rgb_db - 1.0);
+
+    heap_caps_free(rgb);
+    heap_caps_free(decoded);
+    heap_caps_free(yuyv);
+}
+
+TEST_CASE("Conversions JPEG parallel encode test", "[camera]")
+{
+    extern const uint8_t img_start[] asm("_binary_test_inside_jpeg_start");
+    extern const uint8_t img_end[]   asm("_binary_test_inside_jpeg_end");
+    size_t rgb_len = 320 * 240 * 3;
+    uint8_t *rgb = heap_caps_malloc(rgb_len, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    TEST_ASSERT_NOT_NULL(rgb);
+    TEST_ASSERT_TRUE(fmt2rgb888(img_start, img_end - img_start, PIXFORMAT_JPEG, rgb));
+
+    // Different qualities and Huffman modes, so the encoders can not share any state
+    jpg_encode_job_t jobs[4];
+    uint8_t *seq[4];
+    size_t seq_len[4];
+    uint64_t t_seq = esp_timer_get_time();
+    for (int i = 0; i < 4; i++) {
+        jpg_encode_config_t config = JPG_ENCODE_CONFIG_DEFAULT();
+        config.quality = 50 + i * 10;
+        config.optimize_huffman = i & 1;
+        jobs[i] = (jpg_encode_job_t) {
+            .src = rgb, .src_len = rgb_len, .width = 320, .height = 240, .format = PIXFORMAT_RGB888, .config = config,
+        };
+        TEST_ASSERT_TRUE(fmt2jpg_ex(rgb, rgb_len, 320, 240, PIXFORMAT_RGB888, &config, &seq[i], &seq_len[i]));
+    }
+    t_seq = esp_timer_get_time() - t_seq;
+
+    uint64_t t_par = esp_timer_get_time();
+    TEST_ASSERT_TRUE(fmt2jpg_parallel(jobs, 4));
+    t_par = esp_timer_get_time() - t_par;
+    ESP_LOGI(TAG, "4 encodes: %u us sequential, %u us parallel, %.2fx", (unsigned) t_seq, (unsigned) t_par,
+             (double) t_seq / t_par);
+
+    for (int i = 0; i < 4; i++) {
+        TEST_ASSERT_TRUE(jobs[i].ok);
+        TEST_ASSERT_EQUAL(seq_len[i], jobs[i].out_len);
+        TEST_ASSERT_EQUAL_UINT8_ARRAY(seq[i], jobs[i].out, seq_len[i]);
+        free(seq[i]);
+        free(jobs[i].out);
+    }
+#if !CONFIG_FREERTOS_UNICORE
+    TEST_ASSERT_GREATER_THAN(t_par * 6 / 5, t_seq);
+#endif
+    heap_caps_free(rgb);
+}
+
+typedef struct {
+    uint8_t *buf;
+    uint16_t width;
+} decode_out_t;
+
+static bool decode_out(void *arg, uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint8_t *data)
+{
+    decode_out_t *out = (decode_out_t *)arg;
+    if (data == NULL) {
+        if (x == 0 && y == 0) {
+            out->width = w;
+        }
+        return true;
+    }
+    for (int i = 0; i < h; i++) {
+        memcpy(out->buf + ((y + i) * out->width + x) * 3, data + i * w * 3, w * 3);
+    }
+    return true;
+}
+
+TEST_CASE("Conversions JPEG target size test", "[camera]")
+{
+    extern const uint8_t img_start[] asm("_binary_test_inside_jpeg_start");
+    extern const uint8_t img_end[]   asm("_binary_test_inside_jpeg_end");
+    size_t rgb_len = 320 * 240 * 3;
+    uint8_t *rgb = heap_caps_malloc(rgb_len, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    uint8_t *decoded = heap_caps_malloc(rgb_len, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    TEST_ASSERT_NOT_NULL(rgb);
+    TEST_ASSERT_NOT_NULL(decoded);
+    TEST_ASSERT_TRUE(fmt2rgb888(img_start, img_end - img_start, PIXFORMAT_JPEG, rgb));
+
+    // a third, two thirds and all of the quality 80 size, within -20% and +5% of the target
+    jpg_encode_config_t config = JPG_ENCODE_CONFIG_DEFAULT();
+    uint8_t *jpg;
+    size_t base_len, jpg_len;
+    TEST_ASSERT_TRUE(fmt2jpg_ex(rgb, rgb_len, 320, 240, PIXFORMAT_RGB888, &config, &jpg, &base_len));
+    free(jpg);
+    for (int i = 1; i <= 3; i++) {
+        config.target_size = base_len * i / 3;
+        uint64_t t = esp_timer_get_time();
+        TEST_ASSERT_TRUE(fmt2jpg_ex(rgb, rgb_len, 320, 240, PIXFORMAT_RGB888, &config, &jpg, &jpg_len));
+        t = esp_timer_get_time() - t;
+        ESP_LOGI(TAG, "Target %u bytes: %u bytes in %u us", (unsigned) config.target_size, (unsigned) jpg_len, (unsigned) t);
+        TEST_ASSERT_LESS_OR_EQUAL(config.target_size + config.target_size / 20, jpg_len);
+        TEST_ASSERT_GREATER_OR_EQUAL(config.target_size - config.target_size / 5, jpg_len);
+        TEST_ASSERT_TRUE(fmt2rgb888(jpg, jpg_len, PIXFORMAT_JPEG, decoded));
+        free(jpg);
+    }
+
+    heap_caps_free(rgb);
+    heap_caps_free(decoded);
+}
+
+TEST_CASE("Conversions JPEG multi output test", "[camera]")
+{
+    extern const uint8_t img_start[] asm("_binary_test_inside_jpeg_start");
+    extern const uint8_t img_end[]   asm("_binary_test_inside_jpeg_end");
+    size_t rgb_len = 320 * 240 * 3;
+    uint8_t *rgb = heap_caps_malloc(rgb_len, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    uint8_t *small = heap_caps_malloc(80 * 60 * 3, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    TEST_ASSERT_NOT_NULL(rgb);
+    TEST_ASSERT_NOT_NULL(small);
+    TEST_ASSERT_TRUE(fmt2rgb888(img_start, img_end - img_start, PIXFORMAT_JPEG, rgb));
+
+    // the full size JPEG is the one of fmt2jpg_ex(), the other one a quarter of its size in each direction
+    jpg_encode_config_t config = JPG_ENCODE_CONFIG_DEFAULT();
+    uint8_t *jpg;
+    size_t jpg_len;
+    TEST_ASSERT_TRUE(fmt2jpg_ex(rgb, rgb_len, 320, 240, PIXFORMAT_RGB888, &config, &jpg, &jpg_len));
+    const pixformat_t formats[] = { PIXFORMAT_RGB888, PIXFORMAT_JPEG };
+    for (int i = 0; i < 2; i++) {
+        jpg_encode_output_t outputs[2] = {
+            { .scale = 1, .config = config },
+            { .scale = 4, .config = config },
+        };
+        uint64_t t = esp_timer_get_time();
+        if (formats[i] == PIXFORMAT_JPEG) {
+            TEST_ASSERT_TRUE(fmt2jpg_multi((uint8_t *)img_start, img_end - img_start, 0, 0, PIXFORMAT_JPEG, outputs, 2));
+        } else {
+            TEST_ASSERT_TRUE(fmt2jpg_multi(rgb, rgb_len, 320, 240, PIXFORMAT_RGB888, outputs, 2));
+        }
+        t = esp_timer_get_time() - t;
+        ESP_LOGI(TAG, "Multi output from format %d: %u + %u bytes in %u us", formats[i],
+                 (unsigned) outputs[0].out_len, (unsigned) outputs[1].out_len, (unsigned) t);
+        TEST_ASSERT_EQUAL(jpg_len, outputs[0].out_len);
+        TEST_ASSERT_EQUAL_MEMORY(jpg, outputs[0].out, jpg_len);
+        TEST_ASSERT_TRUE(fmt2rgb888(outputs[1].out, outputs[1].out_len, PIXFORMAT_JPEG, small));
+        free(outputs[0].out);
+        free(outputs[1].out);
+    }
+    free(jpg);
+
+    heap_caps_free(rgb);
+    heap_caps_free(small);
+}
+
+TEST_CASE("Conversions JPEG restart markers test", "[camera]")
+{
+    extern const uint8_t img_start[] asm("_binary_test_inside_jpeg_start");
+    extern const uint8_t img_end[]   asm("_binary_test_inside_jpeg_end");
+    size_t rgb_len = 320 * 240 * 3;
+    uint8_t *rgb = heap_caps_malloc(rgb_len, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    decode_out_t ref = { .buf = heap_caps_malloc(rgb_len, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT) };
+    decode_out_t out = { .buf = heap_caps_malloc(rgb_len, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT) };
+    TEST_ASSERT_NOT_NULL(rgb);
+    TEST_ASSERT_NOT_NULL(ref.buf);
+    TEST_ASSERT_NOT_NULL(out.buf);
+    TEST_ASSERT_TRUE(fmt2rgb888(img_start, img_end - img_start, PIXFORMAT_JPEG, rgb));
+
+    jpg_encode_config_t config = JPG_ENCODE_CONFIG_DEFAULT();
+    uint8_t *jpg;
+    size_t jpg_len;
+    TEST_ASSERT_TRUE(fmt2jpg_ex(rgb, rgb_len, 320, 240, PIXFORMAT_RGB888, &config, &jpg, &jpg_len));
+    TEST_ASSERT_EQUAL(ESP_OK, esp_jpg_decode_mem(jpg, jpg_len, JPG_SCALE_NONE, JPG_PIXEL_RGB888, decode_out, &ref));
+    free(jpg);
+
+    // a marker after every row of 20 MCUs, numbered RST0 to RST7 in turn
+    config.restart_interval = 320 / 16;
+    TEST_ASSERT_TRUE(fmt2jpg_ex(rgb, rgb_len, 320, 240, PIXFORMAT_RGB888, &config, &jpg, &jpg_len));
+    int markers = 0;
+    for (size_t i = 0; i + 1 < jpg_len; i++) {
+        if (jpg[i] == 0xFF && (jpg[i + 1] & 0xF8) == 0xD0) {
+            TEST_ASSERT_EQUAL(0xD0 + (markers++ & 7), jpg[i + 1]);
+        }
+    }
+    TEST_ASSERT_EQUAL(240 / 16 - 1, markers);
+
+    // the restarts only reset the DC prediction, the pixels do not change
+    uint64_t t_seq = esp_timer_get_time();
+    TEST_ASSERT_EQUAL(ESP_OK, esp_jpg_decode_mem(jpg, jpg_len, JPG_SCALE_NONE, JPG_PIXEL_RGB888, decode_out, &out));
+    t_seq = esp_timer_get_time() - t_seq;
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(ref.buf, out.buf, rgb_len);
+    memset(out.buf, 0, rgb_len);
+    uint64_t t_par = esp_timer_get_time();
+    TEST_ASSERT_EQUAL(ESP_OK, esp_jpg_decode_parallel(jpg, jpg_len, JPG_SCALE_NONE, JPG_PIXEL_RGB888, decode_out, &out));
+    t_par = esp_timer_get_time() - t_par;
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(ref.buf, out.buf, rgb_len);
+    ESP_LOGI(TAG, "Decode with restart markers: %u us, parallel %u us, %.2fx", (unsigned) t_seq, (unsigned) t_par,
+             (double) t_seq / t_par);
+#if !CONFIG_FREERTOS_UNICORE
+    TEST_ASSERT_GREATER_THAN(t_par * 6 / 5, t_seq);
+#endif
+
+    free(jpg);
+    heap_caps_free(rgb);
+    heap_caps_free(ref.buf);
+    heap_caps_free(out.buf);
+}
+
+/* per pixel YUV to RGB conversion from conversions/yuv.c, the reference for the line converters */
+void yuv2rgb(uint8_t y, uint8_t u, uint8_t v, uint8_t *r, uint8_t *g, uint8_t *b);
+
+TEST_CASE("Conversions RGB888 line converters test", "[camera]")
+{
+    // Every U, V pair, with Y covering the whole range
+    size_t pixels = 2 * 65536;
+    uint8_t *yuyv = heap_caps_malloc(pixels * 2, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    uint8_t *table = heap_caps_malloc(pixels * 3, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    uint8_t *fixed = heap_caps_malloc(pixels * 3, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    TEST_ASSERT_NOT_NULL(yuyv);
+    TEST_ASSERT_NOT_NULL(table);
+    TEST_ASSERT_NOT_NULL(fixed);
+    for (size_t i = 0; i < 65536; i++) {
+        yuyv[i * 4] = i * 7;
+        yuyv[i * 4 + 1] = i >> 8;
+        yuyv[i * 4 + 2] = i * 13 + 5;
+        yuyv[i * 4 + 3] = i;
+    }
+
+    uint64_t t_table = esp_timer_get_time();
+    yuv422_to_rgb888_line(yuyv, table, pixels);
+    t_table = esp_timer_get_time() - t_table;
+    uint64_t t_fixed = esp_timer_get_time();
+    yuv422_to_rgb888_line_fixed(yuyv, fixed, pixels);
+    t_fixed = esp_timer_get_time() - t_fixed;
+    ESP_LOGI(TAG, "YUV422 to RGB888: %.2f Mpixel/s table, %.2f Mpixel/s fixed point",
+             (double) pixels / t_table, (double) pixels / t_fixed);
+
+    // BGR888 from the per pixel conversion, each pixel pair shares its U and V
+    uint8_t *ref = heap_caps_malloc(pixels * 3, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    TEST_ASSERT_NOT_NULL(ref);
+    for (size_t i = 0; i < pixels; i++) {
+        const uint8_t *pair = yuyv + (i & ~1) * 2;
+        yuv2rgb(pair[(i & 1) * 2], pair[1], pair[3], &ref[i * 3 + 2], &ref[i * 3 + 1], &ref[i * 3]);
+    }
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(ref, table, pixels * 3);
+    for (size_t i = 0; i < pixels * 3; i++) {
+        TEST_ASSERT_INT_WITHIN(3, table[i], fixed[i]);
+    }
+
+    // Every RGB565 value, high byte first
+    for (size_t i = 0; i < 65536; i++) {
+        uint8_t hb = i >> 8, lb = i;
+        yuyv[i * 2] = hb;
+        yuyv[i * 2 + 1] = lb;
+        ref[i * 3] = (lb & 0x1F) << 3;
+        ref[i * 3 + 1] = (hb & 0x07) << 5 | (lb & 0xE0) >> 3;
+        ref[i * 3 + 2] = hb & 0xF8;
+    }
+    rgb565_to_rgb888_line(yuyv, table, 65536);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(ref, table, 65536 * 3);
+    heap_caps_free(ref);
+
+    heap_caps_free(yuyv);
+    heap_caps_free(table);
+    heap_caps_free(fixed);
+}
+
+typedef struct {
+    uint8_t *buf;
+    size_t len;
+    size_t max_write;
+} bmp_stream_out_t;
+
+static size_t bmp_stream_out(void *arg, size_t index, const void *data, size_t len)
+{
+    bmp_stream_out_t *out = (bmp_stream_out_t *)arg;
+    // the JPEG encoder ends its output with an empty write
+    if (!data || !len) {
+        return 0;
+    }
+    TEST_ASSERT_EQUAL(out->len, index);
+    memcpy(out->buf + index, data, len);
+    out->len += len;
+    out->max_write = len > out->max_write ? len : out->max_write;
+    return len;
+}
+
+TEST_CASE("Conversions JPEG to BMP stream test", "[camera]")
+{
+    extern const uint8_t img_start[] asm("_binary_test_inside_jpeg_start");
+    extern const uint8_t img_end[]   asm("_binary_test_inside_jpeg_end");
+    uint8_t *bmp;
+    size_t bmp_len;
+    TEST_ASSERT_TRUE(fmt2bmp((uint8_t *)img_start, img_end - img_start, 320, 240, PIXFORMAT_JPEG, &bmp, &bmp_len));
+
+    // 320 pixels wide, so the rows need no padding and both give the same bytes
+    bmp_stream_out_t out = { 0 };
+    out.buf = heap_caps_malloc(bmp_len, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    TEST_ASSERT_NOT_NULL(out.buf);
+    uint64_t t = esp_timer_get_time();
+    TEST_ASSERT_TRUE(jpg2bmp_cb(img_start, img_end - img_start, bmp_stream_out, &out));
+    t = esp_timer_get_time() - t;
+    ESP_LOGI(TAG, "BMP stream: %u us, largest write %u bytes", (unsigned) t, (unsigned) out.max_write);
+    TEST_ASSERT_EQUAL(bmp_len, out.len);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(bmp, out.buf, bmp_len);
+    TEST_ASSERT_LESS_OR_EQUAL(320 * 3 * 16, out.max_write);
+
+    free(bmp);
+    heap_caps_free(out.buf);
+}
+
+TEST_CASE("Conversions JPEG workspace test", "[camera]")
+{
+    extern const uint8_t img_start[] asm("_binary_test_inside_jpeg_start");
+    extern const uint8_t img_end[]   asm("_binary_test_inside_jpeg_end");
+    size_t rgb_len = 320 * 240 * 3;
+    uint8_t *rgb = heap_caps_malloc(rgb_len, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    TEST_ASSERT_NOT_NULL(rgb);
+    TEST_ASSERT_TRUE(fmt2rgb888(img_start, img_end - img_start, PIXFORMAT_JPEG, rgb));
+
+    // one workspace for the encode and the decode, which must take nothing from the heap
+    jpg_encode_config_t config = JPG_ENCODE_CONFIG_DEFAULT();
+    config.optimize_huffman = true;
+    size_t size = img_workspace_size(320, 240, PIXFORMAT_RGB888, &config);
+    size_t bmp_size = img_workspace_size(320, 240, PIXFORMAT_JPEG, NULL);
+    img_workspace_t *ws = img_workspace_create(size > bmp_size ? size : bmp_size);
+    TEST_ASSERT_NOT_NULL(ws);
+
+    uint8_t *jpg, *ws_jpg, *bmp;
+    size_t jpg_len, ws_jpg_len, bmp_len;
+    TEST_ASSERT_TRUE(fmt2jpg_ex(rgb, rgb_len, 320, 240, PIXFORMAT_RGB888, &config, &jpg, &jpg_len));
+    config.workspace = ws;
+    uint64_t t = esp_timer_get_time();
+    TEST_ASSERT_TRUE(fmt2jpg_ex(rgb, rgb_len, 320, 240, PIXFORMAT_RGB888, &config, &ws_jpg, &ws_jpg_len));
+    t = esp_timer_get_time() - t;
+    TEST_ASSERT_EQUAL(jpg_len, ws_jpg_len);
+    TEST_ASSERT_EQUAL_MEMORY(jpg, ws_jpg, jpg_len);
+
+    TEST_ASSERT_TRUE(fmt2bmp((uint8_t *)img_start, img_end - img_start, 320, 240, PIXFORMAT_JPEG, &bmp, &bmp_len));
+    bmp_stream_out_t out = { 0 };
+    out.buf = heap_caps_malloc(bmp_len, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    TEST_ASSERT_NOT_NULL(out.buf);
+    TEST_ASSERT_TRUE(jpg2bmp_cb_ex(img_start, img_end - img_start, ws, bmp_stream_out, &out));
+    TEST_ASSERT_EQUAL(bmp_len, out.len);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(bmp, out.buf, bmp_len);
+
+    img_workspace_stats_t stats;
+    img_workspace_get_stats(ws, &stats);
+    ESP_LOGI(TAG, "Workspace %u bytes, peak %u, %u buffers, encode %u us", (unsigned) stats.size,
+             (unsigned) stats.peak, (unsigned) stats.allocs, (unsigned) t);
+    TEST_ASSERT_EQUAL(0, stats.fallbacks);
+    TEST_ASSERT_EQUAL(0, stats.used);
+    TEST_ASSERT_LESS_OR_EQUAL(stats.size, stats.peak);
+
+    img_workspace_delete(ws);
+    free(jpg);
+    free(ws_jpg);
+    free(bmp);
+    heap_caps_free(out.buf);
+    heap_caps_free(rgb);
+}
+
+TEST_CASE("Conversions JPEG progressive encode test", "[camera]")
+{
+    extern const uint8_t img_start[] asm("_binary_test_inside_jpeg_start");
+    extern const uint8_t img_end[]   asm("_binary_test_inside_jpeg_end");
+    size_t rgb_len = 320 * 240 * 3;
+    uint8_t *rgb = heap_caps_malloc(rgb_len, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    TEST_ASSERT_NOT_NULL(rgb);
+    TEST_ASSERT_TRUE(fmt2rgb888(img_start, img_end - img_start, PIXFORMAT_JPEG, rgb));
+
+    bmp_stream_out_t out = { 0 };
+    out.buf = heap_caps_malloc(rgb_len, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    TEST_ASSERT_NOT_NULL(out.buf);
+    jpg_encode_config_t config = JPG_ENCODE_CONFIG_DEFAULT();
+    config.progressive = true;
+    uint64_t t = esp_timer_get_time();
+    TEST_ASSERT_TRUE(fmt2jpg_cb_ex(rgb, rgb_len, 320, 240, PIXFORMAT_RGB888, &config, bmp_stream_out, &out));
+    t = esp_timer_get_time() - t;
+
+    // SOF2, then the DC scan of the three components and four AC scans, each after its own tables
+    size_t scans[5];
+    int sof2 = 0, num_scans = 0;
+    for (size_t i = 0; i + 1 < out.len; i++) {
+        if (out.buf[i] == 0xFF && out.buf[i + 1] == 0xC2) {
+            sof2++;
+        } else if (out.buf[i] == 0xFF && out.buf[i + 1] == 0xDA) {
+            TEST_ASSERT_LESS_THAN(5, num_scans);
+            scans[num_scans++] = i;
+        }
+    }
+    TEST_ASSERT_EQUAL(1, sof2);
+    TEST_ASSERT_EQUAL(5, num_scans);
+    const uint8_t dc_scan[] = { 0xFF, 0xDA, 0x00, 0x0C, 0x03, 0x01, 0x00, 0x02, 0x11, 0x03, 0x11, 0x00, 0x00, 0x00 };
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(dc_scan, out.buf + scans[0], sizeof(dc_scan));
+    ESP_LOGI(TAG, "Progressive encode: %u us, %u bytes, second scan at %u", (unsigned) t, (unsigned) out.len,
+             (unsigned) scans[1]);
+    TEST_ASSERT_LESS_THAN(out.len / 4, scans[1]);
+
+    heap_caps_free(rgb);
+    heap_caps_free(out.buf);
+}
+
+TEST_CASE("Conversions JPEG source prefetch test", "[camera]")
+{
+    extern const uint8_t img3_start[] asm("_binary_test_outside_jpeg_start");
+    extern const uint8_t img3_end[]   asm("_binary_test_outside_jpeg_end");
+    size_t rgb_len = 480 * 320 * 3;
+    uint8_t *rgb = heap_caps_malloc(rgb_len, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    TEST_ASSERT_NOT_NULL(rgb);
+    TEST_ASSERT_TRUE(fmt2rgb888(img3_start, img3_end - img3_start, PIXFORMAT_JPEG, rgb));
+
+    // the source is in PSRAM, read in place or a row of MCUs at a time from internal RAM
+    const jpg_source_read_t modes[] = { JPG_SOURCE_DIRECT, JPG_SOURCE_PREFETCH, JPG_SOURCE_AUTO };
+    uint8_t *jpg[3];
+    size_t jpg_len[3];
+    uint64_t t[3];
+    jpg_encode_config_t config = JPG_ENCODE_CONFIG_DEFAULT();
+    for (int i = 0; i < 3; i++) {
+        config.source_read = modes[i];
+        t[i] = esp_timer_get_time();
+        TEST_ASSERT_TRUE(fmt2jpg_ex(rgb, rgb_len, 480, 320, PIXFORMAT_RGB888, &config, &jpg[i], &jpg_len[i]));
+        t[i] = esp_timer_get_time() - t[i];
+    }
+    ESP_LOGI(TAG, "Encode from PSRAM: in place %u us, prefetched %u us, auto %u us", (unsigned) t[0], (unsigned) t[1],
+             (unsigned) t[2]);
+    for (int i = 1; i < 3; i++) {
+        TEST_ASSERT_EQUAL(jpg_len[0], jpg_len[i]);
+        TEST_ASSERT_EQUAL_UINT8_ARRAY(jpg[0], jpg[i], jpg_len[0]);
+    }
+
+    for (int i = 0; i < 3; i++) {
+        free(jpg[i]);
+    }
+    heap_caps_free(rgb);
+}
+
+TEST_CASE("Conversions JPEG to grayscale test", "[camera]")
+{
+    extern const uint8_t img_start[] asm("_binary_test_inside_jpeg_start");
+    extern const uint8_t img_end[]   asm("_binary_test_inside_jpeg_end");
+    size_t pixels = 320 * 240;
+    uint8_t *rgb = heap_caps_malloc(pixels * 3, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    uint8_t *gray = heap_caps_malloc(pixels, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    TEST_ASSERT_NOT_NULL(rgb);
+    TEST_ASSERT_NOT_NULL(gray);
+
+    uint64_t t = esp_timer_get_time();
+    TEST_ASSERT_TRUE(jpg2rgb565(img_start, img_end - img_start, rgb, JPG_SCALE_NONE));
+    uint64_t t_rgb565 = esp_timer_get_time() - t;
+    t = esp_timer_get_time();
+    TEST_ASSERT_TRUE(jpg2gray(img_start, img_end - img_start, gray, JPG_SCALE_NONE));
+    uint64_t t_gray = esp_timer_get_time() - t;
+    ESP_LOGI(TAG, "JPEG to RGB565: %u us, to grayscale: %u us", (unsigned) t_rgb565, (unsigned) t_gray);
+
+    // the gray levels are Y, the RGB888 pixels are clipped after the color conversion
+    TEST_ASSERT_TRUE(fmt2rgb888(img_start, img_end - img_start, PIXFORMAT_JPEG, rgb));
+    for (size_t i = 0; i < pixels; i++) {
+        const uint8_t *p = rgb + i * 3; // BGR
+        int y = (p[2] * 77 + p[1] * 150 + p[0] * 29) >> 8;
+        TEST_ASSERT_INT_WITHIN(32, y, gray[i]);
+    }
+
+    // every scale writes (width >> scale) * (height >> scale) bytes
+    for (int scale = JPG_SCALE_2X; scale <= JPG_SCALE_MAX; scale++) {
+        memset(gray, 0xA5, pixels);
+        TEST_ASSERT_TRUE(jpg2gray(img_start, img_end - img_start, gray, scale));
+        TEST_ASSERT_EQUAL_UINT8(0xA5, gray[(320 >> scale) * (240 >> scale)]);
+    }
+
+    heap_caps_free(rgb);
+    heap_caps_free(gray);
+}
+
+TEST_CASE("Conversions JPEG thumbnail test", "[camera]")
+{
+    extern const uint8_t img_start[] asm("_binary_test_inside_jpeg_start");
+    extern const uint8_t img_end[]   asm("_binary_test_inside_jpeg_end");
+    size_t pixels = (320 / 8) * (240 / 8);
+    uint8_t *thumb = heap_caps_malloc(pixels * 2, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    uint8_t *ref = heap_caps_malloc(pixels * 2, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    TEST_ASSERT_NOT_NULL(thumb);
+    TEST_ASSERT_NOT_NULL(ref);
+    uint16_t w = 0, h = 0;
+
+    uint64_t t = esp_timer_get_time();
+    TEST_ASSERT_TRUE(jpg2thumb(img_start, img_end - img_start, PIXFORMAT_RGB565, thumb, &w, &h));
+    t = esp_timer_get_time() - t;
+    ESP_LOGI(TAG, "Thumbnail %ux%u: %u us", w, h, (unsigned) t);
+    TEST_ASSERT_EQUAL(320 / 8, w);
+    TEST_ASSERT_EQUAL(240 / 8, h);
+
+    // same pixels as jpg2rgb565() at 1/8, with the high byte first
+    TEST_ASSERT_TRUE(jpg2rgb565(img_start, img_end - img_start, ref, JPG_SCALE_8X));
+    for (size_t i = 0; i < pixels; i++) {
+        TEST_ASSERT_EQUAL_UINT8(ref[i * 2 + 1], thumb[i * 2]);
+        TEST_ASSERT_EQUAL_UINT8(ref[i * 2], thumb[i * 2 + 1]);
+    }
+
+    TEST_ASSERT_TRUE(jpg2thumb(img_start, img_end - img_start, PIXFORMAT_GRAYSCALE, thumb, NULL, NULL));
+    TEST_ASSERT_TRUE(jpg2gray(img_start, img_end - img_start, ref, JPG_SCALE_8X));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(ref, thumb, pixels);
+
+    TEST_ASSERT_FALSE(jpg2thumb(img_start, img_end - img_start, PIXFORMAT_JPEG, thumb, NULL, NULL));
+
+    heap_caps_free(thumb);
+    heap_caps_free(ref);
+}
+
+TEST_CASE("Conversions JPEG lossless transform test", "[camera]")
+{
+    extern const uint8_t img_start[] asm("_binary_test_inside_jpeg_start");
+    extern const uint8_t img_end[]   asm("_binary_test_inside_jpeg_end");
+    size_t pixels = 320 * 240;
+    size_t jpg_size = (img_end - img_start) * 2;
+    uint8_t *rgb = heap_caps_malloc(pixels * 3, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    uint8_t *rotated = heap_caps_malloc(pixels * 3, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    bmp_stream_out_t out = { .buf = heap_caps_malloc(jpg_size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT) };
+    bmp_stream_out_t back = { .buf = heap_caps_malloc(jpg_size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT) };
+    TEST_ASSERT_NOT_NULL(rgb);
+    TEST_ASSERT_NOT_NULL(rotated);
+    TEST_ASSERT_NOT_NULL(out.buf);
+    TEST_ASSERT_NOT_NULL(back.buf);
+    TEST_ASSERT_TRUE(fmt2rgb888(img_start, img_end - img_start, PIXFORMAT_JPEG, rgb));
+
+    // 320x240 is on the 16x16 MCU grid, so nothing is trimmed
+    jpg_transform_config_t config = JPG_TRANSFORM_CONFIG_DEFAULT();
+    config.transform = JPG_TRANSFORM_ROTATE_90;
+    uint64_t t = esp_timer_get_time();
+    TEST_ASSERT_TRUE(jpg_transform_cb(img_start, img_end - img_start, &config, bmp_stream_out, &out));
+    t = esp_timer_get_time() - t;
+    ESP_LOGI(TAG, "JPEG rotate 90: %u us, %u bytes", (unsigned) t, (unsigned) out.len);
+
+    // the rotated pixels only differ by the rounding of the IDCT
+    TEST_ASSERT_TRUE(fmt2rgb888(out.buf, out.len, PIXFORMAT_JPEG, rotated));
+    for (int y = 0; y < 320; y++) {
+        for (int x = 0; x < 240; x++) {
+            for (int c = 0; c < 3; c++) {
+                TEST_ASSERT_INT_WITHIN(4, rgb[((239 - x) * 320 + y) * 3 + c], rotated[(y * 240 + x) * 3 + c]);
+            }
+        }
+    }
+
+    // rotating back gives the coefficients of the source
+    config.transform = JPG_TRANSFORM_ROTATE_270;
+    TEST_ASSERT_TRUE(jpg_transform_cb(out.buf, out.len, &config, bmp_stream_out, &back));
+    TEST_ASSERT_TRUE(fmt2rgb888(back.buf, back.len, PIXFORMAT_JPEG, rotated));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(rgb, rotated, pixels * 3);
+
+    // a crop keeps the pixels of the MCUs it covers
+    out.len = 0;
+    config.transform = JPG_TRANSFORM_NONE;
+    config.crop_x = 32;
+    config.crop_y = 16;
+    config.crop_width = 160;
+    config.crop_height = 128;
+    TEST_ASSERT_TRUE(jpg_transform_cb(img_start, img_end - img_start, &config, bmp_stream_out, &out));
+    TEST_ASSERT_TRUE(fmt2rgb888(out.buf, out.len, PIXFORMAT_JPEG, rotated));
+    for (int y = 0; y < 128; y++) {
+        TEST_ASSERT_EQUAL_UINT8_ARRAY(rgb + ((16 + y) * 320 + 32) * 3, rotated + y * 160 * 3, 160 * 3);
+    }
+
+    heap_caps_free(rgb);
+    heap_caps_free(rotated);
+    heap_caps_free(out.buf);
+    heap_caps_free(back.buf);
+}
+
 TEST_CASE("Camera driver uses an i2c port initialized by other devices test", "[camera]")
 {
     TEST_ESP_OK(i2c_master_init(I2C_MASTER_NUM));